@@ -0,0 +1,574 @@
+#include "ChebyshevProxy.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// Piece starts with 2^PROXY_MIN_LEVEL + 1 Chebyshev points, doubling their
+// number up to 2^PROXY_MAX_LEVEL + 1 before it's split
+#define PROXY_MIN_LEVEL 4
+#define PROXY_MAX_LEVEL 7
+// Maximal number of piece halvings
+#define PROXY_MAX_DEPTH 8
+// Relative size of coefficients tail, which is considered resolved
+#define PROXY_TOLERANCE 1e-13
+// Number of coefficients tail consists of
+#define PROXY_TAIL 4
+// Relative error in probe points, above which function isn't smooth enough
+#define PROXY_PROBE_TOLERANCE 1e-9
+// Eigenvalues of colleague matrix with imaginary part up to that are real
+// roots, and ones up to that out of [-1;1] are roots on its ends
+#define PROXY_ROOT_TOLERANCE 1e-6
+// Maximal number of QR iterations per eigenvalue
+#define PROXY_QR_MAX_ITERATIONS 60
+
+// Points of [-1;1] far from Chebyshev points, where every piece is probed
+static const double kProbePoints[] = { -0.6180339887, 0.1234567891,
+                                       0.8660254037 };
+
+ChebyshevProxy::ChebyshevProxy(const Integrand& f, double a, double b)
+  : _from(a)
+  , _to(b)
+  , _scale(0)
+  , _valid(false)
+  , _evaluations(0)
+  , _rootsSearched{ false, false }
+{
+  if (!(a < b) || !std::isfinite(a) || !std::isfinite(b))
+    return;
+
+  _valid = BuildPiece(f, a, b, 0);
+
+  // Probe every piece with points which weren't used to build it, error is
+  // measured relative to function scale over whole range
+  size_t nProbes = sizeof(kProbePoints) / sizeof(kProbePoints[0]);
+  std::vector<double> xs;
+  for (size_t i = 0; _valid && i < _pieces.size(); ++i) {
+    const Piece& piece = _pieces[i];
+    for (size_t j = 0; j < nProbes; ++j)
+      xs.push_back(0.5 * (piece.from + piece.to) +
+                   0.5 * (piece.to - piece.from) * kProbePoints[j]);
+  }
+
+  std::vector<double> ys(xs.size());
+  if (_valid) {
+    f(xs.data(), xs.size(), ys.data());
+    _evaluations += xs.size();
+  }
+
+  // Actual error in probe points bounds error estimate of piece from below
+  for (size_t i = 0; _valid && i < xs.size(); ++i) {
+    Piece* piece = &_pieces[i / nProbes];
+    double residual =
+      std::fabs(ys[i] - Clenshaw(piece->coeffs, kProbePoints[i % nProbes]));
+    if (!(residual <= PROXY_PROBE_TOLERANCE * _scale))
+      _valid = false;
+    piece->error = std::max(piece->error, residual);
+  }
+
+  if (!_valid)
+    _pieces.clear();
+}
+
+bool
+ChebyshevProxy::BuildPiece(const Integrand& f, double a, double b, int depth)
+{
+  double mid = 0.5 * (a + b);
+  double half = 0.5 * (b - a);
+  // Function values in Chebyshev points cos(pi * j / (n - 1)), points of every
+  // level include points of previous one, so only odd ones are evaluated
+  std::vector<double> values;
+  std::vector<double> xs;
+  std::vector<double> ys;
+
+  for (int level = PROXY_MIN_LEVEL; level <= PROXY_MAX_LEVEL; ++level) {
+    size_t n = (1 << level) + 1;
+    std::vector<double> next(n);
+    xs.clear();
+    for (size_t j = 0; j < n; ++j) {
+      if (level > PROXY_MIN_LEVEL && j % 2 == 0)
+        next[j] = values[j / 2];
+      else
+        xs.push_back(mid + half * std::cos(M_PI * j / (n - 1)));
+    }
+
+    ys.resize(xs.size());
+    f(xs.data(), xs.size(), ys.data());
+    _evaluations += xs.size();
+
+    for (size_t j = 0, k = 0; j < n; ++j) {
+      if (level == PROXY_MIN_LEVEL || j % 2 == 1)
+        next[j] = ys[k++];
+      if (!std::isfinite(next[j]))
+        return false;
+      _scale = std::max(_scale, std::fabs(next[j]));
+    }
+    values.swap(next);
+
+    // Coefficients out of values by discrete cosine transform, cosines are
+    // taken from single table of angles pi * m / (n - 1)
+    std::vector<double> cosines(2 * (n - 1));
+    for (size_t m = 0; m < cosines.size(); ++m)
+      cosines[m] = std::cos(M_PI * m / (n - 1));
+    std::vector<double> coeffs(n);
+    for (size_t k = 0; k < n; ++k) {
+      // Last point is cos(pi * k) multiple, end points have half weight
+      double last = k % 2 ? -values[n - 1] : values[n - 1];
+      double sum = 0.5 * (values[0] + last);
+      for (size_t j = 1; j < n - 1; ++j)
+        sum += values[j] * cosines[j * k % cosines.size()];
+      coeffs[k] = 2 * sum / (n - 1);
+    }
+    coeffs[0] *= 0.5;
+    coeffs[n - 1] *= 0.5;
+
+    // Resolved when whole tail is negligible, then it's chopped
+    double threshold = PROXY_TOLERANCE * _scale;
+    bool resolved = true;
+    for (size_t k = n - PROXY_TAIL; k < n; ++k)
+      resolved = resolved && std::fabs(coeffs[k]) <= threshold;
+    if (!resolved)
+      continue;
+
+    // Interpolation error is about size of chopped tail, aliased coefficients
+    // double it
+    double tail = 0;
+    while (coeffs.size() > 1 && std::fabs(coeffs.back()) <= threshold) {
+      tail += std::fabs(coeffs.back());
+      coeffs.pop_back();
+    }
+
+    // Antiderivative on [-1;1] out of integrals of Chebyshev polynomials
+    std::vector<double> primitive(coeffs.size() + 1);
+    for (size_t k = 0; k < coeffs.size(); ++k) {
+      if (k == 0) {
+        primitive[1] += coeffs[0];
+      } else if (k == 1) {
+        primitive[2] += coeffs[1] / 4;
+      } else {
+        primitive[k + 1] += coeffs[k] / (2 * (k + 1));
+        primitive[k - 1] -= coeffs[k] / (2 * (k - 1));
+      }
+    }
+
+    // Derivative by recurrence d[k - 1] = d[k + 1] + 2 * k * c[k]
+    std::vector<double> slope(coeffs.size() + 1);
+    for (size_t k = coeffs.size(); k-- > 1;)
+      slope[k - 1] = slope[k + 1] + 2 * k * coeffs[k];
+    slope[0] *= 0.5;
+    slope.resize(std::max<size_t>(1, coeffs.size() - 1));
+
+    _pieces.push_back({ a,
+                        b,
+                        std::move(coeffs),
+                        std::move(primitive),
+                        std::move(slope),
+                        2 * tail });
+    return true;
+  }
+
+  // Not resolved even by largest number of points, so halves are tried
+  if (depth == PROXY_MAX_DEPTH)
+    return false;
+
+  return BuildPiece(f, a, mid, depth + 1) && BuildPiece(f, mid, b, depth + 1);
+}
+
+double
+ChebyshevProxy::Clenshaw(const std::vector<double>& coeffs, double t)
+{
+  double b1 = 0;
+  double b2 = 0;
+  for (size_t k = coeffs.size(); k-- > 1;) {
+    double b = 2 * t * b1 - b2 + coeffs[k];
+    b2 = b1;
+    b1 = b;
+  }
+  return t * b1 - b2 + coeffs[0];
+}
+
+const ChebyshevProxy::Piece*
+ChebyshevProxy::FindPiece(double x) const
+{
+  if (!_valid || !(x >= _from && x <= _to))
+    return nullptr;
+
+  // Pieces are sorted and adjacent, so first one ending after x contains it
+  auto it = std::lower_bound(
+    _pieces.begin(), _pieces.end(), x, [](const Piece& piece, double x) {
+      return piece.to < x;
+    });
+  return it == _pieces.end() ? &_pieces.back() : &*it;
+}
+
+void
+ChebyshevProxy::Evaluate(const double* xs, size_t n, double* out) const
+{
+  const Piece* piece = nullptr;
+  for (size_t i = 0; i < n; ++i) {
+    // Points usually come sorted, so previous piece is tried first
+    if (!piece || xs[i] < piece->from || xs[i] > piece->to)
+      piece = FindPiece(xs[i]);
+
+    if (!piece) {
+      out[i] = std::numeric_limits<double>::quiet_NaN();
+      continue;
+    }
+
+    double t =
+      (2 * xs[i] - piece->from - piece->to) / (piece->to - piece->from);
+    out[i] = Clenshaw(piece->coeffs, t);
+  }
+}
+
+void
+ChebyshevProxy::EvaluateDerivative(const double* xs,
+                                   size_t n,
+                                   double* out) const
+{
+  const Piece* piece = nullptr;
+  for (size_t i = 0; i < n; ++i) {
+    if (!piece || xs[i] < piece->from || xs[i] > piece->to)
+      piece = FindPiece(xs[i]);
+
+    if (!piece) {
+      out[i] = std::numeric_limits<double>::quiet_NaN();
+      continue;
+    }
+
+    double half = 0.5 * (piece->to - piece->from);
+    double t = (xs[i] - piece->from) / half - 1;
+    out[i] = Clenshaw(piece->slope, t) / half;
+  }
+}
+
+const std::vector<double>*
+ChebyshevProxy::GetRoots(bool derivative)
+{
+  std::optional<std::vector<double>>& roots = _roots[derivative];
+  if (_rootsSearched[derivative] || !_valid)
+    return roots ? &*roots : nullptr;
+
+  _rootsSearched[derivative] = true;
+  roots.emplace();
+  std::vector<double> ts;
+  for (const Piece& piece : _pieces) {
+    ts.clear();
+    if (!SeriesRoots(derivative ? piece.slope : piece.coeffs, ts)) {
+      roots.reset();
+      return nullptr;
+    }
+
+    double mid = 0.5 * (piece.to + piece.from);
+    double half = 0.5 * (piece.to - piece.from);
+    for (double t : ts)
+      roots->push_back(mid + half * t);
+  }
+  std::sort(roots->begin(), roots->end());
+  return &*roots;
+}
+
+bool
+ChebyshevProxy::SeriesRoots(const std::vector<double>& coeffs,
+                            std::vector<double>& roots)
+{
+  // Negligible leading coefficients would make matrix ill-conditioned
+  double scale = 0;
+  for (double c : coeffs)
+    scale = std::max(scale, std::fabs(c));
+  size_t m = coeffs.size();
+  while (m > 1 && std::fabs(coeffs[m - 1]) <= PROXY_TOLERANCE * scale)
+    --m;
+  m -= 1;
+  if (m == 0)
+    return true;
+
+  std::vector<double> re;
+  std::vector<double> im;
+  if (m == 1) {
+    re.push_back(-coeffs[0] / coeffs[1]);
+    im.push_back(0);
+  } else {
+    // Colleague matrix is transposed, so that it's upper Hessenberg. Vector of
+    // T_0(t)...T_{m-1}(t) is its eigenvector for every root t, as
+    // t * T_k = (T_{k-1} + T_{k+1}) / 2 and T_m is expressed by others
+    std::vector<double> h(m * m);
+    h[1 * m + 0] = 1;
+    for (size_t k = 1; k + 1 < m; ++k) {
+      h[(k - 1) * m + k] = 0.5;
+      h[(k + 1) * m + k] = 0.5;
+    }
+    h[(m - 2) * m + m - 1] = 0.5;
+    for (size_t k = 0; k < m; ++k)
+      h[k * m + m - 1] -= coeffs[k] / (2 * coeffs[m]);
+    if (!HessenbergEigenvalues(h, m, re, im))
+      return false;
+  }
+
+  for (size_t k = 0; k < re.size(); ++k) {
+    if (std::fabs(im[k]) <= PROXY_ROOT_TOLERANCE &&
+        std::fabs(re[k]) <= 1 + PROXY_ROOT_TOLERANCE)
+      roots.push_back(std::clamp(re[k], -1.0, 1.0));
+  }
+  return true;
+}
+
+bool
+ChebyshevProxy::HessenbergEigenvalues(std::vector<double>& h,
+                                      size_t n,
+                                      std::vector<double>& re,
+                                      std::vector<double>& im)
+{
+  // Francis double shift QR algorithm, deflating eigenvalues from bottom of
+  // matrix. Indices are counted from 1 like in its classic formulation
+  auto a = [&h, n](long i, long j) -> double& {
+    return h[(i - 1) * n + (j - 1)];
+  };
+  re.assign(n + 1, 0);
+  im.assign(n + 1, 0);
+
+  // Balance rows and columns by powers of 2 first, which keeps matrix
+  // Hessenberg and makes eigenvalues of colleague matrix much more accurate
+  bool balanced = false;
+  while (!balanced) {
+    balanced = true;
+    for (long i = 1; i <= static_cast<long>(n); ++i) {
+      double rows = 0;
+      double columns = 0;
+      for (long j = 1; j <= static_cast<long>(n); ++j) {
+        if (j != i) {
+          columns += std::fabs(a(j, i));
+          rows += std::fabs(a(i, j));
+        }
+      }
+      if (columns == 0 || rows == 0)
+        continue;
+
+      double g = rows / 2;
+      double f = 1;
+      double s = columns + rows;
+      while (columns < g) {
+        f *= 2;
+        columns *= 4;
+      }
+      g = rows * 2;
+      while (columns > g) {
+        f /= 2;
+        columns /= 4;
+      }
+      if ((columns + rows) / f < 0.95 * s) {
+        balanced = false;
+        for (long j = 1; j <= static_cast<long>(n); ++j)
+          a(i, j) /= f;
+        for (long j = 1; j <= static_cast<long>(n); ++j)
+          a(j, i) *= f;
+      }
+    }
+  }
+
+  double norm = 0;
+  for (long i = 1; i <= static_cast<long>(n); ++i)
+    for (long j = std::max(i - 1, 1L); j <= static_cast<long>(n); ++j)
+      norm += std::fabs(a(i, j));
+
+  long nn = n;
+  double t = 0;
+  while (nn >= 1) {
+    int iterations = 0;
+    long l;
+    do {
+      // Find small subdiagonal element, which splits matrix
+      for (l = nn; l >= 2; --l) {
+        double s = std::fabs(a(l - 1, l - 1)) + std::fabs(a(l, l));
+        if (s == 0)
+          s = norm;
+        if (std::fabs(a(l, l - 1)) + s == s) {
+          a(l, l - 1) = 0;
+          break;
+        }
+      }
+
+      double x = a(nn, nn);
+      if (l == nn) {
+        // Single root found
+        re[nn] = x + t;
+        im[nn--] = 0;
+        continue;
+      }
+
+      double y = a(nn - 1, nn - 1);
+      double w = a(nn, nn - 1) * a(nn - 1, nn);
+      if (l == nn - 1) {
+        // Pair of roots found
+        double p = 0.5 * (y - x);
+        double q = p * p + w;
+        double z = std::sqrt(std::fabs(q));
+        x += t;
+        if (q >= 0) {
+          z = p + std::copysign(z, p);
+          re[nn - 1] = re[nn] = x + z;
+          if (z != 0)
+            re[nn] = x - w / z;
+          im[nn - 1] = im[nn] = 0;
+        } else {
+          re[nn - 1] = re[nn] = x + p;
+          im[nn - 1] = -z;
+          im[nn] = z;
+        }
+        nn -= 2;
+        continue;
+      }
+
+      if (iterations == PROXY_QR_MAX_ITERATIONS)
+        return false;
+      // Exceptional shifts break cycles
+      if (iterations && iterations % 10 == 0) {
+        t += x;
+        for (long i = 1; i <= nn; ++i)
+          a(i, i) -= x;
+        double s = std::fabs(a(nn, nn - 1)) + std::fabs(a(nn - 1, nn - 2));
+        y = x = 0.75 * s;
+        w = -0.4375 * s * s;
+      }
+      ++iterations;
+
+      // Find two consecutive small subdiagonal elements
+      long m;
+      double p = 0;
+      double q = 0;
+      double r = 0;
+      double z;
+      for (m = nn - 2; m >= l; --m) {
+        z = a(m, m);
+        r = x - z;
+        double s = y - z;
+        p = (r * s - w) / a(m + 1, m) + a(m, m + 1);
+        q = a(m + 1, m + 1) - z - r - s;
+        r = a(m + 2, m + 1);
+        s = std::fabs(p) + std::fabs(q) + std::fabs(r);
+        p /= s;
+        q /= s;
+        r /= s;
+        if (m == l)
+          break;
+        double u = std::fabs(a(m, m - 1)) * (std::fabs(q) + std::fabs(r));
+        double v = std::fabs(p) * (std::fabs(a(m - 1, m - 1)) + std::fabs(z) +
+                                   std::fabs(a(m + 1, m + 1)));
+        if (u + v == v)
+          break;
+      }
+      for (long i = m + 2; i <= nn; ++i) {
+        a(i, i - 2) = 0;
+        if (i != m + 2)
+          a(i, i - 3) = 0;
+      }
+
+      // Double QR step on rows l..nn and columns m..nn
+      for (long k = m; k <= nn - 1; ++k) {
+        if (k != m) {
+          p = a(k, k - 1);
+          q = a(k + 1, k - 1);
+          r = k != nn - 1 ? a(k + 2, k - 1) : 0;
+          x = std::fabs(p) + std::fabs(q) + std::fabs(r);
+          if (x != 0) {
+            p /= x;
+            q /= x;
+            r /= x;
+          }
+        }
+        double s = std::copysign(std::sqrt(p * p + q * q + r * r), p);
+        if (s == 0)
+          continue;
+
+        if (k == m) {
+          if (l != m)
+            a(k, k - 1) = -a(k, k - 1);
+        } else {
+          a(k, k - 1) = -s * x;
+        }
+        p += s;
+        x = p / s;
+        y = q / s;
+        z = r / s;
+        q /= p;
+        r /= p;
+        for (long j = k; j <= nn; ++j) {
+          p = a(k, j) + q * a(k + 1, j);
+          if (k != nn - 1) {
+            p += r * a(k + 2, j);
+            a(k + 2, j) -= p * z;
+          }
+          a(k + 1, j) -= p * y;
+          a(k, j) -= p * x;
+        }
+        for (long i = l; i <= std::min(nn, k + 3); ++i) {
+          p = x * a(i, k) + y * a(i, k + 1);
+          if (k != nn - 1) {
+            p += z * a(i, k + 2);
+            a(i, k + 2) -= p * r;
+          }
+          a(i, k + 1) -= p * q;
+          a(i, k) -= p;
+        }
+      }
+    } while (l < nn - 1);
+  }
+
+  re.erase(re.begin());
+  im.erase(im.begin());
+  return true;
+}
+
+IntegrationResult
+ChebyshevProxy::Integrate(double a, double b) const
+{
+  if (a > b) {
+    IntegrationResult res = Integrate(b, a);
+    res.value = -res.value;
+    return res;
+  }
+
+  if (!Covers(a, b))
+    return { std::numeric_limits<double>::quiet_NaN(),
+             std::numeric_limits<double>::infinity(),
+             0,
+             false };
+
+  double sum = 0;
+  double error = 0;
+  for (const Piece& piece : _pieces) {
+    double from = std::max(a, piece.from);
+    double to = std::min(b, piece.to);
+    if (from >= to)
+      continue;
+
+    double half = 0.5 * (piece.to - piece.from);
+    double mid = 0.5 * (piece.to + piece.from);
+    sum += half * (Clenshaw(piece.primitive, (to - mid) / half) -
+                   Clenshaw(piece.primitive, (from - mid) / half));
+    error += piece.error * (to - from);
+  }
+  return { sum, error, 0, true };
+}
+
+bool
+ChebyshevProxy::Probe(const Integrand& f, double x)
+{
+  double p;
+  double y;
+  Evaluate(&x, 1, &p);
+  if (std::isnan(p))
+    return _valid;
+
+  f(&x, 1, &y);
+  ++_evaluations;
+  double residual = std::fabs(y - p);
+  if (!(residual <= PROXY_PROBE_TOLERANCE * _scale)) {
+    _valid = false;
+    _pieces.clear();
+    return _valid;
+  }
+
+  Piece& piece = _pieces[FindPiece(x) - _pieces.data()];
+  piece.error = std::max(piece.error, residual);
+  return _valid;
+}
@@ -0,0 +1,93 @@
+#pragma once
+#include "Quadrature.h"
+#include <cstddef>
+#include <optional>
+#include <vector>
+
+// Piecewise Chebyshev interpolant of smooth function, resolved to about
+// double precision. Once built, it's evaluated and integrated without
+// evaluating function itself
+class ChebyshevProxy
+{
+public:
+  // Build interpolant of f on [a;b]. Range is split into pieces until every
+  // one is resolved. If f isn't finite or smooth enough, proxy is invalid
+  ChebyshevProxy(const Integrand& f, double a, double b);
+
+  inline bool IsValid() const { return _valid; }
+
+  // Check if proxy is valid on whole [a;b]
+  inline bool Covers(double a, double b) const
+  {
+    return _valid && a >= _from && b <= _to;
+  }
+
+  // Get number of function evaluations spent on building
+  inline size_t GetEvaluations() const { return _evaluations; }
+
+  // Evaluate interpolant in n points, points out of range are NaN
+  void Evaluate(const double* xs, size_t n, double* out) const;
+
+  // Evaluate derivative of interpolant in n points, points out of range are
+  // NaN
+  void EvaluateDerivative(const double* xs, size_t n, double* out) const;
+
+  // Get sorted real roots of interpolant over its whole range, or of its
+  // derivative if derivative is set. Roots of every piece are eigenvalues of
+  // colleague matrix of its series, found once, and they're meant to be
+  // polished. Returns nullptr if eigenvalues didn't converge
+  const std::vector<double>* GetRoots(bool derivative);
+
+  // Integrate interpolant over [a;b], which must be covered by it. Error is
+  // estimated out of chopped coefficients and residuals in probe points
+  IntegrationResult Integrate(double a, double b) const;
+
+  // Compare interpolant with f in given point. If they differ, then f isn't as
+  // smooth as it seemed, and proxy becomes invalid. Returns if proxy is valid
+  bool Probe(const Integrand& f, double x);
+
+private:
+  ChebyshevProxy() = delete;
+
+  struct Piece
+  {
+    double from;
+    double to;
+    // Coefficients of Chebyshev series on piece mapped to [-1;1]
+    std::vector<double> coeffs;
+    // Coefficients of its antiderivative and derivative by t
+    std::vector<double> primitive;
+    std::vector<double> slope;
+    // Estimate of maximal error of interpolant on piece
+    double error;
+  };
+
+  std::vector<Piece> _pieces;
+  double _from;
+  double _to;
+  // Maximal absolute value of function, relative to which errors are measured
+  double _scale;
+  bool _valid;
+  size_t _evaluations;
+  // Roots of interpolant and of its derivative, once they were searched
+  std::optional<std::vector<double>> _roots[2];
+  bool _rootsSearched[2];
+
+  // Resolve f on [a;b], splitting it if needed. Returns false if f can't be
+  // resolved
+  bool BuildPiece(const Integrand& f, double a, double b, int depth);
+  // Find piece containing x
+  const Piece* FindPiece(double x) const;
+  // Evaluate Chebyshev series in t from [-1;1]
+  static double Clenshaw(const std::vector<double>& coeffs, double t);
+  // Find real roots of Chebyshev series in [-1;1], appending them to roots.
+  // Returns false if eigenvalues didn't converge
+  static bool SeriesRoots(const std::vector<double>& coeffs,
+                          std::vector<double>& roots);
+  // Find eigenvalues of n x n upper Hessenberg matrix h stored by rows, which
+  // is destroyed. Returns false if QR iterations didn't converge
+  static bool HessenbergEigenvalues(std::vector<double>& h,
+                                    size_t n,
+                                    std::vector<double>& re,
+                                    std::vector<double>& im);
+};
\ No newline at end of file
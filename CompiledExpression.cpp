@@ -0,0 +1,1150 @@
+#include "CompiledExpression.h"
+#include "DoubleDouble.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// Number of points evaluated by each instruction at once
+#define EVAL_BLOCK_SIZE 64
+// Number of family members evaluated together, sharing registers which don't
+// depend on swept variable
+#define FAMILY_GROUP 16
+// Number of temporary series used by Taylor series operations
+#define SERIES_TEMPS 3
+
+// Coefficient j of Taylor series register s. Every coefficient holds values of
+// whole block of points
+#define COEF(s, j) ((s) + (j) * EVAL_BLOCK_SIZE)
+
+// Raise x to integer power by squaring
+template<typename T>
+static inline T
+IntPow(T x, long n)
+{
+  bool negative = n < 0;
+  unsigned long e = negative ? -static_cast<unsigned long>(n) : n;
+  T res = 1;
+
+  while (e) {
+    if (e & 1)
+      res = res * x;
+    x = x * x;
+    e >>= 1;
+  }
+
+  return negative ? 1 / res : res;
+}
+
+// Set series to constant in every point
+static void
+SeriesConst(double* dst, double value, size_t terms, size_t n)
+{
+  std::fill(dst, dst + n, value);
+  std::fill(COEF(dst, 1), COEF(dst, terms), 0.0);
+}
+
+static void
+SeriesCopy(double* dst, const double* a, size_t terms)
+{
+  std::copy(a, COEF(a, terms), dst);
+}
+
+// dst = a * b
+static void
+SeriesMul(double* dst, const double* a, const double* b, size_t terms, size_t n)
+{
+  for (size_t k = 0; k < terms; ++k) {
+    double* c = COEF(dst, k);
+    std::fill(c, c + n, 0.0);
+    for (size_t j = 0; j <= k; ++j) {
+      const double* aj = COEF(a, j);
+      const double* bk = COEF(b, k - j);
+      for (size_t i = 0; i < n; ++i)
+        c[i] += aj[i] * bk[i];
+    }
+  }
+}
+
+// dst = a / b
+static void
+SeriesDiv(double* dst, const double* a, const double* b, size_t terms, size_t n)
+{
+  for (size_t k = 0; k < terms; ++k) {
+    double* c = COEF(dst, k);
+    std::copy(COEF(a, k), COEF(a, k) + n, c);
+    for (size_t j = 1; j <= k; ++j) {
+      const double* bj = COEF(b, j);
+      const double* ck = COEF(dst, k - j);
+      for (size_t i = 0; i < n; ++i)
+        c[i] -= bj[i] * ck[i];
+    }
+    for (size_t i = 0; i < n; ++i)
+      c[i] /= b[i];
+  }
+}
+
+// dst = derivative of a, having one coefficient less
+static void
+SeriesDerivative(double* dst, const double* a, size_t terms, size_t n)
+{
+  for (size_t k = 0; k + 1 < terms; ++k) {
+    const double* ak = COEF(a, k + 1);
+    double* c = COEF(dst, k);
+    for (size_t i = 0; i < n; ++i)
+      c[i] = (k + 1) * ak[i];
+  }
+}
+
+// Find coefficients of g, which derivative is p / q. Constant coefficient of g
+// must be already set
+static void
+SeriesFromDerivative(double* g,
+                     const double* p,
+                     const double* q,
+                     size_t terms,
+                     size_t n)
+{
+  // Coefficient m of derivative of g is (m + 1) * g[m + 1]
+  for (size_t m = 0; m + 1 < terms; ++m) {
+    double* c = COEF(g, m + 1);
+    std::copy(COEF(p, m), COEF(p, m) + n, c);
+    for (size_t j = 1; j <= m; ++j) {
+      const double* qj = COEF(q, j);
+      const double* gk = COEF(g, m - j + 1);
+      for (size_t i = 0; i < n; ++i)
+        c[i] -= qj[i] * (m - j + 1) * gk[i];
+    }
+    for (size_t i = 0; i < n; ++i)
+      c[i] /= q[i] * (m + 1);
+  }
+}
+
+// dst = sqrt(a)
+static void
+SeriesSqrt(double* dst, const double* a, size_t terms, size_t n)
+{
+  for (size_t i = 0; i < n; ++i)
+    dst[i] = std::sqrt(a[i]);
+  for (size_t k = 1; k < terms; ++k) {
+    double* c = COEF(dst, k);
+    std::copy(COEF(a, k), COEF(a, k) + n, c);
+    for (size_t j = 1; j < k; ++j) {
+      const double* cj = COEF(dst, j);
+      const double* ck = COEF(dst, k - j);
+      for (size_t i = 0; i < n; ++i)
+        c[i] -= cj[i] * ck[i];
+    }
+    for (size_t i = 0; i < n; ++i)
+      c[i] /= 2 * dst[i];
+  }
+}
+
+// dst = exp(a)
+static void
+SeriesExp(double* dst, const double* a, size_t terms, size_t n)
+{
+  for (size_t i = 0; i < n; ++i)
+    dst[i] = std::exp(a[i]);
+  for (size_t k = 1; k < terms; ++k) {
+    double* c = COEF(dst, k);
+    std::fill(c, c + n, 0.0);
+    for (size_t j = 1; j <= k; ++j) {
+      const double* aj = COEF(a, j);
+      const double* ck = COEF(dst, k - j);
+      for (size_t i = 0; i < n; ++i)
+        c[i] += j * aj[i] * ck[i];
+    }
+    for (size_t i = 0; i < n; ++i)
+      c[i] /= k;
+  }
+}
+
+// s = sin(a), c = cos(a), or sinh and cosh if hyperbolic is set
+static void
+SeriesSinCos(double* s,
+             double* c,
+             const double* a,
+             bool hyperbolic,
+             size_t terms,
+             size_t n)
+{
+  for (size_t i = 0; i < n; ++i) {
+    s[i] = hyperbolic ? std::sinh(a[i]) : std::sin(a[i]);
+    c[i] = hyperbolic ? std::cosh(a[i]) : std::cos(a[i]);
+  }
+  double sign = hyperbolic ? 1.0 : -1.0;
+  for (size_t k = 1; k < terms; ++k) {
+    double* sk = COEF(s, k);
+    double* ck = COEF(c, k);
+    std::fill(sk, sk + n, 0.0);
+    std::fill(ck, ck + n, 0.0);
+    for (size_t j = 1; j <= k; ++j) {
+      const double* aj = COEF(a, j);
+      const double* sj = COEF(s, k - j);
+      const double* cj = COEF(c, k - j);
+      for (size_t i = 0; i < n; ++i) {
+        sk[i] += j * aj[i] * cj[i];
+        ck[i] += j * aj[i] * sj[i];
+      }
+    }
+    for (size_t i = 0; i < n; ++i) {
+      sk[i] /= k;
+      ck[i] *= sign / k;
+    }
+  }
+}
+
+// dst = tan(a), or tanh(a) if hyperbolic is set. w is temporary series
+static void
+SeriesTan(double* dst,
+          double* w,
+          const double* a,
+          bool hyperbolic,
+          size_t terms,
+          size_t n)
+{
+  // Derivative of tan(a) is a' * (1 + tan(a)^2), of tanh(a) - a' * (1 -
+  // tanh(a)^2)
+  double sign = hyperbolic ? -1.0 : 1.0;
+  for (size_t i = 0; i < n; ++i)
+    dst[i] = hyperbolic ? std::tanh(a[i]) : std::tan(a[i]);
+  for (size_t k = 1; k < terms; ++k) {
+    double* wm = COEF(w, k - 1);
+    std::fill(wm, wm + n, k == 1 ? 1.0 : 0.0);
+    for (size_t j = 0; j < k; ++j) {
+      const double* tj = COEF(dst, j);
+      const double* tm = COEF(dst, k - 1 - j);
+      for (size_t i = 0; i < n; ++i)
+        wm[i] += sign * tj[i] * tm[i];
+    }
+
+    double* c = COEF(dst, k);
+    std::fill(c, c + n, 0.0);
+    for (size_t j = 1; j <= k; ++j) {
+      const double* aj = COEF(a, j);
+      const double* wk = COEF(w, k - j);
+      for (size_t i = 0; i < n; ++i)
+        c[i] += j * aj[i] * wk[i];
+    }
+    for (size_t i = 0; i < n; ++i)
+      c[i] /= k;
+  }
+}
+
+CompiledExpression::CompiledExpression(uint32_t nvariables)
+  : _nVariables(nvariables)
+{
+}
+
+// Check if operation reads two operands
+static bool
+IsBinary(OpCode op)
+{
+  switch (op) {
+    case OpCode::Add:
+    case OpCode::Sub:
+    case OpCode::Mul:
+    case OpCode::Div:
+    case OpCode::Pow:
+    case OpCode::Atan2:
+      return true;
+    default:
+      return false;
+  }
+}
+
+uint32_t
+CompiledExpression::Append(OpCode op, uint32_t a, uint32_t b, double value)
+{
+  // Unused fields are cleared and operands of commutative operations are
+  // ordered, so that equal instructions have equal contents
+  bool unary = !IsBinary(op);
+  if (op == OpCode::Const || op == OpCode::Var)
+    a = 0;
+  if (unary)
+    b = 0;
+  if (op != OpCode::Const && op != OpCode::Var && op != OpCode::PowInt)
+    value = 0;
+  if ((op == OpCode::Add || op == OpCode::Mul) && a > b)
+    std::swap(a, b);
+
+  // Constants are compared bitwise, so that NaN and -0 are kept apart
+  uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  uint64_t hash = static_cast<uint64_t>(op);
+  for (uint64_t part : { uint64_t(a), uint64_t(b), bits })
+    hash = (hash ^ part) * 0x100000001b3ull + (hash >> 29);
+
+  auto range = _index.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    const Instruction& ins = _code[it->second];
+    uint64_t insBits;
+    std::memcpy(&insBits, &ins.value, sizeof(insBits));
+    if (ins.op == op && ins.a == a && ins.b == b && insBits == bits)
+      return it->second;
+  }
+
+  uint64_t deps = 0;
+  if (op == OpCode::Var)
+    deps = uint64_t(1) << std::min<uint32_t>(static_cast<uint32_t>(value), 63);
+  else if (op != OpCode::Const)
+    deps = unary ? _dependencies[a] : _dependencies[a] | _dependencies[b];
+
+  _code.push_back({ op, a, b, value });
+  _dependencies.push_back(deps);
+  _index.emplace(hash, _code.size() - 1);
+  return _code.size() - 1;
+}
+
+uint32_t
+CompiledExpression::AppendProgram(const CompiledExpression& program,
+                                  const std::vector<uint32_t>& variables)
+{
+  // Registers of appended program in this one
+  std::vector<uint32_t> regs(program._code.size());
+  for (size_t r = 0; r < program._code.size(); ++r) {
+    const Instruction& ins = program._code[r];
+    double value = ins.op == OpCode::Var
+                     ? variables[static_cast<uint32_t>(ins.value)]
+                     : ins.value;
+    regs[r] = Append(ins.op, regs[ins.a], regs[ins.b], value);
+  }
+
+  return program._code.empty() ? 0 : regs[program._output];
+}
+
+// Evaluate instruction in n points. a and b are values of its operands, for
+// Var instruction a holds values of variable
+template<typename T>
+static void
+EvaluateInstruction(const Instruction& ins,
+                    const T* a,
+                    const T* b,
+                    size_t n,
+                    T* dst)
+{
+  switch (ins.op) {
+    case OpCode::Const:
+      std::fill(dst, dst + n, static_cast<T>(ins.value));
+      break;
+    case OpCode::Var:
+      std::copy(a, a + n, dst);
+      break;
+    case OpCode::Add:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = a[i] + b[i];
+      break;
+    case OpCode::Sub:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = a[i] - b[i];
+      break;
+    case OpCode::Mul:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = a[i] * b[i];
+      break;
+    case OpCode::Div:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = a[i] / b[i];
+      break;
+    case OpCode::Neg:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = -a[i];
+      break;
+    case OpCode::Pow:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = std::pow(a[i], b[i]);
+      break;
+    case OpCode::PowInt: {
+      long e = static_cast<long>(ins.value);
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = IntPow(a[i], e);
+      break;
+    }
+    case OpCode::Sqrt:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = std::sqrt(a[i]);
+      break;
+    case OpCode::Exp:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = std::exp(a[i]);
+      break;
+    case OpCode::Log:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = std::log(a[i]);
+      break;
+    case OpCode::Sin:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = std::sin(a[i]);
+      break;
+    case OpCode::Cos:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = std::cos(a[i]);
+      break;
+    case OpCode::Tan:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = std::tan(a[i]);
+      break;
+    case OpCode::Asin:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = std::asin(a[i]);
+      break;
+    case OpCode::Acos:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = std::acos(a[i]);
+      break;
+    case OpCode::Atan:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = std::atan(a[i]);
+      break;
+    case OpCode::Atan2:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = std::atan2(a[i], b[i]);
+      break;
+    case OpCode::Sinh:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = std::sinh(a[i]);
+      break;
+    case OpCode::Cosh:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = std::cosh(a[i]);
+      break;
+    case OpCode::Tanh:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = std::tanh(a[i]);
+      break;
+    case OpCode::Asinh:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = std::asinh(a[i]);
+      break;
+    case OpCode::Acosh:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = std::acosh(a[i]);
+      break;
+    case OpCode::Atanh:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = std::atanh(a[i]);
+      break;
+    case OpCode::Abs:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = std::fabs(a[i]);
+      break;
+  }
+}
+
+// Same in double-double precision. Functions run over whole block at once
+static void
+EvaluateInstruction(const Instruction& ins,
+                    const DoubleDouble* a,
+                    const DoubleDouble* b,
+                    size_t n,
+                    DoubleDouble* dst)
+{
+  switch (ins.op) {
+    case OpCode::Const:
+      std::fill(dst, dst + n, DoubleDouble(ins.value));
+      break;
+    case OpCode::Var:
+      std::copy(a, a + n, dst);
+      break;
+    case OpCode::Add:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = a[i] + b[i];
+      break;
+    case OpCode::Sub:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = a[i] - b[i];
+      break;
+    case OpCode::Mul:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = a[i] * b[i];
+      break;
+    case OpCode::Div:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = a[i] / b[i];
+      break;
+    case OpCode::Neg:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = -a[i];
+      break;
+    case OpCode::Pow:
+      Pow(a, b, n, dst);
+      break;
+    case OpCode::PowInt: {
+      long e = static_cast<long>(ins.value);
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = IntPow(a[i], e);
+      break;
+    }
+    case OpCode::Sqrt:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = Sqrt(a[i]);
+      break;
+    case OpCode::Exp:
+      Exp(a, n, dst);
+      break;
+    case OpCode::Log:
+      Log(a, n, dst);
+      break;
+    case OpCode::Sin:
+      Sin(a, n, dst);
+      break;
+    case OpCode::Cos:
+      Cos(a, n, dst);
+      break;
+    case OpCode::Tan:
+      Tan(a, n, dst);
+      break;
+    case OpCode::Asin:
+      Asin(a, n, dst);
+      break;
+    case OpCode::Acos:
+      Acos(a, n, dst);
+      break;
+    case OpCode::Atan:
+      Atan(a, n, dst);
+      break;
+    case OpCode::Atan2:
+      Atan2(a, b, n, dst);
+      break;
+    case OpCode::Sinh:
+      Sinh(a, n, dst);
+      break;
+    case OpCode::Cosh:
+      Cosh(a, n, dst);
+      break;
+    case OpCode::Tanh:
+      Tanh(a, n, dst);
+      break;
+    case OpCode::Asinh:
+      Asinh(a, n, dst);
+      break;
+    case OpCode::Acosh:
+      Acosh(a, n, dst);
+      break;
+    case OpCode::Atanh:
+      Atanh(a, n, dst);
+      break;
+    case OpCode::Abs:
+      for (size_t i = 0; i < n; ++i)
+        dst[i] = Abs(a[i]);
+      break;
+  }
+}
+
+// Round register value back to double
+static inline double
+ToDouble(float value)
+{
+  return value;
+}
+
+static inline double
+ToDouble(const DoubleDouble& value)
+{
+  return value.ToDouble();
+}
+
+template<typename T>
+void
+CompiledExpression::EvaluateBlock(const T* vars,
+                                  size_t stride,
+                                  size_t offset,
+                                  size_t n,
+                                  T* regs) const
+{
+  for (size_t r = 0; r < _code.size(); ++r) {
+    const Instruction& ins = _code[r];
+    const T* a =
+      ins.op == OpCode::Var
+        ? vars + static_cast<size_t>(ins.value) * stride + offset
+        : regs + ins.a * EVAL_BLOCK_SIZE;
+    EvaluateInstruction(
+      ins, a, regs + ins.b * EVAL_BLOCK_SIZE, n, regs + r * EVAL_BLOCK_SIZE);
+  }
+}
+
+void
+CompiledExpression::SetPolynomial(std::vector<double> coeffs, bool compensated)
+{
+  _poly = std::move(coeffs);
+  _compensated = compensated;
+}
+
+void
+CompiledExpression::EvaluatePolynomialBlock(const double* xs,
+                                            size_t n,
+                                            double* out) const
+{
+  size_t degree = _poly.size() - 1;
+
+  if (_compensated) {
+    // Horner scheme, which keeps rounding errors of every step in separate
+    // polynomial and adds it in the end. out is written only then, since it
+    // may be same buffer as xs
+    double acc[EVAL_BLOCK_SIZE];
+    double err[EVAL_BLOCK_SIZE];
+    std::fill(acc, acc + n, _poly[degree]);
+    std::fill(err, err + n, 0.0);
+    for (size_t k = degree; k-- > 0;) {
+      double c = _poly[k];
+      for (size_t i = 0; i < n; ++i) {
+        double product = acc[i] * xs[i];
+        double productErr = ProductError(acc[i], xs[i], product);
+        double sum = product + c;
+        double z = sum - product;
+        double sumErr = (product - (sum - z)) + (c - z);
+        err[i] = err[i] * xs[i] + (productErr + sumErr);
+        acc[i] = sum;
+      }
+    }
+    for (size_t i = 0; i < n; ++i)
+      out[i] = acc[i] + err[i];
+    return;
+  }
+
+  // Estrin scheme: pairs of coefficients are joined into linear terms, then
+  // pairs of terms are joined with x^2, x^4 etc., which makes dependency
+  // chains short and every step is loop across points, which optimizing
+  // compiler vectorizes
+  double terms[(POLY_MAX_DEGREE + 2) / 2][EVAL_BLOCK_SIZE];
+  double power[EVAL_BLOCK_SIZE];
+  size_t count = (degree + 2) / 2;
+
+  for (size_t j = 0; j < count; ++j) {
+    double c0 = _poly[2 * j];
+    double c1 = 2 * j + 1 <= degree ? _poly[2 * j + 1] : 0.0;
+    for (size_t i = 0; i < n; ++i)
+      terms[j][i] = c0 + c1 * xs[i];
+  }
+  for (size_t i = 0; i < n; ++i)
+    power[i] = xs[i] * xs[i];
+
+  while (count > 1) {
+    size_t half = (count + 1) / 2;
+    for (size_t j = 0; j < half; ++j) {
+      if (2 * j + 1 < count) {
+        for (size_t i = 0; i < n; ++i)
+          terms[j][i] = terms[2 * j][i] + terms[2 * j + 1][i] * power[i];
+      } else {
+        std::copy(terms[2 * j], terms[2 * j] + n, terms[j]);
+      }
+    }
+    for (size_t i = 0; i < n; ++i)
+      power[i] *= power[i];
+    count = half;
+  }
+
+  std::copy(terms[0], terms[0] + n, out);
+}
+
+void
+CompiledExpression::Evaluate(const double* vars,
+                             size_t n,
+                             double* out,
+                             Precision precision,
+                             const double* varsLo) const
+{
+  if (_code.empty()) {
+    std::fill(out, out + n, std::nan(""));
+    return;
+  }
+
+  // Double-double precision evaluates instructions of polynomial too, since
+  // extended precision is needed there for cancellation in them
+  if (precision == Precision::DoubleDouble ||
+      (precision == Precision::Single && _poly.empty())) {
+    if (precision == Precision::Single)
+      EvaluateConverted<float>(vars, n, out);
+    else
+      EvaluateConverted<DoubleDouble>(vars, n, out, varsLo);
+    return;
+  }
+
+  if (!_poly.empty()) {
+    for (size_t offset = 0; offset < n; offset += EVAL_BLOCK_SIZE) {
+      size_t count = std::min<size_t>(EVAL_BLOCK_SIZE, n - offset);
+      EvaluatePolynomialBlock(vars + offset, count, out + offset);
+    }
+    return;
+  }
+
+  // Registers are reused between calls, so that evaluation doesn't allocate
+  // once scratch buffer is big enough
+  thread_local std::vector<double> regs;
+  if (regs.size() < _code.size() * EVAL_BLOCK_SIZE)
+    regs.resize(_code.size() * EVAL_BLOCK_SIZE);
+
+  const double* res = regs.data() + _output * EVAL_BLOCK_SIZE;
+  for (size_t offset = 0; offset < n; offset += EVAL_BLOCK_SIZE) {
+    size_t count = std::min<size_t>(EVAL_BLOCK_SIZE, n - offset);
+    EvaluateBlock(vars, n, offset, count, regs.data());
+    std::copy(res, res + count, out + offset);
+  }
+}
+
+template<typename T>
+void
+CompiledExpression::EvaluateConverted(const double* vars,
+                                      size_t n,
+                                      double* out,
+                                      const double* varsLo) const
+{
+  // Variables of block are converted first. Floats run on twice as many
+  // values per vector register, double-doubles keep bits lost by cancellation
+  thread_local std::vector<T> regs;
+  thread_local std::vector<T> blockVars;
+  if (regs.size() < _code.size() * EVAL_BLOCK_SIZE)
+    regs.resize(_code.size() * EVAL_BLOCK_SIZE);
+  blockVars.resize(_nVariables * EVAL_BLOCK_SIZE);
+
+  const T* res = regs.data() + _output * EVAL_BLOCK_SIZE;
+  for (size_t offset = 0; offset < n; offset += EVAL_BLOCK_SIZE) {
+    size_t count = std::min<size_t>(EVAL_BLOCK_SIZE, n - offset);
+    for (uint32_t v = 0; v < _nVariables; ++v) {
+      for (size_t i = 0; i < count; ++i) {
+        size_t k = v * n + offset + i;
+        blockVars[v * EVAL_BLOCK_SIZE + i] =
+          varsLo ? static_cast<T>(vars[k]) + static_cast<T>(varsLo[k])
+                 : static_cast<T>(vars[k]);
+      }
+    }
+    EvaluateBlock(blockVars.data(), EVAL_BLOCK_SIZE, 0, count, regs.data());
+    for (size_t i = 0; i < count; ++i)
+      out[offset + i] = ToDouble(res[i]);
+  }
+}
+
+void
+CompiledExpression::EvaluateOutputs(const double* vars,
+                                    size_t n,
+                                    const std::vector<uint32_t>& outputs,
+                                    double* out) const
+{
+  if (_code.empty()) {
+    std::fill(out, out + n * outputs.size(), std::nan(""));
+    return;
+  }
+
+  thread_local std::vector<double> regs;
+  if (regs.size() < _code.size() * EVAL_BLOCK_SIZE)
+    regs.resize(_code.size() * EVAL_BLOCK_SIZE);
+
+  for (size_t offset = 0; offset < n; offset += EVAL_BLOCK_SIZE) {
+    size_t count = std::min<size_t>(EVAL_BLOCK_SIZE, n - offset);
+    EvaluateBlock(vars, n, offset, count, regs.data());
+    for (size_t j = 0; j < outputs.size(); ++j) {
+      const double* res = regs.data() + outputs[j] * EVAL_BLOCK_SIZE;
+      std::copy(res, res + count, out + j * n + offset);
+    }
+  }
+}
+
+double
+CompiledExpression::GetCost() const
+{
+  double cost = 0;
+  for (auto& ins : _code) {
+    switch (ins.op) {
+      case OpCode::Const:
+      case OpCode::Var:
+        break;
+      case OpCode::Add:
+      case OpCode::Sub:
+      case OpCode::Mul:
+      case OpCode::Neg:
+      case OpCode::Abs:
+        cost += 1;
+        break;
+      case OpCode::Div:
+        cost += 4;
+        break;
+      case OpCode::Sqrt:
+        cost += 6;
+        break;
+      case OpCode::PowInt: {
+        // Multiplications of squaring, division for negative exponent
+        long e = static_cast<long>(ins.value);
+        cost += e < 0 ? 4 : 0;
+        for (unsigned long left = e < 0 ? -e : e; left > 1; left >>= 1)
+          cost += (left & 1) ? 2 : 1;
+        break;
+      }
+      case OpCode::Pow:
+        cost += 60;
+        break;
+      default:
+        // Transcendental functions
+        cost += 25;
+        break;
+    }
+  }
+  return cost;
+}
+
+double
+CompiledExpression::Evaluate(const double* vars) const
+{
+  double res;
+  Evaluate(vars, 1, &res);
+  return res;
+}
+
+void
+CompiledExpression::EvaluateStaged(const double* vars,
+                                   size_t n,
+                                   StagedRegisters& staged,
+                                   double* out) const
+{
+  if (_code.empty() || !_poly.empty()) {
+    Evaluate(vars, n, out);
+    return;
+  }
+
+  // Find variables which changed since registers were filled, all of them if
+  // registers belong to other program or points
+  size_t size = n * _nVariables;
+  uint64_t changed = 0;
+  if (staged.program != this || staged.n != n ||
+      staged.regs.size() != _code.size() * n) {
+    changed = ~uint64_t(0);
+    staged.program = this;
+    staged.n = n;
+    staged.regs.resize(_code.size() * n);
+    staged.vars.assign(vars, vars + size);
+  } else {
+    for (uint32_t v = 0; v < _nVariables; ++v) {
+      const double* src = vars + v * n;
+      double* saved = staged.vars.data() + v * n;
+      if (!std::equal(src, src + n, saved)) {
+        changed |= uint64_t(1) << std::min<uint32_t>(v, 63);
+        std::copy(src, src + n, saved);
+      }
+    }
+  }
+
+  // Whole column of every register is evaluated at once. Constant registers
+  // depend on nothing, so they're evaluated only when registers are new
+  double* regs = staged.regs.data();
+  bool fresh = changed == ~uint64_t(0);
+  for (size_t r = 0; r < _code.size(); ++r) {
+    if (!fresh && !(_dependencies[r] & changed))
+      continue;
+
+    const Instruction& ins = _code[r];
+    const double* a = ins.op == OpCode::Var
+                        ? vars + static_cast<size_t>(ins.value) * n
+                        : regs + ins.a * n;
+    EvaluateInstruction(ins, a, regs + ins.b * n, n, regs + r * n);
+  }
+
+  std::copy(regs + _output * n, regs + _output * n + n, out);
+}
+
+void
+CompiledExpression::EvaluateFamily(const double* vars,
+                                   size_t n,
+                                   uint32_t variable,
+                                   const double* values,
+                                   size_t m,
+                                   double* out) const
+{
+  if (_code.empty() || !_poly.empty() || variable >= _nVariables) {
+    for (size_t j = 0; j < m; ++j)
+      Evaluate(vars, n, out + j * n);
+    return;
+  }
+
+  // Every register has row for block of points of every member of group.
+  // Registers not depending on variable use only first block of their row
+  size_t row = FAMILY_GROUP * EVAL_BLOCK_SIZE;
+  uint64_t bit = uint64_t(1) << std::min<uint32_t>(variable, 63);
+  thread_local std::vector<double> regs;
+  if (regs.size() < _code.size() * row)
+    regs.resize(_code.size() * row);
+
+  for (size_t offset = 0; offset < n; offset += EVAL_BLOCK_SIZE) {
+    size_t count = std::min<size_t>(EVAL_BLOCK_SIZE, n - offset);
+
+    for (size_t r = 0; r < _code.size(); ++r) {
+      if (_dependencies[r] & bit)
+        continue;
+      const Instruction& ins = _code[r];
+      const double* a =
+        ins.op == OpCode::Var
+          ? vars + static_cast<size_t>(ins.value) * n + offset
+          : regs.data() + ins.a * row;
+      EvaluateInstruction(
+        ins, a, regs.data() + ins.b * row, count, regs.data() + r * row);
+    }
+
+    for (size_t first = 0; first < m; first += FAMILY_GROUP) {
+      size_t group = std::min<size_t>(FAMILY_GROUP, m - first);
+
+      for (size_t r = 0; r < _code.size(); ++r) {
+        if (!(_dependencies[r] & bit))
+          continue;
+        const Instruction& ins = _code[r];
+        size_t aStep = _dependencies[ins.a] & bit ? EVAL_BLOCK_SIZE : 0;
+        size_t bStep = _dependencies[ins.b] & bit ? EVAL_BLOCK_SIZE : 0;
+
+        for (size_t k = 0; k < group; ++k) {
+          double* dst = regs.data() + r * row + k * EVAL_BLOCK_SIZE;
+          if (ins.op == OpCode::Var && ins.value == variable) {
+            std::fill(dst, dst + count, values[first + k]);
+            continue;
+          }
+          const double* a =
+            ins.op == OpCode::Var
+              ? vars + static_cast<size_t>(ins.value) * n + offset
+              : regs.data() + ins.a * row + k * aStep;
+          EvaluateInstruction(
+            ins, a, regs.data() + ins.b * row + k * bStep, count, dst);
+        }
+      }
+
+      size_t step = _dependencies[_output] & bit ? EVAL_BLOCK_SIZE : 0;
+      for (size_t k = 0; k < group; ++k) {
+        const double* res = regs.data() + _output * row + k * step;
+        std::copy(res, res + count, out + (first + k) * n + offset);
+      }
+    }
+  }
+}
+
+void
+CompiledExpression::EvaluateSeriesBlock(const double* vars,
+                                        size_t stride,
+                                        size_t offset,
+                                        size_t n,
+                                        uint32_t variable,
+                                        size_t terms,
+                                        double* regs) const
+{
+  size_t size = terms * EVAL_BLOCK_SIZE;
+  double* temp0 = regs + _code.size() * size;
+  double* temp1 = temp0 + size;
+  double* temp2 = temp1 + size;
+
+  for (size_t r = 0; r < _code.size(); ++r) {
+    const Instruction& ins = _code[r];
+    double* dst = regs + r * size;
+    const double* a = regs + ins.a * size;
+    const double* b = regs + ins.b * size;
+
+    switch (ins.op) {
+      case OpCode::Const:
+        SeriesConst(dst, ins.value, terms, n);
+        break;
+      case OpCode::Var: {
+        const double* src =
+          vars + static_cast<size_t>(ins.value) * stride + offset;
+        SeriesConst(dst, 0, terms, n);
+        std::copy(src, src + n, dst);
+        if (terms > 1 && static_cast<uint32_t>(ins.value) == variable)
+          std::fill(COEF(dst, 1), COEF(dst, 1) + n, 1.0);
+        break;
+      }
+      case OpCode::Add:
+        for (size_t i = 0; i < terms * EVAL_BLOCK_SIZE; ++i)
+          dst[i] = a[i] + b[i];
+        break;
+      case OpCode::Sub:
+        for (size_t i = 0; i < terms * EVAL_BLOCK_SIZE; ++i)
+          dst[i] = a[i] - b[i];
+        break;
+      case OpCode::Neg:
+        for (size_t i = 0; i < terms * EVAL_BLOCK_SIZE; ++i)
+          dst[i] = -a[i];
+        break;
+      case OpCode::Mul:
+        SeriesMul(dst, a, b, terms, n);
+        break;
+      case OpCode::Div:
+        SeriesDiv(dst, a, b, terms, n);
+        break;
+      case OpCode::Pow:
+        // a^b = exp(b * log(a))
+        for (size_t i = 0; i < n; ++i)
+          temp0[i] = std::log(a[i]);
+        SeriesDerivative(temp1, a, terms, n);
+        SeriesFromDerivative(temp0, temp1, a, terms, n);
+        SeriesMul(temp1, b, temp0, terms, n);
+        SeriesExp(dst, temp1, terms, n);
+        break;
+      case OpCode::PowInt: {
+        // Square and multiply, so that zero base works too
+        long e = static_cast<long>(ins.value);
+        unsigned long left = e < 0 ? -static_cast<unsigned long>(e) : e;
+        SeriesConst(temp0, 1, terms, n);
+        SeriesCopy(temp1, a, terms);
+        while (left) {
+          if (left & 1) {
+            SeriesMul(temp2, temp0, temp1, terms, n);
+            SeriesCopy(temp0, temp2, terms);
+          }
+          left >>= 1;
+          if (left) {
+            SeriesMul(temp2, temp1, temp1, terms, n);
+            SeriesCopy(temp1, temp2, terms);
+          }
+        }
+        if (e < 0) {
+          SeriesConst(temp1, 1, terms, n);
+          SeriesDiv(dst, temp1, temp0, terms, n);
+        } else {
+          SeriesCopy(dst, temp0, terms);
+        }
+        break;
+      }
+      case OpCode::Sqrt:
+        SeriesSqrt(dst, a, terms, n);
+        break;
+      case OpCode::Exp:
+        SeriesExp(dst, a, terms, n);
+        break;
+      case OpCode::Log:
+        for (size_t i = 0; i < n; ++i)
+          dst[i] = std::log(a[i]);
+        SeriesDerivative(temp0, a, terms, n);
+        SeriesFromDerivative(dst, temp0, a, terms, n);
+        break;
+      case OpCode::Sin:
+        SeriesSinCos(dst, temp0, a, false, terms, n);
+        break;
+      case OpCode::Cos:
+        SeriesSinCos(temp0, dst, a, false, terms, n);
+        break;
+      case OpCode::Tan:
+        SeriesTan(dst, temp0, a, false, terms, n);
+        break;
+      case OpCode::Sinh:
+        SeriesSinCos(dst, temp0, a, true, terms, n);
+        break;
+      case OpCode::Cosh:
+        SeriesSinCos(temp0, dst, a, true, terms, n);
+        break;
+      case OpCode::Tanh:
+        SeriesTan(dst, temp0, a, true, terms, n);
+        break;
+      case OpCode::Asin:
+      case OpCode::Acos:
+      case OpCode::Atan:
+      case OpCode::Asinh:
+      case OpCode::Acosh:
+      case OpCode::Atanh: {
+        // Derivative of each of them is a' / q, where q is 1 - a^2, 1 + a^2,
+        // a^2 - 1 or root of one of these
+        SeriesMul(temp0, a, a, terms, n);
+        double square = 1;
+        double one = 1;
+        bool root = ins.op != OpCode::Atan && ins.op != OpCode::Atanh;
+        if (ins.op == OpCode::Asin || ins.op == OpCode::Acos ||
+            ins.op == OpCode::Atanh)
+          square = -1;
+        if (ins.op == OpCode::Acosh)
+          one = -1;
+        for (size_t i = 0; i < terms * EVAL_BLOCK_SIZE; ++i)
+          temp0[i] *= square;
+        for (size_t i = 0; i < n; ++i)
+          temp0[i] += one;
+        if (root) {
+          SeriesSqrt(temp1, temp0, terms, n);
+          SeriesCopy(temp0, temp1, terms);
+        }
+
+        SeriesDerivative(temp1, a, terms, n);
+        for (size_t i = 0; i < n; ++i) {
+          switch (ins.op) {
+            case OpCode::Asin:
+              dst[i] = std::asin(a[i]);
+              break;
+            case OpCode::Acos:
+              dst[i] = std::asin(a[i]);
+              break;
+            case OpCode::Atan:
+              dst[i] = std::atan(a[i]);
+              break;
+            case OpCode::Asinh:
+              dst[i] = std::asinh(a[i]);
+              break;
+            case OpCode::Acosh:
+              dst[i] = std::acosh(a[i]);
+              break;
+            default:
+              dst[i] = std::atanh(a[i]);
+              break;
+          }
+        }
+        SeriesFromDerivative(dst, temp1, temp0, terms, n);
+
+        // acos(a) = pi / 2 - asin(a)
+        if (ins.op == OpCode::Acos) {
+          for (size_t i = 0; i < terms * EVAL_BLOCK_SIZE; ++i)
+            dst[i] = -dst[i];
+          for (size_t i = 0; i < n; ++i)
+            dst[i] += M_PI_2;
+        }
+        break;
+      }
+      case OpCode::Atan2:
+        // Derivative of atan2(a, b) is (b * a' - a * b') / (a^2 + b^2)
+        SeriesDerivative(temp0, a, terms, n);
+        SeriesMul(temp1, b, temp0, terms, n);
+        SeriesDerivative(temp0, b, terms, n);
+        SeriesMul(temp2, a, temp0, terms, n);
+        for (size_t i = 0; i < terms * EVAL_BLOCK_SIZE; ++i)
+          temp1[i] -= temp2[i];
+        SeriesMul(temp0, a, a, terms, n);
+        SeriesMul(temp2, b, b, terms, n);
+        for (size_t i = 0; i < terms * EVAL_BLOCK_SIZE; ++i)
+          temp0[i] += temp2[i];
+        for (size_t i = 0; i < n; ++i)
+          dst[i] = std::atan2(a[i], b[i]);
+        SeriesFromDerivative(dst, temp1, temp0, terms, n);
+        break;
+      case OpCode::Abs:
+        for (size_t k = 0; k < terms; ++k) {
+          double* c = COEF(dst, k);
+          const double* ak = COEF(a, k);
+          for (size_t i = 0; i < n; ++i)
+            c[i] = a[i] < 0 ? -ak[i] : ak[i];
+        }
+        break;
+    }
+  }
+}
+
+void
+CompiledExpression::EvaluateDerivatives(const double* vars,
+                                        size_t n,
+                                        uint32_t variable,
+                                        uint32_t order,
+                                        double* out) const
+{
+  size_t terms = order + 1;
+  if (_code.empty()) {
+    std::fill(out, out + terms * n, std::nan(""));
+    return;
+  }
+
+  thread_local std::vector<double> regs;
+  size_t size = (_code.size() + SERIES_TEMPS) * terms * EVAL_BLOCK_SIZE;
+  if (regs.size() < size)
+    regs.resize(size);
+
+  const double* res = regs.data() + _output * terms * EVAL_BLOCK_SIZE;
+  for (size_t offset = 0; offset < n; offset += EVAL_BLOCK_SIZE) {
+    size_t count = std::min<size_t>(EVAL_BLOCK_SIZE, n - offset);
+    EvaluateSeriesBlock(vars, n, offset, count, variable, terms, regs.data());
+
+    // Taylor coefficient k is k-th derivative divided by k!
+    double factorial = 1;
+    for (size_t k = 0; k < terms; ++k) {
+      if (k)
+        factorial *= k;
+      const double* c = COEF(res, k);
+      for (size_t i = 0; i < count; ++i)
+        out[k * n + offset + i] = c[i] * factorial;
+    }
+  }
+}
@@ -0,0 +1,223 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Maximal degree of polynomials evaluated by polynomial fast path
+#define POLY_MAX_DEGREE 64
+
+// Operations of compiled expression program
+enum class OpCode : uint8_t
+{
+  // Constant value
+  Const,
+  // Value of variable with index stored in instruction value
+  Var,
+  Add,
+  Sub,
+  Mul,
+  Div,
+  Neg,
+  // Power with arbitrary exponent
+  Pow,
+  // Power with integer exponent stored in instruction value
+  PowInt,
+  Sqrt,
+  Exp,
+  Log,
+  Sin,
+  Cos,
+  Tan,
+  Asin,
+  Acos,
+  Atan,
+  Atan2,
+  Sinh,
+  Cosh,
+  Tanh,
+  Asinh,
+  Acosh,
+  Atanh,
+  Abs
+};
+
+// Single instruction of program. Every instruction writes its result into its
+// own register, which has same number as instruction itself
+struct Instruction
+{
+  OpCode op;
+  // Registers of operands
+  uint32_t a;
+  uint32_t b;
+  // Constant value, variable index or integer exponent
+  double value;
+};
+
+// Floating point type instructions are evaluated with
+enum class Precision
+{
+  // float, about 7 significant digits. Enough for drawing at moderate zoom,
+  // while evaluating twice as many points per vector instruction
+  Single,
+  Double,
+  // Pair of doubles, about 32 significant digits. Many times slower than
+  // double, but keeps precision through cancellation at deep zoom
+  DoubleDouble
+};
+
+class CompiledExpression;
+
+// Registers of program evaluated in same points earlier, kept by caller. Next
+// evaluation compares variables with ones saved here and runs only
+// instructions depending on changed ones
+struct StagedRegisters
+{
+  // Program registers are filled by, null if they're empty
+  const CompiledExpression* program = nullptr;
+  size_t n = 0;
+  // Values of every register in n points, register after register
+  std::vector<double> regs;
+  // Variables registers were evaluated with, in same layout as in Evaluate()
+  std::vector<double> vars;
+};
+
+// Expression lowered to a flat program of double operations, which can be
+// evaluated without GiNaC. Failures (like sqrt(-1) or division by zero) are
+// never reported with exceptions, they propagate as NaN or infinity
+class CompiledExpression
+{
+public:
+  // ctor, nvariables - number of variables program reads
+  CompiledExpression(uint32_t nvariables);
+
+  // Append instruction to program and get register with its result. Program
+  // is hash-consed: instruction equal to one already appended isn't appended
+  // again, its register is returned instead
+  uint32_t Append(OpCode op, uint32_t a = 0, uint32_t b = 0, double value = 0);
+
+  // Append instructions of other program, which reads its variable i from
+  // variable variables[i] of this one. Subexpressions equal to ones already
+  // appended are shared. Returns register with result of appended program
+  uint32_t AppendProgram(const CompiledExpression& program,
+                         const std::vector<uint32_t>& variables);
+
+  // Set register holding result of program
+  inline void SetOutput(uint32_t reg) { _output = reg; }
+
+  inline size_t GetSize() const { return _code.size(); }
+
+  inline uint32_t GetVariablesCount() const { return _nVariables; }
+
+  // Estimate cost of single evaluation, in units of one addition
+  double GetCost() const;
+
+  // Evaluate program as polynomial of its single variable with given
+  // coefficients, starting with constant one. Estrin scheme is used, or
+  // compensated Horner scheme, whose rounding errors are about those of
+  // twice the precision, if compensated is set. Errors of coefficients
+  // themselves aren't reduced. Instructions are still used for derivatives
+  void SetPolynomial(std::vector<double> coeffs, bool compensated);
+
+  inline bool IsPolynomial() const { return !_poly.empty(); }
+
+  // Get coefficients of polynomial fast path, empty if it's not used
+  inline const std::vector<double>& GetPolynomial() const { return _poly; }
+
+  // Check if polynomial is evaluated with compensated scheme
+  inline bool IsCompensated() const { return _compensated; }
+
+  // Evaluate program in n points. vars holds n values of first variable, then
+  // n values of second variable etc. Polynomial fast path is used in double
+  // precision only. In double-double precision varsLo, if it's given, holds
+  // parts of variables below their double rounding in same layout
+  void Evaluate(const double* vars,
+                size_t n,
+                double* out,
+                Precision precision = Precision::Double,
+                const double* varsLo = nullptr) const;
+
+  // Evaluate program in n points like Evaluate(), keeping results of several
+  // registers, so that programs appended together run in single pass. out
+  // holds n values of first register, then n values of second one etc.
+  void EvaluateOutputs(const double* vars,
+                       size_t n,
+                       const std::vector<uint32_t>& outputs,
+                       double* out) const;
+
+  // Evaluate program in single point, vars holds value of every variable
+  double Evaluate(const double* vars) const;
+
+  // Same as Evaluate() in n points, but keeping all registers in staged, so
+  // that when only some variables change between calls, instructions not
+  // depending on them aren't evaluated again
+  void EvaluateStaged(const double* vars,
+                      size_t n,
+                      StagedRegisters& staged,
+                      double* out) const;
+
+  // Evaluate program for m values of given variable in n points of other
+  // variables. out holds n results for first value, then n results for second
+  // one etc. Instructions not depending on variable are evaluated once for all
+  // values
+  void EvaluateFamily(const double* vars,
+                      size_t n,
+                      uint32_t variable,
+                      const double* values,
+                      size_t m,
+                      double* out) const;
+
+  // Evaluate program and its derivatives by given variable up to given order
+  // in n points, propagating truncated Taylor series through instructions.
+  // out holds n values of program, then n values of first derivative etc.
+  void EvaluateDerivatives(const double* vars,
+                           size_t n,
+                           uint32_t variable,
+                           uint32_t order,
+                           double* out) const;
+
+private:
+  CompiledExpression() = delete;
+  std::vector<Instruction> _code;
+  // Registers of instructions by hash of their contents
+  std::unordered_multimap<uint64_t, uint32_t> _index;
+  // Bit mask of variables every register depends on. Variables after 63th
+  // share last bit
+  std::vector<uint64_t> _dependencies;
+  uint32_t _nVariables;
+  uint32_t _output = 0;
+  // Coefficients of polynomial fast path, empty if it's not used
+  std::vector<double> _poly;
+  bool _compensated = false;
+
+  // Evaluate block of at most EVAL_BLOCK_SIZE points starting with offset,
+  // stride is distance between values of different variables. Instantiated
+  // for float, double and double-double registers
+  template<typename T>
+  void EvaluateBlock(const T* vars,
+                     size_t stride,
+                     size_t offset,
+                     size_t n,
+                     T* regs) const;
+
+  // Evaluate program in n points with registers of type T, converting values
+  // of variables, given as sums vars + varsLo if varsLo isn't null, into it
+  // and results back to double
+  template<typename T>
+  void EvaluateConverted(const double* vars,
+                         size_t n,
+                         double* out,
+                         const double* varsLo = nullptr) const;
+
+  // Evaluate polynomial in block of at most EVAL_BLOCK_SIZE points
+  void EvaluatePolynomialBlock(const double* xs, size_t n, double* out) const;
+
+  // Same for Taylor series with given number of coefficients in registers
+  void EvaluateSeriesBlock(const double* vars,
+                           size_t stride,
+                           size_t offset,
+                           size_t n,
+                           uint32_t variable,
+                           size_t terms,
+                           double* regs) const;
+};
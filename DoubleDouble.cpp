@@ -0,0 +1,519 @@
+#include "DoubleDouble.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+// Number of values every function processes at once, longer inputs are split
+#define DD_BLOCK_SIZE 64
+// Power of two argument of exponent is divided by before series, result is
+// squared back as many times
+#define DD_EXP_SQUARINGS 10
+// Number of terms of exponent series in reduced argument, and number of
+// leading ones, which need double-double precision. Further terms are below
+// 1e-16 of result and are summed in double
+#define DD_EXP_TERMS 10
+#define DD_EXP_PRECISE_TERMS 4
+// Same for sine and cosine series in [-pi/4;pi/4]
+#define DD_SIN_TERMS 14
+#define DD_SIN_PRECISE_TERMS 9
+// Maximal magnitude of exponent argument, beyond which result overflows or
+// underflows and double one is taken
+#define DD_EXP_LIMIT 700
+// Maximal number of quarter turns removed from argument of sine, further
+// arguments lose bits of reduction and fall back to double
+#define DD_MAX_QUADRANTS 1e6
+// Maximal magnitude of hyperbolic tangent argument, which is distinguished
+// from one
+#define DD_TANH_LIMIT 40
+
+static const DoubleDouble LN2(6.931471805599452862e-01,
+                              2.319046813846299558e-17);
+static const DoubleDouble PI_2(1.570796326794896558e+00,
+                               6.123233995736766036e-17);
+
+// Coefficients of series, built once
+struct Series
+{
+  // 1 / (n + 1)!, so that exp(x) - 1 = x * (exp[0] + exp[1] * x + ...)
+  DoubleDouble exp[DD_EXP_TERMS];
+  // (-1)^n / (2n + 1)! and (-1)^n / (2n)!, polynomials in x^2
+  DoubleDouble sin[DD_SIN_TERMS];
+  DoubleDouble cos[DD_SIN_TERMS];
+};
+
+static const Series&
+GetSeries()
+{
+  static const Series series = [] {
+    Series res;
+    DoubleDouble inverse[2 * DD_SIN_TERMS + 1];
+    DoubleDouble factorial = 1;
+    for (int n = 0; n <= 2 * DD_SIN_TERMS; ++n) {
+      if (n)
+        factorial = factorial * DoubleDouble(n);
+      inverse[n] = DoubleDouble(1) / factorial;
+    }
+    for (int n = 0; n < DD_EXP_TERMS; ++n)
+      res.exp[n] = inverse[n + 1];
+    for (int n = 0; n < DD_SIN_TERMS; ++n) {
+      res.sin[n] = n % 2 ? -inverse[2 * n + 1] : inverse[2 * n + 1];
+      res.cos[n] = n % 2 ? -inverse[2 * n] : inverse[2 * n];
+    }
+    return res;
+  }();
+  return series;
+}
+
+// Call f(offset, count) for every block of at most DD_BLOCK_SIZE values
+template<typename F>
+static inline void
+ForBlocks(size_t n, F f)
+{
+  for (size_t offset = 0; offset < n; offset += DD_BLOCK_SIZE)
+    f(offset, std::min<size_t>(DD_BLOCK_SIZE, n - offset));
+}
+
+// Get 2^k for k within range of normal doubles, built from its bits
+static inline double
+PowerOfTwo(long k)
+{
+  uint64_t bits = static_cast<uint64_t>(k + 1023) << 52;
+  double res;
+  std::memcpy(&res, &bits, sizeof(res));
+  return res;
+}
+
+// Multiply by power of two, which is exact
+static inline DoubleDouble
+Scale(const DoubleDouble& a, double factor)
+{
+  return { a.hi * factor, a.lo * factor };
+}
+
+// Evaluate polynomial with given coefficients in n values by Horner scheme.
+// Terms starting with precise one are small and are summed in double
+static void
+Horner(const DoubleDouble* coeffs,
+       int terms,
+       int precise,
+       const DoubleDouble* x,
+       size_t n,
+       DoubleDouble* out)
+{
+  double tail[DD_BLOCK_SIZE];
+  std::fill(tail, tail + n, coeffs[terms - 1].hi);
+  for (int k = terms - 2; k >= precise; --k)
+    for (size_t i = 0; i < n; ++i)
+      tail[i] = tail[i] * x[i].hi + coeffs[k].hi;
+
+  for (size_t i = 0; i < n; ++i)
+    out[i] = tail[i];
+  for (int k = precise - 1; k >= 0; --k)
+    for (size_t i = 0; i < n; ++i)
+      out[i] = out[i] * x[i] + coeffs[k];
+}
+
+// Exp(r) - 1 for |r| below half of ln(2), at most DD_BLOCK_SIZE values.
+// Argument is divided further, so that series converge fast, and squaring
+// keeps result without its leading one to avoid cancellation
+static void
+ExpM1Reduced(const DoubleDouble* r, size_t n, DoubleDouble* out)
+{
+  DoubleDouble x[DD_BLOCK_SIZE];
+  for (size_t i = 0; i < n; ++i)
+    x[i] = Scale(r[i], 1.0 / (1 << DD_EXP_SQUARINGS));
+  Horner(GetSeries().exp, DD_EXP_TERMS, DD_EXP_PRECISE_TERMS, x, n, out);
+
+  // (1 + e)^2 - 1 = e * (e + 2)
+  for (size_t i = 0; i < n; ++i)
+    out[i] = out[i] * x[i];
+  for (int k = 0; k < DD_EXP_SQUARINGS; ++k)
+    for (size_t i = 0; i < n; ++i)
+      out[i] = out[i] * (out[i] + DoubleDouble(2));
+}
+
+void
+Exp(const DoubleDouble* a, size_t n, DoubleDouble* out)
+{
+  ForBlocks(n, [&](size_t offset, size_t count) {
+    const DoubleDouble* x = a + offset;
+    DoubleDouble* res = out + offset;
+    double k[DD_BLOCK_SIZE];
+    DoubleDouble r[DD_BLOCK_SIZE];
+
+    // Argument is reduced by multiple of ln(2), which becomes exponent of
+    // result. Values handled by double below are replaced with zero
+    for (size_t i = 0; i < count; ++i) {
+      DoubleDouble arg =
+        std::fabs(x[i].hi) < DD_EXP_LIMIT ? x[i] : DoubleDouble(0);
+      k[i] = std::nearbyint(arg.hi / LN2.hi);
+      r[i] = arg - LN2 * DoubleDouble(k[i]);
+    }
+    ExpM1Reduced(r, count, res);
+    for (size_t i = 0; i < count; ++i)
+      res[i] = Scale(res[i] + DoubleDouble(1),
+                     PowerOfTwo(static_cast<long>(k[i])));
+
+    // Overflow, underflow and NaN are left to double
+    for (size_t i = 0; i < count; ++i)
+      if (!(std::fabs(x[i].hi) < DD_EXP_LIMIT))
+        res[i] = std::exp(x[i].hi);
+  });
+}
+
+void
+ExpM1(const DoubleDouble* a, size_t n, DoubleDouble* out)
+{
+  ForBlocks(n, [&](size_t offset, size_t count) {
+    const DoubleDouble* x = a + offset;
+    DoubleDouble* res = out + offset;
+    DoubleDouble reduced[DD_BLOCK_SIZE];
+    DoubleDouble small[DD_BLOCK_SIZE];
+    for (size_t i = 0; i < count; ++i)
+      reduced[i] = std::fabs(x[i].hi) < LN2.hi / 2 ? x[i] : DoubleDouble(0);
+    ExpM1Reduced(reduced, count, small);
+
+    // Large values don't cancel with one
+    Exp(x, count, res);
+    for (size_t i = 0; i < count; ++i)
+      res[i] = std::fabs(x[i].hi) < LN2.hi / 2 ? small[i]
+                                               : res[i] - DoubleDouble(1);
+  });
+}
+
+void
+Log(const DoubleDouble* a, size_t n, DoubleDouble* out)
+{
+  ForBlocks(n, [&](size_t offset, size_t count) {
+    const DoubleDouble* x = a + offset;
+    DoubleDouble* res = out + offset;
+    DoubleDouble y[DD_BLOCK_SIZE];
+    DoubleDouble arg[DD_BLOCK_SIZE];
+    DoubleDouble e[DD_BLOCK_SIZE];
+
+    // Newton step for root of exp(y) - x
+    for (size_t i = 0; i < count; ++i) {
+      y[i] = std::log(x[i].hi);
+      arg[i] = std::isfinite(y[i].hi) ? -y[i] : DoubleDouble(0);
+    }
+    Exp(arg, count, e);
+    for (size_t i = 0; i < count; ++i)
+      res[i] = std::isfinite(y[i].hi) ? y[i] + x[i] * e[i] - DoubleDouble(1)
+                                      : y[i];
+  });
+}
+
+void
+Pow(const DoubleDouble* a, const DoubleDouble* b, size_t n, DoubleDouble* out)
+{
+  ForBlocks(n, [&](size_t offset, size_t count) {
+    const DoubleDouble* x = a + offset;
+    const DoubleDouble* p = b + offset;
+    DoubleDouble* res = out + offset;
+    DoubleDouble base[DD_BLOCK_SIZE];
+    DoubleDouble t[DD_BLOCK_SIZE];
+
+    // Negative bases are left to double, which handles integer exponents
+    for (size_t i = 0; i < count; ++i)
+      base[i] = x[i].hi > 0 ? x[i] : DoubleDouble(1);
+    Log(base, count, t);
+    for (size_t i = 0; i < count; ++i)
+      base[i] = t[i] * p[i];
+    Exp(base, count, t);
+    for (size_t i = 0; i < count; ++i) {
+      double fallback = std::pow(x[i].hi, p[i].hi);
+      res[i] = x[i].hi > 0 ? Checked(t[i], fallback) : DoubleDouble(fallback);
+    }
+  });
+}
+
+void
+SinCos(const DoubleDouble* a, size_t n, DoubleDouble* s, DoubleDouble* c)
+{
+  const Series& series = GetSeries();
+  ForBlocks(n, [&](size_t offset, size_t count) {
+    const DoubleDouble* x = a + offset;
+    DoubleDouble* sines = s + offset;
+    DoubleDouble* cosines = c + offset;
+    double k[DD_BLOCK_SIZE];
+    DoubleDouble r[DD_BLOCK_SIZE];
+    DoubleDouble r2[DD_BLOCK_SIZE];
+    DoubleDouble sinSum[DD_BLOCK_SIZE];
+    DoubleDouble cosSum[DD_BLOCK_SIZE];
+
+    // Series of sine and cosine in remainder of quarter turns, which is
+    // within [-pi/4;pi/4]
+    for (size_t i = 0; i < count; ++i) {
+      double turns = std::nearbyint(x[i].hi / PI_2.hi);
+      k[i] = std::fabs(turns) < DD_MAX_QUADRANTS ? turns : 0;
+      r[i] = x[i] - PI_2 * DoubleDouble(k[i]);
+      r2[i] = r[i] * r[i];
+    }
+    Horner(series.sin,
+           DD_SIN_TERMS,
+           DD_SIN_PRECISE_TERMS,
+           r2,
+           count,
+           sinSum);
+    Horner(series.cos,
+           DD_SIN_TERMS,
+           DD_SIN_PRECISE_TERMS,
+           r2,
+           count,
+           cosSum);
+
+    for (size_t i = 0; i < count; ++i) {
+      DoubleDouble sine = sinSum[i] * r[i];
+      switch (static_cast<long>(k[i]) & 3) {
+        case 0:
+          sines[i] = sine;
+          cosines[i] = cosSum[i];
+          break;
+        case 1:
+          sines[i] = cosSum[i];
+          cosines[i] = -sine;
+          break;
+        case 2:
+          sines[i] = -sine;
+          cosines[i] = -cosSum[i];
+          break;
+        default:
+          sines[i] = -cosSum[i];
+          cosines[i] = sine;
+          break;
+      }
+    }
+
+    // Error of far arguments is still taken into account to first order
+    for (size_t i = 0; i < count; ++i) {
+      if (!(std::fabs(x[i].hi / PI_2.hi) < DD_MAX_QUADRANTS)) {
+        double sine = std::sin(x[i].hi);
+        double cosine = std::cos(x[i].hi);
+        sines[i] = TwoSum(sine, cosine * x[i].lo);
+        cosines[i] = TwoSum(cosine, -sine * x[i].lo);
+      }
+    }
+  });
+}
+
+void
+Sin(const DoubleDouble* a, size_t n, DoubleDouble* out)
+{
+  ForBlocks(n, [&](size_t offset, size_t count) {
+    DoubleDouble c[DD_BLOCK_SIZE];
+    SinCos(a + offset, count, out + offset, c);
+  });
+}
+
+void
+Cos(const DoubleDouble* a, size_t n, DoubleDouble* out)
+{
+  ForBlocks(n, [&](size_t offset, size_t count) {
+    DoubleDouble s[DD_BLOCK_SIZE];
+    SinCos(a + offset, count, s, out + offset);
+  });
+}
+
+void
+Tan(const DoubleDouble* a, size_t n, DoubleDouble* out)
+{
+  ForBlocks(n, [&](size_t offset, size_t count) {
+    DoubleDouble s[DD_BLOCK_SIZE];
+    DoubleDouble c[DD_BLOCK_SIZE];
+    SinCos(a + offset, count, s, c);
+    for (size_t i = 0; i < count; ++i)
+      out[offset + i] = s[i] / c[i];
+  });
+}
+
+// Inverse functions take double result and correct it by one Newton step,
+// which doubles number of correct bits. Values where double result is
+// infinite or derivative vanishes keep double result
+
+void
+Asin(const DoubleDouble* a, size_t n, DoubleDouble* out)
+{
+  ForBlocks(n, [&](size_t offset, size_t count) {
+    const DoubleDouble* x = a + offset;
+    DoubleDouble* res = out + offset;
+    DoubleDouble s[DD_BLOCK_SIZE];
+    DoubleDouble c[DD_BLOCK_SIZE];
+    for (size_t i = 0; i < count; ++i)
+      res[i] = std::asin(x[i].hi);
+    SinCos(res, count, s, c);
+    for (size_t i = 0; i < count; ++i)
+      if (std::fabs(x[i].hi) < 1)
+        res[i] = res[i] + (x[i] - s[i]) / c[i];
+  });
+}
+
+void
+Acos(const DoubleDouble* a, size_t n, DoubleDouble* out)
+{
+  ForBlocks(n, [&](size_t offset, size_t count) {
+    const DoubleDouble* x = a + offset;
+    DoubleDouble* res = out + offset;
+    DoubleDouble s[DD_BLOCK_SIZE];
+    DoubleDouble c[DD_BLOCK_SIZE];
+    for (size_t i = 0; i < count; ++i)
+      res[i] = std::acos(x[i].hi);
+    SinCos(res, count, s, c);
+    for (size_t i = 0; i < count; ++i)
+      if (std::fabs(x[i].hi) < 1)
+        res[i] = res[i] + (c[i] - x[i]) / s[i];
+  });
+}
+
+void
+Atan(const DoubleDouble* a, size_t n, DoubleDouble* out)
+{
+  ForBlocks(n, [&](size_t offset, size_t count) {
+    const DoubleDouble* x = a + offset;
+    DoubleDouble* res = out + offset;
+    DoubleDouble s[DD_BLOCK_SIZE];
+    DoubleDouble c[DD_BLOCK_SIZE];
+    for (size_t i = 0; i < count; ++i)
+      res[i] = std::atan(x[i].hi);
+    SinCos(res, count, s, c);
+
+    // Derivative of tan(y) is 1 / cos(y)^2
+    for (size_t i = 0; i < count; ++i)
+      if (std::isfinite(x[i].hi))
+        res[i] = res[i] + (x[i] * c[i] - s[i]) * c[i];
+  });
+}
+
+void
+Atan2(const DoubleDouble* a,
+      const DoubleDouble* b,
+      size_t n,
+      DoubleDouble* out)
+{
+  ForBlocks(n, [&](size_t offset, size_t count) {
+    const DoubleDouble* y = a + offset;
+    const DoubleDouble* x = b + offset;
+    DoubleDouble* res = out + offset;
+    DoubleDouble s[DD_BLOCK_SIZE];
+    DoubleDouble c[DD_BLOCK_SIZE];
+    for (size_t i = 0; i < count; ++i)
+      res[i] = std::atan2(y[i].hi, x[i].hi);
+    SinCos(res, count, s, c);
+
+    // For y = r sin(t) and x = r cos(t) correction is tan(t - res)
+    for (size_t i = 0; i < count; ++i)
+      if (std::isfinite(y[i].hi) && std::isfinite(x[i].hi) &&
+          (y[i].hi != 0 || x[i].hi != 0))
+        res[i] = res[i] + (y[i] * c[i] - x[i] * s[i]) /
+                            (y[i] * s[i] + x[i] * c[i]);
+  });
+}
+
+void
+Sinh(const DoubleDouble* a, size_t n, DoubleDouble* out)
+{
+  ForBlocks(n, [&](size_t offset, size_t count) {
+    const DoubleDouble* x = a + offset;
+    DoubleDouble* res = out + offset;
+    DoubleDouble e[DD_BLOCK_SIZE];
+    DoubleDouble m[DD_BLOCK_SIZE];
+
+    // e - 1 / e, which cancels for small values. There m = e - 1 is used
+    // instead of e
+    Exp(x, count, e);
+    ExpM1(x, count, m);
+    for (size_t i = 0; i < count; ++i) {
+      DoubleDouble d = std::fabs(x[i].hi) < 1
+                         ? m[i] + m[i] / (m[i] + DoubleDouble(1))
+                         : e[i] - DoubleDouble(1) / e[i];
+      res[i] = Checked(Scale(d, 0.5), std::sinh(x[i].hi));
+    }
+  });
+}
+
+void
+Cosh(const DoubleDouble* a, size_t n, DoubleDouble* out)
+{
+  ForBlocks(n, [&](size_t offset, size_t count) {
+    const DoubleDouble* x = a + offset;
+    DoubleDouble* res = out + offset;
+    DoubleDouble e[DD_BLOCK_SIZE];
+    Exp(x, count, e);
+    for (size_t i = 0; i < count; ++i)
+      res[i] = Checked(Scale(e[i] + DoubleDouble(1) / e[i], 0.5),
+                       std::cosh(x[i].hi));
+  });
+}
+
+void
+Tanh(const DoubleDouble* a, size_t n, DoubleDouble* out)
+{
+  ForBlocks(n, [&](size_t offset, size_t count) {
+    const DoubleDouble* x = a + offset;
+    DoubleDouble* res = out + offset;
+    DoubleDouble arg[DD_BLOCK_SIZE];
+    DoubleDouble e[DD_BLOCK_SIZE];
+
+    // (e^2 - 1) / (e^2 + 1), far values are one
+    for (size_t i = 0; i < count; ++i)
+      arg[i] = std::fabs(x[i].hi) < DD_TANH_LIMIT ? Scale(x[i], 2)
+                                                  : DoubleDouble(0);
+    ExpM1(arg, count, e);
+    for (size_t i = 0; i < count; ++i)
+      res[i] = std::fabs(x[i].hi) < DD_TANH_LIMIT
+                 ? e[i] / (e[i] + DoubleDouble(2))
+                 : DoubleDouble(std::tanh(x[i].hi));
+  });
+}
+
+void
+Asinh(const DoubleDouble* a, size_t n, DoubleDouble* out)
+{
+  ForBlocks(n, [&](size_t offset, size_t count) {
+    const DoubleDouble* x = a + offset;
+    DoubleDouble* res = out + offset;
+    DoubleDouble s[DD_BLOCK_SIZE];
+    DoubleDouble c[DD_BLOCK_SIZE];
+    for (size_t i = 0; i < count; ++i)
+      res[i] = std::asinh(x[i].hi);
+    Sinh(res, count, s);
+    Cosh(res, count, c);
+    for (size_t i = 0; i < count; ++i)
+      if (std::isfinite(x[i].hi))
+        res[i] = Checked(res[i] + (x[i] - s[i]) / c[i], res[i].hi);
+  });
+}
+
+void
+Acosh(const DoubleDouble* a, size_t n, DoubleDouble* out)
+{
+  ForBlocks(n, [&](size_t offset, size_t count) {
+    const DoubleDouble* x = a + offset;
+    DoubleDouble* res = out + offset;
+    DoubleDouble s[DD_BLOCK_SIZE];
+    DoubleDouble c[DD_BLOCK_SIZE];
+    for (size_t i = 0; i < count; ++i)
+      res[i] = std::acosh(x[i].hi);
+    Sinh(res, count, s);
+    Cosh(res, count, c);
+    for (size_t i = 0; i < count; ++i)
+      if (x[i].hi > 1 && std::isfinite(x[i].hi))
+        res[i] = Checked(res[i] + (x[i] - c[i]) / s[i], res[i].hi);
+  });
+}
+
+void
+Atanh(const DoubleDouble* a, size_t n, DoubleDouble* out)
+{
+  ForBlocks(n, [&](size_t offset, size_t count) {
+    const DoubleDouble* x = a + offset;
+    DoubleDouble* res = out + offset;
+    DoubleDouble t[DD_BLOCK_SIZE];
+    for (size_t i = 0; i < count; ++i)
+      res[i] = std::atanh(x[i].hi);
+    Tanh(res, count, t);
+    for (size_t i = 0; i < count; ++i)
+      if (std::fabs(x[i].hi) < 1)
+        res[i] =
+          res[i] + (x[i] - t[i]) / (DoubleDouble(1) - t[i] * t[i]);
+  });
+}
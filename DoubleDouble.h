@@ -0,0 +1,191 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+
+// Unevaluated sum of two doubles, where lo is below half ulp of hi. Holds
+// about 106 significant bits, so that cancellation which loses all bits of
+// double still leaves double precision. Arithmetic falls back to double
+// result when it isn't finite
+struct DoubleDouble
+{
+  double hi;
+  double lo;
+
+  DoubleDouble() = default;
+  inline DoubleDouble(double h, double l = 0)
+    : hi(h)
+    , lo(l)
+  {
+  }
+
+  // Round to nearest double
+  inline double ToDouble() const { return std::isfinite(hi) ? hi + lo : hi; }
+};
+
+// Get rounding error of product p = a * b
+inline double
+ProductError(double a, double b, double p)
+{
+#ifdef FP_FAST_FMA
+  return std::fma(a, b, -p);
+#else
+  // Without hardware fma, factors are split into halves, products of which
+  // are exact
+  const double split = 134217729.0;
+  double ca = split * a;
+  double aHigh = ca - (ca - a);
+  double aLow = a - aHigh;
+  double cb = split * b;
+  double bHigh = cb - (cb - b);
+  double bLow = b - bHigh;
+  return ((aHigh * bHigh - p) + aHigh * bLow + aLow * bHigh) + aLow * bLow;
+#endif
+}
+
+// Exact sum of doubles
+inline DoubleDouble
+TwoSum(double a, double b)
+{
+  double s = a + b;
+  double z = s - a;
+  return { s, (a - (s - z)) + (b - z) };
+}
+
+// Same when |a| >= |b|
+inline DoubleDouble
+QuickTwoSum(double a, double b)
+{
+  double s = a + b;
+  return { s, b - (s - a) };
+}
+
+// Keep result if it's finite, otherwise take double one
+inline DoubleDouble
+Checked(const DoubleDouble& res, double fallback)
+{
+  return std::isfinite(res.hi) ? res : DoubleDouble(fallback);
+}
+
+inline DoubleDouble
+operator-(const DoubleDouble& a)
+{
+  return { -a.hi, -a.lo };
+}
+
+inline DoubleDouble
+operator+(const DoubleDouble& a, const DoubleDouble& b)
+{
+  DoubleDouble s = TwoSum(a.hi, b.hi);
+  DoubleDouble t = TwoSum(a.lo, b.lo);
+  s = QuickTwoSum(s.hi, s.lo + t.hi);
+  return Checked(QuickTwoSum(s.hi, s.lo + t.lo), a.hi + b.hi);
+}
+
+inline DoubleDouble
+operator-(const DoubleDouble& a, const DoubleDouble& b)
+{
+  return a + -b;
+}
+
+inline DoubleDouble
+operator*(const DoubleDouble& a, const DoubleDouble& b)
+{
+  double p = a.hi * b.hi;
+  double e = ProductError(a.hi, b.hi, p) + (a.hi * b.lo + a.lo * b.hi);
+  return Checked(QuickTwoSum(p, e), p);
+}
+
+inline DoubleDouble
+operator/(const DoubleDouble& a, const DoubleDouble& b)
+{
+  // Every quotient digit is corrected by remainder of previous ones
+  double q1 = a.hi / b.hi;
+  DoubleDouble r = a - b * DoubleDouble(q1);
+  double q2 = r.hi / b.hi;
+  r = r - b * DoubleDouble(q2);
+  double q3 = r.hi / b.hi;
+  DoubleDouble q = QuickTwoSum(q1, q2);
+  return Checked(q + DoubleDouble(q3), q1);
+}
+
+inline DoubleDouble
+Sqrt(const DoubleDouble& a)
+{
+  if (!(a.hi > 0))
+    return std::sqrt(a.hi);
+
+  // One Newton step doubles precision of double root
+  double y = std::sqrt(a.hi);
+  DoubleDouble yy = DoubleDouble(y) * DoubleDouble(y);
+  return Checked(TwoSum(y, (a - yy).hi / (2 * y)), y);
+}
+
+inline DoubleDouble
+Abs(const DoubleDouble& a)
+{
+  return a.hi < 0 ? -a : a;
+}
+
+// Functions below take n values and write n results, which must not overlap
+// them. Every step runs over whole block of values, so that independent
+// values hide latency of long dependency chains of double-double operations
+// and are vectorized
+
+void
+Exp(const DoubleDouble* a, size_t n, DoubleDouble* out);
+
+// Exp(a) - 1 without cancellation for small a
+void
+ExpM1(const DoubleDouble* a, size_t n, DoubleDouble* out);
+
+void
+Log(const DoubleDouble* a, size_t n, DoubleDouble* out);
+
+void
+Pow(const DoubleDouble* a, const DoubleDouble* b, size_t n, DoubleDouble* out);
+
+// Find sines and cosines together
+void
+SinCos(const DoubleDouble* a, size_t n, DoubleDouble* s, DoubleDouble* c);
+
+void
+Sin(const DoubleDouble* a, size_t n, DoubleDouble* out);
+
+void
+Cos(const DoubleDouble* a, size_t n, DoubleDouble* out);
+
+void
+Tan(const DoubleDouble* a, size_t n, DoubleDouble* out);
+
+void
+Asin(const DoubleDouble* a, size_t n, DoubleDouble* out);
+
+void
+Acos(const DoubleDouble* a, size_t n, DoubleDouble* out);
+
+void
+Atan(const DoubleDouble* a, size_t n, DoubleDouble* out);
+
+void
+Atan2(const DoubleDouble* a,
+      const DoubleDouble* b,
+      size_t n,
+      DoubleDouble* out);
+
+void
+Sinh(const DoubleDouble* a, size_t n, DoubleDouble* out);
+
+void
+Cosh(const DoubleDouble* a, size_t n, DoubleDouble* out);
+
+void
+Tanh(const DoubleDouble* a, size_t n, DoubleDouble* out);
+
+void
+Asinh(const DoubleDouble* a, size_t n, DoubleDouble* out);
+
+void
+Acosh(const DoubleDouble* a, size_t n, DoubleDouble* out);
+
+void
+Atanh(const DoubleDouble* a, size_t n, DoubleDouble* out);
\ No newline at end of file
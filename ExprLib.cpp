@@ -1,103 +1,644 @@
 #include "ExprLib.h"
 #include "Expression.h"
 #include "ExpressionCalculator.h"
+#include <algorithm>
 
-ExpressionCalculator _calc = ExpressionCalculator(1000);
+ExprLib::Session::Session(uint npoints)
+  : _calc(npoints)
+  , _status(ExprStatus::Ok)
+  , _viewX1(0)
+  , _viewX2(0)
+  , _exprGeneration(0)
+  , _preparedExpr(nullptr)
+{
+}
+
+void
+ExprLib::Session::SaveError()
+{
+  _status = Expression::GetStatus();
+  _errorDetail = Expression::GetErrorDetail();
+}
+
+void
+ExprLib::Session::Speculate()
+{
+  const Expression* current = _calc.GetCurrentExpression();
+  std::string variable = _calc.GetPlotVariable();
+  if (current && !variable.empty())
+    _speculator.Prepare(*current,
+                        _exprGeneration,
+                        variable,
+                        _viewX1,
+                        _viewX2,
+                        _calc.GetNPoints());
+}
+
+std::unique_ptr<Expression>
+ExprLib::Session::TakePrepared(PreparedExpression prepared)
+{
+  std::unique_ptr<Expression> expr = std::move(prepared.expr);
+  _preparedExpr = expr.get();
+  _prepared = std::move(prepared);
+  return expr;
+}
+
+// Build job request of operation on expression by variable. Job process
+// parses expression string again, it has no copy of expression itself
+static JobRequest
+OperationRequest(JobRequest::Kind kind,
+                 const Expression& expr,
+                 const std::string& variable)
+{
+  JobRequest request;
+  request.kind = kind;
+  request.expression = expr.GetExpressionString();
+  request.variables = expr.GetVariableNames();
+  request.variable = variable;
+  return request;
+}
+
+std::unique_ptr<Expression>
+ExprLib::Session::CreateExpression(const std::string& expr_str,
+                                   const std::vector<std::string>& variables)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  std::unique_ptr<Expression> expr =
+    Expression::CreateExpression(expr_str, variables);
+  if (!expr)
+    SaveError();
+  return expr;
+}
+
+std::string
+ExprLib::Session::GetLastError() const
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  return Expression::DescribeError(_status, _errorDetail);
+}
+
+void
+ExprLib::Session::SetNPoints(uint npoints)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  _calc.SetNPoints(npoints);
+}
+
+void
+ExprLib::Session::SetWorkerPool(std::shared_ptr<WorkerPool> pool)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  _calc.SetWorkerPool(std::move(pool));
+}
+
+void
+ExprLib::Session::SetCancelFlag(const std::atomic_bool* cancelled)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  _calc.SetCancelFlag(cancelled);
+}
+
+std::vector<Point>&
+ExprLib::Session::GetPoints()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _calc.GetPoints();
+}
+
+size_t
+ExprLib::Session::GetPointsCount() const
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _calc.GetPointsCount();
+}
+
+std::optional<Interval>
+ExprLib::Session::GetYRange(double x1, double x2) const
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _calc.GetYRange(x1, x2);
+}
+
+std::vector<Point>&
+ExprLib::Session::GetFamilyPoints()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _calc.GetFamilyPoints();
+}
+
+size_t
+ExprLib::Session::GetFamilyPointsCount() const
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _calc.GetFamilyPointsCount();
+}
+
+bool
+ExprLib::Session::CompareWithCurrentExpr(const Expression& expr) const
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _calc.CompareWithCurrentExpr(expr);
+}
+
+std::unique_ptr<Expression>
+ExprLib::Session::CreateDerivative(const std::string& variable)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  const Expression* current = _calc.GetCurrentExpression();
+  if (current) {
+    std::optional<PreparedExpression> prepared =
+      _speculator.GetDerivative(_exprGeneration, variable);
+    if (prepared)
+      return TakePrepared(std::move(*prepared));
+  }
+
+  std::unique_ptr<Expression> expr = _calc.CreateDerivative(variable);
+  if (!expr)
+    SaveError();
+  return expr;
+}
+
+std::unique_ptr<Expression>
+ExprLib::Session::CreateAntiderivative(const std::string& variable, double C)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  const Expression* current = _calc.GetCurrentExpression();
+  if (current && C == 0) {
+    std::optional<PreparedExpression> prepared =
+      _speculator.GetAntiderivative(_exprGeneration, variable);
+    if (prepared)
+      return TakePrepared(std::move(*prepared));
+  }
+
+  std::unique_ptr<Expression> expr = _calc.CreateAntiderivative(variable, C);
+  if (!expr)
+    SaveError();
+  return expr;
+}
+
+std::optional<IntegrationResult>
+ExprLib::Session::CalculateIntegral(const std::string& variable,
+                                    double lowerBound,
+                                    double upperBound,
+                                    double tolerance,
+                                    size_t maxEvaluations)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  std::optional<IntegrationResult> res = _calc.CalculateIntegral(
+    variable, lowerBound, upperBound, tolerance, maxEvaluations);
+  if (!res)
+    SaveError();
+  return res;
+}
+
+std::shared_ptr<SymbolicJob>
+ExprLib::Session::CreateExpressionAsync(
+  const std::string& expr_str,
+  const std::vector<std::string>& variables,
+  const JobBudget& budget)
+{
+  // Input is parsed, rewritten and compiled in job process, so that runaway
+  // one can be killed. Only chosen form is compiled again here
+  JobRequest request;
+  request.kind = JobRequest::Kind::Parse;
+  request.expression = expr_str;
+  request.variables = variables;
+  return std::make_shared<SymbolicJob>(std::move(request), budget);
+}
+
+std::shared_ptr<SymbolicJob>
+ExprLib::Session::CreateDerivativeAsync(const std::string& variable,
+                                        const JobBudget& budget)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  const Expression* current = _calc.GetCurrentExpression();
+  if (!current)
+    return nullptr;
+
+  std::optional<PreparedExpression> prepared =
+    _speculator.GetDerivative(_exprGeneration, variable);
+  if (prepared)
+    return std::make_shared<SymbolicJob>(
+      JobResult{ TakePrepared(std::move(*prepared)), {} });
+
+  return std::make_shared<SymbolicJob>(
+    OperationRequest(JobRequest::Kind::Derivative, *current, variable),
+    budget);
+}
+
+std::shared_ptr<SymbolicJob>
+ExprLib::Session::CreateAntiderivativeAsync(const std::string& variable,
+                                            double C,
+                                            const JobBudget& budget)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  const Expression* current = _calc.GetCurrentExpression();
+  if (!current)
+    return nullptr;
+
+  if (C == 0) {
+    std::optional<PreparedExpression> prepared =
+      _speculator.GetAntiderivative(_exprGeneration, variable);
+    if (prepared)
+      return std::make_shared<SymbolicJob>(
+        JobResult{ TakePrepared(std::move(*prepared)), {} });
+  }
+
+  JobRequest request =
+    OperationRequest(JobRequest::Kind::Antiderivative, *current, variable);
+  request.C = C;
+  return std::make_shared<SymbolicJob>(std::move(request), budget);
+}
+
+std::shared_ptr<SymbolicJob>
+ExprLib::Session::CalculateIntegralAsync(const std::string& variable,
+                                         double lowerBound,
+                                         double upperBound,
+                                         double tolerance,
+                                         size_t maxEvaluations,
+                                         const JobBudget& budget)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  const Expression* current = _calc.GetCurrentExpression();
+  if (!current)
+    return nullptr;
+
+  std::optional<IntegrationResult> res =
+    _calc.IntegrateProxy(variable, lowerBound, upperBound, tolerance);
+  if (res)
+    return std::make_shared<SymbolicJob>(JobResult{ nullptr, *res });
+
+  JobRequest request =
+    OperationRequest(JobRequest::Kind::Integral, *current, variable);
+  request.lowerBound = lowerBound;
+  request.upperBound = upperBound;
+  request.tolerance = tolerance;
+  request.maxEvaluations = maxEvaluations;
+  request.parameters = _calc.GetParameters();
+  return std::make_shared<SymbolicJob>(std::move(request), budget);
+}
+
+std::string
+ExprLib::Session::GetCurrentExpressionString() const
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _calc.GetCurrentExpressionString();
+}
+
+void
+ExprLib::Session::SetExpression(std::unique_ptr<Expression> expr)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  // Prepared expression comes with its graph already sampled
+  bool prepared = _prepared && expr.get() == _preparedExpr;
+  _calc.SetExpression(std::move(expr));
+  if (prepared)
+    _calc.SetCalculatedPoints(
+      _prepared->points, _prepared->pointsCount, _prepared->x1, _prepared->x2);
+  _prepared.reset();
+  _preparedExpr = nullptr;
+  ++_exprGeneration;
+  Speculate();
+}
+
+void
+ExprLib::Session::UndoSetExpression()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  _calc.UndoSetExpression();
+  ++_exprGeneration;
+  Speculate();
+}
+
+void
+ExprLib::Session::RedoSetExpression()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  _calc.RedoSetExpression();
+  ++_exprGeneration;
+  Speculate();
+}
+
+void
+ExprLib::Session::SetAntiderivativeMode(bool enabled, double lowerBound)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  _calc.SetAntiderivativeMode(enabled, lowerBound);
+}
+
+void
+ExprLib::Session::SetParameter(const std::string& name, double value)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  _calc.SetParameter(name, value);
+}
+
+void
+ExprLib::Session::SetFamily(const std::string& parameter,
+                            double from,
+                            double to,
+                            uint size)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  _calc.SetFamily(parameter, from, to, size);
+}
+
+bool
+ExprLib::Session::AddOverlay()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _calc.AddOverlay();
+}
+
+void
+ExprLib::Session::RemoveOverlay(size_t index)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  _calc.RemoveOverlay(index);
+}
+
+const std::vector<Overlay>&
+ExprLib::Session::GetOverlays() const
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _calc.GetOverlays();
+}
+
+void
+ExprLib::Session::SetAnalysis(bool enabled)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  _calc.SetAnalysis(enabled);
+}
+
+const std::vector<Feature>&
+ExprLib::Session::GetFeatures() const
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _calc.GetFeatures();
+}
+
+void
+ExprLib::Session::SetSinglePrecision(bool enabled)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  _calc.SetSinglePrecision(enabled);
+}
+
+std::vector<Point>&
+ExprLib::Session::CalculateExpression(double x1, double x2)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  _viewX1 = std::min(x1, x2);
+  _viewX2 = std::max(x1, x2);
+  return _calc.CalculateExpression(x1, x2);
+}
+
+ExprLib::Session&
+ExprLib::GetDefaultSession()
+{
+  static Session session(1000);
+  return session;
+}
 
 std::unique_ptr<Expression>
 ExprLib::CreateExpression(const std::string& expr_str,
                           const std::vector<std::string>& variables)
 {
-  return Expression::CreateExpression(expr_str, variables);
+  return GetDefaultSession().CreateExpression(expr_str, variables);
 }
 
 std::string
 ExprLib::GetLastError()
 {
-  return Expression::GetErrorString();
+  return GetDefaultSession().GetLastError();
 }
 
 void
 ExprLib::SetNPoints(uint npoints)
 {
-  _calc.SetNPoints(npoints);
+  GetDefaultSession().SetNPoints(npoints);
+}
+
+// Set pool of processes evaluating expressions, which can't be compiled
+void
+ExprLib::SetWorkerPool(std::shared_ptr<WorkerPool> pool)
+{
+  GetDefaultSession().SetWorkerPool(std::move(pool));
+}
+
+// Set flag, which cancels evaluation in worker processes once it's set
+void
+ExprLib::SetCancelFlag(const std::atomic_bool* cancelled)
+{
+  GetDefaultSession().SetCancelFlag(cancelled);
 }
 
 // Get vector containing last calculation results
 std::vector<Point>&
 ExprLib::GetPoints()
 {
-  return _calc.GetPoints();
+  return GetDefaultSession().GetPoints();
 }
 
 // Get actual count of points vector
 size_t
 ExprLib::GetPointsCount()
 {
-  return _calc.GetPointsCount();
+  return GetDefaultSession().GetPointsCount();
+}
+
+// Get range of Y values of calculated points within [x1;x2]
+std::optional<Interval>
+ExprLib::GetYRange(double x1, double x2)
+{
+  return GetDefaultSession().GetYRange(x1, x2);
+}
+
+// Get points of family curves
+std::vector<Point>&
+ExprLib::GetFamilyPoints()
+{
+  return GetDefaultSession().GetFamilyPoints();
+}
+
+size_t
+ExprLib::GetFamilyPointsCount()
+{
+  return GetDefaultSession().GetFamilyPointsCount();
 }
 
-// compare two expressions if they syntactically equal
+// compare expression with current one if they structurally equal
 bool
-ExprLib::CompareWithCurrentExpr(std::string exprStr)
+ExprLib::CompareWithCurrentExpr(const Expression& expr)
 {
-  return _calc.CompareWithCurrentExpr(exprStr);
+  return GetDefaultSession().CompareWithCurrentExpr(expr);
 }
 
 // Get a derivative of expression
 std::unique_ptr<Expression>
 ExprLib::CreateDerivative(const std::string& variable)
 {
-  return _calc.CreateDerivative(variable);
+  return GetDefaultSession().CreateDerivative(variable);
 }
 
 // Get antiderivative of current expression. Works only for polynomials
 std::unique_ptr<Expression>
 ExprLib::CreateAntiderivative(const std::string& variable, double C)
 {
-  return _calc.CreateAntiderivative(variable, C);
+  return GetDefaultSession().CreateAntiderivative(variable, C);
 }
 
 // Calculate integral of expression with given bounds and integration variable
-std::optional<double>
+std::optional<IntegrationResult>
 ExprLib::CalculateIntegral(const std::string& variable,
                            double lowerBound,
-                           double upperBound)
+                           double upperBound,
+                           double tolerance,
+                           size_t maxEvaluations)
+{
+  return GetDefaultSession().CalculateIntegral(
+    variable, lowerBound, upperBound, tolerance, maxEvaluations);
+}
+
+// Start creating expression in job, which can be cancelled or stopped by budget
+std::shared_ptr<SymbolicJob>
+ExprLib::CreateExpressionAsync(const std::string& expr_str,
+                               const std::vector<std::string>& variables,
+                               const JobBudget& budget)
+{
+  return GetDefaultSession().CreateExpressionAsync(expr_str, variables, budget);
+}
+
+// Start job of derivating current expression, null if there is none
+std::shared_ptr<SymbolicJob>
+ExprLib::CreateDerivativeAsync(const std::string& variable,
+                               const JobBudget& budget)
+{
+  return GetDefaultSession().CreateDerivativeAsync(variable, budget);
+}
+
+// Start job of getting antiderivative of current expression, null if there is
+// none
+std::shared_ptr<SymbolicJob>
+ExprLib::CreateAntiderivativeAsync(const std::string& variable,
+                                   double C,
+                                   const JobBudget& budget)
 {
-  return _calc.CalculateIntegral(variable, lowerBound, upperBound);
+  return GetDefaultSession().CreateAntiderivativeAsync(variable, C, budget);
+}
+
+// Start job of integrating current expression, null if there is none
+std::shared_ptr<SymbolicJob>
+ExprLib::CalculateIntegralAsync(const std::string& variable,
+                                double lowerBound,
+                                double upperBound,
+                                double tolerance,
+                                size_t maxEvaluations,
+                                const JobBudget& budget)
+{
+  return GetDefaultSession().CalculateIntegralAsync(
+    variable, lowerBound, upperBound, tolerance, maxEvaluations, budget);
 }
 
 // Get string representation of current expression
 std::string
 ExprLib::GetCurrentExpressionString()
 {
-  return _calc.GetCurrentExpressionString();
+  return GetDefaultSession().GetCurrentExpressionString();
 }
 
 // Set current expression
 void
 ExprLib::SetExpression(std::unique_ptr<Expression> expr)
 {
-  _calc.SetExpression(std::move(expr));
+  GetDefaultSession().SetExpression(std::move(expr));
 }
 
 // Undo expression setting
 void
 ExprLib::UndoSetExpression()
 {
-  _calc.UndoSetExpression();
+  GetDefaultSession().UndoSetExpression();
 }
 
 // Redo expression setting
 void
 ExprLib::RedoSetExpression()
 {
-  _calc.RedoSetExpression();
+  GetDefaultSession().RedoSetExpression();
+}
+
+// Plot cumulative integral of current expression from lowerBound instead of
+// expression itself
+void
+ExprLib::SetAntiderivativeMode(bool enabled, double lowerBound)
+{
+  GetDefaultSession().SetAntiderivativeMode(enabled, lowerBound);
+}
+
+// Set value of expression parameter
+void
+ExprLib::SetParameter(const std::string& name, double value)
+{
+  GetDefaultSession().SetParameter(name, value);
+}
+
+// Plot family of curves for parameter values spread over [from;to]
+void
+ExprLib::SetFamily(const std::string& parameter,
+                   double from,
+                   double to,
+                   uint size)
+{
+  GetDefaultSession().SetFamily(parameter, from, to, size);
+}
+
+// Keep current expression plotted when other expression is set
+bool
+ExprLib::AddOverlay()
+{
+  return GetDefaultSession().AddOverlay();
+}
+
+// Stop plotting overlay with given index
+void
+ExprLib::RemoveOverlay(size_t index)
+{
+  GetDefaultSession().RemoveOverlay(index);
+}
+
+// Get expressions plotted along with current one
+const std::vector<Overlay>&
+ExprLib::GetOverlays()
+{
+  return GetDefaultSession().GetOverlays();
+}
+
+// Find roots, extrema and intersections in every calculation
+void
+ExprLib::SetAnalysis(bool enabled)
+{
+  GetDefaultSession().SetAnalysis(enabled);
+}
+
+// Get features found by last calculation
+const std::vector<Feature>&
+ExprLib::GetFeatures()
+{
+  return GetDefaultSession().GetFeatures();
+}
+
+// Allow single precision evaluation where it's precise enough
+void
+ExprLib::SetSinglePrecision(bool enabled)
+{
+  GetDefaultSession().SetSinglePrecision(enabled);
 }
 
 // Calculate current expression with given boundaries
 std::vector<Point>&
 ExprLib::CalculateExpression(double x1, double x2)
 {
-  return _calc.CalculateExpression(x1, x2);
+  return GetDefaultSession().CalculateExpression(x1, x2);
 }
\ No newline at end of file
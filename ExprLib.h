@@ -1,7 +1,180 @@
 #pragma once
 #include "ExpressionCalculator.h"
+#include "Speculator.h"
+#include "SymbolicJob.h"
+#include <mutex>
 
 namespace ExprLib {
+// Independent calculation context, which owns its calculator, expressions
+// history and error state. Different sessions can be used from different
+// threads simultaneously, calls to single session are serialized by its mutex
+class Session
+{
+public:
+  // ctor, npoints - number of X points
+  Session(uint npoints);
+
+  std::unique_ptr<Expression> CreateExpression(
+    const std::string& expr_str,
+    const std::vector<std::string>& variables);
+
+  // Get message describing last error of this session
+  std::string GetLastError() const;
+
+  void SetNPoints(uint npoints);
+
+  // Set pool of processes evaluating expressions, which can't be compiled
+  void SetWorkerPool(std::shared_ptr<WorkerPool> pool);
+
+  // Set flag, which cancels evaluation in worker processes once it's set
+  void SetCancelFlag(const std::atomic_bool* cancelled);
+
+  // Get vector containing last calculation results. It stays valid until next
+  // calculation in this session
+  std::vector<Point>& GetPoints();
+
+  // Get actual count of points vector
+  size_t GetPointsCount() const;
+
+  // Get range of Y values of calculated points within [x1;x2], none if there
+  // are no such points
+  std::optional<Interval> GetYRange(double x1, double x2) const;
+
+  // Get points of family curves, valid until next calculation like points
+  std::vector<Point>& GetFamilyPoints();
+
+  size_t GetFamilyPointsCount() const;
+
+  // compare expression with current one if they structurally equal
+  bool CompareWithCurrentExpr(const Expression& expr) const;
+
+  // Get a derivative of expression
+  std::unique_ptr<Expression> CreateDerivative(const std::string& variable);
+
+  // Get antiderivative of current expression. Works only for polynomials
+  std::unique_ptr<Expression> CreateAntiderivative(const std::string& variable,
+                                                   double C);
+
+  // Calculate integral of expression with given bounds and integration
+  // variable
+  std::optional<IntegrationResult> CalculateIntegral(
+    const std::string& variable,
+    double lowerBound,
+    double upperBound,
+    double tolerance = QUAD_DEFAULT_TOLERANCE,
+    size_t maxEvaluations = QUAD_DEFAULT_MAX_EVALUATIONS);
+
+  // Start creating expression in job, which can be cancelled or stopped by
+  // budget. Result expression is set by SetExpression() like usual
+  std::shared_ptr<SymbolicJob> CreateExpressionAsync(
+    const std::string& expr_str,
+    const std::vector<std::string>& variables,
+    const JobBudget& budget);
+
+  // Start job of derivating current expression, null if there is none
+  std::shared_ptr<SymbolicJob> CreateDerivativeAsync(
+    const std::string& variable,
+    const JobBudget& budget);
+
+  // Start job of getting antiderivative of current expression, null if there
+  // is none
+  std::shared_ptr<SymbolicJob> CreateAntiderivativeAsync(
+    const std::string& variable,
+    double C,
+    const JobBudget& budget);
+
+  // Start job of integrating current expression, null if there is none
+  std::shared_ptr<SymbolicJob> CalculateIntegralAsync(
+    const std::string& variable,
+    double lowerBound,
+    double upperBound,
+    double tolerance,
+    size_t maxEvaluations,
+    const JobBudget& budget);
+
+  // Get string representation of current expression
+  std::string GetCurrentExpressionString() const;
+
+  // Set current expression
+  void SetExpression(std::unique_ptr<Expression> expr);
+
+  // Undo expression setting
+  void UndoSetExpression();
+
+  // Redo expression setting
+  void RedoSetExpression();
+
+  // Plot cumulative integral of current expression from lowerBound instead of
+  // expression itself
+  void SetAntiderivativeMode(bool enabled, double lowerBound);
+
+  // Set value of expression parameter
+  void SetParameter(const std::string& name, double value);
+
+  // Plot family of curves for parameter values spread over [from;to]
+  void SetFamily(const std::string& parameter,
+                 double from,
+                 double to,
+                 uint size);
+
+  // Keep current expression plotted when other expression is set. Returns
+  // false if there is no current expression or it's already kept
+  bool AddOverlay();
+
+  // Stop plotting overlay with given index
+  void RemoveOverlay(size_t index);
+
+  // Get expressions plotted along with current one. Their points stay valid
+  // until next calculation like points
+  const std::vector<Overlay>& GetOverlays() const;
+
+  // Find roots and extrema of current expression and its intersections with
+  // overlays in every calculation
+  void SetAnalysis(bool enabled);
+
+  // Get features found by last calculation, valid until next calculation like
+  // points
+  const std::vector<Feature>& GetFeatures() const;
+
+  // Allow evaluating in single precision where it's indistinguishable from
+  // double. Precision falls back to double on deep zoom or large offsets
+  void SetSinglePrecision(bool enabled);
+
+  // Calculate current expression with given boundaries
+  std::vector<Point>& CalculateExpression(double x1, double x2);
+
+private:
+  Session() = delete;
+  Session(const Session&) = delete;
+  mutable std::mutex _mutex;
+  ExpressionCalculator _calc;
+  ExprStatus _status;
+  std::string _errorDetail;
+  // Derivative and antiderivative of current expression prepared in background
+  Speculator _speculator;
+  // Bounds of last calculation, where prepared expressions are sampled
+  double _viewX1;
+  double _viewX2;
+  // Incremented whenever current expression changes, speculated expressions
+  // are matched with it
+  size_t _exprGeneration;
+  // Prepared expression given away last time and its points, which are taken
+  // when it's set as current
+  const Expression* _preparedExpr;
+  std::optional<PreparedExpression> _prepared;
+
+  // Remember error of last failed operation of current thread
+  void SaveError();
+  // Start preparing derivative and antiderivative of current expression
+  void Speculate();
+  // Give prepared expression away, keeping its points
+  std::unique_ptr<Expression> TakePrepared(PreparedExpression prepared);
+};
+
+// Get session used by free functions below
+Session&
+GetDefaultSession();
+
 std::unique_ptr<Expression>
 CreateExpression(const std::string& expr_str,
                  const std::vector<std::string>& variables);
@@ -12,6 +185,14 @@ GetLastError();
 void
 SetNPoints(uint npoints);
 
+// Set pool of processes evaluating expressions, which can't be compiled
+void
+SetWorkerPool(std::shared_ptr<WorkerPool> pool);
+
+// Set flag, which cancels evaluation in worker processes once it's set
+void
+SetCancelFlag(const std::atomic_bool* cancelled);
+
 // Get vector containing last calculation results
 std::vector<Point>&
 GetPoints();
@@ -20,9 +201,20 @@ GetPoints();
 size_t
 GetPointsCount();
 
-// compare two expressions if they syntactically equal
+// Get range of Y values of calculated points within [x1;x2]
+std::optional<Interval>
+GetYRange(double x1, double x2);
+
+// Get points of family curves
+std::vector<Point>&
+GetFamilyPoints();
+
+size_t
+GetFamilyPointsCount();
+
+// compare expression with current one if they structurally equal
 bool
-CompareWithCurrentExpr(std::string exprStr);
+CompareWithCurrentExpr(const Expression& expr);
 
 // Get a derivative of expression
 std::unique_ptr<Expression>
@@ -33,10 +225,38 @@ std::unique_ptr<Expression>
 CreateAntiderivative(const std::string& variable, double C);
 
 // Calculate integral of expression with given bounds and integration variable
-std::optional<double>
+std::optional<IntegrationResult>
 CalculateIntegral(const std::string& variable,
                   double lowerBound,
-                  double upperBound);
+                  double upperBound,
+                  double tolerance = QUAD_DEFAULT_TOLERANCE,
+                  size_t maxEvaluations = QUAD_DEFAULT_MAX_EVALUATIONS);
+
+// Start creating expression in job, which can be cancelled or stopped by budget
+std::shared_ptr<SymbolicJob>
+CreateExpressionAsync(const std::string& expr_str,
+                      const std::vector<std::string>& variables,
+                      const JobBudget& budget);
+
+// Start job of derivating current expression, null if there is none
+std::shared_ptr<SymbolicJob>
+CreateDerivativeAsync(const std::string& variable, const JobBudget& budget);
+
+// Start job of getting antiderivative of current expression, null if there is
+// none
+std::shared_ptr<SymbolicJob>
+CreateAntiderivativeAsync(const std::string& variable,
+                          double C,
+                          const JobBudget& budget);
+
+// Start job of integrating current expression, null if there is none
+std::shared_ptr<SymbolicJob>
+CalculateIntegralAsync(const std::string& variable,
+                       double lowerBound,
+                       double upperBound,
+                       double tolerance,
+                       size_t maxEvaluations,
+                       const JobBudget& budget);
 
 // Get string representation of current expression
 std::string
@@ -54,6 +274,43 @@ UndoSetExpression();
 void
 RedoSetExpression();
 
+// Plot cumulative integral of current expression from lowerBound instead of
+// expression itself
+void
+SetAntiderivativeMode(bool enabled, double lowerBound);
+
+// Set value of expression parameter
+void
+SetParameter(const std::string& name, double value);
+
+// Plot family of curves for parameter values spread over [from;to]
+void
+SetFamily(const std::string& parameter, double from, double to, uint size);
+
+// Keep current expression plotted when other expression is set
+bool
+AddOverlay();
+
+// Stop plotting overlay with given index
+void
+RemoveOverlay(size_t index);
+
+// Get expressions plotted along with current one
+const std::vector<Overlay>&
+GetOverlays();
+
+// Find roots, extrema and intersections in every calculation
+void
+SetAnalysis(bool enabled);
+
+// Get features found by last calculation
+const std::vector<Feature>&
+GetFeatures();
+
+// Allow single precision evaluation where it's precise enough
+void
+SetSinglePrecision(bool enabled);
+
 // Calculate current expression with given boundaries
 std::vector<Point>&
 CalculateExpression(double x1, double x2);
@@ -1,11 +1,486 @@
 #include "Expression.h"
+#include <algorithm>
+#include <cmath>
 #include <idx.h>
 #include <integral.h>
+#include <list>
+#include <mutex>
 #include <numeric.h>
 #include <optional>
+#include <sstream>
 #include <symbol.h>
+#include <thread>
 
-std::string Expression::_error;
+// Number of grid points used to find sign changes in domain analysis
+#define DOMAIN_GRID_POINTS 256
+// Number of structurally distinct expressions kept in parse cache
+#define EXPR_CACHE_SIZE 64
+// Maximal number of nodes in expression tree, for which rewritten forms are
+// tried, and in rewritten forms themselves
+#define REWRITE_MAX_NODES 2000
+// Maximal total degree of expression, for which rewritten forms are tried.
+// Normalizing and factoring time grows fast with degree, not tree size
+#define REWRITE_MAX_DEGREE 64
+// Polynomials of this degree and higher are evaluated with compensated scheme
+#define POLY_COMPENSATED_DEGREE 16
+
+// Single-variable function found by domain analysis. It's compiled when
+// possible, so that it's evaluated without GiNaC
+struct AuxFunction
+{
+  GiNaC::ex expr;
+  std::shared_ptr<const CompiledExpression> program;
+  // For domain functions: if zero is out of domain too
+  bool strict;
+};
+
+// GiNaC objects of expression. GiNaC reference counters aren't atomic, so
+// these are created, modified and destroyed only under GiNaC mutex, and
+// copies of expression share them instead of copying
+struct Expression::Symbolic
+{
+  GiNaC::ex expr;
+  // Equal form of expr, which is cheapest to evaluate
+  GiNaC::ex evalExpr;
+  // Table for quick access to symbol by name
+  std::unordered_map<std::string, GiNaC::symbol> symbols;
+  // Symbol list for substitution purposes
+  GiNaC::lst symList;
+  // If symbolic part of domain analysis is done
+  bool domainPrepared = false;
+  // Functions whose zeros are poles of expression
+  std::vector<AuxFunction> poleFuncs;
+  // Functions that must be non-negative (or positive if strict flag is set)
+  // for expression to be defined
+  std::vector<AuxFunction> domainFuncs;
+};
+
+// Parsed expressions, least recently used first. Every entry is indexed by
+// structural hash and by exact inputs it was parsed from
+struct Expression::Cache
+{
+  struct Entry
+  {
+    Expression expr;
+    std::vector<std::string> keys;
+  };
+
+  std::unordered_map<std::string, GiNaC::symbol> symbols;
+  std::list<Entry> entries;
+  std::unordered_multimap<unsigned, std::list<Entry>::iterator> byHash;
+  std::unordered_map<std::string, std::list<Entry>::iterator> byKey;
+};
+
+thread_local ExprStatus Expression::_status = ExprStatus::Ok;
+thread_local std::string Expression::_errorDetail;
+
+std::recursive_mutex&
+Expression::GetGinacMutex()
+{
+  static std::recursive_mutex mutex;
+  return mutex;
+}
+
+Expression::Cache&
+Expression::GetCache()
+{
+  // Never destroyed, because GiNaC objects can't outlive GiNaC itself
+  static Cache* cache = new Cache();
+  return *cache;
+}
+
+GiNaC::symbol
+Expression::GetSymbol(const std::string& name)
+{
+  Cache& cache = GetCache();
+  auto sym = cache.symbols.find(name);
+  if (sym == cache.symbols.end())
+    sym = cache.symbols.emplace(name, GiNaC::symbol(name)).first;
+  return sym->second;
+}
+
+Expression
+Expression::Intern(Expression expr, const std::string& key, bool analyzed)
+{
+  Cache& cache = GetCache();
+  unsigned hash = expr._sym->expr.gethash();
+
+  auto range = cache.byHash.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    Cache::Entry& entry = *it->second;
+    if (!entry.expr.IsEquivalent(expr))
+      continue;
+
+    // Move entry to the end of eviction order
+    cache.entries.splice(cache.entries.end(), cache.entries, it->second);
+    if (!key.empty() && cache.byKey.emplace(key, it->second).second)
+      entry.keys.push_back(key);
+
+    Expression res = entry.expr;
+    res._userString = expr._userString;
+    return res;
+  }
+
+  if (!analyzed)
+    expr.Analyze();
+
+  if (cache.entries.size() == EXPR_CACHE_SIZE) {
+    auto oldest = cache.entries.begin();
+    for (auto& oldKey : oldest->keys)
+      cache.byKey.erase(oldKey);
+    auto oldRange =
+      cache.byHash.equal_range(oldest->expr._sym->expr.gethash());
+    for (auto it = oldRange.first; it != oldRange.second; ++it) {
+      if (it->second == oldest) {
+        cache.byHash.erase(it);
+        break;
+      }
+    }
+    cache.entries.pop_front();
+  }
+
+  cache.entries.push_back({ expr, {} });
+  auto entry = std::prev(cache.entries.end());
+  cache.byHash.emplace(hash, entry);
+  if (!key.empty()) {
+    cache.byKey.emplace(key, entry);
+    entry->keys.push_back(key);
+  }
+
+  return expr;
+}
+
+bool
+Expression::IsEquivalent(const Expression& other) const
+{
+  if (_sym == other._sym)
+    return true;
+
+  std::lock_guard<std::recursive_mutex> lock(GetGinacMutex());
+  if (_sym->symbols.size() != other._sym->symbols.size())
+    return false;
+  for (auto& [name, sym] : _sym->symbols)
+    if (other._sym->symbols.find(name) == other._sym->symbols.end())
+      return false;
+
+  return _sym->expr.gethash() == other._sym->expr.gethash() &&
+         _sym->expr.is_equal(other._sym->expr);
+}
+
+unsigned
+Expression::GetHash() const
+{
+  std::lock_guard<std::recursive_mutex> lock(GetGinacMutex());
+  return _sym->expr.gethash();
+}
+
+// Count nodes of expression tree
+static size_t
+CountNodes(const GiNaC::ex& expr)
+{
+  size_t count = 1;
+  for (size_t i = 0; i < expr.nops(); ++i)
+    count += CountNodes(expr.op(i));
+  return count;
+}
+
+// Estimate number of terms of expanded expression, saturating at limit
+static size_t
+EstimateExpandedTerms(const GiNaC::ex& expr, size_t limit)
+{
+  if (GiNaC::is_a<GiNaC::add>(expr)) {
+    size_t terms = 0;
+    for (auto term : expr)
+      terms = std::min(limit, terms + EstimateExpandedTerms(term, limit));
+    return terms;
+  }
+
+  if (GiNaC::is_a<GiNaC::mul>(expr)) {
+    size_t terms = 1;
+    for (auto factor : expr)
+      terms = std::min(limit, terms * EstimateExpandedTerms(factor, limit));
+    return terms;
+  }
+
+  if (GiNaC::is_a<GiNaC::power>(expr) &&
+      expr.op(1).info(GiNaC::info_flags::posint)) {
+    size_t base = EstimateExpandedTerms(expr.op(0), limit);
+    long exponent = GiNaC::ex_to<GiNaC::numeric>(expr.op(1)).to_long();
+    size_t terms = 1;
+    for (long i = 0; i < exponent && terms < limit && base > 1; ++i)
+      terms = std::min(limit, terms * base);
+    return terms;
+  }
+
+  return 1;
+}
+
+// Get coefficients of polynomial in single variable, starting with constant
+// one. Fails for non-polynomials and polynomials of too high degree
+static bool
+PolynomialCoefficients(const GiNaC::ex& expr,
+                       const GiNaC::symbol& var,
+                       std::vector<double>& coeffs)
+{
+  if (EstimateExpandedTerms(expr, REWRITE_MAX_NODES) >= REWRITE_MAX_NODES ||
+      !expr.is_polynomial(var))
+    return false;
+
+  GiNaC::ex expanded = expr.expand();
+  int degree = expanded.degree(var);
+  if (degree < 1 || degree > POLY_MAX_DEGREE || expanded.ldegree(var) < 0)
+    return false;
+
+  coeffs.resize(degree + 1);
+  for (int k = 0; k <= degree; ++k) {
+    GiNaC::ex value = expanded.coeff(var, k).evalf();
+    if (!GiNaC::is_a<GiNaC::numeric>(value) ||
+        !GiNaC::ex_to<GiNaC::numeric>(value).is_real())
+      return false;
+    coeffs[k] = GiNaC::ex_to<GiNaC::numeric>(value).to_double();
+  }
+
+  return true;
+}
+
+// Build Horner scheme of polynomial in single variable
+static GiNaC::ex
+Horner(const GiNaC::ex& poly, const GiNaC::symbol& var)
+{
+  int degree = poly.degree(var);
+  GiNaC::ex res = poly.coeff(var, degree);
+  for (int k = degree - 1; k >= 0; --k)
+    res = res * var + poly.coeff(var, k);
+  return res;
+}
+
+// Estimate total degree of expression in its symbols, saturating at limit.
+// Arguments of functions and roots count with their own degree
+static size_t
+EstimateDegree(const GiNaC::ex& expr, size_t limit)
+{
+  if (GiNaC::is_a<GiNaC::symbol>(expr))
+    return 1;
+
+  if (GiNaC::is_a<GiNaC::mul>(expr)) {
+    size_t degree = 0;
+    for (auto factor : expr)
+      degree = std::min(limit, degree + EstimateDegree(factor, limit));
+    return degree;
+  }
+
+  if (GiNaC::is_a<GiNaC::power>(expr) &&
+      expr.op(1).info(GiNaC::info_flags::integer)) {
+    size_t base = EstimateDegree(expr.op(0), limit);
+    GiNaC::numeric exponent = abs(GiNaC::ex_to<GiNaC::numeric>(expr.op(1)));
+    if (base && exponent > GiNaC::numeric(static_cast<int>(limit)))
+      return limit;
+    return std::min<size_t>(limit, base * exponent.to_long());
+  }
+
+  size_t degree = 0;
+  for (size_t i = 0; i < expr.nops(); ++i)
+    degree = std::max(degree, EstimateDegree(expr.op(i), limit));
+  return degree;
+}
+
+// Collect bases of negative powers, zeros of which are poles of expression
+static void
+CollectDenominators(const GiNaC::ex& expr, std::vector<GiNaC::ex>& bases)
+{
+  if (GiNaC::is_a<GiNaC::power>(expr) &&
+      GiNaC::is_a<GiNaC::numeric>(expr.op(1)) &&
+      GiNaC::ex_to<GiNaC::numeric>(expr.op(1)).is_negative())
+    bases.push_back(expr.op(0));
+
+  for (size_t i = 0; i < expr.nops(); ++i)
+    CollectDenominators(expr.op(i), bases);
+}
+
+// Check if form has every pole of expression. Normalizing cancels removable
+// singularities like one of (x^2-1)/(x-1), which would change domain
+static bool
+KeepsPoles(const GiNaC::ex& expr,
+           const GiNaC::ex& form,
+           const GiNaC::lst& symList)
+{
+  std::vector<GiNaC::ex> bases;
+  std::vector<GiNaC::ex> formBases;
+  CollectDenominators(expr, bases);
+  CollectDenominators(form, formBases);
+
+  // Polynomial bases may be split or joined differently, so every one of
+  // expression must divide product of polynomial bases of form
+  GiNaC::ex product = 1;
+  for (auto& base : formBases)
+    if (base.is_polynomial(symList))
+      product *= base;
+
+  for (auto& base : bases) {
+    bool found = std::any_of(
+      formBases.begin(), formBases.end(), [&base](const GiNaC::ex& other) {
+        return other.is_equal(base);
+      });
+    GiNaC::ex quotient;
+    if (!found &&
+        !(base.is_polynomial(symList) &&
+          GiNaC::divide(product.expand(), base.expand(), quotient, false)))
+      return false;
+  }
+  return true;
+}
+
+// Get equal forms of expression, first of which is expression itself. Forms
+// that GiNaC fails to build are skipped, as well as ones losing poles
+static std::vector<GiNaC::ex>
+RewriteCandidates(const GiNaC::ex& expr, const std::vector<GiNaC::symbol>& vars)
+{
+  std::vector<GiNaC::ex> forms = { expr };
+  if (CountNodes(expr) > REWRITE_MAX_NODES ||
+      EstimateDegree(expr, REWRITE_MAX_DEGREE) >= REWRITE_MAX_DEGREE)
+    return forms;
+
+  GiNaC::lst symList;
+  for (auto& var : vars)
+    symList.append(var);
+
+  auto add = [&](const GiNaC::ex& form) {
+    if (KeepsPoles(expr, form, symList))
+      forms.push_back(form);
+  };
+
+  try {
+    add(expr.normal());
+    add(GiNaC::factor(expr));
+
+    // Expanding powers of sums can explode, so it's done only when result
+    // stays small
+    if (EstimateExpandedTerms(expr, REWRITE_MAX_NODES) >= REWRITE_MAX_NODES)
+      return forms;
+
+    GiNaC::ex expanded = expr.expand();
+    add(expanded);
+    add(expanded.collect(symList));
+
+    // Polynomials of single variable are evaluated best by Horner scheme
+    if (vars.size() == 1 && expanded.is_polynomial(vars[0]))
+      add(Horner(expanded, vars[0]));
+  } catch (const std::exception&) {
+    // Keep forms built so far
+  }
+
+  return forms;
+}
+
+Expression::Expression()
+  : _sym(new Symbolic(), [](Symbolic* sym) {
+    std::lock_guard<std::recursive_mutex> lock(GetGinacMutex());
+    delete sym;
+  })
+{
+}
+
+std::string
+Expression::GetErrorString()
+{
+  return DescribeError(_status, _errorDetail);
+}
+
+std::string
+Expression::DescribeError(ExprStatus status, const std::string& detail)
+{
+  switch (status) {
+    case ExprStatus::Ok:
+      return "no error";
+    case ExprStatus::InvalidSymbolName:
+      return "invalid symbol name";
+    case ExprStatus::UndefinedSymbols:
+      return "undefined symbols detected";
+    case ExprStatus::NotEnoughValues:
+      return "not enough values for variables";
+    case ExprStatus::NotNumber:
+      return "result is not a number";
+    case ExprStatus::NotReal:
+      return "result of expression is not a real number";
+    case ExprStatus::Infinite:
+      return "result of expression is infinite";
+    case ExprStatus::EvaluationFailed:
+      return "failed to evaluate expression";
+    case ExprStatus::NonPolynomial:
+      return "can't integrate non-polinomials, sorry";
+    case ExprStatus::IntegralNotReal:
+      return "result of numeric integration is not a real number";
+    case ExprStatus::NotCompiled:
+      return "expression is too complex for fast evaluation";
+    case ExprStatus::GinacError:
+      return detail;
+  }
+
+  return "unknown error";
+}
+
+void
+Expression::SetGinacError(const std::exception& ex)
+{
+  _status = ExprStatus::GinacError;
+  _errorDetail = ex.what();
+}
+
+std::vector<std::string>
+Expression::GetVariableNames() const
+{
+  std::vector<std::string> names;
+  for (auto& [name, sym] : _sym->symbols)
+    names.push_back(name);
+  return names;
+}
+
+std::vector<std::string>
+Expression::FindParameters(const std::string& expr_str,
+                           const std::string& variable)
+{
+  static const char* constants[] = { "Pi", "Euler", "Catalan", "I" };
+  std::vector<std::string> names;
+
+  for (size_t i = 0; i < expr_str.size();) {
+    char c = expr_str[i];
+    // Numbers like 1e5 aren't names
+    if (std::isdigit(c) || c == '.') {
+      while (i < expr_str.size() &&
+             (std::isalnum(expr_str[i]) || expr_str[i] == '.'))
+        ++i;
+      continue;
+    }
+    if (!std::isalpha(c) && c != '_') {
+      ++i;
+      continue;
+    }
+
+    size_t start = i;
+    while (i < expr_str.size() &&
+           (std::isalnum(expr_str[i]) || expr_str[i] == '_'))
+      ++i;
+    std::string name = expr_str.substr(start, i - start);
+
+    // Names followed by parenthesis are functions
+    size_t next = i;
+    while (next < expr_str.size() && std::isspace(expr_str[next]))
+      ++next;
+    if (next < expr_str.size() && expr_str[next] == '(')
+      continue;
+
+    if (name == variable ||
+        std::find(std::begin(constants), std::end(constants), name) !=
+          std::end(constants))
+      continue;
+
+    if (std::find(names.begin(), names.end(), name) == names.end())
+      names.push_back(name);
+  }
+
+  std::sort(names.begin(), names.end());
+  return names;
+}
 
 // Check if symbol is a valid name
 bool
@@ -29,15 +504,15 @@ bool
 Expression::CheckSymbolName(const std::string& name)
 {
   if (!IsValidSymbolName(name)) {
-    _error = "invalid symbol name";
+    _status = ExprStatus::InvalidSymbolName;
     return false;
   }
 
   // Try to find symbol by string
-  auto sym = _symbols.find(name);
+  auto sym = _sym->symbols.find(name);
   // If symbol can't be found, then it wasn't defined, exit then
-  if (sym == _symbols.end()) {
-    _error = "undefined symbols detected";
+  if (sym == _sym->symbols.end()) {
+    _status = ExprStatus::UndefinedSymbols;
     return false;
   }
 
@@ -58,44 +533,517 @@ Expression::GetSymbolicsFromEx(const GiNaC::ex& expr,
   }
 }
 
+// Get opcode of unary function supported by compiled program
+static std::optional<OpCode>
+FunctionOpCode(const GiNaC::ex& func)
+{
+  if (is_ex_the_function(func, GiNaC::sin))
+    return OpCode::Sin;
+  if (is_ex_the_function(func, GiNaC::cos))
+    return OpCode::Cos;
+  if (is_ex_the_function(func, GiNaC::tan))
+    return OpCode::Tan;
+  if (is_ex_the_function(func, GiNaC::exp))
+    return OpCode::Exp;
+  if (is_ex_the_function(func, GiNaC::log))
+    return OpCode::Log;
+  if (is_ex_the_function(func, GiNaC::asin))
+    return OpCode::Asin;
+  if (is_ex_the_function(func, GiNaC::acos))
+    return OpCode::Acos;
+  if (is_ex_the_function(func, GiNaC::atan))
+    return OpCode::Atan;
+  if (is_ex_the_function(func, GiNaC::sinh))
+    return OpCode::Sinh;
+  if (is_ex_the_function(func, GiNaC::cosh))
+    return OpCode::Cosh;
+  if (is_ex_the_function(func, GiNaC::tanh))
+    return OpCode::Tanh;
+  if (is_ex_the_function(func, GiNaC::asinh))
+    return OpCode::Asinh;
+  if (is_ex_the_function(func, GiNaC::acosh))
+    return OpCode::Acosh;
+  if (is_ex_the_function(func, GiNaC::atanh))
+    return OpCode::Atanh;
+  if (is_ex_the_function(func, GiNaC::abs))
+    return OpCode::Abs;
+
+  return std::nullopt;
+}
+
+// Lower GiNaC expression into program instructions, vars holds symbols in order
+// of variable indexes. Returns register with result, or nothing if expression
+// has parts which compiled program can't evaluate
+static std::optional<uint32_t>
+LowerEx(const GiNaC::ex& expr,
+        const std::vector<GiNaC::symbol>& vars,
+        CompiledExpression& program)
+{
+  bool constant = true;
+  for (auto& var : vars) {
+    if (expr.has(var)) {
+      constant = false;
+      break;
+    }
+  }
+
+  // Subexpressions without variables are folded into single constant
+  if (constant) {
+    GiNaC::ex value = expr.evalf();
+    if (!GiNaC::is_a<GiNaC::numeric>(value) ||
+        !GiNaC::ex_to<GiNaC::numeric>(value).is_real())
+      return std::nullopt;
+    return program.Append(
+      OpCode::Const, 0, 0, GiNaC::ex_to<GiNaC::numeric>(value).to_double());
+  }
+
+  if (GiNaC::is_a<GiNaC::symbol>(expr)) {
+    for (size_t i = 0; i < vars.size(); ++i) {
+      if (expr.is_equal(vars[i]))
+        return program.Append(OpCode::Var, 0, 0, i);
+    }
+    return std::nullopt;
+  }
+
+  if (GiNaC::is_a<GiNaC::add>(expr)) {
+    std::optional<uint32_t> res;
+    for (auto term : expr) {
+      std::optional<uint32_t> reg = LowerEx(term, vars, program);
+      if (!reg)
+        return std::nullopt;
+      res = res ? program.Append(OpCode::Add, *res, *reg) : *reg;
+    }
+    return res;
+  }
+
+  if (GiNaC::is_a<GiNaC::mul>(expr)) {
+    // Factors with negative exponents form denominator, so that x/y is a
+    // single division instead of multiplication by power
+    std::optional<uint32_t> numer;
+    std::optional<uint32_t> denom;
+    for (auto factor : expr) {
+      bool inverse = GiNaC::is_a<GiNaC::power>(factor) &&
+                     GiNaC::is_a<GiNaC::numeric>(factor.op(1)) &&
+                     GiNaC::ex_to<GiNaC::numeric>(factor.op(1)).is_negative();
+      std::optional<uint32_t> reg =
+        LowerEx(inverse ? GiNaC::pow(factor.op(0), -factor.op(1)) : factor,
+                vars,
+                program);
+      if (!reg)
+        return std::nullopt;
+
+      std::optional<uint32_t>& acc = inverse ? denom : numer;
+      acc = acc ? program.Append(OpCode::Mul, *acc, *reg) : *reg;
+    }
+
+    if (!numer)
+      numer = program.Append(OpCode::Const, 0, 0, 1.0);
+    return denom ? program.Append(OpCode::Div, *numer, *denom) : *numer;
+  }
+
+  if (GiNaC::is_a<GiNaC::power>(expr)) {
+    GiNaC::ex exponent = expr.op(1);
+
+    if (GiNaC::is_a<GiNaC::numeric>(exponent)) {
+      GiNaC::numeric e = GiNaC::ex_to<GiNaC::numeric>(exponent);
+
+      // Negative fractional powers are inverted positive ones
+      if (e.is_negative() && !e.is_integer()) {
+        std::optional<uint32_t> reg =
+          LowerEx(GiNaC::pow(expr.op(0), -exponent), vars, program);
+        if (!reg)
+          return std::nullopt;
+        uint32_t one = program.Append(OpCode::Const, 0, 0, 1.0);
+        return program.Append(OpCode::Div, one, *reg);
+      }
+
+      std::optional<uint32_t> base = LowerEx(expr.op(0), vars, program);
+      if (!base)
+        return std::nullopt;
+
+      if (e.is_integer())
+        return program.Append(OpCode::PowInt, *base, 0, e.to_double());
+      if (exponent.is_equal(GiNaC::numeric(1, 2)))
+        return program.Append(OpCode::Sqrt, *base);
+    }
+
+    std::optional<uint32_t> base = LowerEx(expr.op(0), vars, program);
+    std::optional<uint32_t> power = LowerEx(exponent, vars, program);
+    if (!base || !power)
+      return std::nullopt;
+    return program.Append(OpCode::Pow, *base, *power);
+  }
+
+  if (is_ex_the_function(expr, GiNaC::atan2)) {
+    std::optional<uint32_t> y = LowerEx(expr.op(0), vars, program);
+    std::optional<uint32_t> x = LowerEx(expr.op(1), vars, program);
+    if (!y || !x)
+      return std::nullopt;
+    return program.Append(OpCode::Atan2, *y, *x);
+  }
+
+  if (GiNaC::is_a<GiNaC::function>(expr) && expr.nops() == 1) {
+    std::optional<OpCode> op = FunctionOpCode(expr);
+    if (!op)
+      return std::nullopt;
+
+    std::optional<uint32_t> arg = LowerEx(expr.op(0), vars, program);
+    if (!arg)
+      return std::nullopt;
+    return program.Append(*op, *arg);
+  }
+
+  return std::nullopt;
+}
+
+void
+Expression::Analyze()
+{
+  std::vector<GiNaC::symbol> vars;
+  for (auto& [name, sym] : _sym->symbols)
+    vars.push_back(sym);
+  Compile(RewriteCandidates(_sym->expr, vars));
+  CompilePolynomial();
+  FindSymmetry();
+}
+
+void
+Expression::Compile(const std::vector<GiNaC::ex>& forms)
+{
+  // Variables are indexed in same order as EvaluateSymbolic() substitutes them
+  std::vector<GiNaC::symbol> vars;
+  for (auto& [name, sym] : _sym->symbols)
+    vars.push_back(sym);
+
+  _compiled = nullptr;
+  _sym->evalExpr = _sym->expr;
+  size_t evalNodes = CountNodes(_sym->expr);
+  std::shared_ptr<CompiledExpression> best;
+  double bestCost = 0;
+
+  // Pick form with cheapest program, or smallest tree if nothing compiles
+  for (auto& form : forms) {
+    size_t nodes = CountNodes(form);
+    if (nodes > REWRITE_MAX_NODES && !form.is_equal(_sym->expr))
+      continue;
+
+    auto program = std::make_shared<CompiledExpression>(vars.size());
+    try {
+      std::optional<uint32_t> res = LowerEx(form, vars, *program);
+      if (res) {
+        program->SetOutput(*res);
+        if (!best || program->GetCost() < bestCost) {
+          best = program;
+          bestCost = program->GetCost();
+          _sym->evalExpr = form;
+        }
+        continue;
+      }
+    } catch (const std::exception&) {
+      // This form stays GiNaC-only
+    }
+
+    if (!best && nodes < evalNodes) {
+      _sym->evalExpr = form;
+      evalNodes = nodes;
+    }
+  }
+
+  _compiled = best;
+}
+
+void
+Expression::CompilePolynomial()
+{
+  // Polynomials entered expanded are evaluated out of their coefficients, if
+  // it's cheaper than program. Others keep their program: expanded
+  // coefficients of e.g. (x-1)^20 cancel near roots, and no evaluation
+  // scheme gets back what expansion lost. Compensated scheme only keeps
+  // rounding of evaluation itself small for high degrees
+  std::vector<double> coeffs;
+  if (!_compiled || _sym->symbols.size() != 1 ||
+      !PolynomialCoefficients(
+        _sym->expr, _sym->symbols.begin()->second, coeffs) ||
+      !_sym->expr.is_equal(_sym->expr.expand()))
+    return;
+
+  size_t degree = coeffs.size() - 1;
+  bool compensated = degree >= POLY_COMPENSATED_DEGREE;
+  double cost = compensated ? 8.0 * degree : degree;
+  if (cost < _compiled->GetCost())
+    SetPolynomial(std::move(coeffs), compensated);
+}
+
+void
+Expression::SetPolynomial(std::vector<double> coeffs, bool compensated)
+{
+  // Program may be shared with other expressions, so it's copied
+  auto program = std::make_shared<CompiledExpression>(*_compiled);
+  program->SetPolynomial(std::move(coeffs), compensated);
+  _compiled = program;
+}
+
+// Period of expression in its variable, which is rational multiple of Pi if
+// inPi is set, or rational number otherwise. Zero period means that expression
+// doesn't depend on variable
+struct Period
+{
+  GiNaC::numeric value;
+  bool inPi;
+};
+
+// Join periods of operands into their least common multiple
+static std::optional<Period>
+JoinPeriods(const Period& a, const Period& b)
+{
+  if (a.value.is_zero())
+    return b;
+  if (b.value.is_zero())
+    return a;
+  // Periods in Pi and in rational numbers have no common multiple
+  if (a.inPi != b.inPi)
+    return std::nullopt;
+
+  GiNaC::numeric numer = GiNaC::lcm(a.value.numer(), b.value.numer());
+  GiNaC::numeric denom = GiNaC::gcd(a.value.denom(), b.value.denom());
+  return Period{ numer / denom, a.inPi };
+}
+
+// Find period of expression in sym. Variable must appear only in arguments of
+// sin, cos and tan, which are linear in it with rational slope or rational
+// multiple of Pi slope, and any composition of such functions is periodic
+static std::optional<Period>
+FindPeriod(const GiNaC::ex& expr, const GiNaC::symbol& sym)
+{
+  if (!expr.has(sym))
+    return Period{ 0, false };
+
+  bool trig = is_ex_the_function(expr, GiNaC::sin) ||
+              is_ex_the_function(expr, GiNaC::cos) ||
+              is_ex_the_function(expr, GiNaC::tan);
+  if (trig && expr.op(0).is_polynomial(sym) && expr.op(0).degree(sym) == 1) {
+    GiNaC::ex slope = expr.op(0).coeff(sym, 1);
+    bool slopeInPi = !GiNaC::is_a<GiNaC::numeric>(slope);
+    if (slopeInPi)
+      slope = slope / GiNaC::Pi;
+    if (!GiNaC::is_a<GiNaC::numeric>(slope) ||
+        !GiNaC::ex_to<GiNaC::numeric>(slope).is_rational())
+      return std::nullopt;
+
+    // Period of sin and cos is 2 Pi, period of tan is Pi, and slope of Pi
+    // cancels Pi out
+    GiNaC::numeric multiple = is_ex_the_function(expr, GiNaC::tan) ? 1 : 2;
+    return Period{ multiple / abs(GiNaC::ex_to<GiNaC::numeric>(slope)),
+                   !slopeInPi };
+  }
+
+  if (expr.is_equal(sym) || expr.nops() == 0)
+    return std::nullopt;
+
+  Period period{ 0, false };
+  for (size_t i = 0; i < expr.nops(); ++i) {
+    std::optional<Period> operand = FindPeriod(expr.op(i), sym);
+    if (!operand)
+      return std::nullopt;
+    operand = JoinPeriods(period, *operand);
+    if (!operand)
+      return std::nullopt;
+    period = *operand;
+  }
+  return period;
+}
+
+void
+Expression::FindSymmetry()
+{
+  _symmetry = Symmetry();
+  if (_sym->symbols.size() != 1 ||
+      EstimateExpandedTerms(_sym->expr, REWRITE_MAX_NODES) >=
+        REWRITE_MAX_NODES)
+    return;
+
+  const GiNaC::symbol& sym = _sym->symbols.begin()->second;
+  try {
+    std::optional<Period> period = FindPeriod(_sym->expr, sym);
+    if (period && !period->value.is_zero()) {
+      _symmetry.period = period->value.to_double();
+      if (period->inPi)
+        _symmetry.period *= M_PI;
+    }
+
+    // Reflected expression is compared after expansion, which cancels most
+    // of terms that differ only in sign
+    GiNaC::ex reflected = _sym->expr.subs(sym == -sym);
+    _symmetry.even = (reflected - _sym->expr).expand().is_zero();
+    _symmetry.odd =
+      !_symmetry.even && (reflected + _sym->expr).expand().is_zero();
+  } catch (const std::exception&) {
+    _symmetry = Symmetry();
+  }
+}
+
+std::string
+Expression::CacheKey(const std::string& expr_str,
+                     const std::vector<std::string>& variables)
+{
+  std::string key;
+  for (auto& var : variables)
+    key += var + ',';
+  key += '\n' + expr_str;
+  return key;
+}
+
 std::unique_ptr<Expression>
-Expression::CreateExpression(const std::string& expr_str,
-                             const std::vector<std::string>& variables)
+Expression::FindCached(const std::string& key, const std::string& expr_str)
+{
+  Cache& cache = GetCache();
+  auto cached = cache.byKey.find(key);
+  if (cached == cache.byKey.end())
+    return nullptr;
+
+  cache.entries.splice(cache.entries.end(), cache.entries, cached->second);
+  Expression res = cached->second->expr;
+  res._userString = expr_str;
+  return std::make_unique<Expression>(res);
+}
+
+std::optional<Expression>
+Expression::Parse(const std::string& expr_str,
+                  const std::vector<std::string>& variables)
 {
   Expression wrapper = Expression();
 
   // Parse variables into symbolic list
   for (auto& var : variables) {
     if (!IsValidSymbolName(var)) {
-      _error = "invalid symbol name";
-      return nullptr;
+      _status = ExprStatus::InvalidSymbolName;
+      return std::nullopt;
     }
-    GiNaC::symbol sym = GiNaC::symbol(var);
-    wrapper._symbols.emplace(var, sym);
-    wrapper._symList.append(sym);
+    GiNaC::symbol sym = GetSymbol(var);
+    wrapper._sym->symbols.emplace(var, sym);
+    wrapper._sym->symList.append(sym);
   }
 
   try {
-    wrapper._expr = GiNaC::ex(expr_str, wrapper._symList);
+    wrapper._sym->expr = GiNaC::ex(expr_str, wrapper._sym->symList);
   } catch (const std::exception& ex) {
-    _error = ex.what();
-    return nullptr;
+    SetGinacError(ex);
+    return std::nullopt;
   }
 
   wrapper._userString = expr_str;
-  return std::make_unique<Expression>(wrapper);
+  return wrapper;
+}
+
+std::unique_ptr<Expression>
+Expression::CreateExpression(const std::string& expr_str,
+                             const std::vector<std::string>& variables)
+{
+  std::lock_guard<std::recursive_mutex> lock(GetGinacMutex());
+
+  // Exactly same input is found without parsing
+  std::string key = CacheKey(expr_str, variables);
+  std::unique_ptr<Expression> cached = FindCached(key, expr_str);
+  if (cached)
+    return cached;
+
+  std::optional<Expression> wrapper = Parse(expr_str, variables);
+  if (!wrapper)
+    return nullptr;
+  return std::make_unique<Expression>(Intern(*wrapper, key));
+}
+
+std::string
+Expression::Serialize() const
+{
+  std::lock_guard<std::recursive_mutex> lock(GetGinacMutex());
+  std::vector<double> coeffs;
+  bool compensated = false;
+  if (_compiled) {
+    coeffs = _compiled->GetPolynomial();
+    compensated = _compiled->IsCompensated();
+  }
+
+  // Symmetry and polynomial coefficients come first, then chosen form of
+  // evaluation and user string on their own lines
+  std::ostringstream oss;
+  oss.precision(17);
+  oss << _symmetry.period << ' ' << _symmetry.even << ' ' << _symmetry.odd
+      << ' ' << compensated << ' ' << coeffs.size();
+  for (double c : coeffs)
+    oss << ' ' << c;
+  oss << '\n' << _sym->evalExpr << '\n' << _userString;
+  return oss.str();
+}
+
+std::unique_ptr<Expression>
+Expression::Deserialize(const std::string& text,
+                        const std::vector<std::string>& variables)
+{
+  std::lock_guard<std::recursive_mutex> lock(GetGinacMutex());
+  size_t header = text.find('\n');
+  size_t form =
+    header == std::string::npos ? header : text.find('\n', header + 1);
+  Symmetry symmetry;
+  bool compensated = false;
+  size_t nCoeffs = 0;
+  std::istringstream iss(text.substr(0, header));
+  iss >> symmetry.period >> symmetry.even >> symmetry.odd >> compensated >>
+    nCoeffs;
+  if (nCoeffs > POLY_MAX_DEGREE + 1)
+    iss.setstate(std::ios::failbit);
+  std::vector<double> coeffs(iss ? nCoeffs : 0);
+  for (double& c : coeffs)
+    iss >> c;
+  if (!iss || form == std::string::npos) {
+    _status = ExprStatus::GinacError;
+    _errorDetail = "malformed expression returned by symbolic job";
+    return nullptr;
+  }
+
+  std::string expr_str = text.substr(form + 1);
+  std::string key = CacheKey(expr_str, variables);
+  std::unique_ptr<Expression> cached = FindCached(key, expr_str);
+  if (cached)
+    return cached;
+
+  std::optional<Expression> wrapper = Parse(expr_str, variables);
+  if (!wrapper)
+    return nullptr;
+
+  // Only chosen form is compiled, parsing it takes about as long as parsing
+  // user string
+  GiNaC::ex evalExpr;
+  try {
+    evalExpr = GiNaC::ex(text.substr(header + 1, form - header - 1),
+                         wrapper->_sym->symList);
+  } catch (const std::exception& ex) {
+    SetGinacError(ex);
+    return nullptr;
+  }
+  wrapper->Compile({ evalExpr });
+
+  // Polynomial and symmetry of single variable were found for the same one
+  if (wrapper->_sym->symbols.size() == 1) {
+    if (wrapper->_compiled && !coeffs.empty())
+      wrapper->SetPolynomial(std::move(coeffs), compensated);
+    wrapper->_symmetry = symmetry;
+  }
+  return std::make_unique<Expression>(Intern(*wrapper, key, true));
 }
 
 std::optional<double>
 Expression::EvaluateExpression(const std::vector<std::string>& values)
 {
+  std::lock_guard<std::recursive_mutex> lock(GetGinacMutex());
   GiNaC::exmap map;
 
   // Fill exmap with tuples <symbol, expr> so that symbols can be replaced
   // with expressions
   size_t i = 0;
-  for (auto begin = _symbols.begin(); begin != _symbols.end(); ++begin, ++i) {
-    GiNaC::ex expr = GiNaC::ex(values[i], _symList);
+  for (auto begin = _sym->symbols.begin(); begin != _sym->symbols.end();
+       ++begin, ++i) {
+    GiNaC::ex expr = GiNaC::ex(values[i], _sym->symList);
     map.emplace(begin->second, expr);
   }
 
@@ -103,18 +1051,18 @@ Expression::EvaluateExpression(const std::vector<std::string>& values)
   try {
     // Substitute expression with given values, assuming that they use same
     // variables as expression does, and then evaluate to float expression
-    GiNaC::ex res = _expr.subs(map);
+    GiNaC::ex res = _sym->expr.subs(map);
 
     // Convert result to numeric type
     numeric_res = GiNaC::ex_to<GiNaC::numeric>(res.evalf());
 
     // If result is not real number, return nullopt
     if (!numeric_res.is_real()) {
-      _error = "result of expression is not a real number";
+      _status = ExprStatus::NotReal;
       return std::nullopt;
     }
   } catch (const std::exception& ex) {
-    _error = ex.what();
+    SetGinacError(ex);
     return std::nullopt;
   }
 
@@ -124,12 +1072,184 @@ Expression::EvaluateExpression(const std::vector<std::string>& values)
 std::optional<double>
 Expression::EvaluateExpression(const std::vector<double>& values)
 {
+  if (values.size() < _sym->symbols.size()) {
+    _status = ExprStatus::NotEnoughValues;
+    return std::nullopt;
+  }
+
+  ExprStatus status;
+  double res = Evaluate(values.data(), status);
+  if (status != ExprStatus::Ok) {
+    _status = status;
+    return std::nullopt;
+  }
+
+  return std::make_optional(res);
+}
+
+// Get status of evaluation result, failures propagate into NaN or infinity
+static inline ExprStatus
+ResultStatus(double value)
+{
+  if (std::isnan(value))
+    return ExprStatus::NotReal;
+  if (std::isinf(value))
+    return ExprStatus::Infinite;
+  return ExprStatus::Ok;
+}
+
+double
+Expression::Evaluate(const double* values, ExprStatus& status)
+{
+  double res;
+  if (_compiled) {
+    res = _compiled->Evaluate(values);
+    status = ResultStatus(res);
+  } else {
+    res = EvaluateSymbolic(values, status);
+  }
+
+  if (status != ExprStatus::Ok)
+    _status = status;
+  return res;
+}
+
+ExprStatus
+Expression::Evaluate(const double* xs,
+                     size_t n,
+                     double* out,
+                     Precision precision,
+                     const double* xsLo)
+{
+  ExprStatus status = ExprStatus::Ok;
+
+  if (_sym->symbols.size() > 1) {
+    std::fill(out, out + n, std::nan(""));
+    status = ExprStatus::NotEnoughValues;
+  } else if (_compiled) {
+    _compiled->Evaluate(xs, n, out, precision, xsLo);
+    for (size_t i = 0; i < n && status == ExprStatus::Ok; ++i)
+      status = ResultStatus(out[i]);
+  } else {
+    for (size_t i = 0; i < n; ++i) {
+      ExprStatus pointStatus;
+      out[i] = EvaluateSymbolic(xs + i, pointStatus);
+      if (status == ExprStatus::Ok)
+        status = pointStatus;
+    }
+  }
+
+  if (status != ExprStatus::Ok)
+    _status = status;
+  return status;
+}
+
+ExprStatus
+Expression::EvaluateVariables(const double* vars,
+                              size_t n,
+                              double* out,
+                              StagedRegisters* staged)
+{
+  ExprStatus status = ExprStatus::Ok;
+  size_t nvars = _sym->symbols.size();
+
+  if (_compiled) {
+    if (staged)
+      _compiled->EvaluateStaged(vars, n, *staged, out);
+    else
+      _compiled->Evaluate(vars, n, out);
+    for (size_t i = 0; i < n && status == ExprStatus::Ok; ++i)
+      status = ResultStatus(out[i]);
+  } else {
+    std::vector<double> values(nvars);
+    for (size_t i = 0; i < n; ++i) {
+      for (size_t v = 0; v < nvars; ++v)
+        values[v] = vars[v * n + i];
+      ExprStatus pointStatus;
+      out[i] = EvaluateSymbolic(values.data(), pointStatus);
+      if (status == ExprStatus::Ok)
+        status = pointStatus;
+    }
+  }
+
+  if (status != ExprStatus::Ok)
+    _status = status;
+  return status;
+}
+
+ExprStatus
+Expression::EvaluateFamily(const double* vars,
+                           size_t n,
+                           uint32_t variable,
+                           const double* values,
+                           size_t m,
+                           double* out)
+{
+  ExprStatus status = ExprStatus::Ok;
+  size_t nvars = _sym->symbols.size();
+
+  if (variable >= nvars) {
+    std::fill(out, out + n * m, std::nan(""));
+    status = ExprStatus::NotEnoughValues;
+  } else if (_compiled) {
+    _compiled->EvaluateFamily(vars, n, variable, values, m, out);
+    for (size_t i = 0; i < n * m && status == ExprStatus::Ok; ++i)
+      status = ResultStatus(out[i]);
+  } else {
+    // Every member is evaluated separately with swept variable replaced
+    std::vector<double> member(vars, vars + n * nvars);
+    for (size_t j = 0; j < m; ++j) {
+      std::fill(member.begin() + variable * n,
+                member.begin() + (variable + 1) * n,
+                values[j]);
+      ExprStatus memberStatus =
+        EvaluateVariables(member.data(), n, out + j * n);
+      if (status == ExprStatus::Ok)
+        status = memberStatus;
+    }
+  }
+
+  if (status != ExprStatus::Ok)
+    _status = status;
+  return status;
+}
+
+ExprStatus
+Expression::EvaluateDerivatives(const double* xs,
+                                size_t n,
+                                uint32_t order,
+                                double* out)
+{
+  ExprStatus status = ExprStatus::Ok;
+
+  if (_sym->symbols.size() > 1) {
+    std::fill(out, out + (order + 1) * n, std::nan(""));
+    status = ExprStatus::NotEnoughValues;
+  } else if (!_compiled) {
+    std::fill(out, out + (order + 1) * n, std::nan(""));
+    status = ExprStatus::NotCompiled;
+  } else {
+    _compiled->EvaluateDerivatives(xs, n, 0, order, out);
+    for (size_t i = 0; i < n && status == ExprStatus::Ok; ++i)
+      status = ResultStatus(out[i]);
+  }
+
+  if (status != ExprStatus::Ok)
+    _status = status;
+  return status;
+}
+
+double
+Expression::EvaluateSymbolic(const double* values, ExprStatus& status)
+{
+  std::lock_guard<std::recursive_mutex> lock(GetGinacMutex());
   GiNaC::exmap map;
 
   // Fill exmap with tuples <symbol, expr> so that symbols can be replaced
   // with expressions
   size_t i = 0;
-  for (auto begin = _symbols.begin(); begin != _symbols.end(); ++begin, ++i) {
+  for (auto begin = _sym->symbols.begin(); begin != _sym->symbols.end();
+       ++begin, ++i) {
     map.emplace(begin->second, values[i]);
   }
 
@@ -137,119 +1257,490 @@ Expression::EvaluateExpression(const std::vector<double>& values)
   try {
     // Substitute expression with given values, assuming that they use same
     // variables as expression does, and then evaluate to float expression
-    GiNaC::ex res = _expr.subs(map).evalf();
+    GiNaC::ex res = _sym->evalExpr.subs(map).evalf();
 
     if (!GiNaC::is_a<GiNaC::numeric>(res)) {
-      _error = "result is not a number";
-      return std::nullopt;
+      status = ExprStatus::NotNumber;
+      return std::nan("");
     }
 
     // Convert result to numeric type
     numeric_res = GiNaC::ex_to<GiNaC::numeric>(res);
 
-    // If result is not real number, return nullopt
+    // If result is not real number, return NaN
     if (!numeric_res.is_real()) {
-      _error = "result of expression is not a real number";
-      return std::nullopt;
+      status = ExprStatus::NotReal;
+      return std::nan("");
     }
-  } catch (const std::exception& ex) {
-    _error = ex.what();
-    return std::nullopt;
+  } catch (const GiNaC::pole_error&) {
+    status = ExprStatus::Infinite;
+    return std::nan("");
+  } catch (const std::exception&) {
+    // Message isn't copied here, since this is called for every sample
+    status = ExprStatus::EvaluationFailed;
+    return std::nan("");
   }
 
-  return std::make_optional(numeric_res.to_double());
+  double res = numeric_res.to_double();
+  status = ResultStatus(res);
+  return res;
 }
 
 std::unique_ptr<Expression>
 Expression::CreateDerivative(const std::string& variable)
 {
+  std::lock_guard<std::recursive_mutex> lock(GetGinacMutex());
   if (!CheckSymbolName(variable))
     return nullptr;
 
-  GiNaC::symbol sym = _symbols[variable];
+  GiNaC::symbol sym = _sym->symbols[variable];
 
-  GiNaC::ex diff = _expr.diff(sym);
+  GiNaC::ex diff = _sym->expr.diff(sym);
   Expression diff_expr = Expression();
-  diff_expr._expr = diff;
+  diff_expr._sym->expr = diff;
 
   // Recreate symbols list
   std::vector<GiNaC::symbol> symbols;
   GetSymbolicsFromEx(diff, symbols);
   for (size_t i = 0; i < symbols.size(); ++i) {
     GiNaC::symbol symbol = symbols[i];
-    diff_expr._symbols[symbol.get_name()] = symbol;
-    diff_expr._symList.append(symbol);
+    diff_expr._sym->symbols[symbol.get_name()] = symbol;
+    diff_expr._sym->symList.append(symbol);
   }
 
   std::ostringstream oss;
-  oss << diff_expr._expr;
+  oss << diff_expr._sym->expr;
 
   diff_expr._userString = oss.str();
 
-  return std::make_unique<Expression>(diff_expr);
+  return std::make_unique<Expression>(Intern(diff_expr, ""));
 }
 
 std::unique_ptr<Expression>
 Expression::CreateAntiderivative(const std::string& variable, double C)
 {
-  if (!_expr.is_polynomial(_symList)) {
-    _error = "can't integrate non-polinomials, sorry";
+  std::lock_guard<std::recursive_mutex> lock(GetGinacMutex());
+  if (!_sym->expr.is_polynomial(_sym->symList)) {
+    _status = ExprStatus::NonPolynomial;
     return nullptr;
   }
 
   if (!CheckSymbolName(variable))
     return nullptr;
 
-  GiNaC::symbol sym = _symbols[variable];
-  GiNaC::integral antideriv = GiNaC::integral(sym, 0, sym, _expr);
+  GiNaC::symbol sym = _sym->symbols[variable];
+  GiNaC::integral antideriv = GiNaC::integral(sym, 0, sym, _sym->expr);
   Expression antideriv_expr = Expression();
-  antideriv_expr._expr = antideriv.eval_integ();
-  antideriv_expr._expr += C;
+  antideriv_expr._sym->expr = antideriv.eval_integ();
+  antideriv_expr._sym->expr += C;
 
   // Recreate symbols list
   std::vector<GiNaC::symbol> symbols;
-  GetSymbolicsFromEx(antideriv_expr._expr, symbols);
+  GetSymbolicsFromEx(antideriv_expr._sym->expr, symbols);
   for (size_t i = 0; i < symbols.size(); ++i) {
     GiNaC::symbol symbol = symbols[i];
-    antideriv_expr._symbols[symbol.get_name()] = symbol;
-    antideriv_expr._symList.append(symbol);
+    antideriv_expr._sym->symbols[symbol.get_name()] = symbol;
+    antideriv_expr._sym->symList.append(symbol);
   }
 
   std::ostringstream oss;
-  oss << antideriv_expr._expr;
+  oss << antideriv_expr._sym->expr;
 
   antideriv_expr._userString = oss.str();
 
-  return std::make_unique<Expression>(antideriv_expr);
+  return std::make_unique<Expression>(Intern(antideriv_expr, ""));
 }
 
-std::optional<double>
+std::optional<IntegrationResult>
 Expression::CalculateIntegral(const std::string& variable,
                               double lowerBound,
-                              double upperBound)
+                              double upperBound,
+                              double tolerance,
+                              size_t maxEvaluations,
+                              const ParameterValues& parameters)
 {
+  std::unique_lock<std::recursive_mutex> lock(GetGinacMutex());
   if (!CheckSymbolName(variable))
     return std::nullopt;
 
-  GiNaC::symbol sym = _symbols[variable];
+  // Every variable other than integration one is fixed by its parameter value,
+  // or is left free
+  std::vector<std::optional<double>> fixed;
+  bool bound = true;
+  for (auto& [name, sym] : _sym->symbols) {
+    auto param = parameters.find(name);
+    if (name != variable && param != parameters.end())
+      fixed.push_back(param->second);
+    else
+      fixed.push_back(std::nullopt);
+    bound = bound && (name == variable || fixed.back());
+  }
+
+  if (bound) {
+    lock.unlock();
+
+    // Compiled program can be evaluated by all cores at once, GiNaC evaluation
+    // is serialized anyway
+    std::shared_ptr<const CompiledExpression> program = _compiled;
+    Integrand integrand = [this, program, fixed](const double* xs,
+                                                 size_t n,
+                                                 double* out) {
+      std::vector<double> vars(fixed.size() * n);
+      for (size_t v = 0; v < fixed.size(); ++v) {
+        if (fixed[v])
+          std::fill_n(vars.data() + v * n, n, *fixed[v]);
+        else
+          std::copy(xs, xs + n, vars.data() + v * n);
+      }
+      if (program)
+        program->Evaluate(vars.data(), n, out);
+      else
+        EvaluateVariables(vars.data(), n, out);
+    };
+    Quadrature quadrature(tolerance,
+                          maxEvaluations,
+                          program ? std::thread::hardware_concurrency() : 1);
+
+    // Infinite bounds and integrands undefined at bounds are left to double
+    // exponential rule, which never evaluates bounds themselves
+    bool singular = false;
+    for (double bound : { lowerBound, upperBound }) {
+      double value = std::nan("");
+      if (std::isfinite(bound))
+        integrand(&bound, 1, &value);
+      singular = singular || !std::isfinite(value);
+    }
+
+    IntegrationResult res =
+      singular ? quadrature.IntegrateDoubleExponential(
+                   integrand, lowerBound, upperBound)
+               : quadrature.Integrate(integrand, lowerBound, upperBound);
+
+    if (!std::isfinite(res.value)) {
+      _status = ExprStatus::IntegralNotReal;
+      return std::nullopt;
+    }
+
+    return res;
+  }
+
+  // Integrand depends on other variables, which can be left only by GiNaC
+  GiNaC::symbol sym = _sym->symbols[variable];
+  GiNaC::exmap values;
+  for (auto& [name, value] : parameters) {
+    auto it = _sym->symbols.find(name);
+    if (it != _sym->symbols.end() && name != variable)
+      values[it->second] = value;
+  }
 
   GiNaC::ex res;
 
   try {
-    res = adaptivesimpson(sym, lowerBound, upperBound, _expr).evalf();
+    res = adaptivesimpson(
+            sym, lowerBound, upperBound, _sym->expr.subs(values))
+            .evalf();
   } catch (const std::exception& ex) {
-    _error = ex.what();
+    SetGinacError(ex);
     return std::nullopt;
   }
 
   if (GiNaC::is_a<GiNaC::numeric>(res)) {
     GiNaC::numeric numeric_res = GiNaC::ex_to<GiNaC::numeric>(res);
     if (numeric_res.is_real())
-      return std::make_optional(numeric_res.to_double());
+      return IntegrationResult{ numeric_res.to_double(), 0, 0, true };
   }
 
   // If result is not real number, return nullopt
-  _error = "result of numeric integration is not a real number";
+  _status = ExprStatus::IntegralNotReal;
 
   return std::nullopt;
-}
\ No newline at end of file
+}
+
+// Evaluate auxiliary function of single variable at given point. Returns NaN
+// if result is not a real number
+static double
+EvaluateAux(const AuxFunction& func, const GiNaC::symbol& sym, double x)
+{
+  if (func.program)
+    return func.program->Evaluate(&x);
+
+  std::lock_guard<std::recursive_mutex> lock(Expression::GetGinacMutex());
+  try {
+    GiNaC::exmap map;
+    map.emplace(sym, x);
+    GiNaC::ex res = func.expr.subs(map).evalf();
+
+    if (GiNaC::is_a<GiNaC::numeric>(res)) {
+      GiNaC::numeric numeric_res = GiNaC::ex_to<GiNaC::numeric>(res);
+      if (numeric_res.is_real())
+        return numeric_res.to_double();
+    }
+  } catch (const std::exception&) {
+  }
+
+  return std::nan("");
+}
+
+// Evaluate auxiliary function on uniform grid of values.size() points
+static void
+EvaluateAuxGrid(const AuxFunction& func,
+                const GiNaC::symbol& sym,
+                double x1,
+                double step,
+                std::vector<double>& values)
+{
+  for (size_t i = 0; i < values.size(); ++i)
+    values[i] = x1 + i * step;
+
+  if (func.program) {
+    func.program->Evaluate(values.data(), values.size(), values.data());
+    return;
+  }
+
+  for (size_t i = 0; i < values.size(); ++i)
+    values[i] = EvaluateAux(func, sym, values[i]);
+}
+
+// Narrow bracket [a;b] around point where predicate changes its value, assuming
+// that pred(a) != pred(b). Stops when bracket is shorter than tolerance
+template<typename Pred>
+static void
+Bisect(double& a, double& b, double tolerance, Pred pred)
+{
+  bool predA = pred(a);
+  while (b - a > tolerance) {
+    double mid = a + (b - a) / 2;
+    // Bracket can't be narrowed anymore
+    if (mid <= a || mid >= b)
+      break;
+
+    if (pred(mid) == predA)
+      a = mid;
+    else
+      b = mid;
+  }
+}
+
+// Add function to vector if it has no equal function yet, compiling it
+static void
+AppendUnique(std::vector<AuxFunction>& vec,
+             const GiNaC::ex& expr,
+             const GiNaC::symbol& sym,
+             bool strict = false)
+{
+  for (auto& func : vec) {
+    if (func.expr.is_equal(expr) && func.strict == strict)
+      return;
+  }
+
+  auto program = std::make_shared<CompiledExpression>(1);
+  std::optional<uint32_t> res = LowerEx(expr, { sym }, *program);
+  if (res)
+    program->SetOutput(*res);
+  else
+    program = nullptr;
+
+  vec.push_back({ expr, program, strict });
+}
+
+void
+Expression::AppendPoleFactors(const GiNaC::ex& denom, const GiNaC::symbol& sym)
+{
+  if (!denom.has(sym))
+    return;
+
+  // Every factor of product is a separate source of poles
+  if (GiNaC::is_a<GiNaC::mul>(denom)) {
+    for (auto factor : denom)
+      AppendPoleFactors(factor, sym);
+    return;
+  }
+
+  // Positive power has same zeros as its base, but base changes its sign on
+  // them while power of even degree does not
+  if (GiNaC::is_a<GiNaC::power>(denom) &&
+      GiNaC::is_a<GiNaC::numeric>(denom.op(1)) &&
+      GiNaC::ex_to<GiNaC::numeric>(denom.op(1)).is_positive()) {
+    AppendPoleFactors(denom.op(0), sym);
+    return;
+  }
+
+  GiNaC::ex factor = denom;
+  if (denom.is_polynomial(sym)) {
+    // Leave only distinct roots, so that every real root is a sign change
+    try {
+      factor = GiNaC::quo(denom, GiNaC::gcd(denom, denom.diff(sym)), sym);
+    } catch (const std::exception&) {
+      factor = denom;
+    }
+  }
+
+  if (factor.has(sym))
+    AppendUnique(_sym->poleFuncs, factor, sym);
+}
+
+void
+Expression::WalkSingularities(const GiNaC::ex& expr, const GiNaC::symbol& sym)
+{
+  if (!expr.has(sym))
+    return;
+
+  if (GiNaC::is_a<GiNaC::function>(expr)) {
+    if (is_ex_the_function(expr, GiNaC::tan)) {
+      // tan(u) = sin(u)/cos(u), so its poles are zeros of cos(u)
+      AppendUnique(_sym->poleFuncs, GiNaC::cos(expr.op(0)), sym);
+    } else if (is_ex_the_function(expr, GiNaC::log)) {
+      AppendUnique(_sym->domainFuncs, expr.op(0), sym, true);
+    }
+
+    // Arguments may have poles and restrictions of their own
+    for (auto arg : expr)
+      CollectSingularities(arg, sym);
+    return;
+  }
+
+  // Roots of even degree (sqrt is power of 1/2) need non-negative base
+  if (GiNaC::is_a<GiNaC::power>(expr) &&
+      GiNaC::is_a<GiNaC::numeric>(expr.op(1))) {
+    GiNaC::numeric exponent = GiNaC::ex_to<GiNaC::numeric>(expr.op(1));
+    if (exponent.is_rational() && !exponent.is_integer() &&
+        exponent.denom().is_even())
+      AppendUnique(_sym->domainFuncs, expr.op(0), sym);
+  }
+
+  for (auto child : expr)
+    WalkSingularities(child, sym);
+}
+
+void
+Expression::CollectSingularities(const GiNaC::ex& expr,
+                                 const GiNaC::symbol& sym)
+{
+  // Zeros of denominator of rational form are poles
+  AppendPoleFactors(expr.numer_denom().op(1), sym);
+  WalkSingularities(expr, sym);
+}
+
+void
+Expression::PrepareDomainAnalysis()
+{
+  _sym->domainPrepared = true;
+
+  if (_sym->symbols.size() != 1)
+    return;
+
+  try {
+    CollectSingularities(_sym->expr, _sym->symbols.begin()->second);
+  } catch (const std::exception&) {
+    // Without analysis graph lines are still broken on failed evaluations
+    _sym->poleFuncs.clear();
+    _sym->domainFuncs.clear();
+  }
+}
+
+DomainInfo
+Expression::AnalyzeDomain(double x1, double x2)
+{
+  DomainInfo info;
+
+  {
+    // Symbolic part is done once, after that functions are only read
+    std::lock_guard<std::recursive_mutex> lock(GetGinacMutex());
+    if (!_sym->domainPrepared)
+      PrepareDomainAnalysis();
+  }
+
+  const std::vector<AuxFunction>& poleFuncs = _sym->poleFuncs;
+  const std::vector<AuxFunction>& domainFuncs = _sym->domainFuncs;
+  if ((poleFuncs.empty() && domainFuncs.empty()) || !(x1 < x2))
+    return info;
+
+  const GiNaC::symbol& sym = _sym->symbols.begin()->second;
+  double step = (x2 - x1) / (DOMAIN_GRID_POINTS - 1);
+  double tolerance = (x2 - x1) * DOMAIN_TOLERANCE;
+  std::vector<double> values(DOMAIN_GRID_POINTS);
+
+  // Poles are sign changes of pole functions, which are refined by bisection
+  for (auto& pole : poleFuncs) {
+    auto negative = [&](double x) { return EvaluateAux(pole, sym, x) < 0; };
+
+    EvaluateAuxGrid(pole, sym, x1, step, values);
+
+    for (int i = 0; i < DOMAIN_GRID_POINTS; ++i) {
+      if (values[i] == 0) {
+        info.poles.push_back(x1 + i * step);
+        continue;
+      }
+
+      // NaN values never produce negative product
+      if (i == 0 || !(values[i - 1] * values[i] < 0))
+        continue;
+
+      double a = x1 + (i - 1) * step;
+      double b = x1 + i * step;
+      Bisect(a, b, tolerance, negative);
+
+      // Pole function may change sign on its own pole too (like 1/tan), so
+      // accept only points where it really approaches zero
+      double mid = a + (b - a) / 2;
+      if (std::fabs(EvaluateAux(pole, sym, mid)) <=
+          std::min(std::fabs(values[i - 1]), std::fabs(values[i])))
+        info.poles.push_back(mid);
+    }
+  }
+
+  // Undefined intervals are runs of grid points where argument is out of
+  // domain, bounds of which are refined by bisection
+  for (auto& arg : domainFuncs) {
+    auto invalid = [&](double x) {
+      double value = EvaluateAux(arg, sym, x);
+      return arg.strict ? value <= 0 : value < 0;
+    };
+    auto invalidValue = [&](double value) {
+      return arg.strict ? value <= 0 : value < 0;
+    };
+
+    EvaluateAuxGrid(arg, sym, x1, step, values);
+    bool lastInvalid = invalidValue(values[0]);
+    double from = x1;
+
+    for (int i = 1; i < DOMAIN_GRID_POINTS; ++i) {
+      bool curInvalid = invalidValue(values[i]);
+      if (curInvalid == lastInvalid)
+        continue;
+
+      double a = x1 + (i - 1) * step;
+      double b = x1 + i * step;
+      Bisect(a, b, tolerance, invalid);
+
+      // Keep only points known to be invalid, so that no valid point is lost
+      if (curInvalid)
+        from = b;
+      else
+        info.invalid.push_back({ from, a });
+
+      lastInvalid = curInvalid;
+    }
+
+    if (lastInvalid)
+      info.invalid.push_back({ from, x2 });
+  }
+
+  std::sort(info.poles.begin(), info.poles.end());
+
+  // Merge overlapping intervals of different arguments
+  std::sort(
+    info.invalid.begin(),
+    info.invalid.end(),
+    [](const Interval& a, const Interval& b) { return a.from < b.from; });
+  std::vector<Interval> merged;
+  for (auto& interval : info.invalid) {
+    if (!merged.empty() && interval.from <= merged.back().to)
+      merged.back().to = std::max(merged.back().to, interval.to);
+    else
+      merged.push_back(interval);
+  }
+  info.invalid = std::move(merged);
+
+  return info;
+}
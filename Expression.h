@@ -1,22 +1,116 @@
 #pragma once
+#include "CompiledExpression.h"
+#include "Quadrature.h"
+#include <cmath>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <unordered_map>
+#include <vector>
 #include <ginac.h>
 
+// Precision of found poles and bounds relative to analyzed range
+#define DOMAIN_TOLERANCE 1e-9
+
+// Closed interval of variable values
+struct Interval
+{
+  double from;
+  double to;
+};
+
+// Singularities of single-variable expression found over some range
+struct DomainInfo
+{
+  // Sorted locations of poles, where graph line must be broken
+  std::vector<double> poles;
+  // Sorted non-overlapping intervals, where expression is undefined
+  std::vector<Interval> invalid;
+};
+
+// Symmetry of single-variable expression found symbolically, so that its
+// values can be copied instead of evaluated
+struct Symmetry
+{
+  // Period, which isn't always fundamental one, or zero if expression isn't
+  // known to be periodic
+  double period = 0;
+  // If f(-x) = f(x)
+  bool even = false;
+  // If f(-x) = -f(x)
+  bool odd = false;
+};
+
+// Status of last expression operation. Human-readable message is built out of
+// it only when it's requested
+enum class ExprStatus : uint8_t
+{
+  Ok,
+  InvalidSymbolName,
+  UndefinedSymbols,
+  NotEnoughValues,
+  NotNumber,
+  NotReal,
+  Infinite,
+  EvaluationFailed,
+  NonPolynomial,
+  IntegralNotReal,
+  // Operation needs compiled program, but expression has none
+  NotCompiled,
+  // Error reported by GiNaC, its message is kept as error detail
+  GinacError
+};
+
+// Values of variables, which are fixed as parameters, by their names
+using ParameterValues = std::unordered_map<std::string, double>;
+
 class Expression
 {
 public:
   // Create expression out of given expression string and variables list. If
-  // parsing fails, then return nothing
+  // parsing fails, then return nothing. Structurally equal expressions share
+  // parsed and compiled state through process-wide cache
   static std::unique_ptr<Expression> CreateExpression(
     const std::string& expr_str,
     const std::vector<std::string>& variables);
 
-  inline static std::string GetErrorString() { return _error; }
+  // Rebuild expression serialized by Serialize() with given variables. Form
+  // of evaluation, polynomial and symmetry are taken as they are, so that
+  // nothing expensive is done again
+  static std::unique_ptr<Expression> Deserialize(
+    const std::string& text,
+    const std::vector<std::string>& variables);
+
+  // Find names of symbols in expression string other than variable, which can
+  // be bound to values as parameters. Function names and constants are skipped
+  static std::vector<std::string> FindParameters(const std::string& expr_str,
+                                                 const std::string& variable);
+
+  // Build message describing last error of current thread
+  static std::string GetErrorString();
+
+  // Build message describing given error
+  static std::string DescribeError(ExprStatus status,
+                                   const std::string& detail);
+
+  inline static ExprStatus GetStatus() { return _status; }
+
+  inline static const std::string& GetErrorDetail() { return _errorDetail; }
+
+  // GiNaC isn't thread-safe, so every operation on GiNaC objects is done under
+  // this process-wide mutex. Compiled evaluation doesn't need it
+  static std::recursive_mutex& GetGinacMutex();
 
   inline std::string GetExpressionString() const { return _userString; }
 
+  // Serialize expression along with results of its rewriting and analysis,
+  // so that process which did them passes expression to another one
+  std::string Serialize() const;
+
+  // Get names of expression variables in order of their values
+  std::vector<std::string> GetVariableNames() const;
+
   // Evaluate expression, substituting variables with given values, parsing them
   // before
   std::optional<double> EvaluateExpression(
@@ -25,6 +119,75 @@ public:
   // Same but with doubles, skipping parsing
   std::optional<double> EvaluateExpression(const std::vector<double>& values);
 
+  // Evaluate expression in single point without exceptions and allocations.
+  // values holds value of every variable. Failed evaluation returns NaN and
+  // sets status
+  double Evaluate(const double* values, ExprStatus& status);
+
+  // Evaluate single-variable expression in n points. Failed points are NaN,
+  // returned status is status of first failed point or Ok. Precision is used
+  // by compiled expressions only, and in double-double precision xsLo, if it's
+  // given, holds parts of points below their double rounding
+  ExprStatus Evaluate(const double* xs,
+                      size_t n,
+                      double* out,
+                      Precision precision = Precision::Double,
+                      const double* xsLo = nullptr);
+
+  // Evaluate expression of any number of variables in n points. vars holds n
+  // values of every variable in order of GetVariableNames(). If staged is
+  // given, registers of compiled program are kept there, and next evaluation
+  // skips instructions which don't depend on changed variables
+  ExprStatus EvaluateVariables(const double* vars,
+                               size_t n,
+                               double* out,
+                               StagedRegisters* staged = nullptr);
+
+  // Evaluate expression for m values of variable with given index in n points,
+  // vars holds values of all variables like in EvaluateVariables(). out holds
+  // n results for first value, then n results for second one etc.
+  ExprStatus EvaluateFamily(const double* vars,
+                            size_t n,
+                            uint32_t variable,
+                            const double* values,
+                            size_t m,
+                            double* out);
+
+  // Check if expressions are structurally equal, regardless of how their
+  // strings were written
+  bool IsEquivalent(const Expression& other) const;
+
+  // Get structural hash of expression, equal for equivalent expressions
+  unsigned GetHash() const;
+
+  // Evaluate single-variable expression and its derivatives up to given order
+  // in n points at once, without building symbolic derivatives. out holds n
+  // values of expression, then n values of first derivative etc. Works only
+  // for compiled expressions
+  ExprStatus EvaluateDerivatives(const double* xs,
+                                 size_t n,
+                                 uint32_t order,
+                                 double* out);
+
+  // Check if expression was lowered to compiled program
+  inline bool IsCompiled() const { return _compiled != nullptr; }
+
+  // Get compiled program of expression, null if it isn't compiled
+  inline std::shared_ptr<const CompiledExpression> GetCompiled() const
+  {
+    return _compiled;
+  }
+
+  // Get symmetry of single-variable expression found when it was created
+  inline const Symmetry& GetSymmetry() const { return _symmetry; }
+
+  // Get estimated cost of evaluation in single point, expressions evaluated by
+  // GiNaC are infinitely expensive
+  inline double GetEvaluationCost() const
+  {
+    return _compiled ? _compiled->GetCost() : INFINITY;
+  }
+
   // Get a derivative of expression
   std::unique_ptr<Expression> CreateDerivative(const std::string& variable);
 
@@ -32,21 +195,79 @@ public:
   std::unique_ptr<Expression> CreateAntiderivative(const std::string& variable,
                                                    double C);
 
-  // Calculate integral of expression with given bounds and integration variable
-  std::optional<double> CalculateIntegral(const std::string& variable,
-                                          double lowerBound,
-                                          double upperBound);
+  // Calculate integral of expression with given bounds and integration
+  // variable. Other variables are replaced by given parameter values.
+  // Expressions without other free variables are integrated numerically until
+  // error estimate reaches tolerance or evaluations budget is spent. Bounds
+  // may be infinite
+  std::optional<IntegrationResult> CalculateIntegral(
+    const std::string& variable,
+    double lowerBound,
+    double upperBound,
+    double tolerance = QUAD_DEFAULT_TOLERANCE,
+    size_t maxEvaluations = QUAD_DEFAULT_MAX_EVALUATIONS,
+    const ParameterValues& parameters = {});
+
+  // Find poles and invalid intervals of expression in [x1;x2]. Works only for
+  // expressions of single variable, otherwise returns empty info
+  DomainInfo AnalyzeDomain(double x1, double x2);
 
 private:
-  Expression() = default;
-  GiNaC::ex _expr;
+  // GiNaC objects of expression, shared between its copies
+  struct Symbolic;
+  // Cache of parsed expressions
+  struct Cache;
+
+  Expression();
+  std::shared_ptr<Symbolic> _sym;
   std::string _userString;
-  // Table for quick access to symbol by name
-  std::unordered_map<std::string, GiNaC::symbol> _symbols;
-  // Symbol list for substitution purposes
-  GiNaC::lst _symList;
-  static std::string _error;
+  // Compiled program for fast evaluation, null if expression has parts
+  // which can't be lowered, and only GiNaC can evaluate it
+  std::shared_ptr<const CompiledExpression> _compiled;
+  Symmetry _symmetry;
+  // Error state is kept per thread, so that sessions in different threads
+  // don't overwrite errors of each other
+  static thread_local ExprStatus _status;
+  // Message of last GiNaC error
+  static thread_local std::string _errorDetail;
 
+  // Set error status with message of GiNaC exception
+  static void SetGinacError(const std::exception& ex);
+  // Get process-wide expression cache, must be used under GiNaC mutex
+  static Cache& GetCache();
+  // Get symbol shared by all expressions with variable of given name, so that
+  // equal inputs produce structurally equal GiNaC expressions
+  static GiNaC::symbol GetSymbol(const std::string& name);
+  // Build cache key of exact input
+  static std::string CacheKey(const std::string& expr_str,
+                              const std::vector<std::string>& variables);
+  // Find expression parsed out of exactly same input, null if it isn't cached
+  static std::unique_ptr<Expression> FindCached(const std::string& key,
+                                                const std::string& expr_str);
+  // Parse expression string with given variables, sets status on failure
+  static std::optional<Expression> Parse(
+    const std::string& expr_str,
+    const std::vector<std::string>& variables);
+  // Replace expression with cached equivalent one or put it into cache. key
+  // is exact input, if expression was parsed out of one. New expression is
+  // compiled and its symmetry is found, unless analyzed is set
+  static Expression Intern(Expression expr,
+                           const std::string& key,
+                           bool analyzed = false);
+  // Compile cheapest of rewritten forms of expression and find its symmetry
+  void Analyze();
+  // Lower expression to compiled program if possible, choosing cheapest of
+  // equal forms
+  void Compile(const std::vector<GiNaC::ex>& forms);
+  // Evaluate single-variable polynomial out of its coefficients, if it's
+  // cheaper than compiled program
+  void CompilePolynomial();
+  // Make compiled program evaluate polynomial with given coefficients
+  void SetPolynomial(std::vector<double> coeffs, bool compensated);
+  // Find period and parity of single-variable expression
+  void FindSymmetry();
+  // Evaluate expression with GiNaC, used when it can't be compiled
+  double EvaluateSymbolic(const double* values, ExprStatus& status);
   // Check if symbol is a valid name
   static bool IsValidSymbolName(const std::string& name);
   // Check if given name is valid and exists in symbols map
@@ -54,4 +275,12 @@ private:
   // Get all symbolic variables from expression
   void GetSymbolicsFromEx(const GiNaC::ex& expr,
                           std::vector<GiNaC::symbol>& vec);
+  // Find pole and domain functions of expression, done once per expression
+  void PrepareDomainAnalysis();
+  // Collect denominator factors and restricted function arguments of expr
+  void CollectSingularities(const GiNaC::ex& expr, const GiNaC::symbol& sym);
+  // Walk expression tree looking for tan, log and even roots
+  void WalkSingularities(const GiNaC::ex& expr, const GiNaC::symbol& sym);
+  // Add factors of denominator, zeros of which are poles
+  void AppendPoleFactors(const GiNaC::ex& denom, const GiNaC::symbol& sym);
 };
@@ -1,24 +1,66 @@
 #include "ExpressionCalculator.h"
+#include "DoubleDouble.h"
+#include "FeatureFinder.h"
+#include <algorithm>
 #include <cmath>
+#include <limits>
+#include <thread>
+
+// Minimal number of points worth sending to worker processes
+#define WORKER_POOL_MIN_POINTS 64
+// Maximal multiple of step in symmetric lattice, which is still exact in
+// double
+#define SYMMETRY_MAX_MULTIPLE 4e15
 
 ExpressionCalculator::ExpressionCalculator(uint npoints)
   : _nPoints(npoints)
   , _pointsCount(0)
+  , _cancelled(nullptr)
 {
   _currentExprIndex = 0;
   _forceCalc = false;
+  _antiderivative = false;
+  _antiderivativeLower = 0;
+  _latticeStep = 0;
+  _prefixFirst = 0;
+  _lowerPiece = 0;
+  _lowerSearched = false;
+  _familyFrom = 0;
+  _familyTo = 0;
+  _familySize = 0;
+  _familyPointsCount = 0;
+  _fusedDirty = false;
+  _fusedCurrent = nullptr;
+  _samplesVersion = 0;
+  _analysis = false;
+  _featuresFrom = 0;
+  _featuresTo = 0;
+  _featuresVersion = 0;
+  _featuresValid = false;
+  _singlePrecision = true;
+  _precision = Precision::Double;
   _points.resize(npoints);
+  _xs.resize(npoints);
+  _xsLo.resize(npoints);
+  _ys.resize(npoints);
+  _breaks.resize(npoints);
+  _latticeIndices.resize(npoints);
 }
 
 void
 ExpressionCalculator::SetExpression(std::unique_ptr<Expression> expr)
 {
-  if (_expressions.size() == EXPR_HISTORY)
+  SaveSamples();
+  if (_expressions.size() == EXPR_HISTORY) {
     _expressions.erase(_expressions.begin());
+    _samples.erase(_samples.begin());
+  }
 
   _expressions.push_back(std::move(expr));
+  _samples.emplace_back();
   _currentExprIndex = _expressions.size() - 1;
   _forceCalc = true;
+  ResetCaches();
 }
 
 void
@@ -26,8 +68,11 @@ ExpressionCalculator::UndoSetExpression()
 {
   // If current index is bigger than 0, then "rewind" to previous expression
   if (_currentExprIndex > 0) {
+    SaveSamples();
     --_currentExprIndex;
     _forceCalc = true;
+    ResetCaches();
+    RestoreSamples();
   }
 }
 
@@ -37,11 +82,1053 @@ ExpressionCalculator::RedoSetExpression()
   // If current index is lower than size of expressions vector - 1, then
   // "switch" to more recent expression
   if (_currentExprIndex < _expressions.size() - 1) {
+    SaveSamples();
     ++_currentExprIndex;
     _forceCalc = true;
+    ResetCaches();
+    RestoreSamples();
+  }
+}
+
+void
+ExpressionCalculator::SaveSamples()
+{
+  // Cumulative integral and family are drawn from caches of current
+  // expression only, so their points aren't kept
+  if (_expressions.empty() || _forceCalc || _antiderivative || _familySize)
+    return;
+
+  Samples& samples = _samples[_currentExprIndex];
+  samples.points.assign(_points.begin(), _points.begin() + _pointsCount);
+  samples.count = _pointsCount;
+  samples.x1 = _lastMinX;
+  samples.x2 = _lastMaxX;
+  samples.version = _samplesVersion;
+
+  // Entries farthest from current one are least likely to be seen next
+  auto distance = [this](size_t i) {
+    return i > _currentExprIndex ? i - _currentExprIndex
+                                 : _currentExprIndex - i;
+  };
+  size_t total = 0;
+  for (auto& entry : _samples)
+    total += entry.points.capacity() * sizeof(Point);
+  while (total > HISTORY_SAMPLES_MAX_BYTES) {
+    size_t farthest = _currentExprIndex;
+    for (size_t i = 0; i < _samples.size(); ++i) {
+      if (_samples[i].points.capacity() && distance(i) > distance(farthest))
+        farthest = i;
+    }
+
+    total -= _samples[farthest].points.capacity() * sizeof(Point);
+    _samples[farthest] = Samples();
+    if (farthest == _currentExprIndex)
+      break;
+  }
+}
+
+void
+ExpressionCalculator::RestoreSamples()
+{
+  Samples& samples = _samples[_currentExprIndex];
+  if (!samples.count || samples.version != _samplesVersion ||
+      _antiderivative || _familySize || samples.count > _points.size())
+    return;
+
+  // Calculation in same bounds returns these points, other bounds are
+  // calculated anew
+  std::copy(samples.points.begin(), samples.points.end(), _points.begin());
+  _pointsCount = samples.count;
+  IndexPoints();
+  _lastMinX = samples.x1;
+  _lastMaxX = samples.x2;
+  _forceCalc = false;
+}
+
+void
+ExpressionCalculator::SetAntiderivativeMode(bool enabled, double lowerBound)
+{
+  if (enabled == _antiderivative && lowerBound == _antiderivativeLower)
+    return;
+
+  _antiderivative = enabled;
+  ++_samplesVersion;
+  // Moving lower bound only changes offset of already built integral
+  if (lowerBound != _antiderivativeLower) {
+    _lowerOffset.reset();
+    _lowerSearched = false;
+  }
+  _antiderivativeLower = lowerBound;
+  _forceCalc = true;
+}
+
+std::string
+ExpressionCalculator::GetPlotVariable() const
+{
+  if (_expressions.empty())
+    return "";
+
+  for (auto& name : _expressions[_currentExprIndex]->GetVariableNames()) {
+    if (_parameters.find(name) == _parameters.end())
+      return name;
+  }
+  return "";
+}
+
+bool
+ExpressionCalculator::SetCalculatedPoints(const std::vector<Point>& points,
+                                          size_t count,
+                                          double x1,
+                                          double x2)
+{
+  if (_antiderivative || _familySize || count > _points.size())
+    return false;
+
+  std::copy(points.begin(), points.begin() + count, _points.begin());
+  _pointsCount = count;
+  IndexPoints();
+  _lastMinX = x1;
+  _lastMaxX = x2;
+  _forceCalc = false;
+  CalculateOverlays(x1, x2);
+  return true;
+}
+
+void
+ExpressionCalculator::SetParameter(const std::string& name, double value)
+{
+  auto it = _parameters.find(name);
+  if (it != _parameters.end() && it->second == value)
+    return;
+
+  // Variable, which becomes parameter, is read from other column
+  if (it == _parameters.end())
+    _fusedDirty = true;
+  _parameters[name] = value;
+  ++_samplesVersion;
+  _prefix.clear();
+  _pieces.clear();
+  _lowerOffset.reset();
+  _forceCalc = true;
+}
+
+void
+ExpressionCalculator::SetFamily(const std::string& parameter,
+                                double from,
+                                double to,
+                                uint size)
+{
+  if (parameter == _familyParameter && from == _familyFrom &&
+      to == _familyTo && size == _familySize)
+    return;
+
+  _familyParameter = parameter;
+  _familyFrom = from;
+  _familyTo = to;
+  _familySize = size;
+  _familyPointsCount = 0;
+  ++_samplesVersion;
+  _forceCalc = true;
+}
+
+bool
+ExpressionCalculator::AddOverlay()
+{
+  const Expression* current = GetCurrentExpression();
+  if (!current)
+    return false;
+
+  for (auto& overlay : _overlays) {
+    if (overlay.expr->IsEquivalent(*current))
+      return false;
+  }
+
+  _overlays.push_back({ std::make_unique<Expression>(*current), {}, 0 });
+  _fusedDirty = true;
+  _featureSets.clear();
+  _forceCalc = true;
+  return true;
+}
+
+void
+ExpressionCalculator::RemoveOverlay(size_t index)
+{
+  if (index >= _overlays.size())
+    return;
+
+  _overlays.erase(_overlays.begin() + index);
+  _fusedDirty = true;
+  _featureSets.clear();
+  _forceCalc = true;
+}
+
+// Check if expression can be evaluated by fused program. Polynomials keep
+// their own more precise evaluation
+static bool
+IsFusable(const Expression* expr)
+{
+  return expr && expr->IsCompiled() && !expr->GetCompiled()->IsPolynomial();
+}
+
+void
+ExpressionCalculator::FuseOverlays()
+{
+  _fusedDirty = false;
+
+  // Current expression is fused only when it's plotted with overlays, and
+  // expensive one is taken from its interpolant instead
+  std::vector<const Expression*> members;
+  for (auto& overlay : _overlays)
+    members.push_back(overlay.expr.get());
+  const Expression* current = GetCurrentExpression();
+  bool fuseCurrent = !_overlays.empty() && current &&
+                     current->GetEvaluationCost() < PROXY_MIN_COST;
+  members.push_back(fuseCurrent ? current : nullptr);
+
+  // Variables of every member in fused program. Plotted variable, which is
+  // first one that isn't parameter, is read from first column, and parameters
+  // are shared by name
+  std::vector<std::string> fusedVariables = { "" };
+  std::vector<std::vector<uint32_t>> maps(members.size());
+  for (size_t k = 0; k < members.size(); ++k) {
+    if (!IsFusable(members[k]))
+      continue;
+
+    bool plotted = false;
+    for (auto& name : members[k]->GetVariableNames()) {
+      if (_parameters.find(name) == _parameters.end() && !plotted) {
+        maps[k].push_back(0);
+        plotted = true;
+        continue;
+      }
+
+      auto it = std::find(fusedVariables.begin(), fusedVariables.end(), name);
+      maps[k].push_back(it - fusedVariables.begin());
+      if (it == fusedVariables.end())
+        fusedVariables.push_back(name);
+    }
+  }
+
+  // Subexpressions common to several members are appended once
+  _fused = std::make_unique<CompiledExpression>(fusedVariables.size());
+  _fusedVariables = std::move(fusedVariables);
+  std::vector<std::optional<uint32_t>> outputs(members.size());
+  for (size_t k = 0; k < members.size(); ++k) {
+    if (IsFusable(members[k]))
+      outputs[k] = _fused->AppendProgram(*members[k]->GetCompiled(), maps[k]);
+  }
+  _currentOutput = outputs.back();
+  outputs.pop_back();
+  _overlayOutputs = std::move(outputs);
+}
+
+void
+ExpressionCalculator::CalculateOverlays(double x1, double x2)
+{
+  _fusedCurrent = nullptr;
+  if (_overlays.empty())
+    return;
+  if (_fusedDirty)
+    FuseOverlays();
+
+  // Lattice is same as one of current expression before undefined intervals
+  // are skipped, so that all curves share X values
+  double epsilon = (x2 - x1) * BOUNDS_EPSILON;
+  double step = (x2 - x1) / (_nPoints - 2);
+  _overlayXs.resize(_nPoints);
+  for (uint i = 0; i < _nPoints; ++i)
+    _overlayXs[i] = x1 - epsilon + i * step;
+
+  // Plotted variable and parameters are filled once for all fused members,
+  // which are evaluated block by block together. Values of every overlay are
+  // kept in its own row, overlays evaluated alone overwrite theirs
+  std::vector<uint32_t> outputs;
+  for (auto& output : _overlayOutputs)
+    outputs.push_back(output.value_or(0));
+  bool withCurrent = _currentOutput && !_antiderivative;
+  if (withCurrent)
+    outputs.push_back(*_currentOutput);
+  _columns.resize(_fusedVariables.size() * _nPoints);
+  FillColumns(_fusedVariables, _overlayXs.data(), _nPoints, _columns.data());
+  _overlayYs.resize(_nPoints * outputs.size());
+  _fused->EvaluateOutputs(
+    _columns.data(), _nPoints, outputs, _overlayYs.data());
+  if (withCurrent)
+    _fusedCurrent = _overlayYs.data() + _overlays.size() * _nPoints;
+
+  _overlayBreaks.resize(_overlays.size());
+  for (size_t k = 0; k < _overlays.size(); ++k) {
+    Overlay& overlay = _overlays[k];
+    double* ys = _overlayYs.data() + k * _nPoints;
+    if (!_overlayOutputs[k])
+      EvaluatePoints(overlay.expr.get(), _overlayXs.data(), _nPoints, ys);
+
+    // Line is broken on poles, undefined points are NaN anyway
+    LatticeBreaks(overlay.expr.get(), x1, x2, _overlayBreaks[k]);
+    overlay.points.resize(_nPoints);
+    overlay.pointsCount = CollectPoints(_overlayXs.data(),
+                                        _overlayBreaks[k],
+                                        ys,
+                                        _nPoints,
+                                        overlay.points.data());
   }
 }
 
+void
+ExpressionCalculator::LatticeBreaks(Expression* expr,
+                                    double x1,
+                                    double x2,
+                                    std::vector<bool>& breaks)
+{
+  double step = (x2 - x1) / (_nPoints - 2);
+  DomainInfo domain = expr->AnalyzeDomain(x1, x2);
+  breaks.assign(_nPoints, false);
+  for (double pole : domain.poles) {
+    double i = std::ceil((pole - _overlayXs[0]) / step);
+    if (i >= 0 && i < _nPoints)
+      breaks[static_cast<size_t>(i)] = true;
+  }
+}
+
+void
+ExpressionCalculator::FindFeatures(Expression* expr, double x1, double x2)
+{
+  _featuresValid = true;
+  _features.clear();
+  if (!_analysis) {
+    _featureSets.clear();
+    return;
+  }
+
+  // Features found with same settings are taken again for brackets inside
+  // range they were found over, so that panning only refines new ones
+  if (_featuresVersion != _samplesVersion ||
+      _featureSets.size() != _overlays.size() + 1)
+    _featureSets.assign(_overlays.size() + 1, {});
+
+  // Expensive expression answered by interpolant has its roots and extrema
+  // found without evaluating it: they're roots of interpolant and of its
+  // derivative, polished on interpolant itself
+  uint nthreads = expr->IsCompiled() ? std::thread::hardware_concurrency() : 1;
+  const std::vector<double>* roots = nullptr;
+  const std::vector<double>* criticals = nullptr;
+  if (_proxy && _proxy->Covers(x1, x2)) {
+    roots = _proxy->GetRoots(false);
+    criticals = _proxy->GetRoots(true);
+  }
+  if (roots && criticals) {
+    const ChebyshevProxy* proxy = _proxy.get();
+    FeatureFinder polisher(
+      [proxy](const double* xs, size_t n, double* out) {
+        proxy->Evaluate(xs, n, out);
+      },
+      [proxy](const double* xs, size_t n, double* out) {
+        proxy->EvaluateDerivative(xs, n, out);
+      },
+      1);
+    _featureSets[0] =
+      polisher.Polish(*roots, *criticals, FeatureKind::Root, x1, x2);
+  } else {
+    // Derivative of single-variable compiled expression is evaluated as
+    // Taylor series, extrema of others are found by golden section search
+    Integrand f = [this, expr](const double* xs, size_t n, double* out) {
+      EvaluatePoints(expr, xs, n, out);
+    };
+    Integrand df;
+    if (expr->IsCompiled() && expr->GetVariableNames().size() == 1) {
+      df = [expr](const double* xs, size_t n, double* out) {
+        std::vector<double> series(2 * n);
+        expr->EvaluateDerivatives(xs, n, 1, series.data());
+        std::copy(series.begin() + n, series.end(), out);
+      };
+    }
+    FeatureFinder finder(f, df, nthreads);
+    _featureSets[0] = finder.Find(_points.data(),
+                                  _pointsCount,
+                                  FeatureKind::Root,
+                                  true,
+                                  _featureSets[0],
+                                  _featuresFrom,
+                                  _featuresTo);
+  }
+
+  // Intersections are roots of difference with every overlay, sampled on
+  // lattice they share. Difference is broken on poles of both curves
+  std::vector<double> values;
+  const double* current = _fusedCurrent;
+  std::vector<bool> currentBreaks;
+  if (!_overlays.empty()) {
+    if (!current) {
+      values.resize(_nPoints);
+      EvaluatePoints(expr, _overlayXs.data(), _nPoints, values.data());
+      current = values.data();
+    }
+    LatticeBreaks(expr, x1, x2, currentBreaks);
+  }
+
+  std::vector<double> diff(_nPoints);
+  std::vector<bool> breaks(_nPoints);
+  std::vector<Point> points(_nPoints);
+  for (size_t k = 0; k < _overlays.size(); ++k) {
+    Expression* other = _overlays[k].expr.get();
+    const double* ys = _overlayYs.data() + k * _nPoints;
+    for (uint i = 0; i < _nPoints; ++i) {
+      diff[i] = current[i] - ys[i];
+      breaks[i] = currentBreaks[i] || _overlayBreaks[k][i];
+    }
+    size_t count = CollectPoints(
+      _overlayXs.data(), breaks, diff.data(), _nPoints, points.data());
+
+    Integrand h = [this, expr, other](const double* xs, size_t n, double* out) {
+      std::vector<double> g(n);
+      EvaluatePoints(expr, xs, n, out);
+      EvaluatePoints(other, xs, n, g.data());
+      for (size_t i = 0; i < n; ++i)
+        out[i] -= g[i];
+    };
+    FeatureFinder intersections(h, {}, other->IsCompiled() ? nthreads : 1);
+    std::vector<Feature>& set = _featureSets[k + 1];
+    set = intersections.Find(points.data(),
+                             count,
+                             FeatureKind::Intersection,
+                             false,
+                             set,
+                             _featuresFrom,
+                             _featuresTo);
+
+    // Intersection lies on current curve, not on difference
+    std::vector<double> xs(set.size());
+    std::vector<double> curveYs(set.size());
+    for (size_t j = 0; j < set.size(); ++j)
+      xs[j] = set[j].x;
+    EvaluatePoints(expr, xs.data(), xs.size(), curveYs.data());
+    for (size_t j = 0; j < set.size(); ++j)
+      set[j].y = curveYs[j];
+  }
+
+  for (auto& set : _featureSets)
+    _features.insert(_features.end(), set.begin(), set.end());
+  _featuresFrom = x1;
+  _featuresTo = x2;
+  _featuresVersion = _samplesVersion;
+}
+
+std::optional<Interval>
+ExpressionCalculator::GetYRange(double x1, double x2) const
+{
+  // Points are ordered by X, so that visible ones are found by binary search
+  auto end = _points.begin() + _pointsCount;
+  auto first = std::lower_bound(
+    _points.begin(), end, x1, [](const Point& p, double x) { return p.x < x; });
+  auto last = std::upper_bound(
+    first, end, x2, [](double x, const Point& p) { return x < p.x; });
+
+  double min;
+  double max;
+  if (!_yIndex.Find(
+        first - _points.begin(), last - _points.begin(), min, max))
+    return std::nullopt;
+  return Interval{ min, max };
+}
+
+Precision
+ExpressionCalculator::ChoosePrecision(Expression* expr,
+                                      size_t count,
+                                      double step)
+{
+  if (!count || !expr->IsCompiled() || expr->GetVariableNames().size() != 1)
+    return Precision::Double;
+
+  // X values only few ulps apart lose significance in almost any nonlinear
+  // operation, and they aren't even resolved by doubles. Lattice keeps their
+  // lower parts for double-double evaluation
+  double maxX = std::max(std::fabs(_xs[0]), std::fabs(_xs[count - 1]));
+  double ulp = maxX * std::numeric_limits<double>::epsilon();
+  if (step < ulp * DOUBLE_DOUBLE_MIN_STEP_ULPS)
+    return Precision::DoubleDouble;
+
+  // Probe points spread over visible range, including its ends. Errors are
+  // compared with span of values rather than their magnitude, so that small
+  // variation over large offset isn't lost
+  size_t probes = std::min<size_t>(PRECISION_PROBE_POINTS, count);
+  double xs[PRECISION_PROBE_POINTS];
+  double exact[PRECISION_PROBE_POINTS];
+  for (size_t k = 0; k < probes; ++k)
+    xs[k] = _xs[probes > 1 ? k * (count - 1) / (probes - 1) : 0];
+  expr->Evaluate(xs, probes, exact);
+
+  double min = std::numeric_limits<double>::infinity();
+  double max = -min;
+  for (size_t k = 0; k < probes; ++k) {
+    if (std::isfinite(exact[k])) {
+      min = std::min(min, exact[k]);
+      max = std::max(max, exact[k]);
+    }
+  }
+
+  // Few of probes are checked against double-double, since ill-conditioned
+  // expression loses significance in double even at moderate zoom. Rounding
+  // errors of few ulps of value itself aren't loss of significance
+  size_t extended = std::min<size_t>(DOUBLE_DOUBLE_PROBE_POINTS, probes);
+  double extendedXs[DOUBLE_DOUBLE_PROBE_POINTS];
+  double extendedLo[DOUBLE_DOUBLE_PROBE_POINTS];
+  double doubles[DOUBLE_DOUBLE_PROBE_POINTS];
+  double precise[DOUBLE_DOUBLE_PROBE_POINTS];
+  for (size_t k = 0; k < extended; ++k) {
+    size_t probe = extended > 1 ? k * (probes - 1) / (extended - 1) : 0;
+    size_t point = probes > 1 ? probe * (count - 1) / (probes - 1) : 0;
+    extendedXs[k] = xs[probe];
+    extendedLo[k] = _xsLo[point];
+    doubles[k] = exact[probe];
+  }
+  expr->Evaluate(
+    extendedXs, extended, precise, Precision::DoubleDouble, extendedLo);
+  for (size_t k = 0; k < extended; ++k) {
+    double error = std::fabs(precise[k] - doubles[k]);
+    if (std::isfinite(precise[k]) && std::isfinite(doubles[k]) &&
+        error > std::fabs(precise[k]) * DOUBLE_DOUBLE_MIN_ERROR_ULPS *
+                  std::numeric_limits<double>::epsilon() &&
+        !(error <= DOUBLE_DOUBLE_PROBE_TOLERANCE * (max - min)))
+      return Precision::DoubleDouble;
+  }
+
+  // Rounding X to float must move it by small part of step, otherwise curve
+  // becomes staircase
+  double floatUlp = maxX * std::numeric_limits<float>::epsilon();
+  if (!_singlePrecision || expr->GetCompiled()->IsPolynomial() ||
+      step < floatUlp * SINGLE_MIN_STEP_ULPS)
+    return Precision::Double;
+
+  double single[PRECISION_PROBE_POINTS];
+  expr->Evaluate(xs, probes, single, Precision::Single);
+  double error = 0;
+  for (size_t k = 0; k < probes; ++k) {
+    if (std::isnan(exact[k]) && std::isnan(single[k]))
+      continue;
+    if (!std::isfinite(exact[k]) || !std::isfinite(single[k]) ||
+        std::fabs(exact[k]) > SINGLE_MAX_MAGNITUDE)
+      return Precision::Double;
+    error = std::max(error, std::fabs(single[k] - exact[k]));
+  }
+
+  return error <= SINGLE_PROBE_TOLERANCE * (max - min) ? Precision::Single
+                                                        : Precision::Double;
+}
+
+void
+ExpressionCalculator::IndexPoints()
+{
+  _pointYs.resize(_pointsCount);
+  for (size_t i = 0; i < _pointsCount; ++i)
+    _pointYs[i] = _points[i].y;
+  _yIndex.Build(_pointYs.data(), _pointsCount);
+}
+
+std::optional<ExpressionCalculator::SymmetricLattice>
+ExpressionCalculator::PlanSymmetry(const Expression* expr,
+                                   double x1,
+                                   double x2) const
+{
+  const Symmetry& symmetry = expr->GetSymmetry();
+  bool parity = symmetry.even || symmetry.odd;
+  if (_fusedCurrent || (!symmetry.period && !parity))
+    return std::nullopt;
+
+  // Step is stretched a bit, so that period is whole number of steps
+  double step = (x2 - x1) / (_nPoints - 2);
+  SymmetricLattice lattice = { step, 0, 0, symmetry.even, symmetry.odd };
+  long keys = _nPoints;
+  double steps = std::floor(symmetry.period / step);
+  if (steps >= 2 && steps < _nPoints) {
+    lattice.period = steps;
+    lattice.step = symmetry.period / steps;
+    keys = parity ? lattice.period / 2 + 1 : lattice.period;
+  }
+
+  // Multiples of step must be exact integers. Bound lying on lattice point
+  // within rounding is kept, with tolerance relative to step, which may be
+  // tiny at deep zoom
+  double first = std::floor(x1 / lattice.step - BOUNDS_EPSILON);
+  if (std::fabs(first) + _nPoints > SYMMETRY_MAX_MULTIPLE)
+    return std::nullopt;
+  lattice.first = first;
+
+  // Without period only points on both sides of zero share values
+  long last = lattice.first + _nPoints - 1;
+  if (!lattice.period && lattice.first < 0 && last > 0)
+    keys = std::max(-lattice.first, last) + 1;
+
+  if (keys >= _nPoints)
+    return std::nullopt;
+  return lattice;
+}
+
+void
+ExpressionCalculator::EvaluateSymmetric(Expression* expr,
+                                        const SymmetricLattice& lattice,
+                                        size_t count)
+{
+  if (!count)
+    return;
+
+  // Every point is mapped onto key, which is its multiple of step reduced by
+  // period into one around zero, and reflected to non-negative one by parity
+  bool parity = lattice.even || lattice.odd;
+  std::vector<long> keys(count);
+  std::vector<double> signs(count, 1.0);
+  long minKey = std::numeric_limits<long>::max();
+  long maxKey = std::numeric_limits<long>::min();
+  for (size_t c = 0; c < count; ++c) {
+    long key = lattice.first + _latticeIndices[c];
+    if (lattice.period) {
+      key %= lattice.period;
+      if (key < 0)
+        key += lattice.period;
+      if (parity && 2 * key > lattice.period)
+        key -= lattice.period;
+    }
+    if (parity && key < 0) {
+      key = -key;
+      if (lattice.odd)
+        signs[c] = -1;
+    }
+
+    keys[c] = key;
+    minKey = std::min(minKey, key);
+    maxKey = std::max(maxKey, key);
+  }
+
+  std::vector<double> xs(maxKey - minKey + 1);
+  std::vector<double> values(xs.size());
+  for (size_t k = 0; k < xs.size(); ++k)
+    xs[k] = (minKey + static_cast<long>(k)) * lattice.step;
+  EvaluatePoints(expr, xs.data(), xs.size(), values.data());
+
+  for (size_t c = 0; c < count; ++c)
+    _ys[c] = signs[c] * values[keys[c] - minKey];
+}
+
+void
+ExpressionCalculator::ResetCaches()
+{
+  _prefix.clear();
+  _pieces.clear();
+  _lowerOffset.reset();
+  _proxy.reset();
+  _proxyRange.reset();
+  _staged.program = nullptr;
+  _fusedDirty = true;
+  _fusedCurrent = nullptr;
+  _featureSets.clear();
+  _features.clear();
+  _featuresValid = false;
+}
+
+void
+ExpressionCalculator::FillColumns(const std::vector<std::string>& variables,
+                                  const double* xs,
+                                  size_t n,
+                                  double* columns) const
+{
+  bool xFound = false;
+  for (size_t v = 0; v < variables.size(); ++v) {
+    double* column = columns + v * n;
+    auto param = _parameters.find(variables[v]);
+    if (param != _parameters.end()) {
+      std::fill(column, column + n, param->second);
+    } else if (!xFound) {
+      std::copy(xs, xs + n, column);
+      xFound = true;
+    } else {
+      std::fill(column, column + n, std::nan(""));
+    }
+  }
+}
+
+size_t
+ExpressionCalculator::CollectPoints(const double* xs,
+                                    const std::vector<bool>& breaks,
+                                    const double* ys,
+                                    size_t count,
+                                    Point* out) const
+{
+  size_t collected = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (breaks[i] && collected)
+      out[collected - 1].lineEnd = true;
+
+    if (std::isfinite(ys[i])) {
+      out[collected] = { xs[i], ys[i], false };
+      ++collected;
+    } else if (collected) {
+      out[collected - 1].lineEnd = true;
+    }
+  }
+
+  if (collected)
+    out[collected - 1].lineEnd = true;
+  return collected;
+}
+
+void
+ExpressionCalculator::CalculateFamily(Expression* expr, size_t count)
+{
+  _familyPointsCount = 0;
+  std::vector<std::string> variables = expr->GetVariableNames();
+  auto swept = std::find(variables.begin(), variables.end(), _familyParameter);
+  if (_familySize == 0 || swept == variables.end())
+    return;
+
+  // Members are spread evenly over range, including its ends
+  std::vector<double> values(_familySize);
+  for (uint j = 0; j < _familySize; ++j)
+    values[j] = _familySize == 1 ? _familyFrom
+                                 : _familyFrom + (_familyTo - _familyFrom) *
+                                                   j / (_familySize - 1);
+
+  _columns.resize(variables.size() * count);
+  FillColumns(variables, _xs.data(), count, _columns.data());
+  _familyYs.resize(count * _familySize);
+  expr->EvaluateFamily(_columns.data(),
+                       count,
+                       swept - variables.begin(),
+                       values.data(),
+                       _familySize,
+                       _familyYs.data());
+
+  _familyPoints.resize(count * _familySize);
+  for (uint j = 0; j < _familySize; ++j)
+    _familyPointsCount += CollectPoints(_familyYs.data() + j * count,
+                                        count,
+                                        _familyPoints.data() +
+                                          _familyPointsCount);
+}
+
+void
+ExpressionCalculator::EvaluatePoints(Expression* expr,
+                                     const double* xs,
+                                     size_t n,
+                                     double* out,
+                                     StagedRegisters* staged)
+{
+  std::vector<std::string> variables = expr->GetVariableNames();
+
+  // Variables other than parameters take X values, unset parameters are NaN.
+  // Integration evaluates from several threads, so only staged evaluation
+  // keeps variables in member buffer
+  if (variables.size() > 1) {
+    std::vector<double> local;
+    std::vector<double>& columns = staged ? _columns : local;
+    columns.resize(variables.size() * n);
+    FillColumns(variables, xs, n, columns.data());
+    expr->EvaluateVariables(columns.data(), n, out, staged);
+    return;
+  }
+
+  // Expressions which only GiNaC can evaluate are spread over worker processes
+  if (!expr->IsCompiled() && _workerPool && _workerPool->IsAvailable() &&
+      n >= WORKER_POOL_MIN_POINTS && variables.size() == 1) {
+    if (_workerPool->Evaluate(
+          expr->GetExpressionString(), variables[0], xs, n, out, _cancelled))
+      return;
+
+    // Cancelled evaluation isn't done again in this process
+    if (_cancelled && _cancelled->load(std::memory_order_acquire)) {
+      std::fill(out, out + n, std::nan(""));
+      return;
+    }
+  }
+
+  expr->Evaluate(xs, n, out);
+}
+
+ChebyshevProxy*
+ExpressionCalculator::UpdateProxy(Expression* expr, double x1, double x2)
+{
+  if (expr->GetEvaluationCost() < PROXY_MIN_COST ||
+      expr->GetVariableNames().size() != 1)
+    return nullptr;
+
+  if (_proxyRange && x1 >= _proxyRange->from && x2 <= _proxyRange->to)
+    return _proxy && _proxy->IsValid() ? _proxy.get() : nullptr;
+
+  // Neighbouring ranges are covered too, so that panning and zooming out a bit
+  // are answered without rebuilding. Interpolant can't cross singularities
+  double width = x2 - x1;
+  _proxyRange = Interval{ x1 - width, x2 + width };
+  _proxy.reset();
+  DomainInfo domain = expr->AnalyzeDomain(_proxyRange->from, _proxyRange->to);
+  if (!domain.poles.empty() || !domain.invalid.empty())
+    return nullptr;
+
+  Integrand integrand = [this, expr](const double* xs, size_t n, double* out) {
+    EvaluatePoints(expr, xs, n, out);
+  };
+  _proxy = std::make_unique<ChebyshevProxy>(
+    integrand, _proxyRange->from, _proxyRange->to);
+  return _proxy->IsValid() ? _proxy.get() : nullptr;
+}
+
+std::optional<IntegrationResult>
+ExpressionCalculator::IntegrateProxy(const std::string& variable,
+                                     double lowerBound,
+                                     double upperBound,
+                                     double tolerance) const
+{
+  if (!_proxy || !_proxy->Covers(std::min(lowerBound, upperBound),
+                                 std::max(lowerBound, upperBound)))
+    return std::nullopt;
+
+  std::vector<std::string> variables =
+    _expressions[_currentExprIndex]->GetVariableNames();
+  IntegrationResult res = _proxy->Integrate(lowerBound, upperBound);
+  if (variables.size() == 1 && variables[0] == variable &&
+      res.error <= tolerance * std::max(1.0, std::fabs(res.value)))
+    return res;
+  return std::nullopt;
+}
+
+std::optional<IntegrationResult>
+ExpressionCalculator::CalculateIntegral(const std::string& variable,
+                                        double lowerBound,
+                                        double upperBound,
+                                        double tolerance,
+                                        size_t maxEvaluations)
+{
+  std::optional<IntegrationResult> res =
+    IntegrateProxy(variable, lowerBound, upperBound, tolerance);
+  if (res)
+    return res;
+
+  return _expressions[_currentExprIndex]->CalculateIntegral(
+    variable, lowerBound, upperBound, tolerance, maxEvaluations, _parameters);
+}
+
+// Check if [a;b] overlaps interval, where expression is undefined, or has
+// pole within tolerance of analysis, which located poles
+static bool
+CrossesBreak(const DomainInfo& domain, double a, double b, double tolerance)
+{
+  auto pole =
+    std::lower_bound(domain.poles.begin(), domain.poles.end(), a - tolerance);
+  if (pole != domain.poles.end() && *pole <= b + tolerance)
+    return true;
+
+  for (auto& interval : domain.invalid)
+    if (interval.from <= b && interval.to >= a)
+      return true;
+  return false;
+}
+
+bool
+ExpressionCalculator::ExtendPrefix(Expression* expr, long first, long last)
+{
+  // Compiled expressions are integrated by all cores
+  Quadrature quadrature(QUAD_DEFAULT_TOLERANCE,
+                        QUAD_DEFAULT_MAX_EVALUATIONS,
+                        expr->IsCompiled() ? std::thread::hardware_concurrency()
+                                           : 1);
+  Integrand integrand = [this, expr](const double* xs, size_t n, double* out) {
+    EvaluatePoints(expr, xs, n, out);
+  };
+  std::vector<double> panels;
+  bool grown = _prefix.empty();
+
+  if (_prefix.empty()) {
+    _prefixFirst = first;
+    _prefix.push_back(0.0);
+    _pieces.push_back(0);
+  }
+
+  // Panels crossing poles or undefined intervals aren't summed, sum starts
+  // anew in next piece of domain
+  if (first < _prefixFirst) {
+    double from = first * _latticeStep;
+    panels.resize(_prefixFirst - first);
+    quadrature.IntegratePanels(
+      integrand, from, _latticeStep, panels.size(), panels.data());
+    double to = _prefixFirst * _latticeStep;
+    DomainInfo domain = expr->AnalyzeDomain(from, to);
+    for (size_t i = panels.size(); i-- > 0;) {
+      double a = from + i * _latticeStep;
+      if (std::isfinite(panels[i]) &&
+          !CrossesBreak(domain,
+                        a,
+                        a + _latticeStep,
+                        (to - from) * DOMAIN_TOLERANCE)) {
+        _prefix.push_front(_prefix.front() - panels[i]);
+        _pieces.push_front(_pieces.front());
+      } else {
+        _prefix.push_front(0.0);
+        _pieces.push_front(_pieces.front() - 1);
+      }
+    }
+    _prefixFirst = first;
+    grown = true;
+  }
+
+  long prefixLast = _prefixFirst + static_cast<long>(_prefix.size()) - 1;
+  if (last > prefixLast) {
+    double from = prefixLast * _latticeStep;
+    panels.resize(last - prefixLast);
+    quadrature.IntegratePanels(
+      integrand, from, _latticeStep, panels.size(), panels.data());
+    double to = last * _latticeStep;
+    DomainInfo domain = expr->AnalyzeDomain(from, to);
+    for (size_t i = 0; i < panels.size(); ++i) {
+      double a = from + i * _latticeStep;
+      if (std::isfinite(panels[i]) &&
+          !CrossesBreak(domain,
+                        a,
+                        a + _latticeStep,
+                        (to - from) * DOMAIN_TOLERANCE)) {
+        _prefix.push_back(_prefix.back() + panels[i]);
+        _pieces.push_back(_pieces.back());
+      } else {
+        _prefix.push_back(0.0);
+        _pieces.push_back(_pieces.back() + 1);
+      }
+    }
+    grown = true;
+  }
+
+  return grown;
+}
+
+std::optional<double>
+ExpressionCalculator::PrefixAt(Expression* expr, double x, long& piece)
+{
+  Quadrature quadrature(QUAD_DEFAULT_TOLERANCE,
+                        QUAD_DEFAULT_MAX_EVALUATIONS,
+                        expr->IsCompiled() ? std::thread::hardware_concurrency()
+                                           : 1);
+  Integrand integrand = [this, expr](const double* xs, size_t n, double* out) {
+    EvaluatePoints(expr, xs, n, out);
+  };
+
+  long k = std::floor(x / _latticeStep);
+  long prefixLast = _prefixFirst + static_cast<long>(_prefix.size()) - 1;
+  bool inside = k >= _prefixFirst && k < prefixLast;
+
+  // Integral is taken from lattice point, which x is reached from without
+  // breaks: from either end of its panel, or from nearest end of lattice
+  long anchors[2] = { std::clamp(k, _prefixFirst, prefixLast), k + 1 };
+  for (int i = 0; i < (inside ? 2 : 1); ++i) {
+    double from = anchors[i] * _latticeStep;
+    double a = std::min(from, x);
+    double b = std::max(from, x);
+    if (a < b && CrossesBreak(expr->AnalyzeDomain(a, b),
+                              a,
+                              b,
+                              (b - a) * DOMAIN_TOLERANCE))
+      continue;
+
+    // Inside of lattice only part of single panel is integrated
+    double partial = 0;
+    if (a < b && inside)
+      quadrature.IntegratePanels(integrand, a, b - a, 1, &partial);
+    else if (a < b)
+      partial = quadrature.Integrate(integrand, a, b).value;
+    if (!std::isfinite(partial))
+      continue;
+
+    piece = _pieces[anchors[i] - _prefixFirst];
+    return _prefix[anchors[i] - _prefixFirst] + (x < from ? -partial : partial);
+  }
+
+  return std::nullopt;
+}
+
+double
+ExpressionCalculator::NearestDefined(Expression* expr,
+                                     double x,
+                                     double x1,
+                                     double x2)
+{
+  double from = std::min(x, x1);
+  double to = std::max(x, x2);
+  DomainInfo domain = expr->AnalyzeDomain(from, to);
+  // Ends of undefined intervals are last points known to be undefined, and
+  // domain starts within tolerance of analysis past them
+  double tolerance = (to - from) * DOMAIN_TOLERANCE;
+
+  for (auto& interval : domain.invalid) {
+    if (x < interval.from || x > interval.to)
+      continue;
+
+    // Ends of analyzed range aren't ends of domain
+    bool left = interval.from > from;
+    bool right = interval.to < to;
+    if (left && (!right || x - interval.from < interval.to - x))
+      return interval.from - tolerance;
+    if (right)
+      return interval.to + tolerance;
+  }
+
+  return x;
+}
+
+std::vector<Point>&
+ExpressionCalculator::CalculateAntiderivative(double x1, double x2)
+{
+  Expression* expr = _expressions[_currentExprIndex].get();
+  double step = (x2 - x1) / (_nPoints - 2);
+  _familyPointsCount = 0;
+
+  // Lattice is kept while panning, zooming changes its step and rebuilds it
+  if (_prefix.empty() ||
+      std::fabs(step - _latticeStep) > PREFIX_STEP_TOLERANCE * _latticeStep ||
+      _prefix.size() > PREFIX_MAX_PANELS_FACTOR * _nPoints) {
+    _latticeStep = step;
+    _prefix.clear();
+    _pieces.clear();
+    _lowerOffset.reset();
+  }
+
+  long first = std::ceil(x1 / _latticeStep);
+  long last =
+    std::min<long>(std::floor(x2 / _latticeStep), first + _nPoints - 1);
+
+  // Lower bound, which isn't connected with lattice, may get connected when
+  // lattice grows. Lower bound in undefined interval is moved to its end
+  if (ExtendPrefix(expr, first, last) && !_lowerOffset)
+    _lowerSearched = false;
+  if (!_lowerSearched) {
+    double lower = NearestDefined(expr, _antiderivativeLower, x1, x2);
+    _lowerOffset = PrefixAt(expr, lower, _lowerPiece);
+    _lowerSearched = true;
+  }
+
+  // Pieces of domain other than one of lower bound are plotted with sum
+  // started anywhere in them, so their points are marked floating. Points,
+  // which are in no piece with their neighbours, are undefined or isolated
+  // between breaks
+  _pointsCount = 0;
+  for (long k = first; k <= last; ++k) {
+    size_t i = k - _prefixFirst;
+    bool connected = (i > 0 && _pieces[i - 1] == _pieces[i]) ||
+                     (i + 1 < _pieces.size() && _pieces[i + 1] == _pieces[i]);
+    double y = _prefix[i];
+    bool floating = !_lowerOffset || _pieces[i] != _lowerPiece;
+    if (!floating)
+      y -= *_lowerOffset;
+
+    bool valid = connected && std::isfinite(y);
+    if (_pointsCount && (!valid || _pieces[i] != _pieces[i - 1]))
+      _points[_pointsCount - 1].lineEnd = true;
+    if (valid) {
+      _points[_pointsCount] = { k * _latticeStep, y, false, floating };
+      ++_pointsCount;
+    }
+  }
+
+  if (_pointsCount)
+    _points[_pointsCount - 1].lineEnd = true;
+  IndexPoints();
+
+  return _points;
+}
+
 std::vector<Point>&
 ExpressionCalculator::CalculateExpression(double x1, double x2)
 {
@@ -50,41 +1137,120 @@ ExpressionCalculator::CalculateExpression(double x1, double x2)
     return _points;
   }
 
-  double epsilon = 1e-9;
   if (x1 > x2) {
     double temp = x2;
     x2 = x1;
     x1 = temp;
   }
 
+  // Bounds are compared relative to view width, which may be tiny at deep
+  // zoom
+  double epsilon = (x2 - x1) * BOUNDS_EPSILON;
+
+  Expression* expr = _expressions[_currentExprIndex].get();
   if (!_forceCalc && std::fabs(_lastMinX - x1) < epsilon &&
-      (std::fabs(_lastMaxX - x2) < epsilon) && _points.size())
+      (std::fabs(_lastMaxX - x2) < epsilon) && _points.size()) {
+    // Points taken from history have no features yet
+    if (!_featuresValid && !_antiderivative) {
+      CalculateOverlays(x1, x2);
+      FindFeatures(expr, x1, x2);
+    }
     return _points;
+  }
 
   _lastMinX = x1;
   _lastMaxX = x2;
-  Expression* expr = _expressions[_currentExprIndex].get();
-  double step = (_lastMaxX - _lastMinX) / (_nPoints - 2);
-  double x = _lastMinX - epsilon;
-  int lastCorrectIndex = 0;
-  _pointsCount = 0;
+  CalculateOverlays(x1, x2);
 
-  // Fill points vector with calculated points
+  if (_antiderivative) {
+    _features.clear();
+    return CalculateAntiderivative(x1, x2);
+  }
+
+  // Symmetric expression is sampled on lattice, where its values repeat, and
+  // every distinct value is evaluated once
+  std::optional<SymmetricLattice> lattice = PlanSymmetry(expr, x1, x2);
+  double step = (x2 - x1) / (_nPoints - 2);
+  double start = x1 - epsilon;
+  if (lattice) {
+    step = lattice->step;
+    start = lattice->first * step;
+  }
+  // Find poles and undefined intervals first, so that line is broken exactly on
+  // poles and points known to be undefined aren't evaluated at all
+  DomainInfo domain = expr->AnalyzeDomain(x1, x2);
+  size_t pole = 0;
+  size_t interval = 0;
+  size_t count = 0;
+  bool lineBreak = false;
+
+  // Collect X values which need evaluation, marking where line must be broken
   for (int i = 0; i < _nPoints; ++i) {
-    std::optional<double> value =
-      expr->EvaluateExpression(std::vector<double>{ x });
-    if (value.has_value()) {
-      _points[_pointsCount] = { x, value.value(), false };
-      ++_pointsCount;
-      lastCorrectIndex = i;
-    } else if (i - 1 == lastCorrectIndex) {
-      _points[lastCorrectIndex].lineEnd = true;
+    // Lattice point is exact sum of start and its offset, which is rounded to
+    // double for all evaluations but double-double one
+    double offset = i * step;
+    DoubleDouble exact =
+      DoubleDouble(start) + DoubleDouble(offset, ProductError(i, step, offset));
+    double x = exact.hi;
+    // Lattice of longer step ends earlier
+    if (lattice && x > x2 + step)
+      break;
+
+    // Skip whole undefined interval, breaking line before it
+    while (interval < domain.invalid.size() && domain.invalid[interval].to < x)
+      ++interval;
+    if (interval < domain.invalid.size() &&
+        domain.invalid[interval].from <= x) {
+      lineBreak = true;
+      int next = std::floor((domain.invalid[interval].to - start) / step) + 1;
+      i = std::max(i, next - 1);
+      continue;
     }
-    x += step;
+
+    // Break line if there is a pole between previous and current points
+    while (pole < domain.poles.size() && domain.poles[pole] <= x) {
+      lineBreak = true;
+      ++pole;
+    }
+
+    _xs[count] = x;
+    _xsLo[count] = exact.lo;
+    _breaks[count] = lineBreak;
+    _latticeIndices[count] = i;
+    lineBreak = false;
+    ++count;
   }
 
-  if (_pointsCount)
-    _points[_pointsCount - 1].lineEnd = true;
+  // Evaluate all points at once, failed ones are NaN. Expression plotted with
+  // overlays is already evaluated by fused program. Expensive expressions
+  // are taken from interpolant, which is checked against expression in single
+  // point every time
+  ChebyshevProxy* proxy = UpdateProxy(expr, x1, x2);
+  Integrand integrand = [this, expr](const double* xs, size_t n, double* out) {
+    EvaluatePoints(expr, xs, n, out);
+  };
+  _precision = Precision::Double;
+  if (_fusedCurrent) {
+    for (size_t c = 0; c < count; ++c)
+      _ys[c] = _fusedCurrent[_latticeIndices[c]];
+  } else if (lattice) {
+    EvaluateSymmetric(expr, *lattice, count);
+  } else if (proxy && count && proxy->Probe(integrand, _xs[count / 2])) {
+    proxy->Evaluate(_xs.data(), count, _ys.data());
+  } else {
+    _precision = ChoosePrecision(expr, count, step);
+    if (_precision != Precision::Double)
+      expr->Evaluate(
+        _xs.data(), count, _ys.data(), _precision, _xsLo.data());
+    else
+      EvaluatePoints(expr, _xs.data(), count, _ys.data(), &_staged);
+  }
+
+  // Fill points vector with calculated points
+  _pointsCount = CollectPoints(_ys.data(), count, _points.data());
+  IndexPoints();
+  CalculateFamily(expr, count);
+  FindFeatures(expr, x1, x2);
 
   return _points;
-}
\ No newline at end of file
+}
@@ -1,15 +1,82 @@
 #pragma once
+#include "ChebyshevProxy.h"
 #include "Expression.h"
+#include "RangeIndex.h"
+#include "WorkerPool.h"
+#include <atomic>
+#include <deque>
 #include <sys/types.h>
+#include <unordered_map>
 #include <vector>
 
 #define EXPR_HISTORY 10
+// Maximal size in bytes of points kept by all history entries together
+#define HISTORY_SAMPLES_MAX_BYTES (4 << 20)
+// Maximal number of cumulative integral panels per point, after which it's
+// built anew
+#define PREFIX_MAX_PANELS_FACTOR 16
+// Relative change of sampling step, which still reuses cumulative integral
+#define PREFIX_STEP_TOLERANCE 1e-6
+// Minimal cost of expression evaluation, above which visible function is
+// replaced by its Chebyshev interpolant
+#define PROXY_MIN_COST 200
+// Part of view width, within which bounds are considered same and points just
+// outside of view are still sampled
+#define BOUNDS_EPSILON 1e-9
+// Number of points evaluated in different precisions to choose one
+#define PRECISION_PROBE_POINTS 16
+// Minimal sampling step in units of float epsilon of largest X, which allows
+// evaluating in single precision
+#define SINGLE_MIN_STEP_ULPS 4096
+// Maximal error of single precision relative to span of probed values
+#define SINGLE_PROBE_TOLERANCE 1e-5
+// Maximal magnitude of probed values, which is far from float overflow
+#define SINGLE_MAX_MAGNITUDE 1e30
+// Number of probes also evaluated in double-double precision, and maximal
+// error of double relative to span of probed values
+#define DOUBLE_DOUBLE_PROBE_POINTS 4
+#define DOUBLE_DOUBLE_PROBE_TOLERANCE 1e-6
+// Sampling step in units of double epsilon of largest X, below which
+// expression is evaluated in double-double precision
+#define DOUBLE_DOUBLE_MIN_STEP_ULPS 256
+// Errors of double within this number of ulps of value don't need double-double
+#define DOUBLE_DOUBLE_MIN_ERROR_ULPS 4
 
 struct Point
 {
   double x;
   double y;
   bool lineEnd;
+  // If y is cumulative integral with arbitrary offset, as point isn't
+  // connected with lower bound of integral
+  bool floating = false;
+};
+
+// Expression plotted along with current one, with its own curve
+struct Overlay
+{
+  std::unique_ptr<Expression> expr;
+  std::vector<Point> points;
+  size_t pointsCount = 0;
+};
+
+// Kind of special point of curve
+enum class FeatureKind
+{
+  Root,
+  Minimum,
+  Maximum,
+  // Intersection of current expression with overlay
+  Intersection
+};
+
+// Special point of current expression, with coordinates refined beyond
+// sampled points
+struct Feature
+{
+  FeatureKind kind;
+  double x;
+  double y;
 };
 
 class ExpressionCalculator
@@ -22,7 +89,27 @@ public:
   inline void SetNPoints(uint npoints)
   {
     _points.resize(npoints);
+    _xs.resize(npoints);
+    _xsLo.resize(npoints);
+    _ys.resize(npoints);
+    _breaks.resize(npoints);
+    _latticeIndices.resize(npoints);
     _nPoints = npoints;
+    ++_samplesVersion;
+  }
+
+  inline uint GetNPoints() const { return _nPoints; }
+
+  // Set pool of processes evaluating expressions, which can't be compiled
+  inline void SetWorkerPool(std::shared_ptr<WorkerPool> pool)
+  {
+    _workerPool = std::move(pool);
+  }
+
+  // Set flag, which cancels evaluation in worker processes once it's set
+  inline void SetCancelFlag(const std::atomic_bool* cancelled)
+  {
+    _cancelled = cancelled;
   }
 
   // Get vector containing last calculation results
@@ -31,10 +118,44 @@ public:
   // Get actual count of points vector
   inline size_t GetPointsCount() const { return _pointsCount; }
 
-  // compare two expressions if they syntactically equal
-  inline bool CompareWithCurrentExpr(std::string exprStr) const
+  // Get minimal and maximal Y of last calculated points within [x1;x2], none
+  // if there are no such points
+  std::optional<Interval> GetYRange(double x1, double x2) const;
+
+  // Get curves of expression family, curve after curve, each ending with
+  // lineEnd point
+  inline std::vector<Point>& GetFamilyPoints() { return _familyPoints; }
+
+  inline size_t GetFamilyPointsCount() const { return _familyPointsCount; }
+
+  // Get current expression, null if there is none
+  inline const Expression* GetCurrentExpression() const
+  {
+    if (_expressions.empty())
+      return nullptr;
+
+    return _expressions[_currentExprIndex].get();
+  }
+
+  // Get name of variable plotted along X, which is first variable of current
+  // expression that isn't parameter
+  std::string GetPlotVariable() const;
+
+  // Take points of current expression calculated elsewhere in [x1;x2], so that
+  // calculation in same bounds returns them. Points aren't taken if they
+  // can't be plotted as they are, which is reported by return value
+  bool SetCalculatedPoints(const std::vector<Point>& points,
+                           size_t count,
+                           double x1,
+                           double x2);
+
+  // compare expression with current one if they structurally equal
+  inline bool CompareWithCurrentExpr(const Expression& expr) const
   {
-    return exprStr == GetCurrentExpressionString();
+    if (_expressions.empty())
+      return false;
+
+    return _expressions[_currentExprIndex]->IsEquivalent(expr);
   }
 
   // Get a derivative of expression
@@ -52,14 +173,21 @@ public:
     return _expressions[_currentExprIndex]->CreateAntiderivative(variable, C);
   }
 
-  // Calculate integral of expression with given bounds and integration variable
-  inline std::optional<double> CalculateIntegral(const std::string& variable,
-                                                 double lowerBound,
-                                                 double upperBound)
-  {
-    return _expressions[_currentExprIndex]->CalculateIntegral(
-      variable, lowerBound, upperBound);
-  }
+  // Take integral of current expression from its interpolant, if it covers
+  // bounds with requested tolerance
+  std::optional<IntegrationResult> IntegrateProxy(const std::string& variable,
+                                                  double lowerBound,
+                                                  double upperBound,
+                                                  double tolerance) const;
+
+  // Calculate integral of expression with given bounds and integration
+  // variable. Integrals within range of interpolant are taken from it
+  std::optional<IntegrationResult> CalculateIntegral(
+    const std::string& variable,
+    double lowerBound,
+    double upperBound,
+    double tolerance,
+    size_t maxEvaluations);
 
   // Get string representation of current expression
   inline std::string GetCurrentExpressionString() const
@@ -79,18 +207,268 @@ public:
   // Redo expression setting
   void RedoSetExpression();
 
+  // Set value of expression parameter, which is any variable other than first
+  // one. Only instructions depending on changed parameters are evaluated again
+  void SetParameter(const std::string& name, double value);
+
+  // Get values of parameters set so far
+  inline const ParameterValues& GetParameters() const { return _parameters; }
+
+  // Plot family of size curves along with expression, for parameter values
+  // spread evenly over [from;to]. Zero size disables family
+  void SetFamily(const std::string& parameter,
+                 double from,
+                 double to,
+                 uint size);
+
+  // Plot cumulative integral F(x) of current expression from lowerBound
+  // instead of expression itself. Works for any single-variable expression
+  void SetAntiderivativeMode(bool enabled, double lowerBound);
+
+  // Keep current expression plotted when other expression is set. Returns
+  // false if there is no current expression or it's already kept
+  bool AddOverlay();
+
+  // Stop plotting overlay with given index
+  void RemoveOverlay(size_t index);
+
+  // Get expressions plotted along with current one and their last points
+  inline const std::vector<Overlay>& GetOverlays() const { return _overlays; }
+
+  // Find roots and extrema of current expression and its intersections with
+  // overlays in every calculation
+  inline void SetAnalysis(bool enabled)
+  {
+    _analysis = enabled;
+    _featuresValid = false;
+  }
+
+  // Get features found by last calculation: roots and extrema ordered by X,
+  // then intersections with every overlay
+  inline const std::vector<Feature>& GetFeatures() const { return _features; }
+
+  // Allow evaluating compiled expressions in single precision when it's
+  // indistinguishable from double in visible range
+  inline void SetSinglePrecision(bool enabled)
+  {
+    _singlePrecision = enabled;
+    _forceCalc = true;
+  }
+
+  // Get precision current expression was evaluated with by last calculation
+  inline Precision GetPrecision() const { return _precision; }
+
   // Calculate current expression with given boundaries
   std::vector<Point>& CalculateExpression(double x1, double x2);
 
 private:
+  // Points of history entry from its last calculation, with bounds they cover
+  // and version of settings they were calculated with
+  struct Samples
+  {
+    std::vector<Point> points;
+    size_t count = 0;
+    double x1 = 0;
+    double x2 = 0;
+    uint64_t version = 0;
+  };
+
+  // Lattice of multiples of step, where values of symmetric expression repeat
+  // every period steps and are reflected around zero by parity
+  struct SymmetricLattice
+  {
+    double step;
+    // Multiple of step in first lattice point
+    long first;
+    // Number of steps in period, zero if period isn't used
+    long period;
+    bool even;
+    bool odd;
+  };
+
   ExpressionCalculator() = delete;
   ExpressionCalculator(const ExpressionCalculator&) = delete;
   size_t _currentExprIndex;
   uint _nPoints;
-  float _lastMinX;
-  float _lastMaxX;
+  double _lastMinX;
+  double _lastMaxX;
   bool _forceCalc;
   std::vector<Point> _points;
   size_t _pointsCount;
+  // Y values of points and index of their extrema over ranges, rebuilt
+  // whenever points change
+  std::vector<double> _pointYs;
+  RangeIndex _yIndex;
+  // X values to evaluate, their results and line break flags, kept between
+  // calculations to avoid allocations
+  std::vector<double> _xs;
+  // Parts of lattice X values below their double rounding, which are
+  // evaluated in double-double precision
+  std::vector<double> _xsLo;
+  std::vector<double> _ys;
+  std::vector<bool> _breaks;
+  std::shared_ptr<WorkerPool> _workerPool;
+  const std::atomic_bool* _cancelled;
   std::vector<std::unique_ptr<Expression>> _expressions;
+  // Points of every history entry, so that undo and redo don't recalculate
+  // function which was just seen. Version changes with every setting which
+  // changes points
+  std::vector<Samples> _samples;
+  uint64_t _samplesVersion;
+  // If cumulative integral is plotted
+  bool _antiderivative;
+  double _antiderivativeLower;
+  // Cumulative integral of current expression over lattice of points
+  // k * _latticeStep. Integral isn't taken over poles and undefined intervals,
+  // so lattice is split into pieces of domain numbered by _pieces.
+  // _prefix[i] is integral up to lattice point _prefixFirst + i from point of
+  // its piece, where sum was started. That point depends on where lattice was
+  // started, so only piece of lower bound has offset defined
+  double _latticeStep;
+  long _prefixFirst;
+  std::deque<double> _prefix;
+  std::deque<long> _pieces;
+  // Cumulative integral in lower bound and piece it belongs to, none if lower
+  // bound isn't connected with lattice. It's searched again when lattice grows
+  std::optional<double> _lowerOffset;
+  long _lowerPiece;
+  bool _lowerSearched;
+  // Chebyshev interpolant of expensive expression over visible range and its
+  // neighbours, and range it was tried to build on. Invalid interpolant isn't
+  // rebuilt until view leaves that range
+  std::unique_ptr<ChebyshevProxy> _proxy;
+  std::optional<Interval> _proxyRange;
+  // Values of parameters by name
+  ParameterValues _parameters;
+  // Values of all variables of expression with parameters, and registers of
+  // its last evaluation in plotted points
+  std::vector<double> _columns;
+  StagedRegisters _staged;
+  // Swept parameter of family, its range and number of curves
+  std::string _familyParameter;
+  double _familyFrom;
+  double _familyTo;
+  uint _familySize;
+  // Values of family curves and their points
+  std::vector<double> _familyYs;
+  std::vector<Point> _familyPoints;
+  size_t _familyPointsCount;
+  // Overlays and current expression plotted with them are appended into
+  // single fused program, where their common subexpressions are evaluated
+  // once. _overlayOutputs holds register of every overlay in fused program,
+  // or none if it's evaluated alone, _currentOutput is same for current
+  // expression. Fused program reads plotted variable first, then parameters.
+  // It's rebuilt before next calculation when _fusedDirty is set
+  std::vector<Overlay> _overlays;
+  std::unique_ptr<CompiledExpression> _fused;
+  std::vector<std::optional<uint32_t>> _overlayOutputs;
+  std::optional<uint32_t> _currentOutput;
+  std::vector<std::string> _fusedVariables;
+  bool _fusedDirty;
+  // Lattice of X values shared by all overlays, values of every overlay one
+  // after another and their line breaks
+  std::vector<double> _overlayXs;
+  std::vector<double> _overlayYs;
+  std::vector<std::vector<bool>> _overlayBreaks;
+  // Values of current expression in lattice found by fused program, null if
+  // it isn't evaluated there. Lattice index of every collected X point
+  const double* _fusedCurrent;
+  std::vector<uint> _latticeIndices;
+  // If features are found, and ones found by last calculation. Roots and
+  // extrema of current expression come first in _featureSets, then its
+  // intersections with every overlay. They are reused over range and
+  // settings version they were found with
+  bool _analysis;
+  std::vector<Feature> _features;
+  std::vector<std::vector<Feature>> _featureSets;
+  double _featuresFrom;
+  double _featuresTo;
+  uint64_t _featuresVersion;
+  bool _featuresValid;
+  // If single precision may be used and precision of last calculation
+  bool _singlePrecision;
+  Precision _precision;
+
+  // Evaluate expression in n points, spreading them over worker processes if
+  // it's worth it. Parameters of expression are substituted with their values,
+  // and if staged is given, evaluation is staged between calls
+  void EvaluatePoints(Expression* expr,
+                      const double* xs,
+                      size_t n,
+                      double* out,
+                      StagedRegisters* staged = nullptr);
+  // Calculate cumulative integral of current expression in [x1;x2]
+  std::vector<Point>& CalculateAntiderivative(double x1, double x2);
+  // Integrate new panels, so that cumulative integral covers lattice points
+  // from first to last. Returns if lattice grew
+  bool ExtendPrefix(Expression* expr, long first, long last);
+  // Get cumulative integral in arbitrary point and piece of lattice it's
+  // connected with. Returns none if breaks separate point from lattice
+  std::optional<double> PrefixAt(Expression* expr, double x, long& piece);
+  // Move point out of undefined interval of expression to nearest end of
+  // domain found within range covering x and [x1;x2]
+  double NearestDefined(Expression* expr, double x, double x1, double x2);
+  // Fill values of all expression variables in n points. First variable which
+  // isn't parameter takes xs, parameters take their values
+  void FillColumns(const std::vector<std::string>& variables,
+                   const double* xs,
+                   size_t n,
+                   double* columns) const;
+  // Convert count values in X points into graph points, breaking line where
+  // needed. Returns number of points written to out
+  size_t CollectPoints(const double* xs,
+                       const std::vector<bool>& breaks,
+                       const double* ys,
+                       size_t count,
+                       Point* out) const;
+  // Same for values of collected X points
+  inline size_t CollectPoints(const double* ys, size_t count, Point* out) const
+  {
+    return CollectPoints(_xs.data(), _breaks, ys, count, out);
+  }
+  // Rebuild fused program out of overlays and current expression
+  void FuseOverlays();
+  // Evaluate all overlays in lattice covering [x1;x2], along with current
+  // expression if it's fused with them
+  void CalculateOverlays(double x1, double x2);
+  // Mark lattice points of overlays, which follow poles of expression
+  void LatticeBreaks(Expression* expr,
+                     double x1,
+                     double x2,
+                     std::vector<bool>& breaks);
+  // Find features of current expression in its points and its intersections
+  // with overlays in their lattice
+  void FindFeatures(Expression* expr, double x1, double x2);
+  // Plan lattice covering [x1;x2] for symmetric expression, none if it's not
+  // symmetric or sampling it doesn't save evaluations
+  std::optional<SymmetricLattice> PlanSymmetry(const Expression* expr,
+                                               double x1,
+                                               double x2) const;
+  // Evaluate count collected points of symmetric lattice, evaluating every
+  // distinct value once
+  void EvaluateSymmetric(Expression* expr,
+                         const SymmetricLattice& lattice,
+                         size_t count);
+  // Choose precision of evaluating count collected points with given step.
+  // Double-double precision is taken for X values few ulps apart, which are
+  // evaluated with their parts below double rounding, or when double loses
+  // significance in few points. Single precision is tried only if X values
+  // are resolved by floats, and it's checked against double
+  Precision ChoosePrecision(Expression* expr, size_t count, double step);
+  // Rebuild index of Y values over points
+  void IndexPoints();
+  // Evaluate family curves in collected X points
+  void CalculateFamily(Expression* expr, size_t count);
+  // Build interpolant of current expression covering [x1;x2], if it's worth
+  // it. Returns interpolant if it's valid there
+  ChebyshevProxy* UpdateProxy(Expression* expr, double x1, double x2);
+  // Keep points of current expression in its history entry, if they are up
+  // to date, dropping points of farthest entries over size limit
+  void SaveSamples();
+  // Take points of current expression from its history entry, if they were
+  // calculated with current settings
+  void RestoreSamples();
+  // Forget cumulative integral, interpolant and fused program of previous
+  // expression
+  void ResetCaches();
 };
\ No newline at end of file
@@ -0,0 +1,314 @@
+#include "FeatureFinder.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <thread>
+
+// Minimal number of brackets worth refining in separate thread
+#define FEATURE_MIN_BRACKETS_PER_THREAD 8
+// Ratio of golden section
+#define FEATURE_GOLDEN_RATIO 0.618033988749894848
+
+// Evaluate function in single point
+static double
+EvaluateAt(const Integrand& f, double x)
+{
+  double y;
+  f(&x, 1, &y);
+  return y;
+}
+
+FeatureFinder::FeatureFinder(Integrand f, Integrand df, uint nthreads)
+  : _f(std::move(f))
+  , _df(std::move(df))
+  , _nThreads(std::max(1u, nthreads))
+{
+}
+
+std::vector<Feature>
+FeatureFinder::Find(const Point* points,
+                    size_t n,
+                    FeatureKind rootKind,
+                    bool extrema,
+                    const std::vector<Feature>& known,
+                    double knownFrom,
+                    double knownTo) const
+{
+  // Roots in sampled points are exact, others are bracketed by neighbours of
+  // different signs. Extrema are bracketed by neighbours of middle point,
+  // where slope changes its sign
+  std::vector<Feature> features;
+  std::vector<Bracket> brackets;
+  for (size_t i = 0; i < n; ++i) {
+    const Point& p = points[i];
+    if (p.y == 0)
+      features.push_back({ rootKind, p.x, p.y });
+    if (p.lineEnd || i + 1 == n)
+      continue;
+
+    const Point& q = points[i + 1];
+    if ((p.y < 0 && q.y > 0) || (p.y > 0 && q.y < 0))
+      brackets.push_back({ rootKind, p, q });
+    if (!extrema || !i || points[i - 1].lineEnd)
+      continue;
+
+    const Point& o = points[i - 1];
+    if (p.y > o.y && p.y > q.y)
+      brackets.push_back({ FeatureKind::Maximum, o, q });
+    else if (p.y < o.y && p.y < q.y)
+      brackets.push_back({ FeatureKind::Minimum, o, q });
+  }
+  if (features.size() + brackets.size() > FEATURES_MAX)
+    return {};
+
+  // Brackets within range of known features take them again, if there is
+  // one of same kind inside
+  std::vector<Bracket> pending;
+  for (auto& bracket : brackets) {
+    auto it = known.end();
+    if (bracket.from.x >= knownFrom && bracket.to.x <= knownTo) {
+      it = std::find_if(known.begin(), known.end(), [&](const Feature& f) {
+        return f.kind == bracket.kind && f.x >= bracket.from.x &&
+               f.x <= bracket.to.x;
+      });
+    }
+    if (it != known.end())
+      features.push_back(*it);
+    else
+      pending.push_back(bracket);
+  }
+
+  // Split pending brackets between threads, first part is refined by caller
+  std::vector<Feature> refined(pending.size());
+  size_t nthreads = std::min<size_t>(
+    _nThreads,
+    std::max<size_t>(1, pending.size() / FEATURE_MIN_BRACKETS_PER_THREAD));
+  size_t perThread = (pending.size() + nthreads - 1) / nthreads;
+  auto refine = [this, &pending, &refined](size_t from, size_t count) {
+    for (size_t i = from; i < from + count; ++i)
+      refined[i] = Refine(pending[i]);
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t from = perThread; from < pending.size(); from += perThread)
+    threads.emplace_back(
+      refine, from, std::min(perThread, pending.size() - from));
+  refine(0, std::min(perThread, pending.size()));
+  for (auto& thread : threads)
+    thread.join();
+
+  for (auto& feature : refined) {
+    if (!std::isnan(feature.x))
+      features.push_back(feature);
+  }
+  std::sort(features.begin(),
+            features.end(),
+            [](const Feature& a, const Feature& b) { return a.x < b.x; });
+  return features;
+}
+
+std::vector<Feature>
+FeatureFinder::Polish(const std::vector<double>& roots,
+                      const std::vector<double>& criticals,
+                      FeatureKind rootKind,
+                      double a,
+                      double b) const
+{
+  auto first = std::lower_bound(roots.begin(), roots.end(), a);
+  auto last = std::upper_bound(roots.begin(), roots.end(), b);
+  auto firstCritical = std::lower_bound(criticals.begin(), criticals.end(), a);
+  auto lastCritical = std::upper_bound(criticals.begin(), criticals.end(), b);
+  if ((last - first) + (lastCritical - firstCritical) > FEATURES_MAX)
+    return {};
+
+  // Polishing evaluates function few times per estimate, so it isn't split
+  // between threads
+  std::vector<Feature> features;
+  bool rising;
+  for (auto it = first; it != last; ++it) {
+    double x = PolishZero(_f, *it, b - a, rising);
+    if (!std::isnan(x))
+      features.push_back({ rootKind, x, EvaluateAt(_f, x) });
+  }
+
+  // Extremum is minimum where derivative rises through zero
+  for (auto it = firstCritical; it != lastCritical; ++it) {
+    double x = PolishZero(_df, *it, b - a, rising);
+    if (!std::isnan(x))
+      features.push_back({ rising ? FeatureKind::Minimum : FeatureKind::Maximum,
+                           x,
+                           EvaluateAt(_f, x) });
+  }
+
+  // Roots on common end of pieces are found in both of them
+  std::sort(features.begin(),
+            features.end(),
+            [](const Feature& p, const Feature& q) { return p.x < q.x; });
+  auto end = std::unique(
+    features.begin(), features.end(), [&](const Feature& p, const Feature& q) {
+      return p.kind == q.kind &&
+             q.x - p.x <= FEATURE_POLISH_MAX_WIDTH * (b - a);
+    });
+  features.erase(end, features.end());
+  return features;
+}
+
+double
+FeatureFinder::PolishZero(const Integrand& g,
+                          double x,
+                          double width,
+                          bool& rising)
+{
+  for (double h = FEATURE_POLISH_MIN_WIDTH * width;
+       h <= FEATURE_POLISH_MAX_WIDTH * width;
+       h *= 16) {
+    double lo = EvaluateAt(g, x - h);
+    double hi = EvaluateAt(g, x + h);
+    if ((lo < 0 && hi > 0) || (lo > 0 && hi < 0)) {
+      rising = lo < 0;
+      return Zero(g, x - h, x + h, lo, hi);
+    }
+  }
+  return std::nan("");
+}
+
+Feature
+FeatureFinder::Refine(const Bracket& bracket) const
+{
+  const Point& a = bracket.from;
+  const Point& b = bracket.to;
+  Feature feature = { bracket.kind, std::nan(""), std::nan("") };
+
+  if (bracket.kind != FeatureKind::Minimum &&
+      bracket.kind != FeatureKind::Maximum) {
+    // Sign change, where function grows instead of approaching zero, is pole
+    // or jump
+    double x = Zero(_f, a.x, b.x, a.y, b.y);
+    double y = EvaluateAt(_f, x);
+    if (std::fabs(y) <= std::min(std::fabs(a.y), std::fabs(b.y)))
+      feature = { bracket.kind, x, y };
+    return feature;
+  }
+
+  // Extremum is zero of derivative, if it changes sign over bracket
+  bool maximum = bracket.kind == FeatureKind::Maximum;
+  double x = std::nan("");
+  if (_df) {
+    double da = EvaluateAt(_df, a.x);
+    double db = EvaluateAt(_df, b.x);
+    if ((da < 0 && db > 0) || (da > 0 && db < 0))
+      x = Zero(_df, a.x, b.x, da, db);
+  }
+  if (std::isnan(x))
+    x = Extremum(a.x, b.x, maximum);
+
+  double y = EvaluateAt(_f, x);
+  double bound = maximum ? std::max(a.y, b.y) : std::min(a.y, b.y);
+  if (maximum ? y >= bound : y <= bound)
+    feature = { bracket.kind, x, y };
+  return feature;
+}
+
+double
+FeatureFinder::Zero(const Integrand& g,
+                    double a,
+                    double b,
+                    double ga,
+                    double gb)
+{
+  // Brent's method: inverse quadratic or linear interpolation, falling back
+  // to bisection when it doesn't shrink bracket [b;c] fast enough
+  double c = a;
+  double gc = ga;
+  double tolerance = DBL_EPSILON * std::fabs(b - a);
+  for (int iteration = 0; iteration < FEATURE_MAX_ITERATIONS; ++iteration) {
+    double previousStep = b - a;
+    if (std::fabs(gc) < std::fabs(gb)) {
+      a = b;
+      b = c;
+      c = a;
+      ga = gb;
+      gb = gc;
+      gc = ga;
+    }
+
+    double actualTolerance = 2 * DBL_EPSILON * std::fabs(b) + tolerance;
+    double step = (c - b) / 2;
+    if (std::fabs(step) <= actualTolerance || gb == 0)
+      return b;
+
+    if (std::fabs(previousStep) >= actualTolerance &&
+        std::fabs(ga) > std::fabs(gb)) {
+      double cb = c - b;
+      double p;
+      double q;
+      if (a == c) {
+        double s = gb / ga;
+        p = cb * s;
+        q = 1 - s;
+      } else {
+        double r = ga / gc;
+        double s = gb / gc;
+        double t = gb / ga;
+        p = t * (cb * r * (r - s) - (b - a) * (s - 1));
+        q = (r - 1) * (s - 1) * (t - 1);
+      }
+      if (p > 0)
+        q = -q;
+      else
+        p = -p;
+
+      if (p < 0.75 * cb * q - std::fabs(actualTolerance * q) / 2 &&
+          p < std::fabs(previousStep * q / 2))
+        step = p / q;
+    }
+    if (std::fabs(step) < actualTolerance)
+      step = step > 0 ? actualTolerance : -actualTolerance;
+
+    a = b;
+    ga = gb;
+    b += step;
+    gb = EvaluateAt(g, b);
+    // Function undefined inside bracket has no zero there
+    if (std::isnan(gb))
+      return std::nan("");
+    if ((gb > 0 && gc > 0) || (gb < 0 && gc < 0)) {
+      c = a;
+      gc = ga;
+    }
+  }
+  return b;
+}
+
+double
+FeatureFinder::Extremum(double a, double b, bool maximum) const
+{
+  // Golden section search keeps two inner points, one of which is reused on
+  // every iteration. Maximum is found as minimum of negated function
+  double sign = maximum ? -1 : 1;
+  double c = b - FEATURE_GOLDEN_RATIO * (b - a);
+  double d = a + FEATURE_GOLDEN_RATIO * (b - a);
+  double fc = sign * EvaluateAt(_f, c);
+  double fd = sign * EvaluateAt(_f, d);
+  double tolerance =
+    std::max(std::sqrt(DBL_EPSILON) * (std::fabs(a) + std::fabs(b)),
+             DBL_EPSILON * (b - a));
+  for (int iteration = 0;
+       iteration < FEATURE_MAX_ITERATIONS && b - a > tolerance;
+       ++iteration) {
+    if (fc < fd) {
+      b = d;
+      d = c;
+      fd = fc;
+      c = b - FEATURE_GOLDEN_RATIO * (b - a);
+      fc = sign * EvaluateAt(_f, c);
+    } else {
+      a = c;
+      c = d;
+      fc = fd;
+      d = a + FEATURE_GOLDEN_RATIO * (b - a);
+      fd = sign * EvaluateAt(_f, d);
+    }
+  }
+  return (a + b) / 2;
+}
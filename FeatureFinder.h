@@ -0,0 +1,82 @@
+#pragma once
+#include "ExpressionCalculator.h"
+#include "Quadrature.h"
+#include <vector>
+
+// Maximal number of features found at once. Curve with more of them
+// oscillates too fast for them to be seen, and none are found
+#define FEATURES_MAX 256
+// Maximal number of iterations refining single bracket
+#define FEATURE_MAX_ITERATIONS 100
+// Half-widths of brackets tried around estimated feature, relative to width
+// of range it's searched in
+#define FEATURE_POLISH_MIN_WIDTH 1e-13
+#define FEATURE_POLISH_MAX_WIDTH 1e-6
+
+// Finds roots and extrema of function between its sampled points. Sign
+// changes of values and of slope bracket them, and brackets are refined in
+// parallel by Brent's method, on derivative for extrema if it's available
+// and by golden section search otherwise
+class FeatureFinder
+{
+public:
+  // ctor, f - function, df - its derivative or empty function, nthreads -
+  // number of threads refining brackets, which must be thread-safe if it's
+  // not 1
+  FeatureFinder(Integrand f, Integrand df, uint nthreads);
+
+  // Find features between n sampled points of function, brackets never cross
+  // line ends. Roots are reported as rootKind, extrema are looked for if
+  // extrema is set. Features of known found earlier over [knownFrom;knownTo]
+  // are taken again for brackets they lie in instead of refining them
+  std::vector<Feature> Find(const Point* points,
+                            size_t n,
+                            FeatureKind rootKind,
+                            bool extrema,
+                            const std::vector<Feature>& known,
+                            double knownFrom,
+                            double knownTo) const;
+
+  // Polish estimated roots of function and of its derivative, which must be
+  // given, into roots and extrema within [a;b]. Every estimate is bracketed
+  // by sign change found close to it, estimates without one are dropped.
+  // Roots are reported as rootKind
+  std::vector<Feature> Polish(const std::vector<double>& roots,
+                              const std::vector<double>& criticals,
+                              FeatureKind rootKind,
+                              double a,
+                              double b) const;
+
+private:
+  // Interval between sampled points, where feature lies. Root is bracketed by
+  // values of different signs in from and to, extremum by middle point
+  struct Bracket
+  {
+    FeatureKind kind;
+    Point from;
+    Point to;
+  };
+
+  FeatureFinder() = delete;
+  Integrand _f;
+  Integrand _df;
+  uint _nThreads;
+
+  // Refine bracket, returns feature with NaN X if there is none
+  Feature Refine(const Bracket& bracket) const;
+  // Find zero of g in [a;b], where its values ga and gb have different signs
+  static double Zero(const Integrand& g,
+                     double a,
+                     double b,
+                     double ga,
+                     double gb);
+  // Find minimum of f in [a;b], or maximum if maximum is set
+  double Extremum(double a, double b, bool maximum) const;
+  // Find zero of g close to estimate x, widening bracket around it until g
+  // changes sign. Returns NaN if it doesn't. Sign of g before zero is
+  // returned in rising
+  static double PolishZero(const Integrand& g,
+                           double x,
+                           double width,
+                           bool& rising);
+};
\ No newline at end of file
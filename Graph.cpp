@@ -1,13 +1,46 @@
 #include "Graph.h"
 #include "Roboto_font.h"
 #include <SFML/System/Vector2.hpp>
+#include <algorithm>
 #include <cmath>
 #include <cstdio>
 #include <mutex>
 
+// Radius of feature marker in pixels
+#define FEATURE_MARKER_RADIUS 4.0f
+// Maximal number of labeled features, others are only marked
+#define FEATURE_MAX_LABELS 32
+// Significant digits of feature coordinates
+#define FEATURE_LABEL_DIGITS 10
+// Part of height taken by curve fitted into view
+#define FIT_HEIGHT_RATIO 0.8f
+// Maximal power of two between Y and X grid steps
+#define FIT_MAX_STRETCH_EXP 40
+// Maximal distance of vertex from screen in pixels. Farther vertices are
+// clamped, so that floats keep subpixel precision of visible part of segment
+#define SCREEN_COORD_LIMIT 1e6
+// Number of label digits after first significant digit of grid step
+#define LABEL_EXTRA_DIGITS 2
+
+// Colors of overlays, repeated when there are more overlays
+static const sf::Color kOverlayColors[] = {
+  sf::Color(0, 150, 0),   sf::Color(200, 0, 200), sf::Color(230, 130, 0),
+  sf::Color(0, 170, 200), sf::Color(120, 70, 30), sf::Color(100, 100, 255)
+};
+
+// Round offset from view corner in pixels to vertex coordinate
+static inline float
+ScreenCoord(double pixels)
+{
+  return static_cast<float>(
+    std::clamp(pixels, -SCREEN_COORD_LIMIT, SCREEN_COORD_LIMIT));
+}
+
 Graph::Graph(sf::Vector2u size, sf::Vector2f center)
   : _size(size)
   , _sampleUnitLabel(_gridTextFont)
+  , _featureMarker(FEATURE_MARKER_RADIUS)
+  , _featureLabel(_gridTextFont)
 {
   if (!_gridTextFont.openFromMemory(Roboto_variable_ttf,
                                     Roboto_variable_ttf_len)) {
@@ -18,7 +51,11 @@ Graph::Graph(sf::Vector2u size, sf::Vector2f center)
   _backBuffer = sf::RenderTexture(_size);
   _vertices = sf::VertexArray(sf::PrimitiveType::LineStrip);
   _gridVerticesArray = sf::VertexArray(sf::PrimitiveType::Lines);
+  _familyVertices = sf::VertexArray(sf::PrimitiveType::Lines);
+  _overlayVertices = sf::VertexArray(sf::PrimitiveType::Lines);
   _graphColor = sf::Color::Red;
+  _familyColor = sf::Color::Blue;
+  _floatingColor = sf::Color(255, 0, 0, 96);
   _gridColor = sf::Color(128, 128, 128, 255);
   _axisColor = sf::Color::Black;
 
@@ -26,7 +63,7 @@ Graph::Graph(sf::Vector2u size, sf::Vector2f center)
 
   _pixelsPerUnit = 80;
   _scaledPixelsPerUnit = _pixelsPerUnit;
-  _pivotPoint = center;
+  _pivotPoint = Vector2d(center);
 
   // Setup labels vector, width/height of symbol and sample text object
   auto glyph = _gridTextFont.getGlyph('A', _fontSymbolSize, false);
@@ -35,6 +72,11 @@ Graph::Graph(sf::Vector2u size, sf::Vector2f center)
   _sampleUnitLabel.setFont(_gridTextFont);
   _sampleUnitLabel.setCharacterSize(_fontSymbolSize);
   _sampleUnitLabel.setFillColor(_axisColor);
+  _featureMarker.setOrigin({ FEATURE_MARKER_RADIUS, FEATURE_MARKER_RADIUS });
+  _featureMarker.setOutlineColor(_axisColor);
+  _featureMarker.setOutlineThickness(1.0f);
+  _featureLabel.setCharacterSize(_fontSymbolSize);
+  _featureLabel.setFillColor(_axisColor);
   // add 2 to account for labels on edges due to float inaccuracy
   _gridLabels.resize((size.x / _scaledPixelsPerUnit) +
                        (size.y / _scaledPixelsPerUnit) + 2,
@@ -44,35 +86,30 @@ Graph::Graph(sf::Vector2u size, sf::Vector2f center)
   _verticalLabelsOffsetY = _axisLineThickness;
 
   // Adjust visible bounds
-  _xBounds.x = _pivotPoint.x - (_size.x / (_scaledPixelsPerUnit * 2.0f));
-  _xBounds.y = _pivotPoint.x + (_size.x / (_scaledPixelsPerUnit * 2.0f));
-  _yBounds.x = _pivotPoint.y - (_size.y / (_scaledPixelsPerUnit * 2.0f));
-  _yBounds.y = _pivotPoint.y + (_size.y / (_scaledPixelsPerUnit * 2.0f));
+  _xBounds.x = _pivotPoint.x - (_size.x / (_scaledPixelsPerUnit * 2.0));
+  _xBounds.y = _pivotPoint.x + (_size.x / (_scaledPixelsPerUnit * 2.0));
+  _yBounds.x = _pivotPoint.y - (_size.y / (_scaledPixelsPerUnit * 2.0));
+  _yBounds.y = _pivotPoint.y + (_size.y / (_scaledPixelsPerUnit * 2.0));
 }
 
 void
-Graph::SetScale(float scale)
+Graph::SetScale(double scale)
 {
   std::lock_guard<std::mutex> lock(_bufferMutex);
 
   double ratio = _scale / scale;
   int newExp = floor(log2(scale));
-  int oldExp = floor(log2(_scale));
-
-  // If new scaling is bigger, then zooming in, increase precision
-  if (newExp > oldExp && scale > 1.0f) {
-    ++_gridLabelTextPrecision;
-  }
-  // If previous scale is bigger that newer, then we're zooming out, decrease
-  // precision
-  else if (newExp < oldExp && _gridLabelTextPrecision > 0) {
-    --_gridLabelTextPrecision;
-  }
 
   _scale = scale;
   // Get nice step scale of 1,2,4,8.. instead of arbitrary like 1.1, 1.2 etc
   // by finding floor'ed exponent, and then dividing logical step by 2^exp
-  _scaledStep = _baseStep / std::pow(2.0f, newExp);
+  _scaledStep = _baseStep / std::pow(2.0, newExp);
+
+  // Labels need one more digit with every halving of step to be exact, but
+  // digits far below step are noise at deep zoom
+  int magnitude = std::ceil(-std::log10(_scaledStep));
+  _gridLabelTextPrecision =
+    std::clamp(magnitude + LABEL_EXTRA_DIGITS, 0, std::max(0, newExp));
   _scaledPixelsPerUnit = _scaledPixelsPerUnit / ratio;
   if (_scaledPixelsPerUnit > 2 * _pixelsPerUnit)
     _scaledPixelsPerUnit = _pixelsPerUnit;
@@ -83,10 +120,10 @@ Graph::SetScale(float scale)
     _pivotPoint.x - _pivotPointScreen.x * _scaledStep / _scaledPixelsPerUnit;
   _xBounds.y = _pivotPoint.x + (_size.x - _pivotPointScreen.x) * _scaledStep /
                                  _scaledPixelsPerUnit;
-  _yBounds.x = _pivotPoint.y - (_size.y - _pivotPointScreen.y) * _scaledStep /
+  _yBounds.x = _pivotPoint.y - (_size.y - _pivotPointScreen.y) * GetYStep() /
                                  _scaledPixelsPerUnit;
   _yBounds.y =
-    _pivotPoint.y + _pivotPointScreen.y * _scaledStep / _scaledPixelsPerUnit;
+    _pivotPoint.y + _pivotPointScreen.y * GetYStep() / _scaledPixelsPerUnit;
 
   // add 2 to account for labels on edges due to float inaccuracy
   _gridLabels.resize((_size.x / _scaledPixelsPerUnit) +
@@ -108,69 +145,148 @@ Graph::Resize(sf::Vector2u size)
                      _sampleUnitLabel);
   // Set new right and bottom corners of logical view, so that its anchored to
   // top-left corner
-  sf::Vector2f newCorner =
+  Vector2d newCorner =
     ScreenToLogical({ static_cast<int>(size.x), static_cast<int>(size.y) });
   _xBounds.y = newCorner.x;
   _yBounds.x = newCorner.y;
 }
 
 void
-Graph::Draw(std::vector<Point>& points, size_t count)
+Graph::FitY(double min, double max)
+{
+  std::lock_guard<std::mutex> lock(_bufferMutex);
+  double center = (min + max) / 2;
+  double range = max - min;
+  if (!std::isfinite(center) || !std::isfinite(range))
+    return;
+
+  // Flat curve is only centered
+  if (range > 0) {
+    double stretch = range / (_size.y * FIT_HEIGHT_RATIO) *
+                     _scaledPixelsPerUnit / _scaledStep;
+    int exp = std::ceil(std::log2(stretch));
+    _yStretch = std::ldexp(
+      1.0, std::clamp(exp, -FIT_MAX_STRETCH_EXP, FIT_MAX_STRETCH_EXP));
+  }
+
+  double half = _size.y / 2.0 * GetYStep() / _scaledPixelsPerUnit;
+  _yBounds.x = center - half;
+  _yBounds.y = center + half;
+}
+
+void
+Graph::Draw(std::vector<Point>& points,
+            size_t count,
+            const Point* family,
+            size_t familyCount,
+            uint8_t familyAlpha,
+            const std::vector<Overlay>* overlays,
+            const std::vector<Feature>* features)
 {
   std::lock_guard<std::mutex> lock(_bufferMutex);
   // Clear out texture area with white color
   _backBuffer.clear(sf::Color::White);
   _xAxisVisible =
-    (_yBounds.x + _fontSymbolHeight * _scaledStep / _scaledPixelsPerUnit <=
-       0.0f &&
-     _yBounds.y >= 0.0f);
+    (_yBounds.x + _fontSymbolHeight * GetYStep() / _scaledPixelsPerUnit <=
+       0.0 &&
+     _yBounds.y >= 0.0);
   _yAxisVisible =
     (_xBounds.x + _fontSymbolWidth * _scaledStep / _scaledPixelsPerUnit <=
-       0.0f &&
-     _xBounds.y >= 0.0f);
+       0.0 &&
+     _xBounds.y >= 0.0);
 
   DrawGrid();
   DrawAxisLines();
   DrawLabels();
 
+  // Draw family curves as one array of segments between neighbour points
+  _familyVertices.clear();
+  sf::Color familyColor = _familyColor;
+  familyColor.a = familyAlpha;
+  for (size_t i = 0; i + 1 < familyCount; ++i) {
+    if (family[i].lineEnd)
+      continue;
+    _familyVertices.append(
+      { LogicalToScreen({ family[i].x, family[i].y }), familyColor });
+    _familyVertices.append(
+      { LogicalToScreen({ family[i + 1].x, family[i + 1].y }), familyColor });
+  }
+  if (_familyVertices.getVertexCount())
+    _backBuffer.draw(_familyVertices);
+
+  // Draw overlays as another array of segments, mapping points to screen with
+  // transform found once for all of them
+  _overlayVertices.clear();
+  double xUnit = _scaledPixelsPerUnit / _scaledStep;
+  double yUnit = _scaledPixelsPerUnit / GetYStep();
+  for (size_t k = 0; overlays && k < overlays->size(); ++k) {
+    const Overlay& overlay = (*overlays)[k];
+    sf::Color color = GetOverlayColor(k);
+    for (size_t i = 0; i + 1 < overlay.pointsCount; ++i) {
+      const Point& p = overlay.points[i];
+      const Point& q = overlay.points[i + 1];
+      if (p.lineEnd)
+        continue;
+      _overlayVertices.append({ { ScreenCoord((p.x - _xBounds.x) * xUnit),
+                                  ScreenCoord((_yBounds.y - p.y) * yUnit) },
+                                color });
+      _overlayVertices.append({ { ScreenCoord((q.x - _xBounds.x) * xUnit),
+                                  ScreenCoord((_yBounds.y - q.y) * yUnit) },
+                                color });
+    }
+  }
+  if (_overlayVertices.getVertexCount())
+    _backBuffer.draw(_overlayVertices);
+
   // Draw function graph
   for (size_t i = 0; i < count; ++i) {
-    _vertices.append({ LogicalToScreen({ static_cast<float>(points[i].x),
-                                         static_cast<float>(points[i].y) }),
-                       _graphColor });
+    _vertices.append({ LogicalToScreen({ points[i].x, points[i].y }),
+                       points[i].floating ? _floatingColor : _graphColor });
     if (points[i].lineEnd) {
       _backBuffer.draw(_vertices);
       _vertices.clear();
     }
   }
 
+  if (features)
+    DrawFeatures(*features);
+
   _backBuffer.display();
 
   std::lock_guard<std::mutex> front_lock(_frontBufferMutex);
   std::swap(_frontBuffer, _backBuffer);
 }
 
-sf::Vector2f
-Graph::LogicalToScreen(const sf::Vector2f point)
+sf::Color
+Graph::GetOverlayColor(size_t index)
 {
-  return { (point.x - _xBounds.x) * _scaledPixelsPerUnit / _scaledStep,
-           (_yBounds.y - point.y) * _scaledPixelsPerUnit / _scaledStep };
+  return kOverlayColors[index % (sizeof(kOverlayColors) /
+                                 sizeof(kOverlayColors[0]))];
 }
 
 sf::Vector2f
+Graph::LogicalToScreen(const Vector2d& point)
+{
+  return { ScreenCoord((point.x - _xBounds.x) * _scaledPixelsPerUnit /
+                       _scaledStep),
+           ScreenCoord((_yBounds.y - point.y) * _scaledPixelsPerUnit /
+                       GetYStep()) };
+}
+
+Vector2d
 Graph::ScreenToLogical(const sf::Vector2i& point)
 {
   return { _xBounds.x + point.x * _scaledStep / _scaledPixelsPerUnit,
-           _yBounds.y - point.y * _scaledStep / _scaledPixelsPerUnit };
+           _yBounds.y - point.y * GetYStep() / _scaledPixelsPerUnit };
 }
 
 void
 Graph::DrawGrid()
 {
   // Draw vertical lines
-  float linePos = _xBounds.x - std::fmod(_xBounds.x, _scaledStep);
+  double firstLine = _xBounds.x - std::fmod(_xBounds.x, _scaledStep);
   // Convert to screen coords
-  linePos = LogicalToScreen({ linePos, 0 }).x;
+  float linePos = LogicalToScreen({ firstLine, 0 }).x;
   _gridVerticesArray.clear();
   // Set vertical lines
   while (linePos < _size.x) {
@@ -179,8 +295,8 @@ Graph::DrawGrid()
       { { linePos, static_cast<float>(_size.y) }, _gridColor });
     linePos += _scaledPixelsPerUnit;
   }
-  linePos = _yBounds.y - std::fmod(_yBounds.y, _scaledStep);
-  linePos = LogicalToScreen({ 0, linePos }).y;
+  firstLine = _yBounds.y - std::fmod(_yBounds.y, GetYStep());
+  linePos = LogicalToScreen({ 0, firstLine }).y;
   // Set horizontal lines
   while (linePos < _size.y) {
     _gridVerticesArray.append({ { 0, linePos }, _gridColor });
@@ -221,8 +337,10 @@ Graph::DrawLabels()
   float yPos = _xAxisVisible
                  ? LogicalToScreen({ 0, 0 }).y + _verticalLabelsOffsetY
                  : _size.y - (_verticalLabelsOffsetY + _fontSymbolHeight * 2);
-  float leftMostX = _xBounds.x - std::fmod(_xBounds.x, _scaledStep);
-  float epsilon = 1e-9;
+  double leftMostX = _xBounds.x - std::fmod(_xBounds.x, _scaledStep);
+  // Line of axis is found by distance from zero relative to step, since
+  // summed steps don't give exact zero
+  double epsilon = _scaledStep / 2;
   // Draw unit labels on horizontal grid lines
   linePos = LogicalToScreen({ leftMostX, 0 }).x;
 
@@ -254,16 +372,20 @@ Graph::DrawLabels()
   // draw on it, otherwise draw on the right edge of screen
   float xPos = _yAxisVisible ? LogicalToScreen({ 0, 0 }).x
                              : _size.x - _horizontalLabelsOffsetY;
-  float topMostY = _yBounds.y - std::fmod(_yBounds.y, _scaledStep);
+  double topMostY = _yBounds.y - std::fmod(_yBounds.y, GetYStep());
+  // Stretched Y step needs its own number of digits
+  int yPrecision = std::max(
+    0, static_cast<int>(_gridLabelTextPrecision) - std::ilogb(_yStretch));
   // Draw unit labels on vertical grid lines
-  linePos = LogicalToScreen({ static_cast<float>(_size.x), topMostY }).y +
-            _verticalLabelsOffsetY;
+  epsilon = GetYStep() / 2;
+  linePos =
+    LogicalToScreen({ _xBounds.x, topMostY }).y + _verticalLabelsOffsetY;
   while (linePos < _size.y) {
     // do not draw 0 label on Y axis if Y axis is visible
     if (!_yAxisVisible && fabs(topMostY) < epsilon) {
       // Move to other grid line
       linePos += _scaledPixelsPerUnit;
-      topMostY -= _scaledStep;
+      topMostY -= GetYStep();
       ++i;
       continue;
     }
@@ -273,7 +395,7 @@ Graph::DrawLabels()
     int chars = snprintf(_gridLabelBuf,
                          sizeof(_gridLabelBuf),
                          _unitLabelPattern.c_str(),
-                         _gridLabelTextPrecision,
+                         yPrecision,
                          topMostY);
 
     float offsetX = chars * _fontSymbolWidth;
@@ -284,17 +406,65 @@ Graph::DrawLabels()
 
     // Move to other grid line
     linePos += _scaledPixelsPerUnit;
-    topMostY -= _scaledStep;
+    topMostY -= GetYStep();
     ++i;
   }
 }
 
+void
+Graph::DrawFeatures(const std::vector<Feature>& features)
+{
+  size_t labels = 0;
+  for (auto& feature : features) {
+    sf::Vector2f pos = LogicalToScreen({ feature.x, feature.y });
+    if (pos.x < 0 || pos.y < 0 || pos.x > _size.x || pos.y > _size.y)
+      continue;
+
+    // Roots are marked with curve color, extrema are hollow, intersections
+    // are filled with axis color
+    switch (feature.kind) {
+      case FeatureKind::Root:
+        _featureMarker.setFillColor(_graphColor);
+        break;
+      case FeatureKind::Minimum:
+      case FeatureKind::Maximum:
+        _featureMarker.setFillColor(sf::Color::White);
+        break;
+      case FeatureKind::Intersection:
+        _featureMarker.setFillColor(_axisColor);
+        break;
+    }
+    _featureMarker.setPosition(pos);
+    _backBuffer.draw(_featureMarker);
+
+    if (labels == FEATURE_MAX_LABELS)
+      continue;
+    // Label is placed above marker, or below it for minimum
+    char buf[64];
+    snprintf(buf,
+             sizeof(buf),
+             "(%.*g; %.*g)",
+             FEATURE_LABEL_DIGITS,
+             feature.x,
+             FEATURE_LABEL_DIGITS,
+             feature.y);
+    float offsetY = feature.kind == FeatureKind::Minimum
+                      ? FEATURE_MARKER_RADIUS
+                      : -FEATURE_MARKER_RADIUS - _fontSymbolHeight * 2;
+    _featureLabel.setString(buf);
+    _featureLabel.setPosition({ std::round(pos.x + FEATURE_MARKER_RADIUS),
+                                std::round(pos.y + offsetY) });
+    _backBuffer.draw(_featureLabel);
+    ++labels;
+  }
+}
+
 void
 Graph::Move(sf::Vector2i move)
 {
   std::lock_guard<std::mutex> lock(_bufferMutex);
-  float xMove = move.x * _scaledStep / _scaledPixelsPerUnit;
-  float yMove = move.y * _scaledStep / _scaledPixelsPerUnit;
+  double xMove = move.x * _scaledStep / _scaledPixelsPerUnit;
+  double yMove = move.y * GetYStep() / _scaledPixelsPerUnit;
   _xBounds.x += xMove;
   _xBounds.y += xMove;
   _yBounds.x += yMove;
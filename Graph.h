@@ -3,6 +3,14 @@
 #include <SFML/Graphics.hpp>
 #include <mutex>
 
+// Point of logical plane. View is kept in doubles, so that deep zoom neither
+// quantizes bounds nor makes them jitter. View origin and X of points stay
+// doubles though, so positions are resolved only to ulp of X: near x = 1e3,
+// whose ulp is about 1.1e-13, at 1e12 times zoom neighbour doubles are about
+// 9 pixels apart, and curve is drawn as steps of that width. Y values there
+// are still evaluated at exact lattice points in double-double precision
+using Vector2d = sf::Vector2<double>;
+
 class Graph
 {
 public:
@@ -16,7 +24,7 @@ public:
     return sf::Sprite(_frontBuffer.getTexture());
   }
 
-  inline sf::Vector2f GetXBounds() const
+  inline Vector2d GetXBounds() const
   {
     std::lock_guard<std::mutex> lock(_bufferMutex);
     return _xBounds;
@@ -24,11 +32,11 @@ public:
 
   inline void ResetScale()
   {
+    _yStretch = 1.0;
     SetScale(_baseScale);
-    _gridLabelTextPrecision = 0;
   }
 
-  inline float GetScale() { return _scale; }
+  inline double GetScale() { return _scale; }
 
   inline sf::Vector2u GetSize() { return _size; }
 
@@ -40,30 +48,52 @@ public:
 
   inline uint GetPrecision() { return _gridLabelTextPrecision; }
 
-  void SetScale(float scale);
+  void SetScale(double scale);
 
   void Resize(sf::Vector2u size);
 
-  void Draw(std::vector<Point>& points, size_t count);
+  // Fit visible Y range to [min;max], centering it and changing Y grid step
+  // by powers of two relative to X one
+  void FitY(double min, double max);
+
+  // Draw graph of points. Family curves, if given, are drawn under it in
+  // single batch with given opacity, so that dense regions look darker.
+  // Overlays are drawn in another batch, each with its own color. Features
+  // are marked over all curves and labeled with their coordinates. Floating
+  // points of cumulative integral are drawn pale
+  void Draw(std::vector<Point>& points,
+            size_t count,
+            const Point* family = nullptr,
+            size_t familyCount = 0,
+            uint8_t familyAlpha = 255,
+            const std::vector<Overlay>* overlays = nullptr,
+            const std::vector<Feature>* features = nullptr);
+
+  // Get color of overlay with given index
+  static sf::Color GetOverlayColor(size_t index);
 
   // "Move" view by given vector in pixels
   void Move(sf::Vector2i move);
 
-  // Convert logical point to point on screen
-  sf::Vector2f LogicalToScreen(const sf::Vector2f point);
+  // Convert logical point to point on screen. Offset from top-left corner of
+  // view is found in doubles, so that only pixels within screen are rounded to
+  // floats of vertices
+  sf::Vector2f LogicalToScreen(const Vector2d& point);
 
   // Convert point on screen to logical point
-  sf::Vector2f ScreenToLogical(const sf::Vector2i& point);
+  Vector2d ScreenToLogical(const sf::Vector2i& point);
 
 private:
   Graph() = delete;
   Graph(const Graph&) = delete;
-  float _scale = 1.0f;
-  float _baseScale = 1.0f;
+  double _scale = 1.0;
+  double _baseScale = 1.0;
   uint _pixelsPerUnit;
   uint _scaledPixelsPerUnit;
-  float _baseStep = 1.0f;
-  float _scaledStep = 1.0f;
+  double _baseStep = 1.0;
+  double _scaledStep = 1.0;
+  // Ratio of Y grid step to X one, which is power of two
+  double _yStretch = 1.0;
   float _axisLineThickness = 4.0f;
   // Width of font symbol glyph
   float _fontSymbolWidth;
@@ -76,7 +106,7 @@ private:
   // Is Y axis visible on screen
   bool _yAxisVisible;
   // Buffer for formatted grid unit value
-  char _gridLabelBuf[32];
+  char _gridLabelBuf[64];
   // Width of grid unit text, assuming negative number
   uint _gridLabelTextPrecision = 0;
   // Adjustment offset for labels on horizontal lines
@@ -88,11 +118,11 @@ private:
   // Size of graph area
   sf::Vector2u _size;
   // Vector of minimal and maximal visible X of graph
-  sf::Vector2f _xBounds;
+  Vector2d _xBounds;
   // Vector of minimal and maximal visible Y of graph
-  sf::Vector2f _yBounds;
+  Vector2d _yBounds;
   // Current pivot point (scaling is done based on it)
-  sf::Vector2f _pivotPoint;
+  Vector2d _pivotPoint;
   sf::Vector2i _pivotPointScreen;
   sf::RenderTexture _frontBuffer;
   sf::RenderTexture _backBuffer;
@@ -103,16 +133,30 @@ private:
   sf::Color _graphColor;
   sf::Color _gridColor;
   sf::Color _axisColor;
+  sf::Color _familyColor;
+  // Color of graph lines, which are known only up to constant offset
+  sf::Color _floatingColor;
   // Array of function graph vertices
   sf::VertexArray _vertices;
+  // Segments of all family curves
+  sf::VertexArray _familyVertices;
+  // Segments of all overlay curves
+  sf::VertexArray _overlayVertices;
   // Array of grid lines vertices
   sf::VertexArray _gridVerticesArray;
   // Sample label, which is used for resizing vector of grid labels
   sf::Text _sampleUnitLabel;
   // Grid unit labels vector
   std::vector<sf::Text> _gridLabels;
+  // Marker and coordinates label of feature
+  sf::CircleShape _featureMarker;
+  sf::Text _featureLabel;
+
+  // Get logical step between horizontal grid lines
+  inline double GetYStep() const { return _scaledStep * _yStretch; }
 
   void DrawGrid();
   void DrawAxisLines();
   void DrawLabels();
+  void DrawFeatures(const std::vector<Feature>& features);
 };
\ No newline at end of file
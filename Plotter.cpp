@@ -3,6 +3,7 @@
 #include "Expression.h"
 #include "RobotoMono_font.h"
 #include "Roboto_font.h"
+#include <algorithm>
 #include <atomic>
 #include <chrono>
 #include <imgui-SFML.h>
@@ -12,6 +13,19 @@
 #include <mutex>
 #include <thread>
 
+// Range of parameter sliders and initial parameter value
+#define PARAMETER_MIN -10.0f
+#define PARAMETER_MAX 10.0f
+#define PARAMETER_DEFAULT 1.0f
+// Initial and maximal number of family curves
+#define FAMILY_DEFAULT_SIZE 64
+#define FAMILY_MAX_SIZE 1024
+// Sum of opacities of all family curves with density shading
+#define FAMILY_DENSITY 2048
+// Spinner frames shown while symbolic job runs, and their rate per second
+#define JOB_SPINNER "|/-\\"
+#define JOB_SPINNER_RATE 8
+
 Plotter::Plotter(sf::Vector2u size, sf::Vector2f center)
   : _window(sf::RenderWindow(sf::VideoMode(size), "Plotter"))
   , _graph(size, center)
@@ -23,13 +37,23 @@ Plotter::Plotter(sf::Vector2u size, sf::Vector2f center)
 
   _mousePressed = false;
   _integrateNumeric = false;
+  _plotAntiderivative = false;
+  _analysis = false;
+  _autoscale = false;
   _cursorLogicalPosition = { 0, 0 };
   _calcNeeded = false;
   _pointsAvailable = false;
   _calcCancelled = false;
-  _numericResult = 0;
+  _numericResult = { 0, 0, 0, true };
+  _integrationTolerance = QUAD_DEFAULT_TOLERANCE;
+  _integrationBudget = QUAD_DEFAULT_MAX_EVALUATIONS;
   _lowerBound = 0;
   _upperBound = 0;
+  _familySize = FAMILY_DEFAULT_SIZE;
+  _familyShading = true;
+  _jobSetsInput = false;
+  _jobTimeLimit = JOB_DEFAULT_TIME_LIMIT;
+  _jobSizeLimit = JOB_DEFAULT_SIZE_LIMIT;
 
   // Set more neater font
   ImFontConfig fontCfg;
@@ -44,11 +68,15 @@ Plotter::Plotter(sf::Vector2u size, sf::Vector2f center)
   io.IniFilename = nullptr;
   io.LogFilename = nullptr;
 
+  // Closing window doesn't wait for workers stuck in GiNaC evaluation
+  ExprLib::SetCancelFlag(&_calcCancelled);
+
   // Set example expression
   std::unique_ptr<Expression> expr =
     ExprLib::CreateExpression("sqrt(x)", { "x" });
   ExprLib::SetExpression(std::move(expr));
   _exprStr = ExprLib::GetCurrentExpressionString();
+  UpdateParameters();
 
   _window.setFramerateLimit(60);
 }
@@ -123,12 +151,12 @@ Plotter::OnMouseRelease(const sf::Mouse::Button& button)
 void
 Plotter::OnMouseScroll(const sf::Vector2i& position, const float& delta)
 {
-  float scale = _graph.GetScale();
+  double scale = _graph.GetScale();
   _graph.SetPivotPoint(position);
   if (delta < 0)
-    _graph.SetScale(scale / 1.1f);
+    _graph.SetScale(scale / 1.1);
   else if (delta > 0)
-    _graph.SetScale(scale * 1.1f);
+    _graph.SetScale(scale * 1.1);
 }
 
 void
@@ -175,7 +203,22 @@ Plotter::Render()
   // Draw graph if points are available
   std::lock_guard<std::mutex> _lock(_graphMutex);
   // Get graph texture
-  _graph.Draw(ExprLib::GetPoints(), ExprLib::GetPointsCount());
+  int familyAlpha = FAMILY_DENSITY / std::max(1, _familySize);
+  if (!_familyShading)
+    familyAlpha = 255;
+  if (_autoscale) {
+    Vector2d xBounds = _graph.GetXBounds();
+    std::optional<Interval> yRange = ExprLib::GetYRange(xBounds.x, xBounds.y);
+    if (yRange)
+      _graph.FitY(yRange->from, yRange->to);
+  }
+  _graph.Draw(ExprLib::GetPoints(),
+              ExprLib::GetPointsCount(),
+              ExprLib::GetFamilyPoints().data(),
+              ExprLib::GetFamilyPointsCount(),
+              std::clamp(familyAlpha, 8, 255),
+              &ExprLib::GetOverlays(),
+              &ExprLib::GetFeatures());
   // Get graph size
   sf::Vector2u graphSize = _graph.GetSize();
   // Set window view that way so we can draw graph correctly
@@ -202,27 +245,26 @@ Plotter::DrawGUI()
   ImGui::SetNextWindowPos({ 0, 0 }, ImGuiCond_Always);
   ImGui::Begin("##guiPanel", nullptr, flags);
 
-  bool openPopup = false;
+  bool openPopup = FinishJob();
+  JobBudget budget = { _jobTimeLimit,
+                       static_cast<size_t>(std::max(1, _jobSizeLimit)) };
 
   if (ImGui::BeginTable("##table", 1)) {
     float spacing = ImGui::GetStyle().ItemSpacing.x;
 
     ImGui::TableNextColumn();
 
-    if (ImGui::Button("Build graph!##exprButton")) {
+    // Symbolic operations run in job, one at a time, so buttons starting them
+    // do nothing while job runs
+    if (ImGui::Button("Build graph!##exprButton") && !_job) {
       if (_exprStr[0] != '\0') {
-        // Try to create new expression out of input string
-        std::unique_ptr<Expression> expr =
-          ExprLib::CreateExpression(_exprStr, { "x" });
-        if (expr != nullptr) {
-          // If expressions are syntactically not equal, then add set new
-          // expression
-          if (!ExprLib::CompareWithCurrentExpr(expr->GetExpressionString()))
-            ExprLib::SetExpression(std::move(expr));
-        } else {
-          _error = ExprLib::GetLastError();
-          openPopup = true;
-        }
+        // Try to create new expression out of input string, symbols other
+        // than x are parameters
+        std::vector<std::string> variables = { "x" };
+        for (auto& name : Expression::FindParameters(_exprStr, "x"))
+          variables.push_back(name);
+        _job = ExprLib::CreateExpressionAsync(_exprStr, variables, budget);
+        _jobSetsInput = false;
       } else {
         _error = "Empty expression!";
         openPopup = true;
@@ -240,21 +282,18 @@ Plotter::DrawGUI()
                              this);
 
     ImGui::SameLine(0, spacing);
-    if (ImGui::Button("Derivate##derivateButton")) {
+    if (ImGui::Button("Derivate##derivateButton") && !_job) {
       if (_integrationVariable.empty()) {
         _error = "variable not set";
         openPopup = true;
       } else {
         // Try to derivate current expression by X variable and set derived
-        // expression as current, this sometimes may fail if derivation is too
-        // computationally complex
-        std::unique_ptr<Expression> expr =
-          ExprLib::CreateDerivative(_integrationVariable);
-        if (expr != nullptr) {
-          ExprLib::SetExpression(std::move(expr));
-          _exprStr = ExprLib::GetCurrentExpressionString();
-        } else {
-          _error = ExprLib::GetLastError();
+        // expression as current, derivation which is too computationally
+        // complex is stopped by budget
+        _job = ExprLib::CreateDerivativeAsync(_integrationVariable, budget);
+        _jobSetsInput = true;
+        if (!_job) {
+          _error = "Build graph first!";
           openPopup = true;
         }
       }
@@ -271,13 +310,37 @@ Plotter::DrawGUI()
     if (ImGui::IsItemHovered())
       ImGui::SetTooltip("Integration/differentiation variable");
 
+    ImGui::SameLine(0, spacing);
+    if (ImGui::Button("Pin##pinButton"))
+      ExprLib::AddOverlay();
+    if (ImGui::IsItemHovered())
+      ImGui::SetTooltip("Keep current function plotted");
+
     ImGui::TableNextRow();
     ImGui::TableSetColumnIndex(0);
     ImGui::Checkbox("Numeric integration##integrateNumericCheckbox",
                     &_integrateNumeric);
 
     ImGui::SameLine(0.0f, spacing);
-    if (ImGui::Button("Integrate##integrateButton")) {
+    if (ImGui::Checkbox("F(x)##antiderivativeCheckbox", &_plotAntiderivative))
+      ExprLib::SetAntiderivativeMode(_plotAntiderivative, _lowerBound);
+    if (ImGui::IsItemHovered())
+      ImGui::SetTooltip("Plot integral of current function from x1");
+
+    ImGui::SameLine(0.0f, spacing);
+    ImGui::Checkbox("Fit Y##autoscaleCheckbox", &_autoscale);
+    if (ImGui::IsItemHovered())
+      ImGui::SetTooltip("Keep visible part of function fitted vertically");
+
+    ImGui::SameLine(0.0f, spacing);
+    if (ImGui::Checkbox("Features##analysisCheckbox", &_analysis))
+      ExprLib::SetAnalysis(_analysis);
+    if (ImGui::IsItemHovered())
+      ImGui::SetTooltip("Mark roots, extrema and intersections with pinned "
+                        "functions");
+
+    ImGui::SameLine(0.0f, spacing);
+    if (ImGui::Button("Integrate##integrateButton") && !_job) {
       if (_integrationVariable.empty()) {
         _error = "variable not set";
         openPopup = true;
@@ -285,17 +348,11 @@ Plotter::DrawGUI()
         if (!_integrateNumeric) {
           // Try to integrate current expression by X with constant C set as 0.
           // This will fail if current expression is not a polynomial
-          std::unique_ptr<Expression> expr =
-            ExprLib::CreateAntiderivative(_integrationVariable, 0);
-          if (expr != nullptr) {
-            ExprLib::SetExpression(std::move(expr));
-            _exprStr = ExprLib::GetCurrentExpressionString();
-          } else {
-            _error = ExprLib::GetLastError();
-            openPopup = true;
-          }
+          _job =
+            ExprLib::CreateAntiderivativeAsync(_integrationVariable, 0, budget);
+          _jobSetsInput = true;
         } else {
-          float parsed = 0;
+          double parsed = 0;
           char* endptr = nullptr;
 
           // Try to parse x1 (lower bound)
@@ -315,14 +372,19 @@ Plotter::DrawGUI()
             _upperBound = parsed;
           }
 
-          std::optional<double> res =
-            ExprLib::CalculateIntegral("x", _lowerBound, _upperBound);
-          if (res.has_value()) {
-            _numericResult = res.value();
-          } else {
-            _error = ExprLib::GetLastError();
-            openPopup = true;
-          }
+          ExprLib::SetAntiderivativeMode(_plotAntiderivative, _lowerBound);
+
+          _job =
+            ExprLib::CalculateIntegralAsync("x",
+                                            _lowerBound,
+                                            _upperBound,
+                                            _integrationTolerance,
+                                            std::max(1, _integrationBudget),
+                                            budget);
+        }
+        if (!_job) {
+          _error = "Build graph first!";
+          openPopup = true;
         }
       }
     }
@@ -366,9 +428,139 @@ Plotter::DrawGUI()
 
       ImGui::SetNextItemWidth(third - ImGui::CalcTextSize("x2:").x - spacing);
       ImGui::SameLine(0.0f, spacing);
-      ImGui::Text("I = %f", _numericResult);
+      ImGui::Text("I = %f", _numericResult.value);
+
+      ImGui::TableNextRow();
+      ImGui::TableSetColumnIndex(0);
+
+      ImGui::TextUnformatted("tol:");
+      ImGui::SetNextItemWidth(third - ImGui::CalcTextSize("tol:").x - spacing);
+      ImGui::SameLine(0.0f, spacing);
+      ImGui::InputDouble("##toleranceInput",
+                         &_integrationTolerance,
+                         0.0,
+                         0.0,
+                         "%.1e",
+                         ImGuiInputTextFlags_CharsScientific);
+      if (ImGui::IsItemHovered())
+        ImGui::SetTooltip("Requested integration error");
+
+      ImGui::SameLine(0.0f, spacing);
+      ImGui::TextUnformatted("max:");
+      ImGui::SetNextItemWidth(third - ImGui::CalcTextSize("max:").x - spacing);
+      ImGui::SameLine(0.0f, spacing);
+      ImGui::InputInt("##budgetInput", &_integrationBudget, 0);
+      if (ImGui::IsItemHovered())
+        ImGui::SetTooltip("Maximal number of function evaluations");
+
+      ImGui::SameLine(0.0f, spacing);
+      ImGui::TextColored(_numericResult.converged
+                           ? ImVec4(1.0f, 1.0f, 1.0f, 1.0f)
+                           : ImVec4(1.0f, 0.5f, 0.0f, 1.0f),
+                         "err = %.1e (%zu evals)",
+                         _numericResult.error,
+                         _numericResult.evaluations);
     }
 
+    // Dragging slider reevaluates only part of expression depending on it
+    for (size_t i = 0; i < _parameterNames.size(); ++i) {
+      const std::string& name = _parameterNames[i];
+      if (i % 3 == 0) {
+        ImGui::TableNextRow();
+        ImGui::TableSetColumnIndex(0);
+      } else {
+        ImGui::SameLine(0.0f, spacing);
+      }
+
+      ImGui::SetNextItemWidth(150.0f);
+      if (ImGui::SliderFloat((name + "##parameterSlider").c_str(),
+                             &_parameterValues[name],
+                             PARAMETER_MIN,
+                             PARAMETER_MAX))
+        ExprLib::SetParameter(name, _parameterValues[name]);
+
+      ImGui::SameLine(0.0f, spacing);
+      bool sweep = _familyParameter == name;
+      if (ImGui::Checkbox(("##familyCheckbox" + name).c_str(), &sweep)) {
+        _familyParameter = sweep ? name : "";
+        UpdateFamily();
+      }
+      if (ImGui::IsItemHovered())
+        ImGui::SetTooltip("Plot family of curves over whole slider range");
+    }
+
+    if (!_familyParameter.empty()) {
+      ImGui::TableNextRow();
+      ImGui::TableSetColumnIndex(0);
+
+      ImGui::TextUnformatted("curves:");
+      ImGui::SetNextItemWidth(100.0f);
+      ImGui::SameLine(0.0f, spacing);
+      if (ImGui::InputInt("##familySizeInput", &_familySize)) {
+        _familySize = std::clamp(_familySize, 1, FAMILY_MAX_SIZE);
+        UpdateFamily();
+      }
+
+      ImGui::SameLine(0.0f, spacing);
+      ImGui::Checkbox("Density##familyShadingCheckbox", &_familyShading);
+      if (ImGui::IsItemHovered())
+        ImGui::SetTooltip("Draw curves translucent to show their density");
+    }
+
+    // Pinned functions in their colors, removed by their buttons
+    const std::vector<Overlay>& overlays = ExprLib::GetOverlays();
+    for (size_t k = 0; k < overlays.size(); ++k) {
+      ImGui::TableNextRow();
+      ImGui::TableSetColumnIndex(0);
+
+      if (ImGui::Button(("x##removeOverlayButton" + std::to_string(k)).c_str()))
+        ExprLib::RemoveOverlay(k);
+      if (ImGui::IsItemHovered())
+        ImGui::SetTooltip("Stop plotting this function");
+
+      // Removed overlay isn't shown anymore
+      if (k >= overlays.size())
+        break;
+      sf::Color color = Graph::GetOverlayColor(k);
+      ImGui::SameLine(0.0f, spacing);
+      ImGui::TextColored(
+        ImVec4(color.r / 255.0f, color.g / 255.0f, color.b / 255.0f, 1.0f),
+        "%s",
+        overlays[k].expr->GetExpressionString().c_str());
+    }
+
+    ImGui::TableNextRow();
+    ImGui::TableSetColumnIndex(0);
+
+    if (_job) {
+      double elapsed = _job->GetElapsed();
+      int frame = static_cast<int>(elapsed * JOB_SPINNER_RATE) %
+                  (sizeof(JOB_SPINNER) - 1);
+      ImGui::PushFont(ImGui::GetIO().Fonts->Fonts[2]);
+      ImGui::Text("%c %.1f s", JOB_SPINNER[frame], elapsed);
+      ImGui::PopFont();
+
+      ImGui::SameLine(0.0f, spacing);
+      if (ImGui::Button("Cancel##cancelJobButton"))
+        _job->Cancel();
+      ImGui::SameLine(0.0f, spacing);
+    }
+
+    ImGui::TextUnformatted("limit, s:");
+    ImGui::SetNextItemWidth(60.0f);
+    ImGui::SameLine(0.0f, spacing);
+    ImGui::InputDouble("##jobTimeInput", &_jobTimeLimit, 0.0, 0.0, "%.1f");
+    if (ImGui::IsItemHovered())
+      ImGui::SetTooltip("Time after which symbolic operation is aborted");
+
+    ImGui::SameLine(0.0f, spacing);
+    ImGui::TextUnformatted("size:");
+    ImGui::SetNextItemWidth(100.0f);
+    ImGui::SameLine(0.0f, spacing);
+    ImGui::InputInt("##jobSizeInput", &_jobSizeLimit, 0);
+    if (ImGui::IsItemHovered())
+      ImGui::SetTooltip("Maximal length of symbolic operation result");
+
     ImGui::EndTable();
   }
 
@@ -402,6 +594,64 @@ Plotter::DrawGUI()
   ImGui::PopFont();
 }
 
+bool
+Plotter::FinishJob()
+{
+  if (!_job || _job->IsRunning())
+    return false;
+
+  std::shared_ptr<SymbolicJob> job = std::move(_job);
+  _job = nullptr;
+  if (job->GetState() == SymbolicJob::State::Cancelled)
+    return false;
+
+  if (job->GetState() != SymbolicJob::State::Done) {
+    _error = job->GetError();
+    return true;
+  }
+
+  JobResult& result = job->GetResult();
+  if (!result.expression) {
+    _numericResult = result.integral;
+    return false;
+  }
+
+  // Built expression structurally equal to current one isn't set again
+  if (_jobSetsInput || !ExprLib::CompareWithCurrentExpr(*result.expression))
+    ExprLib::SetExpression(std::move(result.expression));
+  if (_jobSetsInput)
+    _exprStr = ExprLib::GetCurrentExpressionString();
+  UpdateParameters();
+  return false;
+}
+
+void
+Plotter::UpdateParameters()
+{
+  _parameterNames = Expression::FindParameters(_exprStr, "x");
+  for (auto& name : _parameterNames) {
+    auto param = _parameterValues.emplace(name, PARAMETER_DEFAULT).first;
+    ExprLib::SetParameter(name, param->second);
+  }
+
+  // Family of parameter which expression doesn't have anymore is dropped
+  if (std::find(_parameterNames.begin(),
+                _parameterNames.end(),
+                _familyParameter) == _parameterNames.end()) {
+    _familyParameter.clear();
+    UpdateFamily();
+  }
+}
+
+void
+Plotter::UpdateFamily()
+{
+  ExprLib::SetFamily(_familyParameter,
+                     PARAMETER_MIN,
+                     PARAMETER_MAX,
+                     _familyParameter.empty() ? 0 : _familySize);
+}
+
 void
 Plotter::CalculatorThread()
 {
@@ -411,7 +661,7 @@ Plotter::CalculatorThread()
       // We use same mutex to lock different logic because here we reading
       // shared bounds, and in graph Resize() we write to this bounds
       std::lock_guard<std::mutex> _lock(_graphMutex);
-      sf::Vector2f xBounds = _graph.GetXBounds();
+      Vector2d xBounds = _graph.GetXBounds();
       ExprLib::CalculateExpression(xBounds.x, xBounds.y);
       _pointsAvailable.store(true, std::memory_order_release);
     }
@@ -427,11 +677,13 @@ Plotter::ExprInputHistoryCallback(ImGuiInputTextCallbackData* data)
     if (data->EventKey == ImGuiKey_UpArrow) {
       ExprLib::UndoSetExpression();
       plotter->_exprStr = ExprLib::GetCurrentExpressionString();
+      plotter->UpdateParameters();
       data->DeleteChars(0, data->BufTextLen);
       data->InsertChars(0, plotter->_exprStr.c_str());
     } else if (data->EventKey == ImGuiKey_DownArrow) {
       ExprLib::RedoSetExpression();
       plotter->_exprStr = ExprLib::GetCurrentExpressionString();
+      plotter->UpdateParameters();
       data->DeleteChars(0, data->BufTextLen);
       data->InsertChars(0, plotter->_exprStr.c_str());
     }
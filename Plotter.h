@@ -1,8 +1,11 @@
 #pragma once
 #include "Graph.h"
+#include "Quadrature.h"
+#include "SymbolicJob.h"
 #include <SFML/Graphics.hpp>
 #include <atomic>
 #include <imgui.h>
+#include <map>
 #include <mutex>
 #include <sys/types.h>
 
@@ -24,7 +27,7 @@ private:
   // Graph position offset relative to window
   sf::Vector2f _graphOffset;
   // Mouse pointer position in graph
-  sf::Vector2f _cursorLogicalPosition;
+  Vector2d _cursorLogicalPosition;
   // If calculation of points needed
   std::atomic_bool _calcNeeded;
   // If points calculated are available
@@ -45,17 +48,53 @@ private:
   std::string _integrationVariable;
   // "Numeric integration" checkbox value
   bool _integrateNumeric;
-  // Lower bound for numeric integration
-  float _lowerBound;
+  // "F(x)" checkbox value, if cumulative integral is plotted
+  bool _plotAntiderivative;
+  // "Features" checkbox value, if roots, extrema and intersections are marked
+  bool _analysis;
+  // "Fit Y" checkbox value, if visible Y range follows visible curve
+  bool _autoscale;
+  // Lower bound for numeric integration, may be infinite
+  double _lowerBound;
   // Upper bound
-  float _upperBound;
+  double _upperBound;
   // Numeric integration result
-  double _numericResult;
+  IntegrationResult _numericResult;
+  // Requested numeric integration error
+  double _integrationTolerance;
+  // Maximal number of integrand evaluations
+  int _integrationBudget;
+  // Names of current expression parameters, which are bound to sliders
+  std::vector<std::string> _parameterNames;
+  // Slider values of all parameters ever seen, kept when expression changes
+  std::map<std::string, float> _parameterValues;
+  // Parameter swept by family of curves over whole slider range, empty if
+  // family isn't plotted
+  std::string _familyParameter;
+  // Number of family curves
+  int _familySize;
+  // "Density" checkbox value, if family curves are translucent
+  bool _familyShading;
+  // Symbolic operation running in background, null if there is none
+  std::shared_ptr<SymbolicJob> _job;
+  // If expression of job replaces input string when it's done
+  bool _jobSetsInput;
+  // Seconds after which symbolic job is aborted
+  double _jobTimeLimit;
+  // Maximal length of symbolic job result
+  int _jobSizeLimit;
 
   void ProcessEvents(sf::Clock& clock);
   void Render();
   void DrawGUI();
   void CalculatorThread();
+  // Find parameters of current expression string and pass their values
+  void UpdateParameters();
+  // Pass family settings to calculator
+  void UpdateFamily();
+  // Take result of symbolic job if it's done. Returns true if job failed and
+  // its error is set to be shown
+  bool FinishJob();
 
   void OnWindowClose();
   void OnKeyPress(const sf::Event::KeyPressed& event);
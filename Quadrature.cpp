@@ -0,0 +1,425 @@
+#include "Quadrature.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <queue>
+
+// Number of Kronrod nodes in every segment
+#define QUAD_NODES 15
+// Number of segments split at once per evaluating thread
+#define QUAD_SPLITS_PER_THREAD 4
+// Minimal number of points worth evaluating in separate thread
+#define QUAD_MIN_POINTS_PER_THREAD 120
+// Step of first level of double exponential rule, halved on every next level
+#define QUAD_DE_STEP 0.5
+// Maximal number of double exponential rule levels
+#define QUAD_DE_MAX_LEVEL 10
+// Range of substituted variable for tanh-sinh, beyond it points are rounded to
+// bounds of integration
+#define QUAD_DE_TANH_SINH_RANGE 4.0
+// Range of substituted variable for exp-sinh and sinh-sinh
+#define QUAD_DE_SINH_RANGE 4.5
+// Integrand failures further than that from zero of substituted variable cut
+// off tail of the rule instead of failing integration
+#define QUAD_DE_TAIL 1.0
+
+// Number of Gauss-Legendre nodes in every panel
+#define QUAD_PANEL_NODES 5
+
+// Gauss-Legendre nodes on [-1;1] and their weights
+static const double PANEL_NODES[QUAD_PANEL_NODES] = { -0.906179845938663993,
+                                                      -0.538469310105683091,
+                                                      0.0,
+                                                      0.538469310105683091,
+                                                      0.906179845938663993 };
+
+static const double PANEL_WEIGHTS[QUAD_PANEL_NODES] = { 0.236926885056189088,
+                                                        0.478628670499366468,
+                                                        0.568888888888888889,
+                                                        0.478628670499366468,
+                                                        0.236926885056189088 };
+
+// Substitutions of double exponential rules
+enum class Substitution
+{
+  // Both bounds are finite
+  TanhSinh,
+  // Upper bound is infinite
+  ExpSinhUpper,
+  // Lower bound is infinite
+  ExpSinhLower,
+  // Both bounds are infinite
+  SinhSinh
+};
+
+// Get abscissa x and weight w of double exponential rule at point t
+static void
+SubstitutionNode(Substitution sub,
+                 double a,
+                 double b,
+                 double t,
+                 double& x,
+                 double& w)
+{
+  double u = M_PI_2 * std::sinh(t);
+  double du = M_PI_2 * std::cosh(t);
+
+  switch (sub) {
+    case Substitution::TanhSinh: {
+      // Distance to nearest bound is computed directly, so that points close
+      // to bounds don't lose precision
+      double distance = (b - a) / (1 + std::exp(2 * std::fabs(u)));
+      x = t > 0 ? b - distance : a + distance;
+      double c = std::cosh(u);
+      w = 0.5 * (b - a) * du / (c * c);
+      break;
+    }
+    case Substitution::ExpSinhUpper:
+      x = a + std::exp(u);
+      w = du * std::exp(u);
+      break;
+    case Substitution::ExpSinhLower:
+      x = b - std::exp(u);
+      w = du * std::exp(u);
+      break;
+    case Substitution::SinhSinh:
+      x = std::sinh(u);
+      w = du * std::cosh(u);
+      break;
+  }
+}
+
+// Kronrod nodes on [0;1], Gauss nodes are every second of them
+static const double KRONROD_NODES[8] = {
+  0.991455371120812639206854697526329, 0.949107912342758524526189684047851,
+  0.864864423359769072789712788640926, 0.741531185599394439863864773280788,
+  0.586087235467691130294144845693013, 0.405845151377397166906606412076961,
+  0.207784955007898467600689403773245, 0.000000000000000000000000000000000
+};
+
+static const double KRONROD_WEIGHTS[8] = {
+  0.022935322010529224963732008058970, 0.063092092629978553290700663189204,
+  0.104790010322250183839876322541518, 0.140653259715525918745189590510238,
+  0.169004726639267902826583426598550, 0.190350578064785409913256402421014,
+  0.204432940075298892414161999234649, 0.209482141084727828012999174891714
+};
+
+static const double GAUSS_WEIGHTS[4] = { 0.129484966168869693270611432679082,
+                                         0.279705391489276667901467771423780,
+                                         0.381830050505118944950369775488975,
+                                         0.417959183673469387755102040816327 };
+
+Quadrature::Quadrature(double tolerance, size_t maxEvaluations, uint nthreads)
+  : _tolerance(tolerance)
+  , _maxEvaluations(maxEvaluations)
+  , _nThreads(std::max(1u, nthreads))
+{
+}
+
+void
+Quadrature::EvaluateParallel(const Integrand& f,
+                             const double* xs,
+                             size_t n,
+                             double* ys,
+                             size_t granularity) const
+{
+  // Split points between threads of shared pool, which are started once
+  // instead of every refinement round. Caller evaluates its part too
+  ThreadPool& pool = ThreadPool::GetShared();
+  size_t nthreads = std::min<size_t>(
+    { _nThreads,
+      pool.GetThreadCount() + 1,
+      std::max<size_t>(1, n / QUAD_MIN_POINTS_PER_THREAD) });
+  size_t groups = (n + granularity - 1) / granularity;
+  size_t perThread = (groups + nthreads - 1) / nthreads * granularity;
+
+  pool.Run((n + perThread - 1) / perThread, [&](size_t part) {
+    size_t from = part * perThread;
+    f(xs + from, std::min(perThread, n - from), ys + from);
+  });
+}
+
+void
+Quadrature::EvaluateSegments(const Integrand& f,
+                             std::vector<Segment>& segments,
+                             std::vector<double>& xs,
+                             std::vector<double>& ys) const
+{
+  size_t n = segments.size() * QUAD_NODES;
+  xs.resize(n);
+  ys.resize(n);
+
+  // Nodes of segment go from left to right, center is 8th of them
+  for (size_t s = 0; s < segments.size(); ++s) {
+    double center = 0.5 * (segments[s].a + segments[s].b);
+    double half = 0.5 * (segments[s].b - segments[s].a);
+    double* x = xs.data() + s * QUAD_NODES;
+    for (int j = 0; j < 7; ++j) {
+      x[j] = center - half * KRONROD_NODES[j];
+      x[QUAD_NODES - 1 - j] = center + half * KRONROD_NODES[j];
+    }
+    x[7] = center;
+  }
+
+  EvaluateParallel(f, xs.data(), n, ys.data(), QUAD_NODES);
+
+  const double epsilon = std::numeric_limits<double>::epsilon();
+  for (size_t s = 0; s < segments.size(); ++s) {
+    Segment& seg = segments[s];
+    const double* y = ys.data() + s * QUAD_NODES;
+    double half = 0.5 * (seg.b - seg.a);
+
+    double kronrod = KRONROD_WEIGHTS[7] * y[7];
+    double gauss = GAUSS_WEIGHTS[3] * y[7];
+    double absolute = KRONROD_WEIGHTS[7] * std::fabs(y[7]);
+    for (int j = 0; j < 7; ++j) {
+      double left = y[j];
+      double right = y[QUAD_NODES - 1 - j];
+      kronrod += KRONROD_WEIGHTS[j] * (left + right);
+      absolute += KRONROD_WEIGHTS[j] * (std::fabs(left) + std::fabs(right));
+      if (j % 2 == 1)
+        gauss += GAUSS_WEIGHTS[j / 2] * (left + right);
+    }
+
+    // Same error estimate as in QUADPACK, based on difference between rules
+    // and deviation of integrand from its mean
+    double mean = 0.5 * kronrod;
+    double deviation = KRONROD_WEIGHTS[7] * std::fabs(y[7] - mean);
+    for (int j = 0; j < 7; ++j) {
+      double left = std::fabs(y[j] - mean);
+      double right = std::fabs(y[QUAD_NODES - 1 - j] - mean);
+      deviation += KRONROD_WEIGHTS[j] * (left + right);
+    }
+
+    seg.value = kronrod * half;
+    absolute *= std::fabs(half);
+    deviation *= std::fabs(half);
+
+    double error = std::fabs((kronrod - gauss) * half);
+    if (deviation != 0 && error != 0)
+      error = deviation * std::min(1.0, std::pow(200 * error / deviation, 1.5));
+    if (absolute > std::numeric_limits<double>::min() / (50 * epsilon))
+      error = std::max(50 * epsilon * absolute, error);
+    seg.error = error;
+  }
+}
+
+IntegrationResult
+Quadrature::Integrate(const Integrand& f, double a, double b) const
+{
+  if (a == b)
+    return { 0, 0, 0, true };
+
+  double sign = 1;
+  if (a > b) {
+    std::swap(a, b);
+    sign = -1;
+  }
+
+  std::vector<double> xs;
+  std::vector<double> ys;
+  std::vector<Segment> batch = { { a, b, 0, 0 } };
+  EvaluateSegments(f, batch, xs, ys);
+
+  IntegrationResult res = { batch[0].value, batch[0].error, QUAD_NODES, false };
+
+  auto lessError = [](const Segment& l, const Segment& r) {
+    return l.error < r.error;
+  };
+  std::priority_queue<Segment, std::vector<Segment>, decltype(lessError)>
+    queue(lessError);
+  queue.push(batch[0]);
+
+  // Segments, which can't be split further in double precision
+  std::vector<Segment> finished;
+
+  size_t maxSplits = _nThreads * QUAD_SPLITS_PER_THREAD;
+  while (std::isfinite(res.value) && !queue.empty()) {
+    if (res.error <= _tolerance * std::max(1.0, std::fabs(res.value))) {
+      res.converged = true;
+      break;
+    }
+
+    // Split worst segments, as long as their halves fit evaluation budget
+    batch.clear();
+    while (!queue.empty() && batch.size() < 2 * maxSplits &&
+           res.evaluations + (batch.size() + 2) * QUAD_NODES <=
+             _maxEvaluations) {
+      Segment seg = queue.top();
+      queue.pop();
+
+      double middle = 0.5 * (seg.a + seg.b);
+      if (middle <= seg.a || middle >= seg.b) {
+        finished.push_back(seg);
+        continue;
+      }
+
+      res.value -= seg.value;
+      res.error -= seg.error;
+      batch.push_back({ seg.a, middle, 0, 0 });
+      batch.push_back({ middle, seg.b, 0, 0 });
+    }
+
+    if (batch.empty())
+      break;
+
+    EvaluateSegments(f, batch, xs, ys);
+    res.evaluations += batch.size() * QUAD_NODES;
+    for (auto& seg : batch) {
+      res.value += seg.value;
+      res.error += seg.error;
+      queue.push(seg);
+    }
+  }
+
+  // Sum once more from scratch to get rid of accumulated rounding errors
+  if (std::isfinite(res.value)) {
+    res.value = 0;
+    res.error = 0;
+    for (; !queue.empty(); queue.pop())
+      finished.push_back(queue.top());
+    for (auto& seg : finished) {
+      res.value += seg.value;
+      res.error += seg.error;
+    }
+    res.converged =
+      res.error <= _tolerance * std::max(1.0, std::fabs(res.value));
+  }
+
+  res.value *= sign;
+  return res;
+}
+
+IntegrationResult
+Quadrature::IntegrateDoubleExponential(const Integrand& f,
+                                       double a,
+                                       double b) const
+{
+  if (a == b)
+    return { 0, 0, 0, true };
+
+  double sign = 1;
+  if (a > b) {
+    std::swap(a, b);
+    sign = -1;
+  }
+
+  Substitution sub = Substitution::SinhSinh;
+  if (std::isfinite(a) && std::isfinite(b))
+    sub = Substitution::TanhSinh;
+  else if (std::isfinite(a))
+    sub = Substitution::ExpSinhUpper;
+  else if (std::isfinite(b))
+    sub = Substitution::ExpSinhLower;
+
+  double range = sub == Substitution::TanhSinh ? QUAD_DE_TANH_SINH_RANGE
+                                               : QUAD_DE_SINH_RANGE;
+  // Exclusive range of t, narrowed when integrand fails in tails
+  double tLower = -range - QUAD_DE_STEP;
+  double tUpper = range + QUAD_DE_STEP;
+
+  std::vector<double> ts;
+  std::vector<double> xs;
+  std::vector<double> ws;
+  std::vector<double> ys;
+
+  IntegrationResult res = { std::nan(""), INFINITY, 0, false };
+  // Weighted integrand values in all points of all levels with their t. Every
+  // level adds points in the middle between previous ones, so that all of them
+  // are reused
+  std::vector<std::pair<double, double>> terms;
+  double step = QUAD_DE_STEP;
+
+  for (int level = 0; level <= QUAD_DE_MAX_LEVEL; ++level) {
+    ts.clear();
+    xs.clear();
+    ws.clear();
+
+    // First level takes all multiples of step, next ones only odd multiples
+    long last = static_cast<long>(range / step);
+    long increment = level == 0 ? 1 : 2;
+    for (long j = level == 0 ? -last : -last | 1; j <= last; j += increment) {
+      double t = j * step;
+      if (t <= tLower || t >= tUpper)
+        continue;
+
+      double x, w;
+      SubstitutionNode(sub, a, b, t, x, w);
+      // Points rounded to bounds are skipped, integrand may be singular there
+      if (!(x > a && x < b) || !std::isfinite(w) || w == 0)
+        continue;
+
+      ts.push_back(t);
+      xs.push_back(x);
+      ws.push_back(w);
+    }
+
+    if (res.evaluations + xs.size() > _maxEvaluations)
+      break;
+
+    ys.resize(xs.size());
+    EvaluateParallel(f, xs.data(), xs.size(), ys.data(), 1);
+    res.evaluations += xs.size();
+
+    // Failures far in tails mean that integrand overflows there, while true
+    // contribution of tail is negligible, so rest of tail is dropped
+    for (size_t i = 0; i < ys.size(); ++i) {
+      terms.push_back({ ts[i], ws[i] * ys[i] });
+      if (std::isfinite(ys[i]) || std::fabs(ts[i]) <= QUAD_DE_TAIL)
+        continue;
+      if (ts[i] < 0)
+        tLower = std::max(tLower, ts[i]);
+      else
+        tUpper = std::min(tUpper, ts[i]);
+    }
+
+    double sum = 0;
+    for (auto& [t, term] : terms)
+      if (t > tLower && t < tUpper)
+        sum += term;
+
+    double estimate = sum * step;
+    if (level > 0)
+      res.error = std::fabs(estimate - res.value);
+    res.value = estimate;
+
+    if (!std::isfinite(estimate))
+      break;
+    if (res.error <= _tolerance * std::max(1.0, std::fabs(estimate))) {
+      res.converged = true;
+      break;
+    }
+
+    step /= 2;
+  }
+
+  res.value *= sign;
+  return res;
+}
+
+void
+Quadrature::IntegratePanels(const Integrand& f,
+                            double x0,
+                            double width,
+                            size_t n,
+                            double* out) const
+{
+  std::vector<double> xs(n * QUAD_PANEL_NODES);
+  std::vector<double> ys(n * QUAD_PANEL_NODES);
+
+  for (size_t p = 0; p < n; ++p) {
+    double center = x0 + (p + 0.5) * width;
+    for (int j = 0; j < QUAD_PANEL_NODES; ++j)
+      xs[p * QUAD_PANEL_NODES + j] = center + 0.5 * width * PANEL_NODES[j];
+  }
+
+  EvaluateParallel(f, xs.data(), xs.size(), ys.data(), QUAD_PANEL_NODES);
+
+  for (size_t p = 0; p < n; ++p) {
+    double sum = 0;
+    for (int j = 0; j < QUAD_PANEL_NODES; ++j)
+      sum += PANEL_WEIGHTS[j] * ys[p * QUAD_PANEL_NODES + j];
+    out[p] = 0.5 * width * sum;
+  }
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <sys/types.h>
+#include <vector>
+
+// Default requested integration error
+#define QUAD_DEFAULT_TOLERANCE 1e-10
+// Default maximal number of integrand evaluations
+#define QUAD_DEFAULT_MAX_EVALUATIONS 1000000
+
+// Result of numeric integration
+struct IntegrationResult
+{
+  double value;
+  // Estimate of absolute error of value
+  double error;
+  // Number of integrand evaluations done
+  size_t evaluations;
+  // If requested tolerance was reached within evaluation budget
+  bool converged;
+};
+
+// Integrand evaluated in n points at once. Failed points are NaN
+using Integrand = std::function<void(const double* xs, size_t n, double* out)>;
+
+// Adaptive Gauss-Kronrod (G7K15) integrator in double precision. Subintervals
+// are kept in single queue ordered by their error, several worst ones are split
+// at once and rules on their halves are evaluated in parallel
+class Quadrature
+{
+public:
+  // ctor, tolerance - requested error (absolute for results smaller than 1,
+  // relative otherwise), maxEvaluations - evaluation budget, nthreads - number
+  // of threads evaluating integrand, which must be thread-safe if it's not 1
+  Quadrature(double tolerance, size_t maxEvaluations, uint nthreads);
+
+  // Integrate f over [a;b]
+  IntegrationResult Integrate(const Integrand& f, double a, double b) const;
+
+  // Integrate f over [a;b] with double exponential substitution: tanh-sinh for
+  // finite bounds, exp-sinh for one infinite bound and sinh-sinh for two. It
+  // converges quickly for integrands singular at bounds and on infinite ranges
+  IntegrationResult IntegrateDoubleExponential(const Integrand& f,
+                                               double a,
+                                               double b) const;
+
+  // Integrate f over n adjacent panels of given width starting at x0 with
+  // 5-point Gauss-Legendre rule, writing integral of every panel into out
+  void IntegratePanels(const Integrand& f,
+                       double x0,
+                       double width,
+                       size_t n,
+                       double* out) const;
+
+private:
+  Quadrature() = delete;
+  double _tolerance;
+  size_t _maxEvaluations;
+  uint _nThreads;
+
+  // Subinterval with its rule value and error
+  struct Segment
+  {
+    double a;
+    double b;
+    double value;
+    double error;
+  };
+
+  // Evaluate f in n points using all threads. Points are split between
+  // threads in groups of given size
+  void EvaluateParallel(const Integrand& f,
+                        const double* xs,
+                        size_t n,
+                        double* ys,
+                        size_t granularity) const;
+
+  // Apply rule to every segment, filling their values and errors. xs and ys are
+  // scratch buffers
+  void EvaluateSegments(const Integrand& f,
+                        std::vector<Segment>& segments,
+                        std::vector<double>& xs,
+                        std::vector<double>& ys) const;
+};
\ No newline at end of file
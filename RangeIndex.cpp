@@ -0,0 +1,58 @@
+#include "RangeIndex.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// Get index of level, which entries cover largest power of two not above n
+static size_t
+Level(size_t n)
+{
+  size_t level = 0;
+  while ((size_t(2) << level) <= n)
+    ++level;
+  return level;
+}
+
+void
+RangeIndex::Build(const double* values, size_t n)
+{
+  _size = n;
+  size_t levels = n ? Level(n) + 1 : 0;
+  _min.resize(levels * n);
+  _max.resize(levels * n);
+
+  // Ignored values never win, so they are infinities of opposite sign
+  double inf = std::numeric_limits<double>::infinity();
+  for (size_t i = 0; i < n; ++i) {
+    bool finite = std::isfinite(values[i]);
+    _min[i] = finite ? values[i] : inf;
+    _max[i] = finite ? values[i] : -inf;
+  }
+
+  // Entry of level k joins two halves from level k - 1
+  for (size_t k = 1; k < levels; ++k) {
+    size_t half = size_t(1) << (k - 1);
+    const double* lowerMin = _min.data() + (k - 1) * n;
+    const double* lowerMax = _max.data() + (k - 1) * n;
+    double* levelMin = _min.data() + k * n;
+    double* levelMax = _max.data() + k * n;
+    for (size_t i = 0; i + 2 * half <= n; ++i) {
+      levelMin[i] = std::min(lowerMin[i], lowerMin[i + half]);
+      levelMax[i] = std::max(lowerMax[i], lowerMax[i + half]);
+    }
+  }
+}
+
+bool
+RangeIndex::Find(size_t from, size_t to, double& min, double& max) const
+{
+  to = std::min(to, _size);
+  if (from >= to)
+    return false;
+
+  size_t k = Level(to - from);
+  size_t last = to - (size_t(1) << k);
+  min = std::min(_min[k * _size + from], _min[k * _size + last]);
+  max = std::max(_max[k * _size + from], _max[k * _size + last]);
+  return min <= max;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+
+// Sparse table answering minimum and maximum of values over any range of
+// indices in constant time. Level k holds extrema of 2^k values starting at
+// every index, and any range is covered by two overlapping entries of one
+// level
+class RangeIndex
+{
+public:
+  // Build index over n values, non-finite values are ignored
+  void Build(const double* values, size_t n);
+
+  // Find minimum and maximum of values with indices in [from;to). Returns
+  // false if there are no values there which aren't ignored
+  bool Find(size_t from, size_t to, double& min, double& max) const;
+
+private:
+  size_t _size = 0;
+  // Levels one after another, level k starts at k * _size
+  std::vector<double> _min;
+  std::vector<double> _max;
+};
\ No newline at end of file
@@ -0,0 +1,227 @@
+#include "Spawner.h"
+#include "Expression.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+// Pid in request, which makes helper exit
+#define SPAWNER_EXIT_PID -1
+
+// Request sent to helper
+struct SpawnerRequest
+{
+  // Zero to spawn process, pid of spawned process to kill it, or
+  // SPAWNER_EXIT_PID
+  pid_t pid;
+};
+
+bool
+Spawner::ReadAll(int fd, void* buf, size_t size)
+{
+  char* ptr = static_cast<char*>(buf);
+  while (size) {
+    ssize_t res = recv(fd, ptr, size, 0);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res <= 0)
+      return false;
+    ptr += res;
+    size -= res;
+  }
+  return true;
+}
+
+bool
+Spawner::WriteAll(int fd, const void* buf, size_t size)
+{
+  const char* ptr = static_cast<const char*>(buf);
+  while (size) {
+    // Dead peer shouldn't kill whole process with SIGPIPE
+    ssize_t res = send(fd, ptr, size, MSG_NOSIGNAL);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res <= 0)
+      return false;
+    ptr += res;
+    size -= res;
+  }
+  return true;
+}
+
+// Send pid of spawned process along with socket connected to it, which is
+// passed only if process was spawned
+static bool
+SendProcess(int fd, pid_t pid, int processFd)
+{
+  iovec iov = { &pid, sizeof(pid) };
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (pid > 0) {
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), &processFd, sizeof(int));
+  }
+
+  ssize_t res;
+  do
+    res = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  while (res < 0 && errno == EINTR);
+  return res == sizeof(pid);
+}
+
+// Receive pid and socket sent by SendProcess(), -1 pid if there are none
+static pid_t
+ReceiveProcess(int fd, int& processFd)
+{
+  pid_t pid = -1;
+  iovec iov = { &pid, sizeof(pid) };
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t res;
+  do
+    res = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  while (res < 0 && errno == EINTR);
+
+  processFd = -1;
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (res == sizeof(pid) && cmsg && cmsg->cmsg_type == SCM_RIGHTS)
+    std::memcpy(&processFd, CMSG_DATA(cmsg), sizeof(int));
+  return processFd >= 0 ? pid : -1;
+}
+
+Spawner::Spawner(Entry entry, void* arg)
+  : _pid(-1)
+  , _fd(-1)
+{
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    return;
+
+  // Hold GiNaC mutex while forking, so that helper doesn't get it locked if
+  // some thread already uses GiNaC
+  std::recursive_mutex& ginacMutex = Expression::GetGinacMutex();
+  ginacMutex.lock();
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Child has only forking thread, and its copy of mutex is owned by
+    // thread of parent process, so mutex is recreated unlocked
+    new (&ginacMutex) std::recursive_mutex();
+    close(fds[0]);
+    HelperLoop(fds[1], entry, arg);
+    _exit(0);
+  }
+  ginacMutex.unlock();
+
+  close(fds[1]);
+  if (pid < 0) {
+    close(fds[0]);
+    return;
+  }
+  _pid = pid;
+  _fd = fds[0];
+}
+
+Spawner::~Spawner()
+{
+  if (!IsAvailable())
+    return;
+
+  // Helper is asked to exit instead of waiting until connection is closed,
+  // since other spawned processes may hold copies of its socket
+  SpawnerRequest request = { SPAWNER_EXIT_PID };
+  WriteAll(_fd, &request, sizeof(request));
+  close(_fd);
+  waitpid(_pid, nullptr, 0);
+}
+
+pid_t
+Spawner::Spawn(int& fd)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  fd = -1;
+  if (!IsAvailable())
+    return -1;
+
+  SpawnerRequest request = { 0 };
+  if (!WriteAll(_fd, &request, sizeof(request)))
+    return -1;
+  return ReceiveProcess(_fd, fd);
+}
+
+void
+Spawner::Kill(pid_t pid)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (!IsAvailable() || pid <= 0)
+    return;
+
+  SpawnerRequest request = { pid };
+  WriteAll(_fd, &request, sizeof(request));
+}
+
+void
+Spawner::HelperLoop(int fd, Entry entry, void* arg)
+{
+  std::vector<pid_t> children;
+  SpawnerRequest request;
+  while (ReadAll(fd, &request, sizeof(request)) &&
+         request.pid != SPAWNER_EXIT_PID) {
+    if (request.pid > 0) {
+      // Only own children are killed, they stay zombies until then, so that
+      // their pids aren't reused
+      auto child = std::find(children.begin(), children.end(), request.pid);
+      if (child != children.end()) {
+        kill(request.pid, SIGKILL);
+        waitpid(request.pid, nullptr, 0);
+        children.erase(child);
+      }
+      continue;
+    }
+
+    int fds[2];
+    pid_t pid = -1;
+    bool paired = socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0;
+    if (paired) {
+      pid = fork();
+      if (pid == 0) {
+        close(fd);
+        close(fds[0]);
+        entry(fds[1], arg);
+        _exit(0);
+      }
+      close(fds[1]);
+      if (pid > 0)
+        children.push_back(pid);
+    }
+
+    bool sent = SendProcess(fd, pid, paired ? fds[0] : -1);
+    if (paired)
+      close(fds[0]);
+    if (!sent)
+      break;
+  }
+
+  // Requester is gone, so are processes it used
+  for (pid_t child : children) {
+    kill(child, SIGKILL);
+    waitpid(child, nullptr, 0);
+  }
+  close(fd);
+}
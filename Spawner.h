@@ -0,0 +1,54 @@
+#pragma once
+#include <mutex>
+#include <sys/types.h>
+
+// Helper process, which forks processes on request. Process running threads
+// can't be forked safely: child gets locks of malloc and other libraries in
+// whatever state other threads left them, and may deadlock. So helper is
+// forked while process has single thread, and forks only itself after that
+class Spawner
+{
+public:
+  // Main function of spawned process, gets socket connected to requester and
+  // argument given to ctor. Process exits when it returns
+  using Entry = void (*)(int fd, void* arg);
+
+  // Fork helper, which spawns processes running entry. Should be created
+  // before any threads. Helper keeps copy of memory from this moment, so arg
+  // must point to data which is already set
+  Spawner(Entry entry, void* arg);
+  // Kills helper along with all processes it spawned
+  ~Spawner();
+
+  // Check if helper is running
+  inline bool IsAvailable() const { return _fd >= 0; }
+
+  // Spawn process, returns its pid and sets fd to socket connected to it.
+  // Returns -1 if process can't be spawned
+  pid_t Spawn(int& fd);
+
+  // Ask helper to kill spawned process. Returns at once, helper reaps process
+  // afterwards, so its pid isn't reused before that
+  void Kill(pid_t pid);
+
+  // Read exactly size bytes from socket, returns false if connection is
+  // closed
+  static bool ReadAll(int fd, void* buf, size_t size);
+
+  // Write exactly size bytes to socket, returns false if connection is
+  // closed
+  static bool WriteAll(int fd, const void* buf, size_t size);
+
+private:
+  Spawner() = delete;
+  Spawner(const Spawner&) = delete;
+
+  pid_t _pid;
+  // Socket connected to helper
+  int _fd;
+  // Requests of different threads aren't mixed
+  std::mutex _mutex;
+
+  // Main loop of helper process
+  static void HelperLoop(int fd, Entry entry, void* arg);
+};
\ No newline at end of file
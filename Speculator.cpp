@@ -0,0 +1,173 @@
+#include "Speculator.h"
+#include <chrono>
+
+// Time budget of speculative symbolic job in seconds
+#define SPECULATOR_TIME_LIMIT 10.0
+// Interval in milliseconds of checking if speculation is abandoned
+#define SPECULATOR_POLL_INTERVAL 20
+
+Speculator::Speculator()
+  : _stopped(false)
+  , _generation(0)
+{
+}
+
+Speculator::~Speculator()
+{
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stopped = true;
+  }
+  _wakeup.notify_all();
+  if (_thread.joinable())
+    _thread.join();
+}
+
+void
+Speculator::Prepare(const Expression& expr,
+                    size_t token,
+                    const std::string& variable,
+                    double x1,
+                    double x2,
+                    uint npoints)
+{
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _pending = Job{ expr.GetExpressionString(),
+                    expr.GetVariableNames(),
+                    token,
+                    variable,
+                    x1,
+                    x2,
+                    npoints };
+    ++_generation;
+    _done.reset();
+    _derivative.reset();
+    _antiderivative.reset();
+    // Thread is started with first job
+    if (!_thread.joinable())
+      _thread = std::thread(&Speculator::Run, this);
+  }
+  _wakeup.notify_one();
+}
+
+PreparedExpression
+Speculator::Sample(std::unique_ptr<Expression> expr, const Job& job)
+{
+  PreparedExpression res = { nullptr, {}, 0, job.x1, job.x2 };
+
+  // Expressions with parameters are sampled by calculator knowing their values
+  if (job.x1 < job.x2 && expr->GetVariableNames().size() == 1) {
+    ExpressionCalculator calc(job.npoints);
+    calc.SetExpression(std::make_unique<Expression>(*expr));
+    res.points = calc.CalculateExpression(job.x1, job.x2);
+    res.pointsCount = calc.GetPointsCount();
+  }
+
+  res.expr = std::move(expr);
+  return res;
+}
+
+std::unique_ptr<Expression>
+Speculator::RunJob(JobRequest::Kind kind, const Job& job, size_t generation)
+{
+  JobRequest request;
+  request.kind = kind;
+  request.expression = job.expression;
+  request.variables = job.variables;
+  request.variable = job.variable;
+  request.background = true;
+  SymbolicJob symbolic(std::move(request),
+                       { SPECULATOR_TIME_LIMIT, JOB_DEFAULT_SIZE_LIMIT });
+
+  // New job or stop wakes thread at once. Abandoned job is cancelled by its
+  // destructor after lock is released
+  std::unique_lock<std::mutex> lock(_mutex);
+  while (symbolic.IsRunning()) {
+    if (_stopped || generation != _generation)
+      return nullptr;
+    _wakeup.wait_for(lock,
+                     std::chrono::milliseconds(SPECULATOR_POLL_INTERVAL));
+  }
+  lock.unlock();
+
+  if (symbolic.GetState() != SymbolicJob::State::Done)
+    return nullptr;
+  return std::move(symbolic.GetResult().expression);
+}
+
+void
+Speculator::Run()
+{
+  // Thread itself runs at normal priority, as it takes GiNaC mutex to sample
+  // results, which job processes of lowest priority have built
+  std::unique_lock<std::mutex> lock(_mutex);
+  while (true) {
+    _wakeup.wait(lock, [this] { return _stopped || _pending; });
+    if (_stopped)
+      return;
+
+    Job job = std::move(*_pending);
+    _pending.reset();
+    size_t generation = _generation;
+    lock.unlock();
+
+    std::optional<PreparedExpression> derivative;
+    std::optional<PreparedExpression> antiderivative;
+    std::unique_ptr<Expression> expr =
+      RunJob(JobRequest::Kind::Derivative, job, generation);
+    if (expr)
+      derivative = Sample(std::move(expr), job);
+
+    // Results of abandoned job aren't needed, antiderivative isn't worth
+    // preparing then
+    bool abandoned;
+    {
+      std::lock_guard<std::mutex> check(_mutex);
+      abandoned = generation != _generation;
+    }
+    if (!abandoned) {
+      expr = RunJob(JobRequest::Kind::Antiderivative, job, generation);
+      if (expr)
+        antiderivative = Sample(std::move(expr), job);
+    }
+
+    lock.lock();
+    if (generation == _generation) {
+      _derivative = std::move(derivative);
+      _antiderivative = std::move(antiderivative);
+      _done = std::move(job);
+    }
+  }
+}
+
+std::optional<PreparedExpression>
+Speculator::Get(const std::optional<PreparedExpression>& prepared,
+                size_t token,
+                const std::string& variable)
+{
+  // Expressions aren't compared, as comparison waits for GiNaC mutex, which
+  // sampling of results may hold
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (!_done || !prepared || _done->token != token ||
+      _done->variable != variable)
+    return std::nullopt;
+
+  return PreparedExpression{ std::make_unique<Expression>(*prepared->expr),
+                             prepared->points,
+                             prepared->pointsCount,
+                             prepared->x1,
+                             prepared->x2 };
+}
+
+std::optional<PreparedExpression>
+Speculator::GetDerivative(size_t token, const std::string& variable)
+{
+  return Get(_derivative, token, variable);
+}
+
+std::optional<PreparedExpression>
+Speculator::GetAntiderivative(size_t token, const std::string& variable)
+{
+  return Get(_antiderivative, token, variable);
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include "ExpressionCalculator.h"
+#include "SymbolicJob.h"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// Expression prepared in background together with its graph points in view it
+// was prepared for
+struct PreparedExpression
+{
+  std::unique_ptr<Expression> expr;
+  std::vector<Point> points;
+  size_t pointsCount;
+  double x1;
+  double x2;
+};
+
+// Background thread, which prepares derivative and antiderivative of current
+// expression, so that they're shown at once when requested. Symbolic work is
+// done by job processes of lowest priority, so that it never holds GiNaC mutex
+// of this process. Prepared expressions are compiled and already sampled
+class Speculator
+{
+public:
+  Speculator();
+  ~Speculator();
+
+  // Start preparing derivative and antiderivative of expr by variable, sampled
+  // by npoints in [x1;x2]. Results are given for the same token, which caller
+  // changes with expression. Unfinished previous job is abandoned
+  void Prepare(const Expression& expr,
+               size_t token,
+               const std::string& variable,
+               double x1,
+               double x2,
+               uint npoints);
+
+  // Get prepared derivative of expression given with token, if it's ready
+  std::optional<PreparedExpression> GetDerivative(size_t token,
+                                                  const std::string& variable);
+
+  // Get prepared antiderivative with zero constant of expression given with
+  // token, if it's ready
+  std::optional<PreparedExpression> GetAntiderivative(
+    size_t token,
+    const std::string& variable);
+
+private:
+  Speculator(const Speculator&) = delete;
+
+  struct Job
+  {
+    std::string expression;
+    std::vector<std::string> variables;
+    size_t token;
+    std::string variable;
+    double x1;
+    double x2;
+    uint npoints;
+  };
+
+  std::thread _thread;
+  std::mutex _mutex;
+  std::condition_variable _wakeup;
+  bool _stopped;
+  // Incremented by every new job, so that results of abandoned one are dropped
+  size_t _generation;
+  // Job waiting for thread, and one whose results are kept
+  std::optional<Job> _pending;
+  std::optional<Job> _done;
+  std::optional<PreparedExpression> _derivative;
+  std::optional<PreparedExpression> _antiderivative;
+
+  void Run();
+  // Run symbolic job of given kind in job process, waiting for it. Returns
+  // nothing if job failed, or was abandoned and cancelled
+  std::unique_ptr<Expression> RunJob(JobRequest::Kind kind,
+                                     const Job& job,
+                                     size_t generation);
+  // Sample expression in view of job, if it's of single variable
+  static PreparedExpression Sample(std::unique_ptr<Expression> expr,
+                                   const Job& job);
+  // Copy prepared expression if it was made for given token and variable
+  std::optional<PreparedExpression> Get(
+    const std::optional<PreparedExpression>& prepared,
+    size_t token,
+    const std::string& variable);
+};
\ No newline at end of file
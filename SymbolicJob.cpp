@@ -0,0 +1,363 @@
+#include "SymbolicJob.h"
+#include "Spawner.h"
+#include <cerrno>
+#include <cstdio>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Interval in milliseconds of checking if job is cancelled or out of time
+#define JOB_POLL_INTERVAL 20
+// Niceness of job process doing background work
+#define JOB_BACKGROUND_NICENESS 19
+
+// Reply of job process, followed by error detail or result text
+struct JobReply
+{
+  uint8_t ok;
+  ExprStatus status;
+  uint64_t length;
+};
+
+// Fixed part of request sent to job process, followed by expression string,
+// variable and variables, each of them preceded by its length, and then by
+// parameter names preceded by length and followed by value
+struct JobRequestHeader
+{
+  JobRequest::Kind kind;
+  uint32_t nVariables;
+  uint32_t nParameters;
+  uint8_t background;
+  double C;
+  double lowerBound;
+  double upperBound;
+  double tolerance;
+  uint64_t maxEvaluations;
+};
+
+// Append string preceded by its length to buffer
+static void
+AppendString(std::string& buf, const std::string& str)
+{
+  uint64_t length = str.size();
+  buf.append(reinterpret_cast<const char*>(&length), sizeof(length));
+  buf.append(str);
+}
+
+// Read string written by AppendString()
+static bool
+ReadString(int fd, std::string& str)
+{
+  uint64_t length;
+  if (!Spawner::ReadAll(fd, &length, sizeof(length)))
+    return false;
+  str.resize(length);
+  return Spawner::ReadAll(fd, str.data(), length);
+}
+
+// Do requested operation, returns text of result or nothing if it failed,
+// leaving error status of its thread. Expressions are returned serialized,
+// so that rewriting and compiling isn't done again
+static std::optional<std::string>
+Perform(const JobRequest& request)
+{
+  std::unique_ptr<Expression> expr =
+    Expression::CreateExpression(request.expression, request.variables);
+  if (expr && request.kind == JobRequest::Kind::Derivative)
+    expr = expr->CreateDerivative(request.variable);
+  else if (expr && request.kind == JobRequest::Kind::Antiderivative)
+    expr = expr->CreateAntiderivative(request.variable, request.C);
+  if (!expr)
+    return std::nullopt;
+
+  if (request.kind != JobRequest::Kind::Integral)
+    return expr->Serialize();
+
+  // Integral travels as text like expressions do, with all digits kept
+  std::optional<IntegrationResult> res =
+    expr->CalculateIntegral(request.variable,
+                            request.lowerBound,
+                            request.upperBound,
+                            request.tolerance,
+                            request.maxEvaluations,
+                            request.parameters);
+  if (!res)
+    return std::nullopt;
+
+  char buf[128];
+  std::snprintf(buf,
+                sizeof(buf),
+                "%.17g %.17g %zu %d",
+                res->value,
+                res->error,
+                res->evaluations,
+                res->converged);
+  return std::string(buf);
+}
+
+// Main function of job process, which reads request, performs it and replies
+static void
+JobProcess(int fd, void*)
+{
+  JobRequestHeader header;
+  JobRequest request;
+  if (!Spawner::ReadAll(fd, &header, sizeof(header)) ||
+      !ReadString(fd, request.expression) ||
+      !ReadString(fd, request.variable))
+    return;
+  request.variables.resize(header.nVariables);
+  for (auto& var : request.variables) {
+    if (!ReadString(fd, var))
+      return;
+  }
+  for (uint32_t i = 0; i < header.nParameters; ++i) {
+    std::string name;
+    double value;
+    if (!ReadString(fd, name) || !Spawner::ReadAll(fd, &value, sizeof(value)))
+      return;
+    request.parameters[name] = value;
+  }
+  if (header.background)
+    setpriority(PRIO_PROCESS, 0, JOB_BACKGROUND_NICENESS);
+  request.kind = header.kind;
+  request.C = header.C;
+  request.lowerBound = header.lowerBound;
+  request.upperBound = header.upperBound;
+  request.tolerance = header.tolerance;
+  request.maxEvaluations = header.maxEvaluations;
+
+  auto res = Perform(request);
+  const std::string& data = res ? *res : Expression::GetErrorDetail();
+  JobReply reply = { res.has_value(), Expression::GetStatus(), data.size() };
+  if (Spawner::WriteAll(fd, &reply, sizeof(reply)))
+    Spawner::WriteAll(fd, data.data(), data.size());
+}
+
+// Get helper spawning job processes, it's forked on first call
+static Spawner&
+GetSpawner()
+{
+  static Spawner spawner(&JobProcess, nullptr);
+  return spawner;
+}
+
+void
+SymbolicJob::StartSpawner()
+{
+  GetSpawner();
+}
+
+SymbolicJob::SymbolicJob(JobRequest request, const JobBudget& budget)
+  : _request(std::move(request))
+  , _budget(budget)
+  , _state(State::Running)
+  , _cancelled(false)
+  , _start(std::chrono::steady_clock::now())
+  , _end(_start)
+  , _status(ExprStatus::Ok)
+{
+  _thread = std::thread(&SymbolicJob::Run, this);
+}
+
+SymbolicJob::SymbolicJob(JobResult result)
+  : _budget{ 0, 0 }
+  , _state(State::Done)
+  , _cancelled(false)
+  , _start(std::chrono::steady_clock::now())
+  , _end(_start)
+  , _status(ExprStatus::Ok)
+  , _result(std::move(result))
+{
+}
+
+SymbolicJob::~SymbolicJob()
+{
+  Cancel();
+  if (_thread.joinable())
+    _thread.join();
+}
+
+double
+SymbolicJob::GetElapsed() const
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto end = IsRunning() ? std::chrono::steady_clock::now() : _end;
+  return std::chrono::duration<double>(end - _start).count();
+}
+
+void
+SymbolicJob::Cancel()
+{
+  _cancelled = true;
+}
+
+std::string
+SymbolicJob::GetError() const
+{
+  switch (GetState()) {
+    case State::Running:
+    case State::Done:
+      return "";
+    case State::Cancelled:
+      return "cancelled";
+    case State::OverBudget:
+      return "operation exceeded its time or size limit";
+    case State::Failed:
+      break;
+  }
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  return Expression::DescribeError(_status, _errorDetail);
+}
+
+void
+SymbolicJob::End(State state)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  _end = std::chrono::steady_clock::now();
+  _state = state;
+}
+
+void
+SymbolicJob::Run()
+{
+  std::string text;
+  State state = RunProcess(text);
+  if (state != State::Done) {
+    End(state);
+    return;
+  }
+
+  // Conversion of text is bounded by its size, so it's done in this process
+  auto result = Finish(text);
+  if (!result) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _status = Expression::GetStatus();
+    _errorDetail = Expression::GetErrorDetail();
+  } else {
+    _result = std::move(*result);
+  }
+  End(result ? State::Done : State::Failed);
+}
+
+SymbolicJob::State
+SymbolicJob::RunProcess(std::string& text)
+{
+  Spawner& spawner = GetSpawner();
+  int fd;
+  pid_t pid = spawner.Spawn(fd);
+  if (pid < 0)
+    return Fail("failed to start symbolic job");
+
+  JobRequestHeader fixed = { _request.kind,
+                             static_cast<uint32_t>(_request.variables.size()),
+                             static_cast<uint32_t>(_request.parameters.size()),
+                             _request.background,
+                             _request.C,
+                             _request.lowerBound,
+                             _request.upperBound,
+                             _request.tolerance,
+                             _request.maxEvaluations };
+  std::string request(reinterpret_cast<const char*>(&fixed), sizeof(fixed));
+  AppendString(request, _request.expression);
+  AppendString(request, _request.variable);
+  for (auto& var : _request.variables)
+    AppendString(request, var);
+  for (auto& [name, value] : _request.parameters) {
+    AppendString(request, name);
+    request.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+  if (!Spawner::WriteAll(fd, request.data(), request.size())) {
+    spawner.Kill(pid);
+    close(fd);
+    return Fail("failed to start symbolic job");
+  }
+
+  // Reply is collected until process closes connection, budget is checked
+  // between reads
+  std::string reply;
+  State state = State::Done;
+  char buf[4096];
+  while (true) {
+    if (_cancelled) {
+      state = State::Cancelled;
+      break;
+    }
+    if (GetElapsed() > _budget.seconds ||
+        reply.size() > sizeof(JobReply) + _budget.resultSize) {
+      state = State::OverBudget;
+      break;
+    }
+
+    pollfd pfd = { fd, POLLIN, 0 };
+    int res = poll(&pfd, 1, JOB_POLL_INTERVAL);
+    if (res < 0 && errno != EINTR) {
+      state = Fail("lost connection with symbolic job");
+      break;
+    }
+    if (res <= 0)
+      continue;
+
+    ssize_t size = recv(fd, buf, sizeof(buf), 0);
+    if (size < 0 && errno == EINTR)
+      continue;
+    if (size <= 0)
+      break;
+    reply.append(buf, size);
+  }
+
+  spawner.Kill(pid);
+  close(fd);
+
+  if (state != State::Done)
+    return state;
+
+  // Process which died without reply has crashed, for example out of memory
+  JobReply header;
+  if (reply.size() < sizeof(header))
+    return Fail("symbolic job crashed");
+  std::copy(reply.data(),
+            reply.data() + sizeof(header),
+            reinterpret_cast<char*>(&header));
+  text = reply.substr(sizeof(header));
+  if (!header.ok) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _status = header.status;
+    _errorDetail = text;
+    return State::Failed;
+  }
+  return State::Done;
+}
+
+std::optional<JobResult>
+SymbolicJob::Finish(const std::string& text) const
+{
+  if (_request.kind != JobRequest::Kind::Integral) {
+    std::unique_ptr<Expression> expr =
+      Expression::Deserialize(text, _request.variables);
+    if (!expr)
+      return std::nullopt;
+    return JobResult{ std::move(expr), {} };
+  }
+
+  JobResult result;
+  int converged = 0;
+  std::sscanf(text.c_str(),
+              "%lg %lg %zu %d",
+              &result.integral.value,
+              &result.integral.error,
+              &result.integral.evaluations,
+              &converged);
+  result.integral.converged = converged;
+  return result;
+}
+
+SymbolicJob::State
+SymbolicJob::Fail(const std::string& detail)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  _status = ExprStatus::GinacError;
+  _errorDetail = detail;
+  return State::Failed;
+}
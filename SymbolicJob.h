@@ -0,0 +1,134 @@
+#pragma once
+#include "Expression.h"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+// Default time budget of symbolic job in seconds
+#define JOB_DEFAULT_TIME_LIMIT 10.0
+// Default maximal length of job result in characters
+#define JOB_DEFAULT_SIZE_LIMIT 1000000
+
+// Limits after which symbolic job is aborted
+struct JobBudget
+{
+  double seconds;
+  size_t resultSize;
+};
+
+// Symbolic operation on expression given by its string and variables
+struct JobRequest
+{
+  enum class Kind : uint8_t
+  {
+    // Parse, rewrite and compile expression itself
+    Parse,
+    Derivative,
+    Antiderivative,
+    Integral
+  };
+
+  Kind kind = Kind::Parse;
+  std::string expression;
+  std::vector<std::string> variables;
+  // Variable of derivative, antiderivative or integral
+  std::string variable;
+  // Constant of antiderivative
+  double C = 0;
+  // Bounds, tolerance and evaluations budget of integral
+  double lowerBound = 0;
+  double upperBound = 0;
+  double tolerance = 0;
+  size_t maxEvaluations = 0;
+  // Values of parameters, which integrand is evaluated with
+  ParameterValues parameters;
+  // Run job process at lowest priority, for work nobody waits for
+  bool background = false;
+};
+
+// Result of finished symbolic job, which has one of fields set
+struct JobResult
+{
+  std::unique_ptr<Expression> expression;
+  IntegrationResult integral;
+};
+
+// Symbolic operation, which can't be interrupted inside GiNaC, so it runs in
+// process that can be killed at any moment. Processes are spawned by helper
+// forked before threads exist. Job thread watches process and turns text it
+// returns into result. Handle is polled by UI
+class SymbolicJob
+{
+public:
+  enum class State : uint8_t
+  {
+    Running,
+    Done,
+    Failed,
+    Cancelled,
+    // Time or result size budget was exceeded
+    OverBudget
+  };
+
+  // Fork helper, which spawns job processes. Should be called before any
+  // threads are started, otherwise helper is forked by first job
+  static void StartSpawner();
+
+  // Start job, which sends request to job process on its own thread
+  SymbolicJob(JobRequest request, const JobBudget& budget);
+  // Create job which is already done with given result
+  SymbolicJob(JobResult result);
+  // Cancels job if it's still running
+  ~SymbolicJob();
+
+  inline State GetState() const { return _state.load(); }
+
+  inline bool IsRunning() const { return _state.load() == State::Running; }
+
+  // Get seconds spent by job, stops growing when job ends
+  double GetElapsed() const;
+
+  // Kill job process. Job thread notices it soon after that
+  void Cancel();
+
+  // Get message describing why job didn't finish
+  std::string GetError() const;
+
+  // Get result of done job
+  inline JobResult& GetResult() { return _result; }
+
+private:
+  SymbolicJob() = delete;
+  SymbolicJob(const SymbolicJob&) = delete;
+
+  JobRequest _request;
+  JobBudget _budget;
+  std::atomic<State> _state;
+  std::atomic_bool _cancelled;
+  std::chrono::steady_clock::time_point _start;
+  std::chrono::steady_clock::time_point _end;
+  // Protects end time and error
+  mutable std::mutex _mutex;
+  ExprStatus _status;
+  std::string _errorDetail;
+  JobResult _result;
+  std::thread _thread;
+
+  void Run();
+  // Run request in job process, collecting its reply. Returns final state
+  // unless process succeeded
+  State RunProcess(std::string& text);
+  // Convert text returned by job process into result, returns nothing if it
+  // failed
+  std::optional<JobResult> Finish(const std::string& text) const;
+  // Save error which happened outside of GiNaC
+  State Fail(const std::string& detail);
+  // End job with given state
+  void End(State state);
+};
\ No newline at end of file
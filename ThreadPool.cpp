@@ -0,0 +1,77 @@
+#include "ThreadPool.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool(uint nthreads)
+  : _stop(false)
+{
+  for (uint i = 0; i < nthreads; ++i)
+    _threads.emplace_back(&ThreadPool::Work, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _wake.notify_all();
+  for (auto& thread : _threads)
+    thread.join();
+}
+
+ThreadPool&
+ThreadPool::GetShared()
+{
+  static ThreadPool pool(
+    std::max(1u, std::thread::hardware_concurrency()) - 1);
+  return pool;
+}
+
+void
+ThreadPool::Run(size_t n, const std::function<void(size_t)>& task)
+{
+  Batch batch = { &task, n, 0, 0 };
+  std::unique_lock<std::mutex> lock(_mutex);
+  if (!_threads.empty() && n > 1) {
+    _batches.push_back(&batch);
+    _wake.notify_all();
+  }
+
+  while (batch.next < n) {
+    size_t i = batch.next++;
+    lock.unlock();
+    task(i);
+    lock.lock();
+    ++batch.done;
+  }
+
+  // Batch can't be left in queue, where threads find it, after it's gone
+  auto it = std::find(_batches.begin(), _batches.end(), &batch);
+  if (it != _batches.end())
+    _batches.erase(it);
+  _finished.wait(lock, [&batch]() { return batch.done == batch.n; });
+}
+
+void
+ThreadPool::Work()
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+  while (true) {
+    _wake.wait(lock, [this]() { return _stop || !_batches.empty(); });
+    if (_stop)
+      return;
+
+    Batch* batch = _batches.front();
+    if (batch->next >= batch->n) {
+      _batches.pop_front();
+      continue;
+    }
+
+    size_t i = batch->next++;
+    lock.unlock();
+    (*batch->task)(i);
+    lock.lock();
+    if (++batch->done == batch->n)
+      _finished.notify_all();
+  }
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+// Pool of threads, which are started once and then run batches of tasks for
+// any number of callers. Caller of batch runs its tasks too, so that batch
+// finishes even if all threads are busy with other batches
+class ThreadPool
+{
+public:
+  // ctor, nthreads - number of threads besides callers
+  ThreadPool(uint nthreads);
+  // Waits for threads to finish their current tasks
+  ~ThreadPool();
+
+  // Get pool shared by whole process, with thread per core besides caller.
+  // It's started on first call
+  static ThreadPool& GetShared();
+
+  // Get number of threads besides caller
+  inline uint GetThreadCount() const { return _threads.size(); }
+
+  // Run task for indices 0..n-1 on pool threads and calling one, returns when
+  // all of them are done
+  void Run(size_t n, const std::function<void(size_t)>& task);
+
+private:
+  ThreadPool() = delete;
+  ThreadPool(const ThreadPool&) = delete;
+
+  // Tasks of single Run() call, index of next one to take and number of done
+  // ones
+  struct Batch
+  {
+    const std::function<void(size_t)>* task;
+    size_t n;
+    size_t next;
+    size_t done;
+  };
+
+  // Protects batches and their counters
+  std::mutex _mutex;
+  // Notified when batch is added or pool stops
+  std::condition_variable _wake;
+  // Notified when task of any batch is done
+  std::condition_variable _finished;
+  // Batches which still have tasks to take
+  std::deque<Batch*> _batches;
+  bool _stop;
+  std::vector<std::thread> _threads;
+
+  // Main function of pool thread
+  void Work();
+};
\ No newline at end of file
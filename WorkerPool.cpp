@@ -0,0 +1,235 @@
+#include "WorkerPool.h"
+#include "Expression.h"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <memory>
+#include <poll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Minimal number of points in chunk sent to worker
+#define WORKER_MIN_CHUNK 16
+// Number of chunks per worker, so that slow chunks get balanced
+#define WORKER_CHUNKS_PER_WORKER 4
+// Interval in milliseconds of checking if evaluation is cancelled
+#define WORKER_POLL_INTERVAL 20
+
+// Request sent to worker, followed by expression string and variable name
+struct WorkerRequest
+{
+  uint32_t exprLength;
+  uint32_t varLength;
+  // Offset of chunk in shared memory
+  uint64_t offset;
+  // Number of points in chunk
+  uint64_t count;
+};
+
+WorkerPool::WorkerPool(uint nworkers, size_t capacity)
+  : _nWorkers(nworkers)
+  , _capacity(capacity)
+  , _shared(nullptr)
+{
+  void* shared = mmap(nullptr,
+                      2 * capacity * sizeof(double),
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS,
+                      -1,
+                      0);
+  if (shared == MAP_FAILED)
+    return;
+  _shared = static_cast<double*>(shared);
+
+  // Helper gets copy of pool with shared memory already mapped
+  _spawner = std::make_unique<Spawner>(&WorkerPool::WorkerLoop, this);
+  Start();
+}
+
+WorkerPool::~WorkerPool()
+{
+  Stop();
+  if (_shared)
+    munmap(_shared, 2 * _capacity * sizeof(double));
+}
+
+void
+WorkerPool::Start()
+{
+  while (_workers.size() < _nWorkers) {
+    int fd;
+    pid_t pid = _spawner->Spawn(fd);
+    if (pid < 0)
+      break;
+    _workers.push_back({ pid, fd });
+  }
+}
+
+void
+WorkerPool::Stop()
+{
+  // Workers may be stuck in long GiNaC evaluation, so they're killed instead
+  // of waiting for them
+  for (auto& worker : _workers) {
+    close(worker.fd);
+    _spawner->Kill(worker.pid);
+  }
+  _workers.clear();
+}
+
+bool
+WorkerPool::Evaluate(const std::string& expr_str,
+                     const std::string& variable,
+                     const double* xs,
+                     size_t n,
+                     double* out,
+                     const std::atomic_bool* cancelled)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  for (size_t offset = 0; offset < n; offset += _capacity) {
+    size_t count = std::min(_capacity, n - offset);
+    if (!EvaluateBatch(
+          expr_str, variable, xs + offset, count, out + offset, cancelled))
+      return false;
+  }
+
+  return true;
+}
+
+bool
+WorkerPool::SendChunk(Worker& worker,
+                      const std::string& expr_str,
+                      const std::string& variable,
+                      size_t chunk,
+                      size_t chunkSize,
+                      size_t n)
+{
+  WorkerRequest request;
+  request.exprLength = expr_str.size();
+  request.varLength = variable.size();
+  request.offset = chunk * chunkSize;
+  request.count = std::min(chunkSize, n - request.offset);
+
+  int fd = worker.fd;
+  return Spawner::WriteAll(fd, &request, sizeof(request)) &&
+         Spawner::WriteAll(fd, expr_str.data(), expr_str.size()) &&
+         Spawner::WriteAll(fd, variable.data(), variable.size());
+}
+
+bool
+WorkerPool::EvaluateBatch(const std::string& expr_str,
+                          const std::string& variable,
+                          const double* xs,
+                          size_t n,
+                          double* out,
+                          const std::atomic_bool* cancelled)
+{
+  if (_workers.empty())
+    return false;
+
+  std::copy(xs, xs + n, _shared);
+
+  size_t chunkSize = std::max<size_t>(
+    WORKER_MIN_CHUNK, n / (_workers.size() * WORKER_CHUNKS_PER_WORKER) + 1);
+  size_t nChunks = (n + chunkSize - 1) / chunkSize;
+  size_t nextChunk = 0;
+  size_t doneChunks = 0;
+  bool parsed = true;
+
+  // Give every worker its first chunk, others are sent as workers get free
+  for (auto& worker : _workers) {
+    if (nextChunk == nChunks)
+      break;
+    if (!SendChunk(worker, expr_str, variable, nextChunk++, chunkSize, n)) {
+      Stop();
+      return false;
+    }
+  }
+
+  std::vector<pollfd> fds(_workers.size());
+  while (doneChunks < nChunks) {
+    for (size_t i = 0; i < _workers.size(); ++i)
+      fds[i] = { _workers[i].fd, POLLIN, 0 };
+
+    int res = poll(fds.data(), fds.size(), WORKER_POLL_INTERVAL);
+    if (res < 0 && errno != EINTR) {
+      Stop();
+      return false;
+    }
+
+    // Busy workers can't be interrupted, so they're replaced
+    if (cancelled && cancelled->load(std::memory_order_acquire)) {
+      Stop();
+      Start();
+      return false;
+    }
+    if (res <= 0)
+      continue;
+
+    for (size_t i = 0; i < _workers.size(); ++i) {
+      if (!fds[i].revents)
+        continue;
+
+      // Worker replies with single byte when its chunk is done, which is
+      // zero if it failed to parse expression
+      char reply;
+      if (!Spawner::ReadAll(_workers[i].fd, &reply, 1)) {
+        Stop();
+        return false;
+      }
+      parsed = parsed && reply;
+      ++doneChunks;
+
+      if (nextChunk < nChunks &&
+          !SendChunk(
+            _workers[i], expr_str, variable, nextChunk++, chunkSize, n)) {
+        Stop();
+        return false;
+      }
+    }
+  }
+
+  // Expression which workers can't parse is evaluated by caller
+  std::copy(_shared + _capacity, _shared + _capacity + n, out);
+  return parsed;
+}
+
+void
+WorkerPool::WorkerLoop(int fd, void* pool)
+{
+  double* shared = static_cast<WorkerPool*>(pool)->_shared;
+  size_t capacity = static_cast<WorkerPool*>(pool)->_capacity;
+  std::unique_ptr<Expression> expr;
+  std::string exprStr;
+  std::string variable;
+  WorkerRequest request;
+
+  while (Spawner::ReadAll(fd, &request, sizeof(request))) {
+    std::string newExprStr(request.exprLength, '\0');
+    std::string newVariable(request.varLength, '\0');
+    if (!Spawner::ReadAll(fd, newExprStr.data(), newExprStr.size()) ||
+        !Spawner::ReadAll(fd, newVariable.data(), newVariable.size()))
+      break;
+
+    // Expression is parsed again only when it changes
+    if (!expr || newExprStr != exprStr || newVariable != variable) {
+      exprStr = newExprStr;
+      variable = newVariable;
+      expr = Expression::CreateExpression(exprStr, { variable });
+    }
+
+    double* xs = shared + request.offset;
+    double* out = shared + capacity + request.offset;
+    if (expr)
+      expr->Evaluate(xs, request.count, out);
+    else
+      std::fill(out, out + request.count, std::nan(""));
+
+    char reply = expr != nullptr;
+    if (!Spawner::WriteAll(fd, &reply, 1))
+      break;
+  }
+
+  close(fd);
+}
\ No newline at end of file
@@ -0,0 +1,78 @@
+#pragma once
+#include "Spawner.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+// Pool of forked worker processes for expressions which can be evaluated only
+// by GiNaC. GiNaC objects can't be shared between threads, so every worker
+// parses expression string by itself and evaluates its chunk of points, and
+// results are returned through memory shared between processes
+class WorkerPool
+{
+public:
+  // ctor, nworkers - number of processes, capacity - max number of points
+  // evaluated at once. Should be created before threads which use GiNaC
+  WorkerPool(uint nworkers, size_t capacity);
+  ~WorkerPool();
+
+  // Check if workers are running
+  inline bool IsAvailable() const { return !_workers.empty(); }
+
+  // Evaluate single-variable expression given by its string in n points.
+  // Failed points are NaN. Returns false if pool failed to evaluate them,
+  // workers failed to parse expression or cancelled was set meanwhile.
+  // Cancelled workers are replaced with new ones
+  bool Evaluate(const std::string& expr_str,
+                const std::string& variable,
+                const double* xs,
+                size_t n,
+                double* out,
+                const std::atomic_bool* cancelled = nullptr);
+
+private:
+  WorkerPool() = delete;
+  WorkerPool(const WorkerPool&) = delete;
+
+  struct Worker
+  {
+    pid_t pid;
+    // Socket connected to worker
+    int fd;
+  };
+
+  std::vector<Worker> _workers;
+  uint _nWorkers;
+  size_t _capacity;
+  // Shared memory, holds capacity X values followed by capacity results
+  double* _shared;
+  // Only one request is served at a time
+  std::mutex _mutex;
+  // Helper forking workers, so that they can be started again once threads
+  // are running
+  std::unique_ptr<Spawner> _spawner;
+
+  // Evaluate at most capacity points
+  bool EvaluateBatch(const std::string& expr_str,
+                     const std::string& variable,
+                     const double* xs,
+                     size_t n,
+                     double* out,
+                     const std::atomic_bool* cancelled);
+  // Send chunk of points to worker
+  bool SendChunk(Worker& worker,
+                 const std::string& expr_str,
+                 const std::string& variable,
+                 size_t chunk,
+                 size_t chunkSize,
+                 size_t n);
+  // Spawn workers until there are nworkers of them
+  void Start();
+  // Kill all workers, so that pool becomes unavailable
+  void Stop();
+  // Main loop of worker process, which is spawned with pool as argument
+  static void WorkerLoop(int fd, void* pool);
+};
\ No newline at end of file
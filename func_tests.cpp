@@ -1,6 +1,11 @@
+#include "../src/ChebyshevProxy.h"
 #include "../src/Expression.h"
 #include "../src/ExpressionCalculator.h"
+#include "../src/SymbolicJob.h"
+#include <algorithm>
+#include <cmath>
 #include <exception>
+#include <thread>
 
 ExpressionCalculator _calc = ExpressionCalculator(100);
 
@@ -52,7 +57,9 @@ TestExpr(const std::string& expr_str,
   if (!numeric_integral) {
     std::cout << "Error: " << Expression::GetErrorString() << "\n";
   } else {
-    std::cout << "Calculated integral: " << numeric_integral.value() << "\n";
+    std::cout << "Calculated integral: " << numeric_integral->value << " +- "
+              << numeric_integral->error << " ("
+              << numeric_integral->evaluations << " evaluations)\n";
   }
 
   std::cout << "Testing undo():\n";
@@ -69,13 +76,597 @@ TestExpr(const std::string& expr_str,
   return true;
 }
 
+void
+TestEvaluate(const std::string& expr_str, const std::vector<double>& xs)
+{
+  auto expr = Expression::CreateExpression(expr_str, { "x" });
+
+  if (!expr) {
+    std::cout << "Error: " << Expression::GetErrorString() << "\n";
+    return;
+  }
+
+  std::cout << "Evaluating " << expr_str
+            << (expr->IsCompiled() ? " (compiled)" : " (GiNaC)") << ":\n";
+
+  for (double x : xs) {
+    ExprStatus status;
+    double res = expr->Evaluate(&x, status);
+    if (status == ExprStatus::Ok)
+      std::cout << "  f(" << x << ") = " << res << "\n";
+    else
+      std::cout << "  f(" << x << "): " << Expression::GetErrorString() << "\n";
+  }
+}
+
+void
+TestInPlace(const std::string& expr_str, double x1, double x2)
+{
+  auto expr = Expression::CreateExpression(expr_str, { "x" });
+
+  if (!expr) {
+    std::cout << "Error: " << Expression::GetErrorString() << "\n";
+    return;
+  }
+
+  // Block size isn't multiple of evaluation block, so partial block is
+  // evaluated too
+  std::vector<double> xs(100);
+  for (size_t i = 0; i < xs.size(); ++i)
+    xs[i] = x1 + (x2 - x1) * i / (xs.size() - 1);
+  std::vector<double> out(xs.size());
+  expr->Evaluate(xs.data(), xs.size(), out.data());
+  expr->Evaluate(xs.data(), xs.size(), xs.data());
+
+  std::cout << "Evaluating " << expr_str << " in place: "
+            << (std::equal(out.begin(), out.end(), xs.begin()) ? "same"
+                                                                : "different")
+            << " results\n";
+}
+
+void
+TestCompensatedInPlace(const std::vector<double>& coeffs, double x1, double x2)
+{
+  // Cost model rarely picks compensated scheme, so it's set directly
+  CompiledExpression program(1);
+  program.SetOutput(program.Append(OpCode::Var, 0, 0, 0));
+  program.SetPolynomial(coeffs, true);
+
+  std::vector<double> xs(100);
+  for (size_t i = 0; i < xs.size(); ++i)
+    xs[i] = x1 + (x2 - x1) * i / (xs.size() - 1);
+  std::vector<double> out(xs.size());
+  program.Evaluate(xs.data(), xs.size(), out.data());
+  program.Evaluate(xs.data(), xs.size(), xs.data());
+
+  std::cout << "Evaluating compensated polynomial of degree "
+            << coeffs.size() - 1 << " in place: "
+            << (std::equal(out.begin(), out.end(), xs.begin()) ? "same"
+                                                                : "different")
+            << " results\n";
+}
+
+void
+TestDerivatives(const std::string& expr_str, double x)
+{
+  auto expr = Expression::CreateExpression(expr_str, { "x" });
+
+  if (!expr) {
+    std::cout << "Error: " << Expression::GetErrorString() << "\n";
+    return;
+  }
+
+  double res[3];
+  if (expr->EvaluateDerivatives(&x, 1, 2, res) != ExprStatus::Ok) {
+    std::cout << "Error: " << Expression::GetErrorString() << "\n";
+    return;
+  }
+
+  std::cout << "Derivatives of " << expr_str << " at " << x << ": f = "
+            << res[0] << ", f' = " << res[1] << ", f'' = " << res[2] << "\n";
+}
+
+void
+TestDomain(const std::string& expr_str, double x1, double x2)
+{
+  auto expr = Expression::CreateExpression(expr_str, { "x" });
+
+  if (!expr) {
+    std::cout << "Error: " << Expression::GetErrorString() << "\n";
+    return;
+  }
+
+  DomainInfo info = expr->AnalyzeDomain(x1, x2);
+
+  std::cout << "Poles of " << expr_str << " in [" << x1 << ";" << x2 << "]:";
+  for (double pole : info.poles)
+    std::cout << " " << pole;
+
+  std::cout << "\nUndefined intervals:";
+  for (auto& interval : info.invalid)
+    std::cout << " [" << interval.from << ";" << interval.to << "]";
+  std::cout << "\n";
+}
+
+void
+TestIntegral(const std::string& expr_str, double x1, double x2)
+{
+  auto expr = Expression::CreateExpression(expr_str, { "x" });
+
+  if (!expr) {
+    std::cout << "Error: " << Expression::GetErrorString() << "\n";
+    return;
+  }
+
+  auto res = expr->CalculateIntegral("x", x1, x2);
+
+  std::cout << "Integral of " << expr_str << " in [" << x1 << ";" << x2
+            << "]: ";
+  if (!res)
+    std::cout << "Error: " << Expression::GetErrorString() << "\n";
+  else
+    std::cout << res->value << " +- " << res->error << " (" << res->evaluations
+              << " evaluations)\n";
+}
+
+void
+TestAntiderivative(const std::string& expr_str,
+                   double x1,
+                   double x2,
+                   double lower = 0)
+{
+  auto expr = Expression::CreateExpression(expr_str, { "x" });
+
+  if (!expr) {
+    std::cout << "Error: " << Expression::GetErrorString() << "\n";
+    return;
+  }
+
+  _calc.SetExpression(std::move(expr));
+  _calc.SetAntiderivativeMode(true, lower);
+  std::vector<Point>& points = _calc.CalculateExpression(x1, x2);
+  size_t count = _calc.GetPointsCount();
+
+  // Every piece of domain is separate line, pieces not connected with lower
+  // bound have no defined offset
+  size_t lines = 0;
+  size_t floating = 0;
+  for (size_t i = 0; i < count; ++i) {
+    lines += points[i].lineEnd;
+    floating += points[i].lineEnd && points[i].floating;
+  }
+
+  std::cout << "Integral of " << expr_str << " from " << lower << ":";
+  for (size_t i = 0; i < count; i += std::max<size_t>(1, count / 4))
+    std::cout << " F(" << points[i].x << ") = " << points[i].y;
+  std::cout << ", " << lines << " lines (" << floating << " floating)\n";
+
+  _calc.SetAntiderivativeMode(false, 0);
+}
+
+void
+TestEquivalent(const std::string& first, const std::string& second)
+{
+  auto a = Expression::CreateExpression(first, { "x" });
+  auto b = Expression::CreateExpression(second, { "x" });
+
+  if (!a || !b) {
+    std::cout << "Error: " << Expression::GetErrorString() << "\n";
+    return;
+  }
+
+  std::cout << first << (a->IsEquivalent(*b) ? " == " : " != ") << second
+            << "\n";
+}
+
+void
+TestProxy(const std::string& expr_str, double x1, double x2)
+{
+  auto expr = Expression::CreateExpression(expr_str, { "x" });
+
+  if (!expr) {
+    std::cout << "Error: " << Expression::GetErrorString() << "\n";
+    return;
+  }
+
+  Integrand f = [&expr](const double* xs, size_t n, double* out) {
+    expr->Evaluate(xs, n, out);
+  };
+  ChebyshevProxy proxy(f, x1, x2);
+
+  std::cout << "Interpolant of " << expr_str << " in [" << x1 << ";" << x2
+            << "]: ";
+  if (!proxy.IsValid()) {
+    std::cout << "not smooth (" << proxy.GetEvaluations() << " evaluations)\n";
+    return;
+  }
+
+  double error = 0;
+  for (int i = 0; i <= 1000; ++i) {
+    double x = x1 + (x2 - x1) * i / 1000;
+    double p;
+    double y;
+    proxy.Evaluate(&x, 1, &p);
+    f(&x, 1, &y);
+    error = std::max(error, std::fabs(p - y));
+  }
+
+  std::cout << "error " << error << ", integral "
+            << proxy.Integrate(x1, x2).value << " ("
+            << proxy.GetEvaluations() << " evaluations)\n";
+}
+
+void
+TestProxyIntegral(const std::string& expr_str,
+                  double x1,
+                  double x2,
+                  double a,
+                  double b)
+{
+  auto expr = Expression::CreateExpression(expr_str, { "x" });
+
+  if (!expr) {
+    std::cout << "Error: " << Expression::GetErrorString() << "\n";
+    return;
+  }
+
+  // Integral within plotted range is taken from interpolant built for plotting
+  _calc.SetExpression(std::move(expr));
+  _calc.CalculateExpression(x1, x2);
+  auto res = _calc.CalculateIntegral("x", a, b, 1e-10, 100000);
+
+  std::cout << "Integral of visible " << expr_str << " from " << a << " to "
+            << b << ": ";
+  if (!res) {
+    std::cout << "failed\n";
+    return;
+  }
+  std::cout << res->value << " +- " << res->error << " (" << res->evaluations
+            << " new evaluations)\n";
+}
+
+void
+TestParameters(const std::string& expr_str, const std::vector<double>& as)
+{
+  std::vector<std::string> variables = { "x" };
+  for (auto& name : Expression::FindParameters(expr_str, "x"))
+    variables.push_back(name);
+  auto expr = Expression::CreateExpression(expr_str, variables);
+
+  if (!expr) {
+    std::cout << "Error: " << Expression::GetErrorString() << "\n";
+    return;
+  }
+
+  _calc.SetExpression(std::move(expr));
+  for (size_t i = 1; i < variables.size(); ++i)
+    _calc.SetParameter(variables[i], 1);
+
+  // Only parameter a changes, other registers are reused
+  for (double a : as) {
+    _calc.SetParameter("a", a);
+    std::vector<Point>& points = _calc.CalculateExpression(-1, 1);
+    size_t count = _calc.GetPointsCount();
+
+    std::cout << expr_str << " with a = " << a << ":";
+    for (size_t i = 0; i < count; i += std::max<size_t>(1, count / 4))
+      std::cout << " f(" << points[i].x << ") = " << points[i].y;
+    std::cout << "\n";
+  }
+}
+
+void
+TestParameterIntegral(const std::string& expr_str,
+                      double a,
+                      double x1,
+                      double x2)
+{
+  auto expr = Expression::CreateExpression(expr_str, { "x", "a" });
+
+  if (!expr) {
+    std::cout << "Error: " << Expression::GetErrorString() << "\n";
+    return;
+  }
+
+  // Same integral is taken in this process and in job process
+  _calc.SetExpression(std::move(expr));
+  _calc.SetParameter("a", a);
+  auto res = _calc.CalculateIntegral("x", x1, x2, 1e-10, 100000);
+
+  JobRequest request;
+  request.kind = JobRequest::Kind::Integral;
+  request.expression = expr_str;
+  request.variables = { "x", "a" };
+  request.variable = "x";
+  request.lowerBound = x1;
+  request.upperBound = x2;
+  request.tolerance = 1e-10;
+  request.maxEvaluations = 100000;
+  request.parameters = _calc.GetParameters();
+  SymbolicJob job(request, { JOB_DEFAULT_TIME_LIMIT, JOB_DEFAULT_SIZE_LIMIT });
+  while (job.IsRunning())
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+  std::cout << "Integral of " << expr_str << " with a = " << a << " in ["
+            << x1 << ";" << x2 << "]: ";
+  if (!res)
+    std::cout << "Error: " << Expression::GetErrorString();
+  else
+    std::cout << res->value;
+  if (job.GetState() == SymbolicJob::State::Done)
+    std::cout << ", in job " << job.GetResult().integral.value << "\n";
+  else
+    std::cout << ", in job error: " << job.GetError() << "\n";
+}
+
+void
+TestFamily(const std::string& expr_str, const std::string& parameter)
+{
+  std::vector<std::string> variables = { "x" };
+  for (auto& name : Expression::FindParameters(expr_str, "x"))
+    variables.push_back(name);
+  auto expr = Expression::CreateExpression(expr_str, variables);
+
+  if (!expr) {
+    std::cout << "Error: " << Expression::GetErrorString() << "\n";
+    return;
+  }
+
+  _calc.SetExpression(std::move(expr));
+  for (size_t i = 1; i < variables.size(); ++i)
+    _calc.SetParameter(variables[i], 1);
+  _calc.SetFamily(parameter, 0, 2, 3);
+  _calc.CalculateExpression(-1, 1);
+
+  // Print first point of every curve
+  std::vector<Point>& points = _calc.GetFamilyPoints();
+  size_t count = _calc.GetFamilyPointsCount();
+  std::cout << "Family of " << expr_str << " over " << parameter << ":";
+  for (size_t i = 0; i < count; ++i) {
+    if (i == 0 || points[i - 1].lineEnd)
+      std::cout << " f(" << points[i].x << ") = " << points[i].y;
+  }
+  std::cout << "\n";
+
+  _calc.SetFamily("", 0, 0, 0);
+}
+
+void
+TestOverlays(const std::vector<std::string>& exprs)
+{
+  for (auto& expr_str : exprs) {
+    auto expr = Expression::CreateExpression(expr_str, { "x" });
+
+    if (!expr) {
+      std::cout << "Error: " << Expression::GetErrorString() << "\n";
+      return;
+    }
+
+    _calc.SetExpression(std::move(expr));
+    _calc.AddOverlay();
+  }
+  _calc.CalculateExpression(0, 1);
+
+  // Overlays are evaluated by fused program on shared lattice
+  for (auto& overlay : _calc.GetOverlays()) {
+    std::cout << "Overlay " << overlay.expr->GetExpressionString() << ":";
+    const std::vector<Point>& points = overlay.points;
+    for (size_t i = 0; i < overlay.pointsCount;
+         i += std::max<size_t>(1, overlay.pointsCount / 4))
+      std::cout << " f(" << points[i].x << ") = " << points[i].y;
+    std::cout << "\n";
+  }
+
+  while (!_calc.GetOverlays().empty())
+    _calc.RemoveOverlay(0);
+}
+
+void
+TestFeatures(const std::string& expr_str,
+             const std::string& overlay_str,
+             double x1,
+             double x2)
+{
+  auto overlay = Expression::CreateExpression(overlay_str, { "x" });
+  auto expr = Expression::CreateExpression(expr_str, { "x" });
+
+  if (!overlay || !expr) {
+    std::cout << "Error: " << Expression::GetErrorString() << "\n";
+    return;
+  }
+
+  _calc.SetExpression(std::move(overlay));
+  _calc.AddOverlay();
+  _calc.SetExpression(std::move(expr));
+  _calc.SetAnalysis(true);
+  _calc.CalculateExpression(x1, x2);
+
+  // Roots and extrema are refined from brackets between sampled points, or
+  // polished from roots of interpolant of expensive expression
+  const char* kinds[] = { "root", "minimum", "maximum", "intersection" };
+  std::cout << "Features of " << expr_str << " with " << overlay_str << ":\n";
+  std::cout.precision(17);
+  for (auto& feature : _calc.GetFeatures())
+    std::cout << "  " << kinds[static_cast<int>(feature.kind)] << " ("
+              << feature.x << "; " << feature.y << ")\n";
+  std::cout.precision(6);
+
+  _calc.SetAnalysis(false);
+  _calc.RemoveOverlay(0);
+}
+
+void
+TestYRange(const std::string& expr_str, double x1, double x2)
+{
+  auto expr = Expression::CreateExpression(expr_str, { "x" });
+
+  if (!expr) {
+    std::cout << "Error: " << Expression::GetErrorString() << "\n";
+    return;
+  }
+
+  _calc.SetExpression(std::move(expr));
+  _calc.CalculateExpression(x1, x2);
+
+  // Range of whole view and of its left half are answered by index
+  for (double to : { x2, (x1 + x2) / 2 }) {
+    std::optional<Interval> range = _calc.GetYRange(x1, to);
+    std::cout << "Y range of " << expr_str << " over [" << x1 << ";" << to
+              << "]: ";
+    if (range)
+      std::cout << "[" << range->from << ";" << range->to << "]\n";
+    else
+      std::cout << "none\n";
+  }
+}
+
+void
+TestSymmetry(const std::string& expr_str)
+{
+  auto expr = Expression::CreateExpression(expr_str, { "x" });
+
+  if (!expr) {
+    std::cout << "Error: " << Expression::GetErrorString() << "\n";
+    return;
+  }
+
+  // Wide view of symmetric function evaluates one period or half of range
+  const Symmetry& symmetry = expr->GetSymmetry();
+  std::cout << "Symmetry of " << expr_str << ": period " << symmetry.period
+            << (symmetry.even ? ", even" : "") << (symmetry.odd ? ", odd" : "")
+            << "\n";
+
+  _calc.SetExpression(std::move(expr));
+  std::vector<Point>& points = _calc.CalculateExpression(-1000, 1000);
+  size_t count = _calc.GetPointsCount();
+  for (size_t i = 0; i < count; i += std::max<size_t>(1, count / 4))
+    std::cout << "  f(" << points[i].x << ") = " << points[i].y << "\n";
+}
+
+void
+TestPrecision(const std::string& expr_str, double x1, double x2)
+{
+  auto expr = Expression::CreateExpression(expr_str, { "x" });
+
+  if (!expr) {
+    std::cout << "Error: " << Expression::GetErrorString() << "\n";
+    return;
+  }
+
+  // Points evaluated in single precision stay close to double ones, while
+  // double-double ones differ where double loses significance
+  Expression* source = expr.get();
+  _calc.SetExpression(std::move(expr));
+  std::vector<Point>& points = _calc.CalculateExpression(x1, x2);
+  double error = 0;
+  for (size_t i = 0; i < _calc.GetPointsCount(); ++i) {
+    ExprStatus status;
+    double exact = source->Evaluate(&points[i].x, status);
+    if (std::isfinite(exact))
+      error = std::max(error, std::fabs(points[i].y - exact));
+  }
+
+  const char* names[] = { "single", "double", "double-double" };
+  std::cout << "Precision of " << expr_str << " over [" << x1 << ";" << x2
+            << "]: " << names[static_cast<int>(_calc.GetPrecision())]
+            << ", max difference from double " << error << "\n";
+}
+
+void
+TestJob(const std::string& expr_str, double seconds)
+{
+  auto expr = Expression::CreateExpression(expr_str, { "x" });
+
+  if (!expr) {
+    std::cout << "Error: " << Expression::GetErrorString() << "\n";
+    return;
+  }
+
+  JobRequest request;
+  request.kind = JobRequest::Kind::Derivative;
+  request.expression = expr_str;
+  request.variables = { "x" };
+  request.variable = "x";
+  SymbolicJob job(request, { seconds, JOB_DEFAULT_SIZE_LIMIT });
+  while (job.IsRunning())
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+  std::cout << "Derivative of " << expr_str << " in job: ";
+  if (job.GetState() == SymbolicJob::State::Done)
+    std::cout << job.GetResult().expression->GetExpressionString() << " ("
+              << (job.GetResult().expression->IsCompiled() ? "compiled"
+                                                           : "not compiled")
+              << ")\n";
+  else
+    std::cout << "Error: " << job.GetError() << "\n";
+}
+
 int
 main()
 {
+  // Job processes are spawned by helper forked while there's single thread
+  SymbolicJob::StartSpawner();
+
   try {
     TestExpr("2*5*sqrt(x)+4", { "x" }, { "-1" }, "x");
     TestExpr("x^2+y^2", { "x", "y" }, { "3", "4" }, "x");
     TestExpr("sin(x^2)", { "x" }, { "2" }, "x");
+    TestEvaluate("1/(x-1)", { 0, 1, 2 });
+    TestEvaluate("sqrt(x)", { -1, 4 });
+    TestEvaluate("x^5-3*x^3+2*x-7", { -2, 0.5, 3 });
+    TestEvaluate("(x-1)^20", { 1.01, 2 });
+    TestEvaluate("(x^2-1)/(x-1)", { 1, 2 });
+    TestEvaluate("(x+1)^200*(x-2)^150", { 0, 1 });
+    TestInPlace("(x-1)^20", 0, 2);
+    TestInPlace("x^5-3*x^3+2*x-7", -2, 3);
+    TestCompensatedInPlace({ -1, 1, 0, 0, 0, -3, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                             0, 0, 1 },
+                           -1.2,
+                           1.2);
+    TestDerivatives("x*sin(x)", 1);
+    TestDerivatives("exp(-x^2)/(1+x)", 0.5);
+    TestDomain("tan(x)", -5, 5);
+    TestDomain("1/(x-1)", -5, 5);
+    TestDomain("1/x^2", -1, 1);
+    TestDomain("sqrt(x)+log(x+3)", -5, 5);
+    TestIntegral("1/sqrt(x)", 0, 1);
+    TestIntegral("exp(-x^2)", -INFINITY, INFINITY);
+    TestIntegral("sin(100*x)*x", 0, 10);
+    TestAntiderivative("exp(-x^2)", -5, 5);
+    TestAntiderivative("sin(x)/x", 1, 20);
+    TestAntiderivative("sqrt(x)", -5, 5);
+    TestAntiderivative("1/x", -5, 5, 1);
+    TestAntiderivative("log(x)", -5, 5, -1);
+    TestEquivalent("x^2 + 1", "1+x^2");
+    TestEquivalent("x^2+1", "x^2+2");
+    TestProxy("sin(x)*exp(-x^2/10)", -10, 10);
+    TestProxy("abs(x-1)", -5, 5);
+    TestProxyIntegral("sin(x)*exp(cos(x))+atan(sin(2*x))+cos(3*x)*log(2+sin(x))"
+                      "+exp(-x^2)*cos(5*x)+tanh(sin(x/2))",
+                      -2,
+                      2,
+                      -1,
+                      1.5);
+    TestParameters("a*sin(b*x)+c", { 1, 2, -1 });
+    TestParameterIntegral("a*x^2", 3, 0, 1);
+    TestFamily("a*sin(b*x)+c", "b");
+    TestJob("x^2*sin(x)", JOB_DEFAULT_TIME_LIMIT);
+    TestOverlays({ "x^3", "3*x^2", "6*x" });
+    TestFeatures("x^3-2*x", "cos(x)", -2, 2);
+    TestFeatures("sin(x)*exp(cos(x))+atan(sin(2*x))+cos(3*x)*log(2+sin(x))"
+                 "+exp(-x^2)*cos(5*x)+tanh(sin(x/2))",
+                 "cos(x)",
+                 -2,
+                 2);
+    TestYRange("sin(x)+x/4", -2, 6);
+    TestSymmetry("sin(3*x)+cos(x)");
+    TestSymmetry("x*sin(x)");
+    TestSymmetry("tan(Pi*x/2)^3");
+    TestPrecision("exp(-x^2/4)*sin(3*x)+x/2", -5, 5);
+    TestPrecision("exp(-x^2/4)*sin(3*x)+x/2", 1e4, 1e4 + 1e-3);
+    TestPrecision("1e6+sin(x)", -5, 5);
+    TestPrecision("exp(x)-1", -1e-12, 1e-12);
+    TestPrecision("x^2-2", 1.4142135623730, 1.4142135623731);
   } catch (const std::exception& ex) {
     std::cout << "Exception: " << ex.what() << "\n";
   }
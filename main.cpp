@@ -1,9 +1,21 @@
+#include "ExprLib.h"
 #include "Plotter.h"
+#include "SymbolicJob.h"
+#include "WorkerPool.h"
 #include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <memory>
+#include <thread>
 
 int
 main()
 {
+  // Helpers forking worker and job processes are started first, while
+  // process has single thread. Window and GL context may start driver threads
+  SymbolicJob::StartSpawner();
+  ExprLib::SetWorkerPool(std::make_shared<WorkerPool>(
+    std::max(1u, std::thread::hardware_concurrency()), 1000));
+
   Plotter program = Plotter({ 800u, 600u }, { 0, 0 });
   program.Run();
 
@@ -0,0 +1,52 @@
+#include "../src/ExprLib.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+// Points calculated by each session per frame
+#define BENCH_POINTS 10000
+// Number of frames calculated by each session
+#define BENCH_FRAMES 200
+
+// Calculate expression in its own session, moving view like panning does
+void
+RunSession(const std::string& expr_str)
+{
+  ExprLib::Session session(BENCH_POINTS);
+  session.SetExpression(session.CreateExpression(expr_str, { "x" }));
+
+  for (int i = 0; i < BENCH_FRAMES; ++i)
+    session.CalculateExpression(-10.0 + i * 0.01, 10.0 + i * 0.01);
+}
+
+int
+main()
+{
+  const std::string expr_str = "sin(x)*exp(-x^2/50)+sqrt(abs(x))*cos(3*x)";
+  unsigned maxSessions = std::max(1u, std::thread::hardware_concurrency());
+  double baseRate = 0;
+
+  std::cout << "Calculating " << expr_str << "\n";
+
+  for (unsigned sessions = 1; sessions <= maxSessions; sessions *= 2) {
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < sessions; ++i)
+      threads.emplace_back(RunSession, expr_str);
+    for (auto& thread : threads)
+      thread.join();
+
+    std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+    double rate =
+      static_cast<double>(sessions) * BENCH_FRAMES * BENCH_POINTS /
+      elapsed.count();
+    if (sessions == 1)
+      baseRate = rate;
+
+    std::cout << sessions << " sessions: " << rate / 1e6
+              << " Mpoints/s, speedup " << rate / baseRate << "\n";
+  }
+}
\ No newline at end of file